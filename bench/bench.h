@@ -0,0 +1,71 @@
+/*
+ * bench.h - Helpers shared by the libntfs-3g benchmarks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_BENCH_H
+#define _NTFS_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * bench_now - monotonic time in seconds
+ */
+static __inline__ double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * bench_report - print one result line
+ * @name:	what was measured
+ * @ops:	number of operations performed
+ * @bytes:	number of bytes processed, or zero
+ * @secs:	elapsed time
+ */
+static __inline__ void bench_report(const char *name, double ops,
+		double bytes, double secs)
+{
+	if (secs <= 0)
+		secs = 1e-9;
+	if (bytes)
+		printf("%-32s %12.0f ops/s %10.1f MiB/s %9.3f s\n", name,
+				ops / secs, bytes / secs / (1024 * 1024), secs);
+	else
+		printf("%-32s %12.0f ops/s %9.3f s\n", name, ops / secs,
+				secs);
+}
+
+/**
+ * bench_random - small xorshift generator, reproducible across runs
+ */
+static __inline__ unsigned long long bench_random(unsigned long long *state)
+{
+	unsigned long long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+#endif /* _NTFS_BENCH_H */
@@ -0,0 +1,184 @@
+/**
+ * bench_bitmap - Measure counting the free clusters.
+ *
+ * Counts the bits set in a large random bitmap in memory, once a 64-bit word
+ * at a time without a popcount instruction, as done before the kernels were
+ * selected by the processor features, then with ntfs_bitmap_popcount() and
+ * with ntfs_bitmap_popcount_parallel().  Given a volume, also times getting
+ * its free space from mounting it read-only, once counting after mounting
+ * and once counting in the background while mounting.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "types.h"
+#include "volume.h"
+#include "bitmap.h"
+#include "logging.h"
+#include "misc.h"
+#include "bench.h"
+
+static struct {
+	s64 size;		/* Bitmap size in bytes. */
+	int rounds;		/* Passes over the bitmap. */
+	const char *device;	/* Volume to get the free space of, or NULL. */
+} opts = {
+	.size = 64 << 20,
+	.rounds = 10,
+};
+
+static void usage(void)
+{
+	printf("\nUsage: bench_bitmap [options] [device]\n\n"
+		"    -s MiB     Bitmap size (default 64)\n"
+		"    -r rounds  Passes over the bitmap (default 10)\n\n");
+	exit(1);
+}
+
+static void parse_options(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "s:r:h")) != -1) {
+		switch (c) {
+		case 's':
+			opts.size = strtoll(optarg, NULL, 0) << 20;
+			break;
+		case 'r':
+			opts.rounds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		opts.device = argv[optind++];
+	if (optind < argc || opts.size <= 0 || opts.rounds <= 0)
+		usage();
+}
+
+/*
+ * The bit-parallel count of the bits set in a word.
+ */
+static s64 count_words(const u8 *bm, s64 size)
+{
+	s64 n = 0, pos;
+	u64 w;
+
+	for (pos = 0; pos < size; pos += 8) {
+		memcpy(&w, bm + pos, 8);
+		w -= (w >> 1) & 0x5555555555555555ULL;
+		w = (w & 0x3333333333333333ULL)
+			+ ((w >> 2) & 0x3333333333333333ULL);
+		w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+		n += (w * 0x0101010101010101ULL) >> 56;
+	}
+	return n;
+}
+
+static void run_memory(void)
+{
+	unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+	double start, total;
+	s64 i, n[3] = { 0, 0, 0 };
+	u8 *bm;
+	int r, k;
+
+	bm = ntfs_malloc(opts.size);
+	if (!bm)
+		exit(1);
+	for (i = 0; i < opts.size; i += 8) {
+		u64 v = bench_random(&seed);
+
+		memcpy(bm + i, &v, 8);
+	}
+	total = (double)opts.rounds * opts.size;
+	for (k = 0; k < 3; k++) {
+		start = bench_now();
+		for (r = 0; r < opts.rounds; r++) {
+			if (k == 0)
+				n[k] = count_words(bm, opts.size);
+			else if (k == 1)
+				n[k] = ntfs_bitmap_popcount(bm, 0,
+						opts.size << 3);
+			else
+				n[k] = ntfs_bitmap_popcount_parallel(bm, 0,
+						opts.size << 3);
+		}
+		bench_report(k == 0 ? "word at a time" : k == 1
+				? "ntfs_bitmap_popcount"
+				: "ntfs_bitmap_popcount_parallel",
+				opts.rounds, total, bench_now() - start);
+	}
+	if (n[1] != n[0] || n[2] != n[0])
+		fprintf(stderr, "Counts differ: %lld %lld %lld\n",
+				(long long)n[0], (long long)n[1],
+				(long long)n[2]);
+	free(bm);
+}
+
+static void run_volume(BOOL background)
+{
+	ntfs_volume *vol;
+	double start, mounted;
+
+	start = bench_now();
+	vol = ntfs_mount(opts.device, NTFS_MNT_RDONLY
+			| (background ? NTFS_MNT_COUNT_FREE : 0));
+	if (!vol) {
+		ntfs_log_perror("Failed to mount '%s'", opts.device);
+		exit(1);
+	}
+	mounted = bench_now();
+	if (ntfs_volume_get_free_space(vol))
+		ntfs_log_perror("Failed to get the free space");
+	printf("%-32s mounted %9.3f s, free space %9.3f s, %lld free "
+			"clusters\n", background ? "counting while mounting"
+			: "counting after mounting", mounted - start,
+			bench_now() - start, (long long)vol->free_clusters);
+	ntfs_umount(vol, FALSE);
+}
+
+int main(int argc, char **argv)
+{
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	parse_options(argc, argv);
+
+	printf("%lld MiB bitmap, %d rounds, %d processors\n",
+			(long long)(opts.size >> 20), opts.rounds,
+			ntfs_nr_cpus());
+	run_memory();
+	if (opts.device) {
+		run_volume(FALSE);
+		run_volume(TRUE);
+	}
+	return 0;
+}
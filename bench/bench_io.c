@@ -0,0 +1,359 @@
+/**
+ * bench_io - Compare the throughput of the device backends.
+ *
+ * Reads (and optionally writes) a large file-backed image in fixed size
+ * blocks, sequentially and at random offsets, through each device backend.
+ * Transfers are handed to ntfs_device_submit() in batches of the queue depth,
+ * so backends without batch support perform them one at a time.  A last
+ * pass sends batches of a single read followed by empty transfers, and
+ * batches of empty transfers only.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "types.h"
+#include "device.h"
+#include "logging.h"
+#include "misc.h"
+#include "bench.h"
+
+static struct {
+	const char *name;
+	struct ntfs_device_operations *ops;
+} backends[] = {
+	{ "unix",	&ntfs_device_default_io_ops },
+#ifdef ENABLE_IO_URING
+	{ "uring",	&ntfs_device_uring_io_ops },
+#endif
+#ifdef ENABLE_MMAP_IO
+	{ "mmap",	&ntfs_device_mmap_io_ops },
+#endif
+#ifdef ENABLE_SIM_IO
+	{ "sim",	&ntfs_device_sim_io_ops },
+#endif
+};
+
+#define NR_BACKENDS (int)(sizeof(backends) / sizeof(backends[0]))
+
+static struct {
+	s64 size;		/* Image size in bytes. */
+	s64 block;		/* Transfer size in bytes. */
+	int depth;		/* Transfers per batch. */
+	BOOL write;		/* Also measure random writes. */
+	const char *backend;	/* Only run this backend. */
+	const char *image;	/* Existing image, or NULL for a temp file. */
+} opts = {
+	.size = 256LL << 20,
+	.block = 4096,
+	.depth = 32,
+};
+
+static void usage(void)
+{
+	printf("\nUsage: bench_io [options] [image]\n\n"
+		"    -s MiB     Size of the temporary image (default 256)\n"
+		"    -b bytes   Transfer size (default 4096)\n"
+		"    -q depth   Transfers per batch (default 32)\n"
+		"    -w         Also measure random writes\n"
+		"    -B name    Only run backend 'name'\n"
+#ifdef ENABLE_SIM_IO
+		"    -S params  Settings of the sim backend, e.g.\n"
+		"               latency=100,seek=8000,bw=100M\n"
+#endif
+		"\nWithout an image a temporary file is created in the current"
+		" directory.\n\n");
+	exit(1);
+}
+
+static void parse_options(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "s:b:q:wB:S:h")) != -1) {
+		switch (c) {
+		case 's':
+			opts.size = strtoll(optarg, NULL, 0) << 20;
+			break;
+		case 'b':
+			opts.block = strtoll(optarg, NULL, 0);
+			break;
+		case 'q':
+			opts.depth = atoi(optarg);
+			break;
+		case 'w':
+			opts.write = TRUE;
+			break;
+		case 'B':
+			opts.backend = optarg;
+			break;
+#ifdef ENABLE_SIM_IO
+		case 'S':
+			if (ntfs_device_sim_io_configure(optarg)) {
+				fprintf(stderr, "Invalid settings '%s'\n",
+						optarg);
+				usage();
+			}
+			break;
+#endif
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		opts.image = argv[optind++];
+	if (optind < argc || opts.size <= 0 || opts.block <= 0
+			|| opts.depth <= 0)
+		usage();
+}
+
+/*
+ * Create the image filled with non-zero data so that the file is not sparse.
+ */
+static int create_image(const char *name)
+{
+	char *buf;
+	s64 pos;
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	buf = ntfs_malloc(1 << 20);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+	memset(buf, 0x5a, 1 << 20);
+	for (pos = 0; pos < opts.size; pos += 1 << 20)
+		if (write(fd, buf, 1 << 20) != 1 << 20) {
+			perror("write");
+			free(buf);
+			close(fd);
+			return -1;
+		}
+	fsync(fd);
+	free(buf);
+	close(fd);
+	return 0;
+}
+
+/*
+ * Drop the image from the page cache so that every pass reads the disk.
+ */
+static void drop_cache(const char *name)
+{
+#ifdef POSIX_FADV_DONTNEED
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd >= 0) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#endif
+}
+
+static int run_pass(struct ntfs_device *dev, const char *what,
+		BOOL at_random, BOOL writing, char *buf)
+{
+	struct ntfs_io_req *reqs;
+	unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+	s64 nr_blocks, done;
+	double start, secs;
+	char title[64];
+	int i, n;
+
+	reqs = ntfs_calloc(opts.depth * sizeof(*reqs));
+	if (!reqs)
+		return -1;
+	nr_blocks = opts.size / opts.block;
+	drop_cache(dev->d_name);
+	start = bench_now();
+	for (done = 0; done < nr_blocks; done += n) {
+		n = opts.depth;
+		if (n > nr_blocks - done)
+			n = nr_blocks - done;
+		for (i = 0; i < n; i++) {
+			s64 blk = at_random ? (s64)(bench_random(&seed)
+					% nr_blocks) : done + i;
+
+			reqs[i].buf = buf + i * opts.block;
+			reqs[i].count = opts.block;
+			reqs[i].offset = blk * opts.block;
+			reqs[i].write = writing;
+		}
+		if (ntfs_device_submit(dev, reqs, n)) {
+			perror("ntfs_device_submit");
+			free(reqs);
+			return -1;
+		}
+	}
+	if (writing)
+		dev->d_ops->sync(dev);
+	secs = bench_now() - start;
+	snprintf(title, sizeof(title), "%s %s", what, !at_random ? "seq read"
+			: writing ? "rand write" : "rand read");
+	bench_report(title, nr_blocks, nr_blocks * opts.block, secs);
+	free(reqs);
+	return 0;
+}
+
+/*
+ * Read one block per batch, the rest of the batch being empty transfers
+ * which have to complete at once, each batch followed by one of empty
+ * transfers only, and check every transfer is done.
+ */
+static int run_empty(struct ntfs_device *dev, const char *what, char *buf)
+{
+	struct ntfs_io_req *reqs;
+	s64 nr_blocks, blk, batches = 0;
+	double start, secs;
+	char title[64];
+	int i;
+	BOOL empty = FALSE;
+
+	reqs = ntfs_calloc(opts.depth * sizeof(*reqs));
+	if (!reqs)
+		return -1;
+	nr_blocks = opts.size / opts.block;
+	start = bench_now();
+	for (blk = 0; blk < nr_blocks; empty = !empty, batches++) {
+		for (i = 0; i < opts.depth; i++) {
+			reqs[i].buf = buf + i * opts.block;
+			reqs[i].count = i || empty ? 0 : opts.block;
+			reqs[i].offset = blk * opts.block;
+			reqs[i].write = FALSE;
+		}
+		if (ntfs_device_submit(dev, reqs, opts.depth)) {
+			perror("ntfs_device_submit");
+			free(reqs);
+			return -1;
+		}
+		for (i = 0; i < opts.depth; i++)
+			if (reqs[i].done != reqs[i].count) {
+				fprintf(stderr, "%s: transfer %d of block "
+					"%lld incomplete\n", what, i,
+					(long long)blk);
+				free(reqs);
+				return -1;
+			}
+		if (empty)
+			blk += opts.depth;
+	}
+	secs = bench_now() - start;
+	snprintf(title, sizeof(title), "%s empty tail", what);
+	bench_report(title, batches, 0, secs);
+	free(reqs);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char tmpname[] = "bench_io.XXXXXX";
+	const char *image;
+	char *buf;
+	int i, ret = 1;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	parse_options(argc, argv);
+
+	image = opts.image;
+	if (!image) {
+		int fd = mkstemp(tmpname);
+
+		if (fd < 0) {
+			perror("mkstemp");
+			return 1;
+		}
+		close(fd);
+		image = tmpname;
+		if (create_image(image))
+			goto out;
+	}
+	buf = ntfs_malloc(opts.depth * opts.block);
+	if (!buf)
+		goto out;
+
+	printf("image %s, %lld MiB, %lld byte blocks, batches of %d\n",
+			image, (long long)(opts.size >> 20),
+			(long long)opts.block, opts.depth);
+	for (i = 0; i < NR_BACKENDS; i++) {
+		struct ntfs_device *dev;
+
+		if (opts.backend && strcmp(opts.backend, backends[i].name))
+			continue;
+		dev = ntfs_device_alloc(image, 0, backends[i].ops, NULL);
+		if (!dev)
+			goto out_free;
+		if (dev->d_ops->open(dev, opts.write ? O_RDWR : O_RDONLY)) {
+			/* Read-only backends are skipped when writing. */
+			if (errno == EROFS) {
+				printf("%s: read-only, skipped\n",
+						backends[i].name);
+				ntfs_device_free(dev);
+				continue;
+			}
+			perror(backends[i].name);
+			ntfs_device_free(dev);
+			goto out_free;
+		}
+		if (run_pass(dev, backends[i].name, FALSE, FALSE, buf)
+		    || run_pass(dev, backends[i].name, TRUE, FALSE, buf)
+		    || run_empty(dev, backends[i].name, buf)
+		    || (opts.write && run_pass(dev, backends[i].name, TRUE,
+				TRUE, buf))) {
+			dev->d_ops->close(dev);
+			ntfs_device_free(dev);
+			goto out_free;
+		}
+		dev->d_ops->close(dev);
+		ntfs_device_free(dev);
+	}
+	ret = 0;
+out_free:
+	free(buf);
+out:
+	if (!opts.image)
+		unlink(tmpname);
+	return ret;
+}
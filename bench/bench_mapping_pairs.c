@@ -0,0 +1,552 @@
+/**
+ * bench_mapping_pairs - Check and measure the mapping pairs coding.
+ *
+ * Mapping pairs used to be decoded and encoded one byte at a time, they are
+ * now loaded and stored in words.  The former code is kept here as a
+ * reference, and first compared to the library on random runlists and on
+ * random mapping pairs, valid or not, then both are timed decoding and
+ * encoding the mapping pairs of a long runlist.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+#include "runlist.h"
+#include "logging.h"
+#include "misc.h"
+#include "bench.h"
+
+/* Room for the pairs of a random runlist, and slack after the attribute. */
+#define MAX_RUNS	64
+#define MP_SIZE		(MAX_RUNS * 17 + 1)
+#define SLACK		16
+
+static struct {
+	int fuzz;		/* Random cases to compare. */
+	int runs;		/* Runs in the timed runlist. */
+	int rounds;		/* Passes over the timed runlist. */
+} opts = {
+	.fuzz = 200000,
+	.runs = 100000,
+	.rounds = 20,
+};
+
+static ntfs_volume vol;
+static unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+
+static void usage(void)
+{
+	printf("\nUsage: bench_mapping_pairs [options]\n\n"
+		"    -f cases   Random cases to compare (default 200000)\n"
+		"    -n runs    Runs in the timed runlist (default 100000)\n"
+		"    -r rounds  Passes over the timed runlist (default 20)\n\n");
+	exit(1);
+}
+
+static void parse_options(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "f:n:r:h")) != -1) {
+		switch (c) {
+		case 'f':
+			opts.fuzz = atoi(optarg);
+			break;
+		case 'n':
+			opts.runs = atoi(optarg);
+			break;
+		case 'r':
+			opts.rounds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc || opts.fuzz < 0 || opts.runs <= 0
+			|| opts.rounds <= 0)
+		usage();
+}
+
+/*
+ * The former byte by byte encoder.
+ */
+static int ref_size(const s64 n)
+{
+	u64 l;
+	int i;
+
+	l = (n < 0 ? ~n : n);
+	i = 1;
+	if (l >= 128) {
+		l >>= 7;
+		do {
+			i++;
+			l >>= 8;
+		} while (l);
+	}
+	return i;
+}
+
+static int ref_write(u8 *dst, const u8 *dst_max, const s64 n)
+{
+	s64 l = n;
+	int i;
+
+	i = 0;
+	if (dst > dst_max)
+		return -1;
+	*dst++ = l;
+	i++;
+	while ((l > 0x7f) || (l < -0x80)) {
+		if (dst > dst_max)
+			return -1;
+		l >>= 8;
+		*dst++ = l;
+		i++;
+	}
+	return i;
+}
+
+static int ref_build(u8 *dst, const int dst_len, const runlist_element *rl,
+		const VCN start_vcn, runlist_element const **stop_rl)
+{
+	LCN prev_lcn = 0;
+	u8 *dst_max = dst + dst_len - 1;
+	s64 length;
+	LCN lcn;
+	int len_len, lcn_len;
+
+	while (rl->length && start_vcn >= rl[1].vcn)
+		rl++;
+	if ((!rl->length && start_vcn > rl->vcn) || start_vcn < rl->vcn)
+		return -EINVAL;
+	for (; rl->length; rl++) {
+		if (rl->length < 0 || rl->lcn < LCN_HOLE)
+			return -EIO;
+		length = rl->length;
+		lcn = rl->lcn;
+		if (start_vcn > rl->vcn) {
+			length -= start_vcn - rl->vcn;
+			if (lcn >= 0)
+				lcn += start_vcn - rl->vcn;
+		}
+		len_len = ref_write(dst + 1, dst_max, length);
+		if (len_len < 0)
+			goto nospc;
+		if (lcn >= 0 || vol.major_ver < 3) {
+			lcn_len = ref_write(dst + 1 + len_len, dst_max,
+					lcn - prev_lcn);
+			if (lcn_len < 0)
+				goto nospc;
+			prev_lcn = lcn;
+		} else
+			lcn_len = 0;
+		if (dst + len_len + lcn_len + 1 > dst_max)
+			goto nospc;
+		*dst = lcn_len << 4 | len_len;
+		dst += 1 + len_len + lcn_len;
+	}
+	*stop_rl = rl;
+	*dst = 0;
+	return 0;
+nospc:
+	*stop_rl = rl;
+	*dst = 0;
+	return -ENOSPC;
+}
+
+/*
+ * Size of mapping pairs, including the terminator.
+ */
+static int mp_len(const u8 *mp)
+{
+	const u8 *p;
+
+	for (p = mp; *p; p += 1 + (*p & 0xf) + (*p >> 4))
+		;
+	return p - mp + 1;
+}
+
+/*
+ * The former byte by byte decoder, storing the runs into @rl.
+ */
+static int ref_decode(const ATTR_RECORD *attr, runlist_element *rl)
+{
+	const u8 *buf, *attr_end;
+	VCN vcn;
+	LCN lcn = 0;
+	s64 deltaxcn;
+	int rlpos = 0;
+	u8 b;
+
+	vcn = sle64_to_cpu(attr->lowest_vcn);
+	buf = (const u8*)attr + le16_to_cpu(attr->mapping_pairs_offset);
+	attr_end = (const u8*)attr + le32_to_cpu(attr->length);
+	while (buf < attr_end && *buf) {
+		rl[rlpos].vcn = vcn;
+		b = *buf & 0xf;
+		if (b) {
+			if (buf + b > attr_end)
+				return -1;
+			for (deltaxcn = (s8)buf[b--]; b; b--)
+				deltaxcn = (deltaxcn << 8) + buf[b];
+		} else
+			deltaxcn = (s64)-1;
+		if (deltaxcn < 0)
+			return -1;
+		rl[rlpos].length = deltaxcn;
+		vcn += deltaxcn;
+		if (!(*buf & 0xf0))
+			rl[rlpos].lcn = (LCN)LCN_HOLE;
+		else {
+			u8 b2 = *buf & 0xf;
+
+			b = b2 + ((*buf >> 4) & 0xf);
+			if (buf + b > attr_end)
+				return -1;
+			for (deltaxcn = (s8)buf[b--]; b > b2; b--)
+				deltaxcn = (deltaxcn << 8) + buf[b];
+			lcn += deltaxcn;
+			if (lcn < (LCN)-1)
+				return -1;
+			if ((lcn != (LCN)-1) && !rl[rlpos].length)
+				return -1;
+			rl[rlpos].lcn = lcn;
+		}
+		if (rl[rlpos].length)
+			rlpos++;
+		buf += (*buf & 0xf) + ((*buf >> 4) & 0xf) + 1;
+	}
+	if (buf >= attr_end)
+		return -1;
+	deltaxcn = sle64_to_cpu(attr->highest_vcn);
+	if (deltaxcn && vcn - 1 != deltaxcn)
+		return -1;
+	return rlpos;
+}
+
+static s64 random_number(void)
+{
+	u64 r = bench_random(&seed);
+
+	/* Numbers of all sizes, not only huge ones. */
+	return (s64)(r >> (r & 63));
+}
+
+/*
+ * A random runlist starting at vcn zero, holes and runs mixed, lcns
+ * sometimes adjacent, sometimes far apart.
+ */
+static int random_runlist(runlist_element *rl)
+{
+	VCN vcn = 0;
+	LCN lcn = 0;
+	int i, n;
+
+	n = bench_random(&seed) % MAX_RUNS;
+	for (i = 0; i < n; i++) {
+		rl[i].vcn = vcn;
+		rl[i].length = 1 + (random_number() & 0xffffffffffLL);
+		if (!(bench_random(&seed) % 4))
+			rl[i].lcn = LCN_HOLE;
+		else {
+			switch (bench_random(&seed) % 3) {
+			case 0:
+				lcn += rl[i].length;
+				break;
+			case 1:
+				lcn = random_number() & 0x7fffffffffffLL;
+				break;
+			default:
+				lcn = bench_random(&seed) % 1000;
+				break;
+			}
+			rl[i].lcn = lcn;
+		}
+		vcn += rl[i].length;
+	}
+	rl[i].vcn = vcn;
+	rl[i].length = 0;
+	rl[i].lcn = LCN_ENOENT;
+	return n;
+}
+
+static int failed(const char *what, int i)
+{
+	fprintf(stderr, "Case %d: %s differ\n", i, what);
+	return 1;
+}
+
+/*
+ * Encode a random runlist from a random vcn into a buffer of random size,
+ * both ways, and decode it back.
+ */
+static int check_encode(int i, u8 *attr_buf)
+{
+	runlist_element rl[MAX_RUNS + 1];
+	runlist_element out[MAX_RUNS + 1];
+	const runlist_element *stop_rl, *ref_stop_rl;
+	ATTR_RECORD *attr = (ATTR_RECORD*)attr_buf;
+	u8 mp[MP_SIZE], ref_mp[MP_SIZE];
+	VCN start_vcn;
+	s64 number;
+	int n, k, len, ret, ref_ret, size, count;
+
+	for (k = 0; k < 4; k++) {
+		number = random_number() * (k & 1 ? -1 : 1);
+		if (ntfs_get_nr_significant_bytes(number) != ref_size(number))
+			return failed("number sizes", i);
+	}
+	n = random_runlist(rl);
+	vol.major_ver = (bench_random(&seed) % 8 ? 3 : 1);
+	start_vcn = (n ? bench_random(&seed) % rl[n].vcn : 0);
+	ref_ret = ref_build(ref_mp, sizeof(ref_mp), rl, start_vcn,
+			&ref_stop_rl);
+	size = ntfs_get_size_for_mapping_pairs(&vol, rl, start_vcn, INT_MAX);
+	if (ref_ret || size != mp_len(ref_mp))
+		return failed("sizes", i);
+	len = 1 + bench_random(&seed) % (size + 24);
+	if (len > (int)sizeof(mp))
+		len = sizeof(mp);
+	memset(mp, 0xa5, sizeof(mp));
+	memset(ref_mp, 0xa5, sizeof(ref_mp));
+	ref_ret = ref_build(ref_mp, len, rl, start_vcn, &ref_stop_rl);
+	errno = 0;
+	ret = ntfs_mapping_pairs_build(&vol, mp, len, rl, start_vcn,
+			&stop_rl);
+	if ((ret ? -errno : 0) != ref_ret || stop_rl != ref_stop_rl
+			|| memcmp(mp, ref_mp, mp_len(ref_mp)))
+		return failed("encoded mapping pairs", i);
+	if (ret || vol.major_ver < 3)
+		return 0;
+	/* Decode back from an attribute extent starting at @start_vcn. */
+	memset(attr_buf, 0, sizeof(ATTR_RECORD));
+	attr->non_resident = 1;
+	attr->lowest_vcn = cpu_to_sle64(start_vcn);
+	attr->highest_vcn = cpu_to_sle64(rl[n].vcn - 1);
+	attr->mapping_pairs_offset = cpu_to_le16(0x40);
+	attr->length = cpu_to_le32(0x40 + len);
+	memcpy(attr_buf + 0x40, mp, len);
+	count = ntfs_mapping_pairs_decode(&vol, attr, out);
+	ret = ref_decode(attr, rl);
+	if (count != ret || (count > 0
+			&& memcmp(out, rl, count * sizeof(runlist_element))))
+		return failed("decoded runlists", i);
+	return 0;
+}
+
+/*
+ * Decode random mapping pairs, mostly made of plausible headers.
+ */
+static int check_decode(int i, u8 *attr_buf)
+{
+	runlist_element ref[MP_SIZE];
+	runlist_element out[MP_SIZE];
+	runlist_element *rl, *p;
+	ATTR_RECORD *attr = (ATTR_RECORD*)attr_buf;
+	u8 *mp = attr_buf + 0x40;
+	int n, k, last, len, count, ref_count;
+	int len_len, lcn_len;
+	u64 r;
+
+	memset(attr_buf, 0, sizeof(ATTR_RECORD));
+	len = 1 + bench_random(&seed) % (MP_SIZE - 1);
+	for (k = last = 0; k < len; k += 1 + len_len + lcn_len) {
+		r = bench_random(&seed);
+		if (r & 0x3f) {
+			/* A positive length and a small lcn change. */
+			len_len = 1 + (r >> 16) % 4;
+			lcn_len = (r >> 18) % 4;
+		} else {
+			len_len = (r >> 16) & 0xf;
+			lcn_len = (r >> 20) & 0xf;
+		}
+		mp[k] = lcn_len << 4 | len_len;
+		for (n = 1; n <= len_len + lcn_len; n++)
+			if (k + n < MP_SIZE + SLACK)
+				mp[k + n] = (u8)bench_random(&seed);
+		if ((r & 0x3f) && (k + len_len < MP_SIZE + SLACK))
+			mp[k + len_len] &= 0x7f;
+		if ((r & 0x3f00) && lcn_len
+				&& (k + len_len + lcn_len < MP_SIZE + SLACK))
+			mp[k + len_len + lcn_len] &= 0x3f;
+		last = k;
+	}
+	/* Mostly terminated, sometimes early. */
+	r = bench_random(&seed);
+	if (r & 3)
+		mp[last] = 0;
+	if (!(r & 12))
+		mp[(r >> 8) % len] = 0;
+	attr->non_resident = 1;
+	attr->lowest_vcn = cpu_to_sle64(1 + bench_random(&seed) % 1000);
+	attr->mapping_pairs_offset = cpu_to_le16(0x40);
+	attr->length = cpu_to_le32(0x40 + len);
+	vol.major_ver = 3;
+	ref_count = ref_decode(attr, ref);
+	count = ntfs_mapping_pairs_decode(&vol, attr, out);
+	if (count != ref_count || (count > 0
+			&& memcmp(out, ref, count * sizeof(runlist_element))))
+		return failed("decoded runlists", i);
+	rl = ntfs_mapping_pairs_decompress(&vol, attr, NULL);
+	if (!rl != (ref_count < 0))
+		return failed("decompression results", i);
+	if (rl) {
+		/* Skip the leading part not mapped. */
+		for (p = rl + 1, k = 0; p->length; p++, k++)
+			if (k >= ref_count || memcmp(p, &ref[k], sizeof(*p)))
+				break;
+		n = (p->length || k != ref_count);
+		free(rl);
+		if (n)
+			return failed("decompressed runlists", i);
+	}
+	return 0;
+}
+
+static int run_fuzz(void)
+{
+	u8 *attr_buf;
+	int i, bad = 0;
+
+	attr_buf = ntfs_calloc(0x40 + MP_SIZE + SLACK);
+	if (!attr_buf)
+		exit(1);
+	for (i = 0; i < opts.fuzz && bad < 10; i++) {
+		bad += check_encode(i, attr_buf);
+		bad += check_decode(i, attr_buf);
+	}
+	free(attr_buf);
+	printf("%d random cases compared, %d differences\n", i, bad);
+	return bad;
+}
+
+static void run_timing(void)
+{
+	unsigned long long s = 0x2545f4914f6cdd1dULL;
+	runlist_element *rl, *out;
+	const runlist_element *stop_rl;
+	ATTR_RECORD *attr;
+	double start, t[5] = { 0, 0, 0, 0, 0 };
+	VCN vcn = 0;
+	LCN lcn = 0;
+	int i, r, size, count = 0;
+
+	rl = ntfs_malloc((opts.runs + 1) * sizeof(runlist_element));
+	out = ntfs_malloc((opts.runs + 2) * sizeof(runlist_element));
+	if (!rl || !out)
+		exit(1);
+	/* Runs and gaps of a fragmented volume, a hole now and then. */
+	for (i = 0; i < opts.runs; i++) {
+		rl[i].vcn = vcn;
+		rl[i].length = 1 + bench_random(&s) % 300;
+		if (!(i % 7))
+			rl[i].lcn = LCN_HOLE;
+		else {
+			lcn += 1 + bench_random(&s) % 100000;
+			rl[i].lcn = lcn;
+			lcn += rl[i].length;
+		}
+		vcn += rl[i].length;
+	}
+	rl[i].vcn = vcn;
+	rl[i].length = 0;
+	rl[i].lcn = LCN_ENOENT;
+	vol.major_ver = 3;
+	size = ntfs_get_size_for_mapping_pairs(&vol, rl, 0, INT_MAX);
+	attr = ntfs_calloc(0x40 + size + SLACK);
+	if (size < 0 || !attr)
+		exit(1);
+	attr->non_resident = 1;
+	attr->mapping_pairs_offset = cpu_to_le16(0x40);
+	attr->length = cpu_to_le32(0x40 + size);
+	attr->lowest_vcn = cpu_to_sle64(1);
+	for (r = 0; r < opts.rounds; r++) {
+		start = bench_now();
+		ref_build((u8*)attr + 0x40, size, rl, 0, &stop_rl);
+		t[0] += bench_now() - start;
+		start = bench_now();
+		ntfs_mapping_pairs_build(&vol, (u8*)attr + 0x40, size, rl, 0,
+				&stop_rl);
+		t[1] += bench_now() - start;
+		start = bench_now();
+		count = ref_decode(attr, out);
+		t[2] += bench_now() - start;
+		start = bench_now();
+		count += ntfs_mapping_pairs_decode(&vol, attr, out);
+		t[3] += bench_now() - start;
+		start = bench_now();
+		free(ntfs_mapping_pairs_decompress(&vol, attr, NULL));
+		t[4] += bench_now() - start;
+	}
+	if (count != 2 * opts.runs)
+		fprintf(stderr, "Decoded %d runs instead of %d\n", count / 2,
+				opts.runs);
+	printf("%d runs, %d bytes of mapping pairs\n", opts.runs, size);
+	bench_report("byte by byte encoding", (double)opts.runs * opts.rounds,
+			(double)size * opts.rounds, t[0]);
+	bench_report("ntfs_mapping_pairs_build",
+			(double)opts.runs * opts.rounds,
+			(double)size * opts.rounds, t[1]);
+	bench_report("byte by byte decoding", (double)opts.runs * opts.rounds,
+			(double)size * opts.rounds, t[2]);
+	bench_report("ntfs_mapping_pairs_decode",
+			(double)opts.runs * opts.rounds,
+			(double)size * opts.rounds, t[3]);
+	bench_report("ntfs_mapping_pairs_decompress",
+			(double)opts.runs * opts.rounds,
+			(double)size * opts.rounds, t[4]);
+	free(attr);
+	free(out);
+	free(rl);
+}
+
+int main(int argc, char **argv)
+{
+	int bad;
+
+	ntfs_log_set_handler(ntfs_log_handler_null);
+	parse_options(argc, argv);
+
+	vol.cluster_size = 4096;
+	vol.cluster_size_bits = 12;
+	bad = run_fuzz();
+	run_timing();
+	return (bad ? 1 : 0);
+}
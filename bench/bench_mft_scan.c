@@ -0,0 +1,220 @@
+/**
+ * bench_mft_scan - Measure how a parallel scan of the mft scales.
+ *
+ * Mounts an image read only and hands its mft records to the workers of
+ * ntfs_mft_scan_parallel(), with one thread then doubling up to the
+ * number of processors.  Each worker checks its records and walks their
+ * attributes, counting the names and the clusters allocated to the data,
+ * as a read only pass of a checker or of an undelete tool would.  The
+ * counts have to agree whatever the number of threads.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+#include "attrib.h"
+#include "mft.h"
+#include "logging.h"
+#include "misc.h"
+#include "bench.h"
+
+static struct {
+	int threads;		/* Most threads, 0 for one per processor. */
+	int rounds;		/* Scans for each number of threads. */
+	int flags;		/* Records scanned. */
+	const char *image;
+} opts = {
+	.rounds = 3,
+	.flags = NTFS_MFT_SCAN_IN_USE,
+};
+
+/* What the workers count, each on its own then merged. */
+struct totals {
+	s64 records;
+	s64 bad;		/* Records failing the check. */
+	s64 attrs;
+	s64 names;		/* $FILE_NAME attributes. */
+	s64 clusters;		/* Allocated to non resident $DATA. */
+};
+
+static void usage(void)
+{
+	printf("\nUsage: bench_mft_scan [options] image\n\n"
+		"    -t threads Most threads (default one per processor)\n"
+		"    -r rounds  Scans for each number of threads (default 3)\n"
+		"    -a         Scan all the records, not only those in use\n\n");
+	exit(1);
+}
+
+static void parse_options(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "t:r:ah")) != -1) {
+		switch (c) {
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'r':
+			opts.rounds = atoi(optarg);
+			break;
+		case 'a':
+			opts.flags = NTFS_MFT_SCAN_ALL;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		opts.image = argv[optind++];
+	if (optind < argc || !opts.image || opts.threads < 0
+			|| opts.threads > NTFS_MFT_SCAN_THREADS
+			|| opts.rounds <= 0)
+		usage();
+}
+
+/*
+ * Check a record and walk its attributes, only reading the record as
+ * required from the workers.
+ */
+static int count_record(ntfs_mft_worker *w, s64 mft_no, MFT_RECORD *mrec)
+{
+	struct totals *t = w->data;
+	ATTR_RECORD *a;
+
+	t->records++;
+	if (ntfs_mft_record_check_ro(w->vol, mft_no, mrec)) {
+		t->bad++;
+		return 0;
+	}
+	while (!ntfs_attrs_walk(w->ctx)) {
+		a = w->ctx->attr;
+		t->attrs++;
+		if (a->type == AT_FILE_NAME)
+			t->names++;
+		else if (a->type == AT_DATA && a->non_resident)
+			t->clusters += sle64_to_cpu(a->allocated_size)
+					>> w->vol->cluster_size_bits;
+	}
+	return errno == ENOENT ? 0 : -1;
+}
+
+static int merge_totals(ntfs_mft_worker *w)
+{
+	struct totals *t = w->data;
+	struct totals *all = w->arg;
+
+	all->records += t->records;
+	all->bad += t->bad;
+	all->attrs += t->attrs;
+	all->names += t->names;
+	all->clusters += t->clusters;
+	return 0;
+}
+
+/*
+ * Scan the mft with up to @threads workers, return 0 if the counts agree
+ * with @ref, or set it on the first run.
+ */
+static int run(ntfs_volume *vol, int threads, struct totals *ref)
+{
+	struct totals all;
+	char title[40];
+	double start, secs = 0;
+	s64 total = 0;
+	int i;
+
+	for (i = 0; i < opts.rounds; i++) {
+		memset(&all, 0, sizeof(all));
+		start = bench_now();
+		if (ntfs_mft_scan_parallel(vol, opts.flags, threads,
+				sizeof(struct totals), count_record,
+				merge_totals, &all)) {
+			ntfs_log_perror("Scan with %d threads failed", threads);
+			return -1;
+		}
+		secs += bench_now() - start;
+		total += all.records;
+		if (!ref->records) {
+			*ref = all;
+			printf("%lld records, %lld bad, %lld attributes, "
+				"%lld names, %lld data clusters\n",
+				(long long)all.records, (long long)all.bad,
+				(long long)all.attrs, (long long)all.names,
+				(long long)all.clusters);
+		} else if (memcmp(&all, ref, sizeof(all))) {
+			fprintf(stderr, "Counts differ with %d threads\n",
+					threads);
+			return -1;
+		}
+	}
+	snprintf(title, sizeof(title), "%d thread%s", threads,
+			threads > 1 ? "s" : "");
+	bench_report(title, total, total * vol->mft_record_size, secs);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	ntfs_volume *vol;
+	struct totals ref;
+	int max, threads, ret = 0;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	parse_options(argc, argv);
+
+	vol = ntfs_mount(opts.image, NTFS_MNT_RDONLY);
+	if (!vol) {
+		ntfs_log_perror("Failed to mount '%s'", opts.image);
+		return 1;
+	}
+	max = opts.threads ? opts.threads : ntfs_nr_cpus();
+	if (max > NTFS_MFT_SCAN_THREADS)
+		max = NTFS_MFT_SCAN_THREADS;
+	memset(&ref, 0, sizeof(ref));
+	for (threads = 1; !ret; threads *= 2) {
+		if (threads > max)
+			threads = max;
+		ret = run(vol, threads, &ref);
+		if (threads == max)
+			break;
+	}
+	ntfs_umount(vol, FALSE);
+	return ret ? 1 : 0;
+}
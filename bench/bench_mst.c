@@ -0,0 +1,193 @@
+/**
+ * bench_mst - Compare single record and batched multi sector fixups.
+ *
+ * Fills a buffer with consecutive protected records, as read from the $MFT
+ * or an index allocation, then times deprotecting them after a read,
+ * protecting them before a write and deprotecting them after the write,
+ * once calling the single record functions for each record and once with
+ * the batch functions.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "mst.h"
+#include "logging.h"
+#include "misc.h"
+#include "bench.h"
+
+static struct {
+	u32 size;		/* Record size in bytes. */
+	s64 count;		/* Records in the buffer. */
+	int rounds;		/* Passes over the buffer. */
+} opts = {
+	.size = 1024,
+	.count = 65536,
+	.rounds = 20,
+};
+
+static void usage(void)
+{
+	printf("\nUsage: bench_mst [options]\n\n"
+		"    -s bytes   Record size (default 1024)\n"
+		"    -n count   Records in the buffer (default 65536)\n"
+		"    -r rounds  Passes over the buffer (default 20)\n\n");
+	exit(1);
+}
+
+static void parse_options(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "s:n:r:h")) != -1) {
+		switch (c) {
+		case 's':
+			opts.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.count = strtoll(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.rounds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc || !opts.size || opts.size % NTFS_BLOCK_SIZE
+			|| opts.count <= 0 || opts.rounds <= 0)
+		usage();
+}
+
+/*
+ * Fill the buffer with protected records holding random data.
+ */
+static void make_records(u8 *buf)
+{
+	unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+	NTFS_RECORD *rec;
+	s64 n, i;
+
+	for (i = 0; i < opts.count * opts.size; i += 8) {
+		u64 r = bench_random(&seed);
+
+		memcpy(buf + i, &r, 8);
+	}
+	for (n = 0; n < opts.count; n++) {
+		rec = (NTFS_RECORD*)(buf + n * opts.size);
+		rec->magic = magic_FILE;
+		rec->usa_ofs = cpu_to_le16(0x30);
+		rec->usa_count = cpu_to_le16(opts.size / NTFS_BLOCK_SIZE + 1);
+		if (ntfs_mst_pre_write_fixup(rec, opts.size)) {
+			fprintf(stderr, "Cannot protect record %lld\n",
+					(long long)n);
+			exit(1);
+		}
+	}
+}
+
+static void run(u8 *buf, BOOL batch)
+{
+	double t_read = 0, t_pre = 0, t_post = 0, start;
+	double total = (double)opts.count * opts.rounds;
+	s64 n, bad = 0;
+	char title[64];
+	int r;
+
+	for (r = 0; r < opts.rounds; r++) {
+		start = bench_now();
+		if (batch)
+			bad += ntfs_mst_post_read_fixup_batch(buf, opts.size,
+					opts.count, TRUE);
+		else
+			for (n = 0; n < opts.count; n++)
+				bad += !!ntfs_mst_post_read_fixup((NTFS_RECORD*)
+					(buf + n * opts.size), opts.size);
+		t_read += bench_now() - start;
+
+		start = bench_now();
+		if (batch)
+			n = ntfs_mst_pre_write_fixup_batch(buf, opts.size,
+					opts.count);
+		else
+			for (n = 0; n < opts.count; n++)
+				if (ntfs_mst_pre_write_fixup((NTFS_RECORD*)
+						(buf + n * opts.size),
+						opts.size))
+					break;
+		t_pre += bench_now() - start;
+		bad += opts.count - n;
+
+		start = bench_now();
+		if (batch)
+			ntfs_mst_post_write_fixup_batch(buf, opts.size,
+					opts.count);
+		else
+			for (n = 0; n < opts.count; n++)
+				ntfs_mst_post_write_fixup((NTFS_RECORD*)
+					(buf + n * opts.size));
+		t_post += bench_now() - start;
+
+		/* Protect again for the next post read pass, untimed. */
+		ntfs_mst_pre_write_fixup_batch(buf, opts.size, opts.count);
+	}
+	if (bad)
+		fprintf(stderr, "%lld records failed\n", (long long)bad);
+	snprintf(title, sizeof(title), "%s post read", batch ? "batch"
+			: "single");
+	bench_report(title, total, total * opts.size, t_read);
+	snprintf(title, sizeof(title), "%s pre write", batch ? "batch"
+			: "single");
+	bench_report(title, total, total * opts.size, t_pre);
+	snprintf(title, sizeof(title), "%s post write", batch ? "batch"
+			: "single");
+	bench_report(title, total, total * opts.size, t_post);
+}
+
+int main(int argc, char **argv)
+{
+	u8 *buf;
+
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	parse_options(argc, argv);
+
+	buf = ntfs_malloc(opts.count * opts.size);
+	if (!buf)
+		return 1;
+	make_records(buf);
+	printf("%lld records of %u bytes, %d rounds\n",
+			(long long)opts.count, (unsigned)opts.size, opts.rounds);
+	run(buf, FALSE);
+	run(buf, TRUE);
+	free(buf);
+	return 0;
+}
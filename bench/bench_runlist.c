@@ -0,0 +1,360 @@
+/**
+ * bench_runlist - Measure finding vcns in hugely fragmented attributes.
+ *
+ * Builds the runlist of a synthetic attribute made of many small runs,
+ * alternately allocated and sparse, and translates vcns at random offsets,
+ * once walking the runlist from its start as done before the runs were
+ * searched, then with ntfs_attr_vcn_to_lcn().  Sequential lookups through
+ * ntfs_attr_find_vcn() are timed too.  Given a volume and the path of a
+ * file on it, also times mapping the whole runlist of the file, which has
+ * many extent mft records when the file is hugely fragmented, and random
+ * 4 KiB reads from the file.  Such a file can be created first, by writing
+ * it interleaved with a companion file, possibly on a volume mounted with
+ * NTFS_MNT_PREALLOC so that the appends are served from reserved clusters.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#include "types.h"
+#include "volume.h"
+#include "inode.h"
+#include "attrib.h"
+#include "runlist.h"
+#include "dir.h"
+#include "unistr.h"
+#include "logging.h"
+#include "misc.h"
+#include "bench.h"
+
+static struct {
+	int runs;		/* Runs in the synthetic attribute. */
+	int lookups;		/* Vcns translated, or reads. */
+	int maps;		/* Mappings of the whole runlist. */
+	int create;		/* Blocks of the file to create, or zero. */
+	int prealloc;		/* Reserve clusters when creating it. */
+	const char *device;	/* Volume to read from, or NULL. */
+	const char *path;	/* File on the volume. */
+} opts = {
+	.runs = 100000,
+	.lookups = 100000,
+	.maps = 20,
+};
+
+static void usage(void)
+{
+	printf("\nUsage: bench_runlist [options] [device path]\n\n"
+		"    -n runs     Runs in the synthetic attribute "
+				"(default 100000)\n"
+		"    -l lookups  Lookups or reads to time (default 100000)\n"
+		"    -m maps     Mappings of the whole runlist to time "
+				"(default 20)\n"
+		"    -c blocks   Create the file with this number of "
+				"fragmented 4 KiB blocks\n"
+		"    -p          Reserve clusters ahead of the appends "
+				"when creating the file\n\n");
+	exit(1);
+}
+
+static void parse_options(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "n:l:m:c:ph")) != -1) {
+		switch (c) {
+		case 'n':
+			opts.runs = atoi(optarg);
+			break;
+		case 'l':
+			opts.lookups = atoi(optarg);
+			break;
+		case 'm':
+			opts.maps = atoi(optarg);
+			break;
+		case 'c':
+			opts.create = atoi(optarg);
+			break;
+		case 'p':
+			opts.prealloc = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 2 == argc) {
+		opts.device = argv[optind++];
+		opts.path = argv[optind++];
+	}
+	if (optind < argc || opts.runs <= 0 || opts.lookups <= 0
+	    || opts.maps <= 0 || opts.create < 0
+	    || (opts.create && !opts.device)
+	    || (opts.prealloc && !opts.create))
+		usage();
+}
+
+/*
+ * A non resident attribute with a fully mapped runlist of @opts.runs runs
+ * of 1 to 16 clusters, every third one being a hole.
+ */
+static ntfs_attr *make_attr(ntfs_inode *ni, VCN *clusters)
+{
+	unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+	runlist_element *rl;
+	ntfs_attr *na;
+	VCN vcn = 0;
+	LCN lcn = 1000;
+	int i;
+
+	na = ntfs_calloc(sizeof(ntfs_attr));
+	rl = ntfs_malloc((opts.runs + 1) * sizeof(runlist_element));
+	if (!na || !rl)
+		exit(1);
+	for (i = 0; i < opts.runs; i++) {
+		rl[i].vcn = vcn;
+		rl[i].length = 1 + bench_random(&seed) % 16;
+		if (i % 3 == 2)
+			rl[i].lcn = LCN_HOLE;
+		else {
+			/* Leave a gap so that the runs cannot be merged */
+			rl[i].lcn = lcn;
+			lcn += rl[i].length + 1;
+		}
+		vcn += rl[i].length;
+	}
+	rl[i].vcn = vcn;
+	rl[i].lcn = LCN_ENOENT;
+	rl[i].length = 0;
+	na->ni = ni;
+	na->type = AT_DATA;
+	na->name = AT_UNNAMED;
+	na->rl = rl;
+	NAttrSetNonResident(na);
+	NAttrSetFullyMapped(na);
+	*clusters = vcn;
+	return (na);
+}
+
+static void run_memory(void)
+{
+	unsigned long long seed = 0x2545f4914f6cdd1dULL;
+	ntfs_inode ni = { .mft_no = FILE_first_user };
+	runlist_element *rl;
+	double start;
+	ntfs_attr *na;
+	VCN clusters, vcn;
+	LCN sum[2] = { 0, 0 };
+	int i, k;
+
+	na = make_attr(&ni, &clusters);
+	for (k = 0; k < 2; k++) {
+		seed = 0x2545f4914f6cdd1dULL;
+		start = bench_now();
+		for (i = 0; i < opts.lookups; i++) {
+			vcn = bench_random(&seed) % clusters;
+			if (k == 0)
+				sum[k] += ntfs_rl_vcn_to_lcn(na->rl, vcn);
+			else
+				sum[k] += ntfs_attr_vcn_to_lcn(na, vcn);
+		}
+		bench_report(k == 0 ? "walking the runlist"
+				: "ntfs_attr_vcn_to_lcn random",
+				opts.lookups, 0, bench_now() - start);
+	}
+	if (sum[1] != sum[0])
+		fprintf(stderr, "Lookups differ: %lld %lld\n",
+				(long long)sum[0], (long long)sum[1]);
+	start = bench_now();
+	for (vcn = 0; vcn < clusters; vcn += rl->length) {
+		rl = ntfs_attr_find_vcn(na, vcn);
+		if (!rl || (rl->vcn != vcn)) {
+			fprintf(stderr, "Vcn %lld not found\n",
+					(long long)vcn);
+			break;
+		}
+	}
+	bench_report("ntfs_attr_find_vcn sequential", opts.runs, 0,
+			bench_now() - start);
+	free(na->rl);
+	free(na);
+}
+
+static ntfs_inode *create_file(ntfs_inode *dir_ni, const char *name)
+{
+	ntfschar *uname = NULL;
+	ntfs_inode *ni;
+	int len;
+
+	len = ntfs_mbstoucs(name, &uname);
+	if (len < 0)
+		return (NULL);
+	ni = ntfs_create(dir_ni, const_cpu_to_le32(0), uname, len, S_IFREG);
+	free(uname);
+	return (ni);
+}
+
+/*
+ * Create @opts.path and a companion file, writing them alternately one
+ * block at a time so that both get fragmented into runs of one block,
+ * and their runlists spread over many extents, unless clusters are
+ * reserved ahead of the appends.
+ */
+static void create_fragmented(void)
+{
+	ntfs_volume *vol;
+	ntfs_inode *dir_ni, *ni[2];
+	ntfs_attr *na[2];
+	char *parent, *name, *other;
+	char buf[4096];
+	double start;
+	int i, k;
+
+	parent = strdup(opts.path);
+	other = malloc(strlen(opts.path) + 3);
+	if (!parent || !other)
+		exit(1);
+	name = strrchr(parent, '/');
+	if (name)
+		*name++ = 0;
+	else
+		name = parent;
+	sprintf(other, "%s.2", name);
+	vol = ntfs_mount(opts.device, opts.prealloc ? NTFS_MNT_PREALLOC : 0);
+	if (!vol) {
+		ntfs_log_perror("Failed to mount '%s'", opts.device);
+		exit(1);
+	}
+	dir_ni = ntfs_pathname_to_inode(vol, NULL,
+			(name != parent) && *parent ? parent : "/");
+	ni[0] = (dir_ni ? create_file(dir_ni, name) : NULL);
+	ni[1] = (dir_ni ? create_file(dir_ni, other) : NULL);
+	na[0] = (ni[0] ? ntfs_attr_open(ni[0], AT_DATA, AT_UNNAMED, 0) : NULL);
+	na[1] = (ni[1] ? ntfs_attr_open(ni[1], AT_DATA, AT_UNNAMED, 0) : NULL);
+	if (!na[0] || !na[1]) {
+		ntfs_log_perror("Failed to create '%s'", opts.path);
+		exit(1);
+	}
+	memset(buf, 0x55, sizeof(buf));
+	start = bench_now();
+	for (i = 0; i < opts.create; i++)
+		for (k = 0; k < 2; k++)
+			if (ntfs_attr_pwrite(na[k], (s64)i * sizeof(buf),
+					sizeof(buf), buf) != (s64)sizeof(buf)) {
+				ntfs_log_perror("Failed to write '%s'",
+						opts.path);
+				exit(1);
+			}
+	for (k = 0; k < 2; k++) {
+		ntfs_attr_close(na[k]);
+		ntfs_inode_close(ni[k]);
+	}
+	bench_report("interleaved 4 KiB writes", 2.0 * opts.create,
+			2.0 * opts.create * sizeof(buf), bench_now() - start);
+	ntfs_inode_close(dir_ni);
+	ntfs_umount(vol, FALSE);
+	free(parent);
+	free(other);
+}
+
+static void run_volume(void)
+{
+	unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+	ntfs_volume *vol;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	runlist_element *rl;
+	double start;
+	char buf[4096];
+	s64 blocks;
+	int i, runs;
+
+	if (opts.create)
+		create_fragmented();
+	vol = ntfs_mount(opts.device, NTFS_MNT_RDONLY);
+	if (!vol) {
+		ntfs_log_perror("Failed to mount '%s'", opts.device);
+		exit(1);
+	}
+	ni = ntfs_pathname_to_inode(vol, NULL, opts.path);
+	na = (ni ? ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0) : NULL);
+	if (!na || !NAttrNonResident(na)
+	    || (na->data_size < (s64)sizeof(buf))) {
+		ntfs_log_error("No non resident data to read in '%s'\n",
+				opts.path);
+		exit(1);
+	}
+		/* the extent records are kept open by the inode */
+	start = bench_now();
+	for (i = 0; i < opts.maps; i++) {
+		ntfs_attr_close(na);
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (!na || ntfs_attr_map_whole_runlist(na)) {
+			ntfs_log_perror("Failed to map '%s'", opts.path);
+			exit(1);
+		}
+	}
+	runs = 0;
+	for (rl = na->rl; rl->length; rl++)
+		runs++;
+	printf("%s: %d runs, attribute list of %u bytes\n", opts.path,
+			runs, (unsigned int)ni->attr_list_size);
+	bench_report("ntfs_attr_map_whole_runlist", opts.maps, 0,
+			bench_now() - start);
+	blocks = na->data_size / sizeof(buf);
+	start = bench_now();
+	for (i = 0; i < opts.lookups; i++) {
+		if (ntfs_attr_pread(na, (bench_random(&seed) % blocks)
+				* sizeof(buf), sizeof(buf), buf)
+					!= (s64)sizeof(buf)) {
+			ntfs_log_perror("Failed to read '%s'", opts.path);
+			break;
+		}
+	}
+	bench_report("random 4 KiB reads", opts.lookups,
+			(double)opts.lookups * sizeof(buf),
+			bench_now() - start);
+	ntfs_attr_close(na);
+	ntfs_inode_close(ni);
+	ntfs_umount(vol, FALSE);
+}
+
+int main(int argc, char **argv)
+{
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	parse_options(argc, argv);
+
+	printf("%d runs, %d lookups\n", opts.runs, opts.lookups);
+	run_memory();
+	if (opts.device)
+		run_volume();
+	return 0;
+}
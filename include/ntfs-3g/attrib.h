@@ -198,6 +198,21 @@ struct _ntfs_attr {
 	u8 compression_block_size_bits;
 	u8 compression_block_clusters;
 	s8 unused_runs; /* pre-reserved entries available */
+	LCN prealloc_lcn;	/* First cluster reserved for appending. */
+	VCN prealloc_vcn;	/* Vcn the reserved clusters are for. */
+	s64 prealloc_len;	/* Clusters reserved, 0 if none. */
+	s64 prealloc_window;	/* Clusters last reserved, 0 before
+				   appending. */
+	runlist_element *rl_seen; /* @rl when its runs were counted. */
+	int rl_runs;		/* Runs in @rl, not counting the terminator. */
+	int rl_cursor;		/* Run where a vcn was last found. */
+	struct ntfs_rlc *rlc;	/* The whole runlist compacted, @rl then
+				   only holds a part of it, or NULL. */
+	VCN mp_delayed_vcn;	/* First vcn whose mapping pairs are not
+				   written yet, when delayed. */
+	ntfs_attr *next_delayed; /* Next attribute kept by the base inode
+				   after its mapping pairs failed to be
+				   written on close. */
 };
 
 /**
@@ -212,6 +227,7 @@ typedef enum {
 	NA_DataAppending,	/* 1: Attribute is being appended to */
 	NA_ComprClosing,	/* 1: Compressed attribute is being closed */
 	NA_RunlistDirty,	/* 1: Runlist has been updated */
+	NA_MappingPairsDelayed,	/* 1: Mapping pairs to be written on close */
 } ntfs_attr_state_bits;
 
 #define  test_nattr_flag(na, flag)	 test_bit(NA_##flag, (na)->state)
@@ -239,13 +255,32 @@ typedef enum {
 #define NAttrClearDataAppending(na)	clear_nattr_flag(na, DataAppending)
 
 #define NAttrRunlistDirty(na)		test_nattr_flag(na, RunlistDirty)
-#define NAttrSetRunlistDirty(na)	set_nattr_flag(na, RunlistDirty)
+#define NAttrSetRunlistDirty(na)	\
+	do { set_nattr_flag(na, RunlistDirty); \
+		ntfs_attr_forget_runs(na); } while (0)
 #define NAttrClearRunlistDirty(na)	clear_nattr_flag(na, RunlistDirty)
 
+#define NAttrMappingPairsDelayed(na)	\
+				test_nattr_flag(na, MappingPairsDelayed)
+#define NAttrSetMappingPairsDelayed(na)	\
+				set_nattr_flag(na, MappingPairsDelayed)
+#define NAttrClearMappingPairsDelayed(na)	\
+				clear_nattr_flag(na, MappingPairsDelayed)
+
 #define NAttrComprClosing(na)		test_nattr_flag(na, ComprClosing)
 #define NAttrSetComprClosing(na)	set_nattr_flag(na, ComprClosing)
 #define NAttrClearComprClosing(na)	clear_nattr_flag(na, ComprClosing)
 
+/*
+ * Forget the runs counted in the runlist of an attribute, to be called
+ * when the runlist is changed in place.  Setting the runlist dirty does
+ * it too.
+ */
+static __inline__ void ntfs_attr_forget_runs(ntfs_attr *na)
+{
+	na->rl_seen = (runlist_element*)NULL;
+}
+
 #define GenNAttrIno(func_name, flag)			\
 extern int NAttr##func_name(ntfs_attr *na);		\
 extern void NAttrSet##func_name(ntfs_attr *na);		\
@@ -298,6 +333,7 @@ extern void ntfs_attr_close(ntfs_attr *na);
 
 extern s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count,
 		void *b);
+extern const void *ntfs_attr_borrow(ntfs_attr *na, s64 pos, s64 count);
 extern s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count,
 		const void *b);
 extern int ntfs_attr_pclose(ntfs_attr *na);
@@ -349,6 +385,10 @@ extern int ntfs_attr_record_move_to(ntfs_attr_search_ctx *ctx, ntfs_inode *ni);
 extern int ntfs_attr_record_move_away(ntfs_attr_search_ctx *ctx, int extra);
 
 extern int ntfs_attr_update_mapping_pairs(ntfs_attr *na, VCN from_vcn);
+extern int ntfs_attr_flush(ntfs_attr *na);
+extern int ntfs_attr_flush_delayed(ntfs_inode *ni, const ATTR_TYPES type,
+		const ntfschar *name, u32 name_len);
+extern void ntfs_attr_drop_delayed(ntfs_inode *ni);
 
 extern int ntfs_attr_truncate(ntfs_attr *na, const s64 newsize);
 extern int ntfs_attr_truncate_solid(ntfs_attr *na, const s64 newsize);
@@ -31,6 +31,11 @@ extern int ntfs_attrlist_need(ntfs_inode *ni);
 extern int ntfs_attrlist_entry_add(ntfs_inode *ni, ATTR_RECORD *attr);
 extern int ntfs_attrlist_entry_rm(ntfs_attr_search_ctx *ctx);
 
+extern ATTR_LIST_ENTRY *ntfs_attrlist_index_find(ntfs_inode *ni,
+		ATTR_TYPES type, const ntfschar *name, u32 name_len,
+		IGNORE_CASE_BOOL ic, VCN lowest_vcn);
+extern void ntfs_attrlist_index_free(ntfs_inode *ni);
+
 /**
  * ntfs_attrlist_mark_dirty - set the attribute list dirty
  * @ni:		ntfs inode which base inode contain dirty attribute list
@@ -30,7 +30,8 @@
  * NOTES:
  *
  * - Operations are 8-bit only to ensure the functions work both on little
- *   and big endian machines! So don't make them 32-bit ops!
+ *   and big endian machines! So don't make them 32-bit ops! The range
+ *   functions use 64-bit words, converted with le64_to_cpu().
  * - bitmap starts at bit = 0 and ends at bit = bitmap size - 1.
  * - _Caller_ has to make sure that the bit to operate on is less than the
  *   size of the bitmap.
@@ -42,6 +43,36 @@ extern char ntfs_bit_get_and_set(u8 *bitmap, const u64 bit, const u8 new_value);
 extern int  ntfs_bitmap_set_run(ntfs_attr *na, s64 start_bit, s64 count);
 extern int  ntfs_bitmap_clear_run(ntfs_attr *na, s64 start_bit, s64 count);
 
+extern void ntfs_bitmap_set_range(u8 *bm, s64 start, s64 count);
+extern void ntfs_bitmap_clear_range(u8 *bm, s64 start, s64 count);
+extern s64  ntfs_bitmap_popcount(const u8 *bm, s64 start, s64 count);
+extern s64  ntfs_bitmap_popcount_parallel(const u8 *bm, s64 start,
+		s64 count);
+extern s64  ntfs_bitmap_find_first_zero(const u8 *bm, s64 start, s64 end);
+extern s64  ntfs_bitmap_find_first_set(const u8 *bm, s64 start, s64 end);
+extern s64  ntfs_bitmap_find_zero_run(const u8 *bm, s64 start, s64 end,
+		s64 len);
+extern s64  ntfs_bitmap_longest_zero_run(const u8 *bm, s64 start, s64 end,
+		s64 *len);
+
+extern int  ntfs_lcn_bitmap_load(ntfs_volume *vol);
+extern int  ntfs_lcn_bitmap_flush(ntfs_volume *vol);
+extern int  ntfs_lcn_bitmap_release(ntfs_volume *vol);
+extern s64  ntfs_lcn_bitmap_pread(ntfs_volume *vol, s64 pos, s64 count,
+		void *b);
+extern s64  ntfs_lcn_bitmap_free_bits(ntfs_volume *vol);
+extern s64  ntfs_lcn_bitmap_pwrite(ntfs_volume *vol, s64 pos, s64 count,
+		const void *b);
+
+extern int  ntfs_mft_bitmap_load(ntfs_volume *vol);
+extern int  ntfs_mft_bitmap_flush(ntfs_volume *vol);
+extern int  ntfs_mft_bitmap_release(ntfs_volume *vol);
+extern s64  ntfs_mft_bitmap_pread(ntfs_volume *vol, s64 pos, s64 count,
+		void *b);
+extern s64  ntfs_mft_bitmap_pwrite(ntfs_volume *vol, s64 pos, s64 count,
+		const void *b);
+extern s64  ntfs_mft_bitmap_find_free(ntfs_volume *vol, s64 start, s64 end);
+
 /**
  * ntfs_bitmap_set_bit - set a bit in a bitmap
  * @na:		attribute containing the bitmap
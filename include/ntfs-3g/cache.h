@@ -42,17 +42,6 @@ struct CACHED_INODE {
 	u64 inum;
 } ;
 
-struct CACHED_NIDATA {
-	struct CACHED_NIDATA *next;
-	struct CACHED_NIDATA *previous;
-	const char *pathname;	/* not used */
-	size_t varsize;		/* not used */
-	union ALIGNMENT payload[0];
-		/* above fields must match "struct CACHED_GENERIC" */
-	u64 inum;
-	ntfs_inode *ni;
-} ;
-
 struct CACHED_LOOKUP {
 	struct CACHED_LOOKUP *next;
 	struct CACHED_LOOKUP *previous;
@@ -111,6 +100,33 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 int ntfs_remove_cache(struct CACHE_HEADER *cache,
 			struct CACHED_GENERIC *item, int flags);
 
+	/* closed inodes, see ntfs_fetch_nidata() */
+
+struct NIDATA_ENTRY {
+	u64 inum;
+	ntfs_inode *ni;		/* NULL while the inode is open */
+	int next_free;		/* next entry in the free list, or -1 */
+	BOOL used;
+	BOOL referenced;	/* second chance left before eviction */
+} ;
+
+struct NIDATA_CACHE {
+	int max_entries;
+	int hand;		/* next entry examined for eviction */
+	int free_entry;		/* first free entry, or -1 */
+	int hash_mask;
+	int *hash;		/* entry indexes, -1 for an empty slot */
+	unsigned long reads;
+	unsigned long hits;
+	unsigned long evictions;
+	struct NIDATA_ENTRY entry[0];
+} ;
+
+ntfs_inode *ntfs_fetch_nidata(struct NIDATA_CACHE *cache, u64 inum);
+void ntfs_enter_nidata(struct NIDATA_CACHE *cache, ntfs_inode *ni);
+int ntfs_invalidate_nidata(struct NIDATA_CACHE *cache, u64 inum);
+void ntfs_set_nidata_budget(s64 bytes);
+
 void ntfs_create_lru_caches(ntfs_volume *vol);
 void ntfs_free_lru_caches(ntfs_volume *vol);
 
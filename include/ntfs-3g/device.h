@@ -27,6 +27,15 @@
 #include "config.h"
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#else
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#endif
+
 #include "device_io.h"
 #include "types.h"
 #include "support.h"
@@ -43,6 +52,7 @@ typedef enum {
 	ND_Dirty,	/* 1: Device is dirty, needs sync. */
 	ND_Block,	/* 1: Device is a block device. */
 	ND_Sync,	/* 1: Device is mounted with "-o sync" */
+	ND_Direct,	/* 1: Device is opened with O_DIRECT */
 } ntfs_device_state_bits;
 
 #define  test_ndev_flag(nd, flag)	   test_bit(ND_##flag, (nd)->d_state)
@@ -69,6 +79,13 @@ typedef enum {
 #define NDevSetSync(nd)		  set_ndev_flag(nd, Sync)
 #define NDevClearSync(nd)	clear_ndev_flag(nd, Sync)
 
+#define NDevDirect(nd)		 test_ndev_flag(nd, Direct)
+#define NDevSetDirect(nd)	  set_ndev_flag(nd, Direct)
+#define NDevClearDirect(nd)	clear_ndev_flag(nd, Direct)
+
+struct ntfs_dev_cache;
+struct ntfs_device_io_stats;
+
 /**
  * struct ntfs_device -
  *
@@ -90,10 +107,32 @@ struct ntfs_device {
 						   heads or -1. */
 	int d_sectors_per_track;		/* Disk geometry: number of
 						   sectors per track or -1. */
+	struct ntfs_dev_cache *d_cache;		/* Block cache or NULL, see
+						   ntfs_device_cache_enable(). */
+	struct ntfs_device_io_stats *d_stats;	/* I/O counters or NULL, see
+						   ntfs_device_io_stats_attach(). */
 };
 
 struct stat;
 
+/**
+ * struct ntfs_io_req -
+ *
+ * One positioned transfer in a batch handed to ntfs_device_submit().  The
+ * caller fills in @buf, @count, @offset and @write, the device fills in @done
+ * with the number of bytes transferred and @error with the errno value of a
+ * failed transfer (zero if it succeeded).  As with ntfs_pread(), @done being
+ * lower than @count with no @error means end of device was reached.
+ */
+struct ntfs_io_req {
+	void *buf;		/* Data buffer. */
+	s64 count;		/* Number of bytes to transfer. */
+	s64 offset;		/* Position on the device. */
+	BOOL write;		/* TRUE to write @buf, FALSE to read into it. */
+	s64 done;		/* Out: number of bytes transferred. */
+	int error;		/* Out: errno value or zero. */
+};
+
 /**
  * struct ntfs_device_operations -
  *
@@ -113,8 +152,21 @@ struct ntfs_device_operations {
 	int (*stat)(struct ntfs_device *dev, struct stat *buf);
 	int (*ioctl)(struct ntfs_device *dev, unsigned long request,
 			void *argp);
+	/* Optional: positioned gather read and scatter write. */
+	s64 (*preadv)(struct ntfs_device *dev, const struct iovec *iov,
+			int iovcnt, s64 offset);
+	s64 (*pwritev)(struct ntfs_device *dev, const struct iovec *iov,
+			int iovcnt, s64 offset);
+	/* Optional: queue a batch of transfers and wait for all of them. */
+	int (*submit)(struct ntfs_device *dev, struct ntfs_io_req *reqs,
+			int nr);
+	/* Optional: pointer to device data, see ntfs_device_borrow(). */
+	const void *(*borrow)(struct ntfs_device *dev, s64 offset, s64 count);
 };
 
+extern void ntfs_device_default_ops_set(struct ntfs_device_operations *dops);
+extern struct ntfs_device_operations *ntfs_device_default_ops_get(void);
+
 extern struct ntfs_device *ntfs_device_alloc(const char *name, const long state,
 		struct ntfs_device_operations *dops, void *priv_data);
 extern int ntfs_device_free(struct ntfs_device *dev);
@@ -125,6 +177,127 @@ extern s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 extern s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		const void *b);
 
+extern s64 ntfs_preadv(struct ntfs_device *dev, const s64 pos,
+		const struct iovec *iov, int iovcnt);
+extern s64 ntfs_pwritev(struct ntfs_device *dev, const s64 pos,
+		const struct iovec *iov, int iovcnt);
+
+/* Maximum number of buffers gathered into one struct ntfs_vio. */
+#define NTFS_VIO_MAX	64
+
+/**
+ * struct ntfs_vio -
+ *
+ * A contiguous device extent being gathered from (or scattered to) several
+ * buffers, so that it can be transferred with a single ntfs_preadv() or
+ * ntfs_pwritev().  See ntfs_vio_add() and ntfs_vio_flush().
+ */
+struct ntfs_vio {
+	s64 pos;			/* Device position of the extent. */
+	s64 count;			/* Bytes gathered so far. */
+	int nr;				/* Buffers used in @iov. */
+	struct iovec iov[NTFS_VIO_MAX];
+};
+
+static __inline__ void ntfs_vio_init(struct ntfs_vio *vio)
+{
+	vio->count = 0;
+	vio->nr = 0;
+}
+
+extern BOOL ntfs_vio_add(struct ntfs_vio *vio, s64 pos, void *buf,
+		s64 count);
+extern s64 ntfs_vio_flush(struct ntfs_device *dev, struct ntfs_vio *vio,
+		BOOL wr, void **stop);
+
+extern int ntfs_device_submit(struct ntfs_device *dev,
+		struct ntfs_io_req *reqs, int nr);
+
+extern const void *ntfs_device_borrow(struct ntfs_device *dev, s64 pos,
+		s64 count);
+
+extern int ntfs_device_shared_fd(struct ntfs_device *dev);
+
+/**
+ * enum ntfs_cache_policy -
+ *
+ * How ntfs_pwrite() treats a device with a block cache.  With write-through
+ * every write reaches the device before ntfs_pwrite() returns and the cache
+ * only ever holds what is on the device.  With write-back small writes are
+ * kept in the cache until the block is evicted or the cache is flushed by
+ * ntfs_device_sync(), ntfs_device_cache_flush() or when the volume is
+ * released.
+ */
+typedef enum {
+	NTFS_CACHE_WRITE_THROUGH,
+	NTFS_CACHE_WRITE_BACK,
+} ntfs_cache_policy;
+
+/* Memory used by a block cache when the caller does not specify it. */
+#define NTFS_DEVICE_CACHE_DEFAULT_SIZE	(64 << 20)
+
+/**
+ * struct ntfs_device_cache_stats -
+ *
+ * Counters of a device block cache, see ntfs_device_cache_stats_get().
+ */
+struct ntfs_device_cache_stats {
+	s64 hits;		/* Blocks read from the cache. */
+	s64 misses;		/* Blocks read from the device into the cache. */
+	s64 bypassed;		/* Large transfers not going through the cache. */
+	s64 evictions;		/* Blocks dropped to make room for others. */
+	s64 writebacks;		/* Dirty blocks written to the device. */
+};
+
+extern int ntfs_device_cache_enable(struct ntfs_device *dev, u32 block_size,
+		s64 max_bytes, ntfs_cache_policy policy);
+extern int ntfs_device_cache_disable(struct ntfs_device *dev);
+extern int ntfs_device_cache_flush(struct ntfs_device *dev);
+extern void ntfs_device_cache_invalidate(struct ntfs_device *dev, s64 pos,
+		s64 count);
+extern int ntfs_device_cache_stats_get(struct ntfs_device *dev,
+		struct ntfs_device_cache_stats *stats);
+
+/* Number of buckets in the I/O size and latency histograms. */
+#define NTFS_IO_HIST_BUCKETS	32
+
+/**
+ * struct ntfs_io_dir_stats -
+ *
+ * I/O counters for one direction, reads or writes.  Bucket n of the size
+ * histogram counts the transfers of 2^n to 2^(n+1)-1 bytes, and bucket n of
+ * the latency histogram the transfers which took 2^n to 2^(n+1)-1
+ * microseconds.  Bucket 0 also counts instantaneous transfers, the last
+ * bucket also counts everything larger.
+ */
+struct ntfs_io_dir_stats {
+	s64 ops;		/* Transfers requested. */
+	s64 bytes;		/* Bytes transferred. */
+	s64 errors;		/* Transfers which failed. */
+	s64 sequential;		/* Transfers starting where the last ended. */
+	s64 mst_records;	/* Records by ntfs_mst_pread/pwrite(). */
+	s64 usecs;		/* Time spent in the transfers. */
+	s64 size_hist[NTFS_IO_HIST_BUCKETS];
+	s64 lat_hist[NTFS_IO_HIST_BUCKETS];
+};
+
+/**
+ * struct ntfs_device_io_stats -
+ *
+ * I/O counters of the devices they are attached to, see
+ * ntfs_device_io_stats_attach().  The counters belong to the caller and
+ * outlive the devices, several devices may share them.
+ */
+struct ntfs_device_io_stats {
+	struct ntfs_io_dir_stats reads;
+	struct ntfs_io_dir_stats writes;
+	s64 next_pos;		/* Device position after the last transfer. */
+};
+
+extern void ntfs_device_io_stats_attach(struct ntfs_device *dev,
+		struct ntfs_device_io_stats *stats);
+extern void ntfs_device_io_stats_default(struct ntfs_device_io_stats *stats);
+
 extern s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b);
 extern s64 ntfs_mst_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
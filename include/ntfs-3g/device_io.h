@@ -82,6 +82,23 @@ struct ntfs_device_operations;
 
 extern struct ntfs_device_operations ntfs_device_default_io_ops;
 
+#ifdef ENABLE_IO_URING
+/* Unix style device operations performing batches through io_uring. */
+extern struct ntfs_device_operations ntfs_device_uring_io_ops;
+#endif
+
+#ifdef ENABLE_MMAP_IO
+/* Read-only unix style device operations serving reads from a mapping. */
+extern struct ntfs_device_operations ntfs_device_mmap_io_ops;
+#endif
+
+#ifdef ENABLE_SIM_IO
+/* Unix style device operations delayed to simulate a slower device. */
+extern struct ntfs_device_operations ntfs_device_sim_io_ops;
+
+extern int ntfs_device_sim_io_configure(const char *params);
+#endif
+
 #endif /* NO_NTFS_DEVICE_DEFAULT_IO_OPS */
 
 #endif /* defined _NTFS_DEVICE_IO_H */
@@ -118,6 +118,8 @@ struct _ntfs_inode {
 	 */
 	u32 attr_list_size;	/* Length of attribute list value in bytes. */
 	u8 *attr_list;		/* Attribute list value itself. */
+	struct ntfs_attrlist_index *attr_index; /* Positions of the entries
+				   of a huge attribute list, or NULL. */
 	/* Below fields are always valid. */
 	s32 nr_extents;		/* For a base mft record, the number of
 				   attached extent inodes (0 if none), for
@@ -165,6 +167,9 @@ struct _ntfs_inode {
 	le64 quota_charged;
 	le64 usn;
 	void *fsck_ibm;		/* for bitmap tracking in fsck */
+	struct _ntfs_attr *delayed_na; /* Attributes closed while their
+				   mapping pairs could not be written,
+				   see ntfs_attr_close(). */
 };
 
 typedef enum {
@@ -188,12 +193,8 @@ extern int ntfs_inode_sync_in_dir(ntfs_inode *ni, ntfs_inode *dir_ni);
 
 #if CACHE_NIDATA_SIZE
 
-struct CACHED_GENERIC;
-
 extern int ntfs_inode_real_close(ntfs_inode *ni);
 extern void ntfs_inode_invalidate(ntfs_volume *vol, const MFT_REF mref);
-extern void ntfs_inode_nidata_free(const struct CACHED_GENERIC *cached);
-extern int ntfs_inode_nidata_hash(const struct CACHED_GENERIC *item);
 
 #endif
 
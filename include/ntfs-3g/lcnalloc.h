@@ -41,6 +41,10 @@ typedef enum {
 extern runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		LCN start_lcn, const NTFS_CLUSTER_ALLOCATION_ZONES zone);
 
+extern runlist *ntfs_cluster_prealloc(ntfs_attr *na, VCN start_vcn,
+		s64 count, LCN start_lcn);
+extern int ntfs_cluster_prealloc_release(ntfs_attr *na);
+
 extern int ntfs_cluster_free_from_rl(ntfs_volume *vol, runlist *rl);
 extern int ntfs_cluster_free_basic(ntfs_volume *vol, s64 lcn, s64 count);
 
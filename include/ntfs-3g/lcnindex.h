@@ -0,0 +1,53 @@
+/*
+ * lcnindex.h - Exports for the index of free cluster extents.
+ *
+ * Copyright (c) 2026 ntfsprogs contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_LCNINDEX_H
+#define _NTFS_LCNINDEX_H
+
+#include "types.h"
+#include "volume.h"
+
+/**
+ * enum NTFS_LCN_INDEX_ZONES -
+ *
+ * The cluster zones in volume order.  Free extents never span two zones.
+ */
+typedef enum {
+	NTFS_LCN_ZONE_DATA2	= 0,	/* From 0 to the start of the mft zone. */
+	NTFS_LCN_ZONE_MFT	= 1,	/* The mft zone. */
+	NTFS_LCN_ZONE_DATA1	= 2,	/* From the mft zone to the end. */
+	NTFS_LCN_ZONES		= 3,
+} NTFS_LCN_INDEX_ZONES;
+
+extern int ntfs_lcn_index_build(ntfs_volume *vol);
+extern void ntfs_lcn_index_free(ntfs_volume *vol);
+extern BOOL ntfs_lcn_index_usable(ntfs_volume *vol);
+extern int ntfs_lcn_index_rezone(ntfs_volume *vol);
+
+extern void ntfs_lcn_index_update(ntfs_volume *vol, s64 pos, s64 count,
+		const void *b);
+
+extern int ntfs_lcn_index_zone(ntfs_volume *vol, LCN lcn);
+extern s64 ntfs_lcn_index_free_at(ntfs_volume *vol, LCN lcn);
+extern s64 ntfs_lcn_index_best_fit(ntfs_volume *vol, int zone, s64 count,
+		LCN *lcn);
+
+#endif /* defined _NTFS_LCNINDEX_H */
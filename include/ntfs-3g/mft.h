@@ -60,6 +60,8 @@ static __inline__ int ntfs_mft_record_read(const ntfs_volume *vol,
 
 extern int ntfs_mft_record_check(ntfs_volume *vol, const MFT_REF mref,
 		MFT_RECORD *m);
+extern int ntfs_mft_record_check_ro(const ntfs_volume *vol,
+		const MFT_REF mref, const MFT_RECORD *m);
 
 extern int ntfs_file_record_read(const ntfs_volume *vol, const MFT_REF mref,
 		MFT_RECORD **mrec, ATTR_RECORD **attr);
@@ -130,5 +132,50 @@ extern int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni);
 
 extern int ntfs_mft_usn_dec(MFT_RECORD *mrec);
 
+/* Mft records queued by default before the queue is flushed. */
+#define NTFS_MFT_QUEUE_DEFAULT	1024
+
+extern int ntfs_mft_queue_start(ntfs_volume *vol, s64 threshold);
+extern int ntfs_mft_queue_flush(ntfs_volume *vol);
+extern int ntfs_mft_queue_stop(ntfs_volume *vol);
+extern int ntfs_mft_queue_barrier(ntfs_attr *na);
+
+/* Records returned by ntfs_mft_scan_next(), see ntfs_mft_scan_open(). */
+#define NTFS_MFT_SCAN_IN_USE	0x1	/* Records marked in use in $BITMAP. */
+#define NTFS_MFT_SCAN_FREE	0x2	/* Records marked free in $BITMAP. */
+#define NTFS_MFT_SCAN_ALL	(NTFS_MFT_SCAN_IN_USE | NTFS_MFT_SCAN_FREE)
+
+typedef struct ntfs_mft_scan ntfs_mft_scan;
+
+extern ntfs_mft_scan *ntfs_mft_scan_open(ntfs_volume *vol, s64 start,
+		int flags);
+extern MFT_RECORD *ntfs_mft_scan_next(ntfs_mft_scan *scan, s64 *mft_no);
+extern BOOL ntfs_mft_scan_in_use(ntfs_mft_scan *scan, s64 mft_no);
+extern void ntfs_mft_scan_close(ntfs_mft_scan *scan);
+
+/* Most threads started by ntfs_mft_scan_parallel(). */
+#define NTFS_MFT_SCAN_THREADS	32
+
+/**
+ * struct ntfs_mft_worker -
+ *
+ * A thread of ntfs_mft_scan_parallel(), as seen by its callbacks.
+ */
+typedef struct {
+	ntfs_volume *vol;	/* Read only, see ntfs_mft_scan_parallel(). */
+	int index;		/* Worker number, from 0. */
+	struct _ntfs_attr_search_ctx *ctx; /* Context on the current record. */
+	void *data;		/* Results of the worker, zeroed at start. */
+	void *arg;		/* Argument given to ntfs_mft_scan_parallel(). */
+} ntfs_mft_worker;
+
+typedef int (*ntfs_mft_record_fn)(ntfs_mft_worker *w, s64 mft_no,
+		MFT_RECORD *mrec);
+typedef int (*ntfs_mft_merge_fn)(ntfs_mft_worker *w);
+
+extern int ntfs_mft_scan_parallel(ntfs_volume *vol, int flags, int nr_threads,
+		size_t data_size, ntfs_mft_record_fn record,
+		ntfs_mft_merge_fn merge, void *arg);
+
 #endif /* defined _NTFS_MFT_H */
 
@@ -27,6 +27,7 @@ void *ntfs_calloc(size_t size);
 void *ntfs_malloc(size_t size);
 void *ntfs_realloc(void *ptr, size_t size);
 void ntfs_free(void *ptr);
+int ntfs_nr_cpus(void);
 
 #endif /* _NTFS_MISC_H_ */
 
@@ -128,4 +128,28 @@ static __inline__ ntfs_time ntfs_current_time(void)
 	return (timespec2ntfs(now));
 }
 
+/*
+ *		Return a time in microseconds for measuring durations
+ *
+ * The origin is unspecified, the clock is not affected by changes of the
+ * system time where the system has a monotonic clock.
+ */
+
+static __inline__ s64 ntfs_monotonic_time(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((s64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#elif defined(HAVE_GETTIMEOFDAY)
+	struct timeval tv;
+
+	gettimeofday(&tv, (struct timezone*)NULL);
+	return ((s64)tv.tv_sec * 1000000 + tv.tv_usec);
+#else
+	return ((s64)time((time_t*)NULL) * 1000000);
+#endif
+}
+
 #endif /* _NTFS_NTFSTIME_H */
@@ -23,11 +23,17 @@
 #define _NTFS_PARAM_H
 
 #define CACHE_INODE_SIZE 32	/* inode cache, zero or >= 3 and not too big */
-#define CACHE_NIDATA_SIZE 64	/* idata cache, zero or >= 3 and not too big */
+#define CACHE_NIDATA_SIZE 64	/* idata cache minimum entries, zero to disable */
+#define CACHE_NIDATA_BUDGET (8 << 20) /* idata cache default memory, in bytes */
 #define CACHE_LOOKUP_SIZE 64	/* lookup cache, zero or >= 3 and not too big */
 #define CACHE_SECURID_SIZE 16    /* securid cache, zero or >= 3 and not too big */
 #define CACHE_LEGACY_SIZE 8    /* legacy cache size, zero or >= 3 and not too big */
 
+	/* attribute lists from this size (bytes) are indexed, zero to disable */
+#define ATTRLIST_INDEX_SIZE 2048
+	/* runlists read from this number of runs are compacted, zero to disable */
+#define RUNLIST_COMPACT_RUNS 65536
+
 #define FORCE_FORMAT_v1x 0	/* Insert security data as in NTFS v1.x */
 #define OWNERFROMACL 1		/* Get the owner from ACL (not Windows owner) */
 
@@ -83,6 +89,12 @@ enum {
 	/* only update the final extent of a runlist when appending data */
 #define PARTIAL_RUNLIST_UPDATING 1
 
+	/*
+	 * when appending to a file, only write the mapping pairs when the
+	 * attribute is flushed or closed, and only rewrite the changed ones
+	 */
+#define DELAYED_MAPPING_PAIRS 1
+
 /*
  *		Parameters for upper-case table
  */
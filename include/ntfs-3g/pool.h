@@ -0,0 +1,36 @@
+/*
+ * pool.h - Exports for the pools of fixed size objects.
+ *
+ * Copyright (c) 2026 ntfsprogs contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_POOL_H
+#define _NTFS_POOL_H
+
+#include "types.h"
+
+typedef struct ntfs_pool ntfs_pool;
+
+extern ntfs_pool *ntfs_pool_create(const char *name, size_t size);
+extern void ntfs_pool_destroy(ntfs_pool *pool);
+
+extern void *ntfs_pool_alloc(ntfs_pool *pool, size_t size);
+extern void *ntfs_pool_calloc(ntfs_pool *pool, size_t size);
+extern void ntfs_pool_free(void *p);
+
+#endif /* defined _NTFS_POOL_H */
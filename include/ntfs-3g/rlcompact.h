@@ -0,0 +1,40 @@
+/*
+ * rlcompact.h - Exports for the compact runlists.
+ *
+ * Copyright (c) 2026 ntfsprogs contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_RLCOMPACT_H
+#define _NTFS_RLCOMPACT_H
+
+#include "types.h"
+#include "runlist.h"
+
+typedef struct ntfs_rlc ntfs_rlc;
+
+extern ntfs_rlc *ntfs_rlc_create(void);
+extern void ntfs_rlc_free(ntfs_rlc *rlc);
+
+extern int ntfs_rlc_append(ntfs_rlc *rlc, const runlist_element *rl);
+extern int ntfs_rlc_runs(const ntfs_rlc *rlc);
+extern size_t ntfs_rlc_size(const ntfs_rlc *rlc);
+
+extern runlist_element *ntfs_rlc_window(const ntfs_rlc *rlc, VCN vcn);
+extern runlist_element *ntfs_rlc_expand(const ntfs_rlc *rlc);
+
+#endif /* defined _NTFS_RLCOMPACT_H */
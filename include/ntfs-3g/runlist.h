@@ -53,6 +53,8 @@ extern runlist_element *ntfs_rl_extend(ntfs_attr *na, runlist_element *rl,
 			int more_entries);
 
 extern LCN ntfs_rl_vcn_to_lcn(const runlist_element *rl, const VCN vcn);
+extern int ntfs_rl_find_run(const runlist_element *rl, int runs,
+		const VCN vcn);
 
 extern s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		const s64 pos, s64 count, void *b);
@@ -69,10 +71,19 @@ extern runlist_element *ntfs_mapping_pairs_decompress_on_fsck(const ntfs_volume
 		const ATTR_RECORD *attr, runlist_element *old_rl,
 		runlist_element **part_rl);
 
+extern int ntfs_mapping_pairs_count(const ATTR_RECORD *attr);
+extern int ntfs_mapping_pairs_decode(const ntfs_volume *vol,
+		const ATTR_RECORD *attr, runlist_element *rl);
+extern int ntfs_mapping_pairs_seek(const ATTR_RECORD *attr,
+		const VCN vcn, runlist_element *last, LCN *prev_lcn);
+
 extern int ntfs_get_nr_significant_bytes(const s64 n);
 
 extern int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		const runlist_element *rl, const VCN start_vcn, int max_size);
+extern int ntfs_get_size_for_mapping_pairs_tail(const ntfs_volume *vol,
+		const runlist_element *rl, const VCN start_vcn,
+		const LCN prev_lcn, int max_size);
 
 extern int ntfs_write_significant_bytes(u8 *dst, const u8 *dst_max,
 		const s64 n);
@@ -80,6 +91,10 @@ extern int ntfs_write_significant_bytes(u8 *dst, const u8 *dst_max,
 extern int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		const int dst_len, const runlist_element *rl,
 		const VCN start_vcn, runlist_element const **stop_rl);
+extern int ntfs_mapping_pairs_build_tail(const ntfs_volume *vol, u8 *dst,
+		const int dst_len, const runlist_element *rl,
+		const VCN start_vcn, const LCN prev_lcn,
+		runlist_element const **stop_rl);
 
 extern int ntfs_rl_truncate(runlist **arl, const VCN start_vcn);
 
@@ -51,6 +51,7 @@ typedef struct _ntfs_volume ntfs_volume;
 #include "inode.h"
 #include "attrib.h"
 #include "index.h"
+#include "pool.h"
 
 extern int fsck_errors;
 extern int fsck_fixes;
@@ -111,13 +112,27 @@ enum {
 	NTFS_MNT_FS_YES_REPAIR		= 0x00000040,
 	NTFS_MNT_FS_ASK_REPAIR		= 0x00000080,
 	NTFS_MNT_FSCK			= 0x00000100,
-
+	NTFS_MNT_COUNT_FREE		= 0x00000200, /* Count the free
+	                                               * space in the
+	                                               * background. */
+	NTFS_MNT_PREALLOC		= 0x00000400, /* Reserve clusters
+	                                               * ahead of appending
+	                                               * writes. */
+	NTFS_MNT_MFT_QUEUE		= 0x00000800, /* Defer and batch
+	                                               * mft record
+	                                               * writes. */
+
+	NTFS_MNT_MMAP_IO                = 0x01000000, /* Read a read-only
+	                                               * volume through a
+	                                               * memory mapping. */
 	NTFS_MNT_MAY_RDONLY             = 0x02000000, /* Allow fallback to ro */
 	NTFS_MNT_FORENSIC               = 0x04000000, /* No modification during
 	                                               * mount. */
 	NTFS_MNT_EXCLUSIVE              = 0x08000000,
 	NTFS_MNT_RECOVER                = 0x10000000,
 	NTFS_MNT_IGNORE_HIBERFILE       = 0x20000000,
+	NTFS_MNT_DIRECT_IO              = 0x40000000, /* Bypass the kernel
+	                                               * page cache. */
 };
 typedef unsigned long ntfs_mount_flags;
 
@@ -175,6 +190,7 @@ typedef enum {
 	NV_FsYesRepair,		/* 1: Volume is for fsck */
 	NV_FsAskRepair,		/* 1: Volume is for fsck */
 	NV_Fsck,		/* 1: Volume is on fsck */
+	NV_Prealloc,		/* 1: Reserve clusters for appending */
 } ntfs_volume_state_bits;
 
 #define test_nvol_flag(nv, flag)	test_bit(NV_##flag, (nv)->state)
@@ -239,6 +255,10 @@ typedef enum {
 
 #define NVolIsOnFsck(nv)		NVolFsck(nv)
 
+#define NVolPrealloc(nv)		 test_nvol_flag(nv, Prealloc)
+#define NVolSetPrealloc(nv)		  set_nvol_flag(nv, Prealloc)
+#define NVolClearPrealloc(nv)		clear_nvol_flag(nv, Prealloc)
+
 /*
  * NTFS version 1.1 and 1.2 are used by Windows NT4.
  * NTFS version 2.x is used by Windows 2000 Beta
@@ -291,6 +311,12 @@ struct _ntfs_volume {
 	LCN mft_zone_pos;	/* Current position in the mft zone. */
 	LCN data1_zone_pos;	/* Current position in the first data zone. */
 	LCN data2_zone_pos;	/* Current position in the second data zone. */
+	struct ntfs_lcn_index *lcn_index; /* Free cluster extents, or NULL
+				   to scan $Bitmap. */
+	struct ntfs_lcn_bitmap *lcnbmp_cache; /* Resident copy of $Bitmap,
+				   or NULL. */
+	struct ntfs_mft_bitmap *mftbmp_cache; /* Resident copy of
+				   $MFT/$BITMAP, or NULL. */
 
 	s64 nr_clusters;	/* Volume size in clusters, hence also the
 				   number of bits in lcn_bitmap. */
@@ -312,6 +338,15 @@ struct _ntfs_volume {
 				   representing mft record 0 and so on. A set
 				   bit means that the mft record is in use and
 				   vice versa. */
+	struct ntfs_mft_queue *mft_queue; /* Mft records waiting to be
+				   written, or NULL. */
+
+	/* Pools of the objects allocated for each operation, or NULL. */
+	ntfs_pool *inode_pool;	/* ntfs_inode structures. */
+	ntfs_pool *mrec_pool;	/* Mft records of mft_record_size bytes. */
+	ntfs_pool *attr_pool;	/* ntfs_attr structures. */
+	ntfs_pool *ctx_pool;	/* Attribute search contexts. */
+	ntfs_pool *index_ctx_pool; /* Index contexts. */
 
 	ntfs_inode *secure_ni;	/* ntfs_inode structure for FILE $Secure */
 	ntfs_index_context *secure_xsii; /* index for using $Secure:$SII */
@@ -343,6 +378,8 @@ struct _ntfs_volume {
 	s64 free_clusters; 	/* Track the number of free clusters which
 				   greatly improves statfs() performance */
 	s64 free_mft_records; 	/* Same for free mft records (see above) */
+	struct ntfs_free_count *free_count; /* Count of the free clusters
+				   in progress, or NULL. */
 	BOOL efs_raw;		/* volume is mounted for raw access to
 				   efs-encrypted files */
 	ntfs_volume_special_files special_files; /* Implementation of special files */
@@ -355,7 +392,7 @@ struct _ntfs_volume {
 	struct CACHE_HEADER *xinode_cache;
 #endif
 #if CACHE_NIDATA_SIZE
-	struct CACHE_HEADER *nidata_cache;
+	struct NIDATA_CACHE *nidata_cache;
 #endif
 #if CACHE_LOOKUP_SIZE
 	struct CACHE_HEADER *lookup_cache;
@@ -389,6 +426,8 @@ extern int ntfs_volume_error(int err);
 extern void ntfs_mount_error(const char *vol, const char *mntpoint, int err);
 
 extern int ntfs_volume_get_free_space(ntfs_volume *vol);
+extern int ntfs_volume_get_free_space_start(ntfs_volume *vol);
+extern int ntfs_volume_get_free_space_wait(ntfs_volume *vol, BOOL block);
 extern int ntfs_volume_rename(ntfs_volume *vol, const ntfschar *label,
 		int label_len);
 
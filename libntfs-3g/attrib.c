@@ -57,7 +57,9 @@
 #include "layout.h"
 #include "inode.h"
 #include "runlist.h"
+#include "rlcompact.h"
 #include "lcnalloc.h"
+#include "lcnindex.h"
 #include "dir.h"
 #include "compress.h"
 #include "bitmap.h"
@@ -380,6 +382,7 @@ static void __ntfs_attr_init(ntfs_attr *na, ntfs_inode *ni,
 		const ATTR_TYPES type, ntfschar *name, const u32 name_len)
 {
 	na->rl = NULL;
+	ntfs_attr_forget_runs(na);
 	na->ni = ni;
 	na->type = type;
 	na->name = name;
@@ -469,7 +472,10 @@ ntfs_attr *ntfs_attr_open(ntfs_inode *ni, const ATTR_TYPES type,
 		errno = EINVAL;
 		goto out;
 	}
-	na = ntfs_calloc(sizeof(ntfs_attr));
+	/* The record is stale if a close could not write the runs. */
+	if (ntfs_attr_flush_delayed(ni, type, name, name_len))
+		goto out;
+	na = ntfs_pool_calloc(ni->vol->attr_pool, sizeof(ntfs_attr));
 	if (!na)
 		goto out;
 	if (!name_len)
@@ -620,7 +626,7 @@ put_err_out:
 	ntfs_attr_put_search_ctx(ctx);
 err_out:
 	free(newname);
-	free(na);
+	ntfs_pool_free(na);
 	na = NULL;
 	goto out;
 }
@@ -630,19 +636,243 @@ err_out:
  * @na:		ntfs attribute structure to free
  *
  * Release all memory associated with the ntfs attribute @na and then release
- * @na itself.
+ * @na itself.  The mapping pairs whose update was delayed are written and
+ * the clusters reserved for appending to @na are freed.
+ *
+ * If the mapping pairs cannot be written, @na is not released but kept by
+ * its base inode, still dirty, and the write is retried by
+ * ntfs_attr_flush_delayed() when the inode is synced or closed, which then
+ * report the error, or when the same attribute is opened again.  Callers
+ * wanting the error at once call ntfs_attr_flush() before closing.
  */
 void ntfs_attr_close(ntfs_attr *na)
 {
+	ntfs_inode *base_ni;
+	BOOL delayed;
+
 	if (!na)
 		return;
+	delayed = NAttrMappingPairsDelayed(na) && ntfs_attr_flush(na);
+	if (delayed)
+		ntfs_log_perror("Failed to write the delayed mapping pairs "
+				"of inode %lld, will retry",
+				(long long)na->ni->mft_no);
+	if (na->prealloc_len && ntfs_cluster_prealloc_release(na))
+		ntfs_log_perror("Failed to release the clusters reserved "
+				"for inode %lld", (long long)na->ni->mft_no);
+	if (delayed) {
+		base_ni = (na->ni->nr_extents == -1 ? na->ni->base_ni
+				: na->ni);
+		na->next_delayed = base_ni->delayed_na;
+		base_ni->delayed_na = na;
+		NInoSetDirty(base_ni);
+		return;
+	}
 	if (NAttrNonResident(na) && na->rl)
 		free(na->rl);
+	ntfs_rlc_free(na->rlc);
 	/* Don't release if using an internal constant. */
 	if (na->name != AT_UNNAMED && na->name != NTFS_INDEX_I30
 				&& na->name != STREAM_SDS)
 		free(na->name);
-	free(na);
+	ntfs_pool_free(na);
+}
+
+/*
+ *		Find the run containing a vcn in the runlist of an attribute
+ *
+ * The runs are counted once for each state of the runlist, then the run
+ * where a vcn was last found and the next one are checked first, so that
+ * sequential accesses need no search.  Otherwise the run is found by a
+ * binary search.
+ *
+ * Returns the index of the run containing the vcn,
+ *	the index of the terminator if the vcn is beyond the runlist,
+ *	-1 if the vcn is before the start of the runlist
+ */
+
+static int ntfs_attr_find_run(ntfs_attr *na, const VCN vcn)
+{
+	const runlist_element *rl;
+	int i;
+
+	rl = na->rl;
+	if (rl != na->rl_seen) {
+		i = 0;
+		while (rl[i].length)
+			i++;
+		na->rl_runs = i;
+		na->rl_cursor = 0;
+		na->rl_seen = na->rl;
+	}
+	i = na->rl_cursor;
+	if ((i < na->rl_runs) && (vcn >= rl[i].vcn)) {
+		if (vcn < rl[i + 1].vcn)
+			return (i);
+		if ((++i < na->rl_runs) && (vcn < rl[i + 1].vcn)) {
+			na->rl_cursor = i;
+			return (i);
+		}
+	}
+	i = ntfs_rl_find_run(rl, na->rl_runs, vcn);
+	if ((i >= 0) && (i < na->rl_runs))
+		na->rl_cursor = i;
+	return (i);
+}
+
+/*
+ *		Convert a vcn into a lcn given the runlist of an attribute
+ *
+ * Same as ntfs_rl_vcn_to_lcn(), with the run searched as above.
+ */
+
+static LCN ntfs_attr_rl_vcn_to_lcn(ntfs_attr *na, const VCN vcn)
+{
+	const runlist_element *rl;
+	int i;
+
+	if (vcn < (VCN)0)
+		return (LCN)LCN_EINVAL;
+	if (!na->rl)
+		return (LCN)LCN_RL_NOT_MAPPED;
+	i = ntfs_attr_find_run(na, vcn);
+	if (i < 0)
+		return (LCN)LCN_ENOENT;
+	rl = &na->rl[i];
+	if (rl->length) {
+		if (rl->lcn >= (LCN)0)
+			return rl->lcn + (vcn - rl->vcn);
+		return rl->lcn;
+	}
+	/* The terminator tells why the vcn is not in the runlist. */
+	if (rl->lcn < (LCN)0)
+		return rl->lcn;
+	return (LCN)LCN_ENOENT;
+}
+
+/*
+ *		Check whether the runlist of an attribute may be compacted
+ *
+ * Only the data of user files is considered, and not when compressed
+ * or encrypted, as compressed data is handled with its runlist fully
+ * expanded.  The runlist must not hold changes not written yet.
+ */
+
+static BOOL ntfs_attr_can_compact(ntfs_attr *na)
+{
+	return (RUNLIST_COMPACT_RUNS
+		&& NAttrNonResident(na)
+		&& !NAttrBeingNonResident(na)
+		&& !NAttrRunlistDirty(na)
+		&& !NAttrEncrypted(na)
+		&& (na->type == AT_DATA)
+		&& !(na->data_flags & ATTR_COMPRESSION_MASK)
+		&& (na->ni->mft_no >= FILE_first_user));
+}
+
+/*
+ *		Replace the runlist of an attribute by a compact one
+ *
+ * The runlist is decoded again from each extent in turn and appended to
+ * the compact runlist, so that the whole runlist is never expanded.  The
+ * runlist of the attribute is then freed, to be replaced by the parts
+ * decoded on demand from the compact runlist.
+ *
+ * Returns 0 if successful,
+ *	-1 if there was an error, the runlist being left unchanged
+ */
+
+static int ntfs_attr_compact_runlist(ntfs_attr *na)
+{
+	ntfs_attr_search_ctx *ctx;
+	ntfs_volume *vol;
+	runlist_element *rl;
+	ATTR_RECORD *a;
+	ntfs_rlc *rlc;
+	VCN next_vcn, last_vcn, highest_vcn;
+	int res;
+
+	vol = na->ni->vol;
+	rlc = ntfs_rlc_create();
+	ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
+	if (!rlc || !ctx)
+		goto err_out;
+	next_vcn = last_vcn = highest_vcn = 0;
+	a = (ATTR_RECORD*)NULL;
+	while (!ntfs_attr_lookup(na->type, na->name, na->name_len,
+			CASE_SENSITIVE, next_vcn, NULL, 0, ctx)) {
+		a = ctx->attr;
+		if (!a->non_resident
+		    || (sle64_to_cpu(a->lowest_vcn) != next_vcn)) {
+			errno = EIO;
+			goto err_out;
+		}
+		if (!next_vcn)
+			last_vcn = sle64_to_cpu(a->allocated_size)
+					>> vol->cluster_size_bits;
+		rl = ntfs_mapping_pairs_decompress(vol, a,
+				(runlist_element*)NULL);
+		if (!rl)
+			goto err_out;
+		res = ntfs_rlc_append(rlc, rl);
+		free(rl);
+		if (res)
+			goto err_out;
+		highest_vcn = sle64_to_cpu(a->highest_vcn);
+		next_vcn = highest_vcn + 1;
+		if (next_vcn <= 0) {
+			errno = ENOENT;
+			break;
+		}
+	}
+	if ((errno != ENOENT) || !a || (highest_vcn != (last_vcn - 1))) {
+		if (errno == ENOENT)
+			errno = EIO;
+		goto err_out;
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	free(na->rl);
+	na->rl = (runlist_element*)NULL;
+	ntfs_attr_forget_runs(na);
+	na->rlc = rlc;
+	NAttrClearFullyMapped(na);
+	ntfs_log_debug("Runlist of inode %lld compacted, %d runs in %ld "
+			"bytes\n", (long long)na->ni->mft_no,
+			ntfs_rlc_runs(rlc), (long)ntfs_rlc_size(rlc));
+	return (0);
+err_out:
+	ntfs_log_debug("Could not compact the runlist of inode %lld\n",
+			(long long)na->ni->mft_no);
+	if (ctx)
+		ntfs_attr_put_search_ctx(ctx);
+	ntfs_rlc_free(rlc);
+	return (-1);
+}
+
+/*
+ *		Expand the compact runlist of an attribute
+ *
+ * The whole runlist is decoded, for changing it or for callers which
+ * need all of it.
+ *
+ * Returns 0 if successful,
+ *	-1 if there was no memory, the compact runlist being kept
+ */
+
+static int ntfs_attr_expand_runlist(ntfs_attr *na)
+{
+	runlist_element *rl;
+
+	rl = ntfs_rlc_expand(na->rlc);
+	if (!rl)
+		return (-1);
+	free(na->rl);
+	na->rl = rl;
+	ntfs_attr_forget_runs(na);
+	ntfs_rlc_free(na->rlc);
+	na->rlc = (ntfs_rlc*)NULL;
+	NAttrSetFullyMapped(na);
+	return (0);
 }
 
 /**
@@ -652,20 +882,35 @@ void ntfs_attr_close(ntfs_attr *na)
  *
  * Map the part of a runlist containing the @vcn of the ntfs attribute @na.
  *
+ * When the runlist has many runs, it is replaced by a compact runlist,
+ * and the part containing @vcn is then decoded from it.
+ *
  * Return 0 on success and -1 on error with errno set to the error code.
  */
 int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn)
 {
 	LCN lcn;
 	ntfs_attr_search_ctx *ctx;
+	runlist_element *rl;
 
 	ntfs_log_trace("Entering for inode 0x%llx, attr 0x%x, vcn 0x%llx.\n",
 		(unsigned long long)na->ni->mft_no, le32_to_cpu(na->type), (long long)vcn);
 
-	lcn = ntfs_rl_vcn_to_lcn(na->rl, vcn);
+	lcn = ntfs_attr_rl_vcn_to_lcn(na, vcn);
 	if (lcn >= 0 || lcn == LCN_HOLE || lcn == LCN_ENOENT)
 		return 0;
 
+	if (na->rlc) {
+		/* Decode the part needed from the compact runlist. */
+		rl = ntfs_rlc_window(na->rlc, vcn);
+		if (!rl)
+			return -1;
+		free(na->rl);
+		na->rl = rl;
+		ntfs_attr_forget_runs(na);
+		return 0;
+	}
+
 	ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
 	if (!ctx)
 		return -1;
@@ -673,14 +918,20 @@ int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn)
 	/* Find the attribute in the mft record. */
 	if (!ntfs_attr_lookup(na->type, na->name, na->name_len, CASE_SENSITIVE,
 			vcn, NULL, 0, ctx)) {
-		runlist_element *rl;
-
 		/* Decode the runlist. */
 		rl = ntfs_mapping_pairs_decompress(na->ni->vol, ctx->attr,
 				na->rl);
 		if (rl) {
 			na->rl = rl;
+			ntfs_attr_forget_runs(na);
 			ntfs_attr_put_search_ctx(ctx);
+			if (ntfs_attr_can_compact(na)) {
+				/* Count the runs, compact them if too many */
+				ntfs_attr_find_run(na, vcn);
+				if ((na->rl_runs >= RUNLIST_COMPACT_RUNS)
+				    && !ntfs_attr_compact_runlist(na))
+					return (ntfs_attr_map_runlist(na, vcn));
+			}
 			return 0;
 		}
 	}
@@ -710,6 +961,8 @@ static int ntfs_attr_map_partial_runlist(ntfs_attr *na, VCN vcn)
 	BOOL done;
 	BOOL newrunlist;
 
+	if (na->rlc)
+		return (ntfs_attr_expand_runlist(na));
 	if (NAttrFullyMapped(na))
 		return 0;
 
@@ -733,7 +986,7 @@ static int ntfs_attr_map_partial_runlist(ntfs_attr *na, VCN vcn)
 
 			a = ctx->attr;
 				/* Decode and merge the runlist. */
-			if (ntfs_rl_vcn_to_lcn(na->rl, needed)
+			if (ntfs_attr_rl_vcn_to_lcn(na, needed)
 						== LCN_RL_NOT_MAPPED) {
 				rl = ntfs_mapping_pairs_decompress(na->ni->vol,
 					a, na->rl);
@@ -742,6 +995,7 @@ static int ntfs_attr_map_partial_runlist(ntfs_attr *na, VCN vcn)
 				rl = na->rl;
 			if (rl) {
 				na->rl = rl;
+				ntfs_attr_forget_runs(na);
 				highest_vcn = sle64_to_cpu(a->highest_vcn);
 				if (highest_vcn < needed) {
 				/* corruption detection on unchanged runlists */
@@ -781,6 +1035,126 @@ static int ntfs_attr_map_partial_runlist(ntfs_attr *na, VCN vcn)
 
 #endif
 
+/*
+ *		Decode the whole runlist of an attribute in a single array
+ *
+ * Merging the runlist of each extent into the runlist of the previous
+ * ones reallocates and moves the growing runlist every time, which is
+ * quadratic in the number of extents.  Instead the extents are walked
+ * twice, first counting their mapping pairs so that the runlist can be
+ * allocated once, then decoding them in place.  Runs adjacent across
+ * extents are merged, as ntfs_runlists_merge() does.
+ *
+ * Only meant for an attribute with no runlist mapped yet.  Any
+ * inconsistency between the extents is reported as EIO, without logging,
+ * so that the caller can fall back to merging the extents one by one,
+ * which reports or tolerates the inconsistency.
+ *
+ * Returns the runlist, or NULL with errno set.
+ */
+
+static runlist_element *ntfs_attr_decode_whole_runlist(ntfs_attr *na)
+{
+	ntfs_volume *vol = na->ni->vol;
+	ntfs_attr_search_ctx *ctx;
+	runlist_element *rl;
+	runlist_element *prev;
+	ATTR_RECORD *a;
+	VCN next_vcn, last_vcn;
+	s64 count, pos;
+	int n, pass;
+
+	ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
+	if (!ctx)
+		return ((runlist_element*)NULL);
+	rl = (runlist_element*)NULL;
+	count = pos = 0;
+	last_vcn = 0;
+	for (pass = 0; pass < 2; pass++) {
+		next_vcn = 0;
+		errno = 0;
+		while (!ntfs_attr_lookup(na->type, na->name, na->name_len,
+				CASE_SENSITIVE, next_vcn, NULL, 0, ctx)) {
+			a = ctx->attr;
+			if (!a->non_resident
+			    || (sle64_to_cpu(a->lowest_vcn) != next_vcn)) {
+				errno = EIO;
+				break;
+			}
+			if (!next_vcn)
+				last_vcn = sle64_to_cpu(a->allocated_size)
+						>> vol->cluster_size_bits;
+			n = ntfs_mapping_pairs_count(a);
+			if (n < 0)
+				break;
+			if (!pass)
+				count += n;
+			else {
+				if ((pos + n) > count) {
+					errno = EIO;
+					break;
+				}
+				n = ntfs_mapping_pairs_decode(vol, a, &rl[pos]);
+				if (n < 0)
+					break;
+					/* merge with the last run of previous extent */
+				prev = (pos ? &rl[pos - 1] : (runlist_element*)NULL);
+				if (prev && n
+				    && (((prev->lcn >= 0) && (rl[pos].lcn >= 0)
+					&& ((prev->lcn + prev->length)
+							== rl[pos].lcn))
+				      || ((prev->lcn == LCN_HOLE)
+					&& (rl[pos].lcn == LCN_HOLE)))) {
+					prev->length += rl[pos].length;
+					memmove(&rl[pos], &rl[pos + 1],
+						(n - 1)*sizeof(runlist_element));
+					n--;
+				}
+				pos += n;
+			}
+			next_vcn = sle64_to_cpu(a->highest_vcn) + 1;
+			if (next_vcn <= 0) {
+				errno = ENOENT;
+				break;
+			}
+		}
+		if ((errno != ENOENT) || (next_vcn < last_vcn)) {
+			if (errno == ENOENT)
+				errno = EIO;
+			free(rl);
+			rl = (runlist_element*)NULL;
+			break;
+		}
+		if (!pass) {
+			if (count >= (INT_MAX / (s64)sizeof(runlist_element))) {
+				errno = EIO;
+				break;
+			}
+				/* rounded as in runlist.c */
+			rl = (runlist_element*)ntfs_malloc(((count + 1)
+					*sizeof(runlist_element) + 0xfff)
+						& ~0xfff);
+			if (!rl)
+				break;
+			ntfs_attr_reinit_search_ctx(ctx);
+		}
+	}
+	if (rl) {
+		if ((pos ? rl[pos - 1].vcn + rl[pos - 1].length : 0)
+					!= last_vcn) {
+			free(rl);
+			rl = (runlist_element*)NULL;
+			errno = EIO;
+		} else {
+			rl[pos].vcn = last_vcn;
+			rl[pos].length = 0;
+			rl[pos].lcn = LCN_ENOENT;
+		}
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	return (rl);
+}
+
 /**
  * ntfs_attr_map_whole_runlist - map the whole runlist of an ntfs attribute
  * @na:		ntfs attribute for which to map the runlist
@@ -810,6 +1184,26 @@ int ntfs_attr_map_whole_runlist(ntfs_attr *na)
 		ret = 0;
 		goto out;
 	}
+	if (na->rlc) {
+		ret = ntfs_attr_expand_runlist(na);
+		goto out;
+	}
+		/*
+		 * Decode all the extents at once if nothing is mapped,
+		 * merging them one by one is quadratic.  On fsck, the
+		 * partial runlists of corrupt extents are needed.
+		 */
+	if (!na->rl && NInoAttrList(na->ni) && !NVolIsOnFsck(vol)) {
+		na->rl = ntfs_attr_decode_whole_runlist(na);
+		if (na->rl) {
+			ntfs_attr_forget_runs(na);
+			NAttrSetFullyMapped(na);
+			ret = 0;
+			goto out;
+		}
+		if (errno != EIO)
+			goto out;
+	}
 	ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
 	if (!ctx)
 		goto out;
@@ -821,7 +1215,7 @@ int ntfs_attr_map_whole_runlist(ntfs_attr *na)
 		runlist_element *rl;
 
 		not_mapped = 0;
-		if (ntfs_rl_vcn_to_lcn(na->rl, next_vcn) == LCN_RL_NOT_MAPPED)
+		if (ntfs_attr_rl_vcn_to_lcn(na, next_vcn) == LCN_RL_NOT_MAPPED)
 			not_mapped = 1;
 
 		if (ntfs_attr_lookup(na->type, na->name, na->name_len,
@@ -837,6 +1231,7 @@ int ntfs_attr_map_whole_runlist(ntfs_attr *na)
 			if (!rl)
 				goto err_out;
 			na->rl = rl;
+			ntfs_attr_forget_runs(na);
 		}
 
 		/* Are we in the first extent? */
@@ -933,7 +1328,7 @@ LCN ntfs_attr_vcn_to_lcn(ntfs_attr *na, const VCN vcn)
 			long)na->ni->mft_no, le32_to_cpu(na->type));
 retry:
 	/* Convert vcn to lcn. If that fails map the runlist and retry once. */
-	lcn = ntfs_rl_vcn_to_lcn(na->rl, vcn);
+	lcn = ntfs_attr_rl_vcn_to_lcn(na, vcn);
 	if (lcn >= 0)
 		return lcn;
 	if (!is_retry && !ntfs_attr_map_runlist(na, vcn)) {
@@ -975,6 +1370,7 @@ runlist_element *ntfs_attr_find_vcn(ntfs_attr *na, const VCN vcn)
 {
 	runlist_element *rl;
 	BOOL is_retry = FALSE;
+	int i;
 
 	if (!na || !NAttrNonResident(na) || vcn < 0) {
 		errno = EINVAL;
@@ -988,16 +1384,12 @@ retry:
 	rl = na->rl;
 	if (!rl)
 		goto map_rl;
-	if (vcn < rl[0].vcn)
+	i = ntfs_attr_find_run(na, vcn);
+	if (i < 0)
 		goto map_rl;
-	while (rl->length) {
-		if (vcn < rl[1].vcn) {
-			if (rl->lcn >= (LCN)LCN_HOLE)
-				return rl;
-			break;
-		}
-		rl++;
-	}
+	rl += i;
+	if (rl->length && (rl->lcn >= (LCN)LCN_HOLE))
+		return rl;
 	switch (rl->lcn) {
 	case (LCN)LCN_RL_NOT_MAPPED:
 		goto map_rl;
@@ -1029,14 +1421,41 @@ map_rl:
 	return NULL;
 }
 
+/**
+ * ntfs_attr_vio_flush - read what ntfs_attr_pread_i() gathered so far
+ * @vol:	volume to read from
+ * @vio:	reads gathered so far
+ * @b0:		start of the destination buffer
+ * @total:	bytes of @b0 accounted as read, reduced on a short read
+ *
+ * Return 0 if everything gathered was read and -1 with errno set otherwise.
+ */
+static int ntfs_attr_vio_flush(ntfs_volume *vol, struct ntfs_vio *vio,
+		void *b0, s64 *total)
+{
+	s64 expected, br;
+	void *stop;
+
+	expected = vio->count;
+	br = ntfs_vio_flush(vol->dev, vio, FALSE, &stop);
+	if (br == expected)
+		return 0;
+	if (br >= 0)
+		errno = EIO;
+	*total = (u8*)stop - (u8*)b0;
+	return -1;
+}
+
 /**
  * ntfs_attr_pread_i - see description at ntfs_attr_pread()
  */ 
 static s64 ntfs_attr_pread_i(ntfs_attr *na, const s64 pos, s64 count, void *b)
 {
-	s64 br, to_read, ofs, total, total2, max_read, max_init;
+	s64 to_read, ofs, total, total2, max_read, max_init;
 	ntfs_volume *vol;
 	runlist_element *rl;
+	struct ntfs_vio vio;
+	void *b0;
 	u16 efs_padding_length;
 
 	/* Sanity checking arguments is done in ntfs_attr_pread(). */
@@ -1170,6 +1589,8 @@ res_err_out:
 	 * length.
 	 */
 	ofs = pos - (rl->vcn << vol->cluster_size_bits);
+	b0 = b;
+	ntfs_vio_init(&vio);
 	for (; count; rl++, ofs = 0) {
 		if (rl->lcn == LCN_RL_NOT_MAPPED) {
 			rl = ntfs_attr_find_vcn(na, rl->vcn);
@@ -1206,40 +1627,43 @@ res_err_out:
 			b = (u8*)b + to_read;
 			continue;
 		}
-		/* It is a real lcn, read it into @dst. */
+		/*
+		 * It is a real lcn, queue it for reading into @dst.  Runs
+		 * which follow each other on disk are read together.
+		 */
 		to_read = min(count, (rl->length << vol->cluster_size_bits) -
 				ofs);
-retry:
 		ntfs_log_trace("Reading %lld bytes from vcn %lld, lcn %lld, ofs"
 				" %lld.\n", (long long)to_read, (long long)rl->vcn,
 			       (long long )rl->lcn, (long long)ofs);
-		br = ntfs_pread(vol->dev, (rl->lcn << vol->cluster_size_bits) +
-				ofs, to_read, b);
-		/* If everything ok, update progress counters and continue. */
-		if (br > 0) {
-			total += br;
-			count -= br;
-			b = (u8*)b + br;
-		}
-		if (br == to_read)
-			continue;
-		/* If the syscall was interrupted, try again. */
-		if (br == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (total)
-			return total;
-		if (!br)
-			errno = EIO;
-		ntfs_log_perror("%s: ntfs_pread failed", __FUNCTION__);
-		return -1;
-	}
+		if (!ntfs_vio_add(&vio, (rl->lcn << vol->cluster_size_bits) +
+				ofs, b, to_read)) {
+			if (ntfs_attr_vio_flush(vol, &vio, b0, &total))
+				goto pread_err_out;
+			ntfs_vio_add(&vio, (rl->lcn << vol->cluster_size_bits)
+					+ ofs, b, to_read);
+		}
+		total += to_read;
+		count -= to_read;
+		b = (u8*)b + to_read;
+	}
+	if (ntfs_attr_vio_flush(vol, &vio, b0, &total))
+		goto pread_err_out;
 	/* Finally, return the number of bytes read. */
 	return total + total2;
 rl_err_out:
+	/* Complete the reads queued before the bad run. */
+	if (ntfs_attr_vio_flush(vol, &vio, b0, &total))
+		goto pread_err_out;
 	if (total)
 		return total;
 	errno = EIO;
 	return -1;
+pread_err_out:
+	if (total)
+		return total;
+	ntfs_log_perror("%s: ntfs_pread failed", __FUNCTION__);
+	return -1;
 }
 
 /**
@@ -1277,12 +1701,107 @@ s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count, void *b)
 		       "%lld\n", (unsigned long long)na->ni->mft_no,
 		       le32_to_cpu(na->type), (long long)pos, (long long)count);
 
-	ret = ntfs_attr_pread_i(na, pos, count, b);
+	ret = 0;
+	if (na == na->ni->vol->lcnbmp_na)
+		ret = ntfs_lcn_bitmap_pread(na->ni->vol, pos, count, b);
+	else if (na == na->ni->vol->mftbmp_na)
+		ret = ntfs_mft_bitmap_pread(na->ni->vol, pos, count, b);
+	else if (ntfs_mft_queue_barrier(na))
+		ret = -1;
+	if (!ret)
+		ret = ntfs_attr_pread_i(na, pos, count, b);
 	
 	ntfs_log_leave("\n");
 	return ret;
 }
 
+/**
+ * ntfs_attr_borrow - get a pointer to attribute data without copying it
+ * @na:		open ntfs attribute to read from
+ * @pos:	byte position in the attribute of the data
+ * @count:	number of bytes wanted
+ *
+ * When the @count bytes at @pos are stored contiguously, return a pointer to
+ * them instead of copying them as ntfs_attr_pread() does.  This is the case
+ * for resident values, which are pointed to in the mft record, and for
+ * ranges of plain non-resident attributes lying within a single run when the
+ * device supports ntfs_device_borrow().
+ *
+ * The data must not be modified.  A pointer into the mft record is valid
+ * until the attribute is changed or the inode is closed, a pointer into the
+ * device until the volume is unmounted.
+ *
+ * Return a pointer to the data on success.  Return NULL with errno set to
+ * EOPNOTSUPP if the data cannot be borrowed, in which case the caller should
+ * fall back to ntfs_attr_pread(), or with errno set to another error code if
+ * the attribute could not be accessed.
+ */
+const void *ntfs_attr_borrow(ntfs_attr *na, s64 pos, s64 count)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	s64 ofs;
+
+	if (!na || !na->ni || !na->ni->vol || pos < 0 || count <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	vol = na->ni->vol;
+	if (ntfs_mft_queue_barrier(na))
+		return NULL;
+	if (!NAttrNonResident(na)) {
+		ntfs_attr_search_ctx *ctx;
+		const char *val;
+
+		if (pos + count > na->data_size) {
+			errno = EOPNOTSUPP;
+			return NULL;
+		}
+		ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
+		if (!ctx)
+			return NULL;
+		if (ntfs_attr_lookup(na->type, na->name, na->name_len, 0,
+				0, NULL, 0, ctx)) {
+			ntfs_attr_put_search_ctx(ctx);
+			return NULL;
+		}
+		val = (char*)ctx->attr + le16_to_cpu(ctx->attr->value_offset);
+		if (val < (char*)ctx->attr || val +
+				le32_to_cpu(ctx->attr->value_length) >
+				(char*)ctx->mrec + vol->mft_record_size
+		    || pos + count > le32_to_cpu(ctx->attr->value_length)) {
+			errno = EIO;
+			ntfs_log_perror("%s: Sanity check failed", __FUNCTION__);
+			ntfs_attr_put_search_ctx(ctx);
+			return NULL;
+		}
+		ntfs_attr_put_search_ctx(ctx);
+		return val + pos;
+	}
+	/*
+	 * Compressed, encrypted and sparse data needs to be decoded, and the
+	 * device may be behind the resident bitmaps.
+	 */
+	if ((na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED))
+	    || pos + count > na->initialized_size
+	    || (na == vol->lcnbmp_na && vol->lcnbmp_cache)
+	    || (na == vol->mftbmp_na && vol->mftbmp_cache)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	rl = ntfs_attr_find_vcn(na, pos >> vol->cluster_size_bits);
+	if (!rl)
+		return NULL;
+	ofs = pos - (rl->vcn << vol->cluster_size_bits);
+	if (rl->lcn < 0 || ofs + count
+			> rl->length << vol->cluster_size_bits) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	return ntfs_device_borrow(vol->dev,
+			(rl->lcn << vol->cluster_size_bits) + ofs, count);
+}
+
 static int ntfs_attr_fill_zero(ntfs_attr *na, s64 pos, s64 count)
 {
 	char *buf;
@@ -1463,7 +1982,13 @@ static int ntfs_attr_fill_hole(ntfs_attr *na, s64 count, s64 *ofs,
 		}
 		rlc = ntfs_cluster_alloc(vol, alloc_vcn, need,
 				 lcn_seek_from, DATA_ZONE);
-	} else
+	} else if (NVolPrealloc(vol) && NAttrDataAppending(na)
+			&& (na->ni->mft_no >= FILE_first_user)
+			&& !(*rl)[1].length)
+		/* Filling the hole at the end of an appended stream */
+		rlc = ntfs_cluster_prealloc(na, from_vcn, need,
+				 lcn_seek_from);
+	else
 		rlc = ntfs_cluster_alloc(vol, from_vcn, need,
 				 lcn_seek_from, DATA_ZONE);
 	if (!rlc)
@@ -1495,6 +2020,7 @@ static int ntfs_attr_fill_hole(ntfs_attr *na, s64 count, s64 *ofs,
 	}
 	na->unused_runs = 2;
 	na->rl = *rl;
+	ntfs_attr_forget_runs(na);
 	if ((*update_from == -1) || (from_vcn < *update_from))
 		*update_from = from_vcn;
 	*rl = ntfs_attr_find_vcn(na, cur_vcn);
@@ -1871,6 +2397,152 @@ static int borrow_from_hole(ntfs_attr *na, runlist_element **prl,
 static int ntfs_attr_truncate_i(ntfs_attr *na, const s64 newsize,
 				hole_type holes);
 
+#if DELAYED_MAPPING_PAIRS
+
+/*
+ *		Find the mapping pairs of an extent which are unchanged
+ *
+ * When the runlist has only been changed from @from_vcn, the mapping
+ * pairs of the extent up to the run containing @from_vcn can be kept,
+ * and the following ones appended, so that appending to an attribute
+ * costs no more than encoding the new runs.  The last kept pair must
+ * describe the run preceding the first rebuilt one.
+ *
+ * @prl is the run the extent starts in, and is updated to the first run
+ * to rebuild, @prev_lcn is set to the lcn the next pair is relative to.
+ *
+ * Returns the size of the mapping pairs kept, 0 if none
+ */
+
+static int ntfs_attr_keep_mapping_pairs(ntfs_attr *na, const ATTR_RECORD *a,
+		VCN from_vcn, const runlist_element **prl, LCN *prev_lcn)
+{
+	const runlist_element *rl;
+	runlist_element last;
+	LCN lcn;
+	int keep;
+	int i;
+
+	keep = 0;
+	i = ntfs_attr_find_run(na, from_vcn);
+	if ((i > 0) && !(na->data_flags & ATTR_COMPRESSION_MASK)) {
+		rl = &na->rl[i];
+		if (rl->vcn > sle64_to_cpu(a->lowest_vcn)) {
+			keep = ntfs_mapping_pairs_seek(a, rl->vcn,
+						&last, &lcn);
+			if ((keep > 0)
+			    && (last.vcn == rl[-1].vcn)
+			    && (last.length == rl[-1].length)
+			    && (last.lcn == rl[-1].lcn)) {
+				*prl = rl;
+				*prev_lcn = lcn;
+			} else
+				keep = 0;
+		}
+	}
+	return (keep);
+}
+
+/*
+ *		Check whether the mapping pairs fit in their extent
+ *
+ * The mapping pairs of the extent containing @from_vcn are rebuilt from
+ * the runlist, keeping the unchanged ones, and they must fit into the
+ * mft record holding the extent, so that no new extent is needed.
+ *
+ * Returns TRUE if the mapping pairs fit
+ */
+
+static BOOL ntfs_attr_mapping_pairs_fit(ntfs_attr *na, VCN from_vcn)
+{
+	ntfs_attr_search_ctx *ctx;
+	const runlist_element *rl;
+	ATTR_RECORD *a;
+	MFT_RECORD *m;
+	VCN start_vcn;
+	LCN prev_lcn;
+	int max_size;
+	int keep;
+	int size;
+	int i;
+	BOOL fit;
+
+	fit = FALSE;
+	ctx = ntfs_attr_get_search_ctx(na->ni->nr_extents == -1
+				? na->ni->base_ni : na->ni, NULL);
+	if (ctx && !ntfs_attr_lookup(na->type, na->name, na->name_len,
+				CASE_SENSITIVE, from_vcn, NULL, 0, ctx)) {
+		a = ctx->attr;
+		m = ctx->mrec;
+		start_vcn = sle64_to_cpu(a->lowest_vcn);
+		i = ntfs_attr_find_run(na, start_vcn);
+		if ((i >= 0) && na->rl[i].length) {
+			rl = &na->rl[i];
+			prev_lcn = 0;
+			keep = ntfs_attr_keep_mapping_pairs(na, a, from_vcn,
+						&rl, &prev_lcn);
+			if (keep)
+				start_vcn = rl->vcn;
+			max_size = le32_to_cpu(m->bytes_allocated)
+				- le32_to_cpu(m->bytes_in_use)
+				+ le32_to_cpu(a->length)
+				- le16_to_cpu(a->mapping_pairs_offset);
+			size = ntfs_get_size_for_mapping_pairs_tail(
+					na->ni->vol, rl, start_vcn, prev_lcn,
+					max_size - keep);
+			fit = (size > 0) && ((keep + size) <= max_size);
+		}
+	}
+	if (ctx)
+		ntfs_attr_put_search_ctx(ctx);
+	return (fit);
+}
+
+/*
+ *		Delay the update of mapping pairs after appending
+ *
+ * When uncompressed data of a user file is appended to, the mapping pairs
+ * are only written when the attribute is flushed or closed, so that a
+ * stream of small appends does not rewrite the last extent each time.
+ * This is not done when the appended part has holes, as the attribute
+ * may then have to be made sparse, nor when the mapping pairs would not
+ * fit into the extent any more.
+ *
+ * Returns TRUE if the update has been delayed
+ */
+
+static BOOL ntfs_attr_delay_mapping_pairs(ntfs_attr *na, VCN from_vcn)
+{
+	const runlist_element *rl;
+	int i;
+
+	if (!NAttrDataAppending(na)
+	    || NAttrBeingNonResident(na)
+	    || (na->type != AT_DATA)
+	    || (na->data_flags & ATTR_COMPRESSION_MASK)
+	    || (na->ni->mft_no < FILE_first_user))
+		return (FALSE);
+	i = ntfs_attr_find_run(na, from_vcn);
+	if (i < 0)
+		return (FALSE);
+	for (rl = &na->rl[i]; rl->length; rl++)
+		if (rl->lcn < 0)
+			return (FALSE);
+	if (NAttrMappingPairsDelayed(na) && (na->mp_delayed_vcn < from_vcn))
+		from_vcn = na->mp_delayed_vcn;
+		/*
+		 * Do the update now if it needs a new extent, so that
+		 * a failure is reported by the write which caused it.
+		 */
+	if (!ntfs_attr_mapping_pairs_fit(na, from_vcn))
+		return (FALSE);
+	na->mp_delayed_vcn = from_vcn;
+	NAttrSetMappingPairsDelayed(na);
+	return (TRUE);
+}
+
+#endif
+
 /**
  * ntfs_attr_pwrite - positioned write to an ntfs attribute
  * @na:		ntfs attribute to write to
@@ -2356,6 +3028,13 @@ done:
 		 * inode extents were needed.
 		 */
 	if (NAttrRunlistDirty(na)) {
+#if DELAYED_MAPPING_PAIRS
+		if (ntfs_attr_delay_mapping_pairs(na,
+				(update_from < 0 ? 0 : update_from))) {
+			NAttrClearDataAppending(na);
+			goto out;
+		}
+#endif
 		if (ntfs_attr_update_mapping_pairs(na,
 				(update_from < 0 ? 0 : update_from))) {
 			/*
@@ -2453,6 +3132,20 @@ s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count, const void *b)
 		goto out;
 	}
 
+	if (ntfs_mft_queue_barrier(na)) {
+		written = -1;
+		goto out;
+	}
+	if (na == na->ni->vol->lcnbmp_na) {
+		written = ntfs_lcn_bitmap_pwrite(na->ni->vol, pos, count, b);
+		if (written)
+			goto out;
+	}
+	if (na == na->ni->vol->mftbmp_na) {
+		written = ntfs_mft_bitmap_pwrite(na->ni->vol, pos, count, b);
+		if (written)
+			goto out;
+	}
 		/*
 		 * Compressed attributes may be written partially, so
 		 * we may have to iterate.
@@ -2463,6 +3156,10 @@ s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count, const void *b)
 		if (written > 0)
 			total += written;
 	} while ((written > 0) && (total < count));
+	/* Keep the free cluster index in sync with $Bitmap. */
+	if (total > 0 && na == na->ni->vol->lcnbmp_na
+	    && !na->ni->vol->lcnbmp_cache)
+		ntfs_lcn_index_update(na->ni->vol, pos, total, b);
 out :
 	ntfs_log_leave("\n");
 	return (total > 0 ? total : written);
@@ -2699,7 +3396,6 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 		const u32 bk_size, void *dst)
 {
 	s64 br;
-	u8 *end;
 	BOOL warn;
 
 	ntfs_log_trace("Entering for inode 0x%llx, attr type 0x%x, pos 0x%llx.\n",
@@ -2716,9 +3412,7 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 	br /= bk_size;
 		/* log errors unless silenced */
 	warn = !na->ni || !na->ni->vol || !NVolNoFixupWarn(na->ni->vol);
-	for (end = (u8*)dst + br * bk_size; (u8*)dst < end; dst = (u8*)dst +
-			bk_size)
-		ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)dst, bk_size, warn);
+	ntfs_mst_post_read_fixup_batch(dst, bk_size, br, warn);
 	/* Finally, return the number of blocks read. */
 	return br;
 }
@@ -2767,20 +3461,13 @@ s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos, s64 bk_cnt,
 	}
 	if (!bk_cnt)
 		return 0;
-	/* Prepare data for writing. */
-	for (i = 0; i < bk_cnt; ++i) {
-		int err;
-
-		err = ntfs_mst_pre_write_fixup((NTFS_RECORD*)
-				((u8*)src + i * bk_size), bk_size);
-		if (err < 0) {
-			/* Abort write at this position. */
-			ntfs_log_perror("%s #1", __FUNCTION__);
-			if (!i)
-				return err;
-			bk_cnt = i;
-			break;
-		}
+	/* Prepare data for writing, aborting at the first bad record. */
+	i = ntfs_mst_pre_write_fixup_batch(src, bk_size, bk_cnt);
+	if (i < bk_cnt) {
+		ntfs_log_perror("%s #1", __FUNCTION__);
+		if (!i)
+			return -1;
+		bk_cnt = i;
 	}
 	/* Write the prepared data. */
 	written = ntfs_attr_pwrite(na, pos, bk_cnt * bk_size, src);
@@ -2789,9 +3476,7 @@ s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos, s64 bk_cnt,
 				(long long)written);
 	}
 	/* Quickly deprotect the data again. */
-	for (i = 0; i < bk_cnt; ++i)
-		ntfs_mst_post_write_fixup((NTFS_RECORD*)((u8*)src + i *
-				bk_size));
+	ntfs_mst_post_write_fixup_batch(src, bk_size, bk_cnt);
 	if (written <= 0)
 		return written;
 	/* Finally, return the number of complete blocks written. */
@@ -3228,6 +3913,20 @@ find_attr_list_attr:
 			return -1;
 		}
 	}
+	/*
+	 * In a huge attribute list, skip the entries which would be
+	 * skipped anyway, see ntfs_attrlist_index_find().  A position
+	 * out of the list is left for the checks below.
+	 */
+	if ((type != AT_UNUSED) && ((u8*)al_entry >= al_start)
+			&& ((u8*)al_entry <= al_end)) {
+		ATTR_LIST_ENTRY *skip_to;
+
+		skip_to = ntfs_attrlist_index_find(base_ni, type, name,
+				name_len, ic, lowest_vcn);
+		if (skip_to && ((u8*)skip_to > (u8*)al_entry))
+			al_entry = skip_to;
+	}
 	for (;; al_entry = next_al_entry) {
 		/* Out of bounds check. */
 		if ((u8*)al_entry < base_ni->attr_list ||
@@ -4022,7 +4721,8 @@ ntfs_attr_search_ctx *ntfs_attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mrec)
 		ntfs_log_perror("NULL arguments");
 		return NULL;
 	}
-	ctx = ntfs_malloc(sizeof(ntfs_attr_search_ctx));
+	ctx = ntfs_pool_alloc(ni ? ni->vol->ctx_pool : NULL,
+			sizeof(ntfs_attr_search_ctx));
 	if (ctx)
 		ntfs_attr_init_search_ctx(ctx, ni, mrec);
 	return ctx;
@@ -4037,7 +4737,7 @@ ntfs_attr_search_ctx *ntfs_attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mrec)
 void ntfs_attr_put_search_ctx(ntfs_attr_search_ctx *ctx)
 {
 	// NOTE: save errno if it could change and function stays void!
-	free(ctx);
+	ntfs_pool_free(ctx);
 }
 
 /**
@@ -4626,6 +5326,7 @@ int ntfs_attr_record_rm(ntfs_attr_search_ctx *ctx)
 	if (type == AT_ATTRIBUTE_LIST) {
 		if (NInoAttrList(base_ni) && base_ni->attr_list)
 			free(base_ni->attr_list);
+		ntfs_attrlist_index_free(base_ni);
 		base_ni->attr_list = NULL;
 		NInoClearAttrList(base_ni);
 		NInoAttrListClearDirty(base_ni);
@@ -5363,6 +6064,7 @@ int ntfs_attr_make_non_resident(ntfs_attr *na,
 	NAttrSetNonResident(na);
 	NAttrSetBeingNonResident(na);
 	na->rl = rl;
+	ntfs_attr_forget_runs(na);
 	na->allocated_size = new_allocated_size;
 	na->data_size = na->initialized_size = le32_to_cpu(a->value_length);
 	/*
@@ -5483,6 +6185,7 @@ cluster_free_err_out:
 	NAttrClearFullyMapped(na);
 	na->allocated_size = na->data_size;
 	na->rl = NULL;
+	ntfs_attr_forget_runs(na);
 	free(rl);
 	errno = err;
 	return -1;
@@ -5964,6 +6667,7 @@ int ntfs_attr_make_resident(ntfs_attr *na, ntfs_attr_search_ctx *ctx)
 	/* Throw away the now unused runlist. */
 	free(na->rl);
 	na->rl = NULL;
+	ntfs_attr_forget_runs(na);
 
 	/* Update in-memory struct ntfs_attr. */
 	NAttrClearNonResident(na);
@@ -6119,6 +6823,9 @@ static int ntfs_attr_update_mapping_pairs_i(ntfs_attr *na, VCN from_vcn,
 	VCN stop_vcn;
 	const runlist_element *stop_rl;
 	int err, mp_size, cur_max_mp_size, exp_max_mp_size, ret = -1;
+	int keep;
+	LCN keep_lcn;
+	VCN tail_vcn;
 	BOOL finished_build;
 	BOOL first_updated = FALSE;
 
@@ -6128,6 +6835,9 @@ retry:
 		ntfs_log_perror("%s: na=%p", __FUNCTION__, na);
 		return -1;
 	}
+		/* Include the changes whose update was delayed */
+	if (NAttrMappingPairsDelayed(na) && (na->mp_delayed_vcn < from_vcn))
+		from_vcn = na->mp_delayed_vcn;
 
 	ntfs_log_trace("Entering for inode %llu, attr 0x%x\n", 
 		       (unsigned long long)na->ni->mft_no, le32_to_cpu(na->type));
@@ -6211,6 +6921,9 @@ retry:
 	/* Fill attribute records with new mapping pairs. */
 	stop_vcn = 0;
 	stop_rl = na->rl;
+	keep = 0;
+	keep_lcn = 0;
+	tail_vcn = 0;
 	finished_build = FALSE;
 	while (!ntfs_attr_lookup(na->type, na->name, na->name_len,
 				CASE_SENSITIVE, from_vcn, NULL, 0, ctx)) {
@@ -6228,13 +6941,12 @@ retry:
 			LCN first_lcn;
 
 			stop_vcn = sle64_to_cpu(a->lowest_vcn);
-			from_vcn = 0;
 			/*
 			 * Check whether the first run we need to update is
 			 * the last run in runlist, if so, then deallocate
 			 * all attrubute extents starting this one.
 			 */
-			first_lcn = ntfs_rl_vcn_to_lcn(na->rl, stop_vcn);
+			first_lcn = ntfs_attr_rl_vcn_to_lcn(na, stop_vcn);
 			if (first_lcn == LCN_EINVAL) {
 				errno = EIO;
 				ntfs_log_perror("Bad runlist");
@@ -6243,6 +6955,12 @@ retry:
 			if (first_lcn == LCN_ENOENT ||
 					first_lcn == LCN_RL_NOT_MAPPED)
 				finished_build = TRUE;
+			else {
+				stop_rl = &na->rl[ntfs_attr_find_run(na,
+							stop_vcn)];
+				tail_vcn = from_vcn;
+			}
+			from_vcn = 0;
 		}
 
 		/*
@@ -6266,6 +6984,15 @@ retry:
 			case -3: goto put_err_out;
 		}
 
+#if DELAYED_MAPPING_PAIRS
+		/* Only rebuild the pairs from the first changed run. */
+		if (tail_vcn) {
+			keep = ntfs_attr_keep_mapping_pairs(na, a, tail_vcn,
+						&stop_rl, &keep_lcn);
+			stop_vcn = stop_rl->vcn;
+			tail_vcn = 0;
+		}
+#endif
 		/*
 		 * Determine maximum possible length of mapping pairs,
 		 * if we shall *not* expand space for mapping pairs.
@@ -6279,13 +7006,18 @@ retry:
 		 */
 		exp_max_mp_size = le32_to_cpu(m->bytes_allocated) -
 				le32_to_cpu(m->bytes_in_use) + cur_max_mp_size;
-		/* Get the size for the rest of mapping pairs array. */
-		mp_size = ntfs_get_size_for_mapping_pairs(na->ni->vol, stop_rl,
-						stop_vcn, exp_max_mp_size);
+		/*
+		 * Get the size for the rest of mapping pairs array, appended
+		 * to the @keep bytes of unchanged ones.
+		 */
+		mp_size = ntfs_get_size_for_mapping_pairs_tail(na->ni->vol,
+				stop_rl, stop_vcn, keep_lcn,
+				exp_max_mp_size - keep);
 		if (mp_size <= 0) {
 			ntfs_log_perror("%s: get MP size failed", __FUNCTION__);
 			goto put_err_out;
 		}
+		mp_size += keep;
 		/* Test mapping pairs for fitting in the current mft record. */
 		if (mp_size > exp_max_mp_size) {
 			/*
@@ -6334,24 +7066,30 @@ retry:
 			}
 		}
 
-		/* Update lowest vcn. */
-		a->lowest_vcn = cpu_to_sle64(stop_vcn);
+		/* Update lowest vcn, unless the first pairs are kept. */
 		ntfs_inode_mark_dirty(ctx->ntfs_ino);
-		if ((ctx->ntfs_ino->nr_extents == -1 ||
+		if (!keep) {
+			a->lowest_vcn = cpu_to_sle64(stop_vcn);
+			if ((ctx->ntfs_ino->nr_extents == -1 ||
 					NInoAttrList(ctx->ntfs_ino)) &&
 					ctx->attr->type != AT_ATTRIBUTE_LIST) {
-			ctx->al_entry->lowest_vcn = cpu_to_sle64(stop_vcn);
-			ntfs_attrlist_mark_dirty(ctx->ntfs_ino);
+				ctx->al_entry->lowest_vcn
+						= cpu_to_sle64(stop_vcn);
+				ntfs_attrlist_mark_dirty(ctx->ntfs_ino);
+			}
 		}
 
 		/*
 		 * Generate the new mapping pairs array directly into the
 		 * correct destination, i.e. the attribute record itself.
 		 */
-		if (!ntfs_mapping_pairs_build(na->ni->vol, (u8*)a + le16_to_cpu(
-				a->mapping_pairs_offset), mp_size, na->rl,
-				stop_vcn, &stop_rl))
+		if (!ntfs_mapping_pairs_build_tail(na->ni->vol, (u8*)a
+				+ le16_to_cpu(a->mapping_pairs_offset) + keep,
+				mp_size - keep, stop_rl, stop_vcn, keep_lcn,
+				&stop_rl))
 			finished_build = TRUE;
+		keep = 0;
+		keep_lcn = 0;
 		if (stop_rl)
 			stop_vcn = stop_rl->vcn;
 		else
@@ -6430,7 +7168,7 @@ retry:
 	while (1) {
 		/* Calculate size of rest mapping pairs. */
 		mp_size = ntfs_get_size_for_mapping_pairs(na->ni->vol,
-						na->rl, stop_vcn, INT_MAX);
+						stop_rl, stop_vcn, INT_MAX);
 		if (mp_size <= 0) {
 			ntfs_log_perror("%s: get mp size failed", __FUNCTION__);
 			goto put_err_out;
@@ -6474,7 +7212,7 @@ retry:
 		a = (ATTR_RECORD*)((u8*)m + err);
 
 		err = ntfs_mapping_pairs_build(na->ni->vol, (u8*)a +
-			le16_to_cpu(a->mapping_pairs_offset), mp_size, na->rl,
+			le16_to_cpu(a->mapping_pairs_offset), mp_size, stop_rl,
 			stop_vcn, &stop_rl);
 		if (stop_rl)
 			stop_vcn = stop_rl->vcn;
@@ -6496,6 +7234,7 @@ retry:
 	}
 ok:
 	NAttrClearRunlistDirty(na);
+	NAttrClearMappingPairsDelayed(na);
 	ret = 0;
 out:
 	return ret;
@@ -6541,6 +7280,114 @@ int ntfs_attr_update_mapping_pairs(ntfs_attr *na, VCN from_vcn)
 	return ret;
 }
 
+/**
+ * ntfs_attr_flush - write the delayed mapping pairs of an attribute
+ * @na:		open ntfs attribute to flush
+ *
+ * When appending to @na, the update of its mapping pairs may have been
+ * delayed, so as to only append the new runs once.  Write them now, this
+ * is done anyway when @na is closed.
+ *
+ * On success return 0 and on error return -1 with errno set to the error
+ * code, as for ntfs_attr_update_mapping_pairs().
+ */
+int ntfs_attr_flush(ntfs_attr *na)
+{
+	int ret;
+
+	ret = 0;
+	if (NAttrMappingPairsDelayed(na)) {
+		ntfs_log_enter("Entering for inode %lld\n",
+				(long long)na->ni->mft_no);
+		ret = ntfs_attr_update_mapping_pairs_i(na,
+				na->mp_delayed_vcn, HOLES_OK);
+		ntfs_log_leave("\n");
+	}
+	return (ret);
+}
+
+/**
+ * ntfs_attr_flush_delayed - retry the mapping pairs left by ntfs_attr_close()
+ * @ni:		inode owning the attributes
+ * @type:	type of the attribute to flush, AT_UNUSED for all of them
+ * @name:	name of the attribute to flush, when @type is not AT_UNUSED
+ * @name_len:	length of @name
+ *
+ * Write the delayed mapping pairs of the attributes which ntfs_attr_close()
+ * kept by the base inode of @ni because it could not write them, and
+ * release those written.  The others are kept for another try.
+ *
+ * On success return 0 and on error return -1 with errno set to the error
+ * of the first attribute which could not be written.
+ */
+int ntfs_attr_flush_delayed(ntfs_inode *ni, const ATTR_TYPES type,
+		const ntfschar *name, u32 name_len)
+{
+	ntfs_attr *na, *next, *kept;
+	int err;
+
+	if (ni->nr_extents == -1)
+		ni = ni->base_ni;
+	if (!ni->delayed_na)
+		return (0);
+	/* Detach the list, the flushes may open attributes of @ni. */
+	na = ni->delayed_na;
+	ni->delayed_na = (ntfs_attr*)NULL;
+	kept = (ntfs_attr*)NULL;
+	err = 0;
+	for (; na; na = next) {
+		next = na->next_delayed;
+		if ((type == AT_UNUSED)
+		    || ((na->type == type)
+			&& (na->name_len == (name ? name_len : 0))
+			&& (!na->name_len || !memcmp(na->name, name,
+				name_len*sizeof(ntfschar))))) {
+			if (!ntfs_attr_flush(na)) {
+				ntfs_attr_close(na);
+				continue;
+			}
+			if (!err)
+				err = errno;
+			ntfs_log_perror("Failed again to write the delayed "
+					"mapping pairs of inode %lld",
+					(long long)ni->mft_no);
+		}
+		na->next_delayed = kept;
+		kept = na;
+	}
+	for (na = kept; na; na = next) {
+		next = na->next_delayed;
+		na->next_delayed = ni->delayed_na;
+		ni->delayed_na = na;
+	}
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * ntfs_attr_drop_delayed - forget the mapping pairs left by ntfs_attr_close()
+ * @ni:		base inode being released
+ *
+ * Release the attributes kept by @ni without writing their mapping pairs,
+ * when the inode is released anyway.
+ */
+void ntfs_attr_drop_delayed(ntfs_inode *ni)
+{
+	ntfs_attr *na;
+
+	while ((na = ni->delayed_na)) {
+		ni->delayed_na = na->next_delayed;
+		ntfs_log_error("Dropping the mapping pairs of inode %lld "
+				"from vcn %lld\n", (long long)ni->mft_no,
+				(long long)na->mp_delayed_vcn);
+		NAttrClearMappingPairsDelayed(na);
+		ntfs_attr_close(na);
+	}
+}
+
 /**
  * ntfs_non_resident_attr_shrink - shrink a non-resident, open ntfs attribute
  * @na:		non-resident ntfs attribute to shrink
@@ -6620,6 +7467,7 @@ int ntfs_non_resident_attr_shrink(ntfs_attr *na, const s64 newsize)
 			 */
 			free(na->rl);
 			na->rl = NULL;
+			ntfs_attr_forget_runs(na);
 			ntfs_log_trace("Eeek! Run list truncation failed.\n");
 			return -1;
 		}
@@ -6924,6 +7772,7 @@ rollback:
 		 */
 		free(na->rl);
 		na->rl = NULL;
+		ntfs_attr_forget_runs(na);
 		ntfs_log_perror("Couldn't truncate runlist. Rollback failed");
 	} else {
 		NAttrSetRunlistDirty(na);
@@ -6999,6 +7848,13 @@ static int ntfs_attr_truncate_i(ntfs_attr *na, const s64 newsize,
 		ret = STATUS_OK;
 		goto out;
 	}
+	/* The resident copies of $Bitmap and $MFT/$BITMAP cannot follow. */
+	if (na == na->ni->vol->lcnbmp_na
+	    && ntfs_lcn_bitmap_release(na->ni->vol))
+		goto out;
+	if (na == na->ni->vol->mftbmp_na
+	    && ntfs_mft_bitmap_release(na->ni->vol))
+		goto out;
 	/*
 	 * Encrypted attributes are not supported. We return access denied,
 	 * which is what Windows NT4 does, too.
@@ -7404,63 +8260,40 @@ int ntfs_attr_remove(ntfs_inode *ni, const ATTR_TYPES type, ntfschar *name,
 	return ret;
 }
 
-/* Below macros are 32-bit ready. */
-#define BCX(x) ((x) - (((x) >> 1) & 0x77777777) - \
-		      (((x) >> 2) & 0x33333333) - \
-		      (((x) >> 3) & 0x11111111))
-#define BITCOUNT(x) (((BCX(x) + (BCX(x) >> 4)) & 0x0F0F0F0F) % 255)
+/*
+ *		Count the zero bits of a bitmap attribute
+ *
+ * The bitmap is read in large chunks, the resident $Bitmap of a volume
+ * mounted for writing is counted in place.
+ */
 
-static u8 *ntfs_init_lut256(void)
-{
-	int i;
-	u8 *lut;
-	
-	lut = ntfs_malloc(256);
-	if (lut)
-		for(i = 0; i < 256; i++)
-			*(lut + i) = 8 - BITCOUNT(i);
-	return lut;
-}
+#define FREE_BITS_CHUNK (1 << 20)
 
 s64 ntfs_attr_get_free_bits(ntfs_attr *na)
 {
-	u8 *buf, *lut;
+	u8 *buf;
 	s64 br      = 0;
 	s64 total   = 0;
 	s64 nr_free = 0;
 
-	lut = ntfs_init_lut256();
-	if (!lut)
-		return -1;
-	
-	buf = ntfs_malloc(65536);
+	if (na == na->ni->vol->lcnbmp_na) {
+		nr_free = ntfs_lcn_bitmap_free_bits(na->ni->vol);
+		if (nr_free >= 0)
+			return nr_free;
+		nr_free = 0;
+	}
+	buf = ntfs_malloc(FREE_BITS_CHUNK);
 	if (!buf)
-		goto out;
+		return -1;
 
 	while (1) {
-		u32 *p;
-		br = ntfs_attr_pread(na, total, 65536, buf);
+		br = ntfs_attr_pread(na, total, FREE_BITS_CHUNK, buf);
 		if (br <= 0)
 			break;
 		total += br;
-		p = (u32 *)buf + br / 4 - 1;
-		for (; (u8 *)p >= buf; p--) {
-			nr_free += lut[ *p        & 255] + 
-			           lut[(*p >>  8) & 255] + 
-			           lut[(*p >> 16) & 255] + 
-			           lut[(*p >> 24)      ];
-		}
-		switch (br % 4) {
-			case 3:  nr_free += lut[*(buf + br - 3)];
-			/* FALLTHRU */
-			case 2:  nr_free += lut[*(buf + br - 2)];
-			/* FALLTHRU */
-			case 1:  nr_free += lut[*(buf + br - 1)];
-		}
+		nr_free += br * 8 - ntfs_bitmap_popcount(buf, 0, br * 8);
 	}
 	free(buf);
-out:
-	free(lut);
 	if (!total || br < 0)
 		return -1;
 	return nr_free;
@@ -36,6 +36,7 @@
 #include <errno.h>
 #endif
 
+#include "param.h"
 #include "types.h"
 #include "layout.h"
 #include "attrib.h"
@@ -92,6 +93,327 @@ int ntfs_attrlist_need(ntfs_inode *ni)
 	return 0;
 }
 
+/*
+ *		Indexing the attribute list
+ *
+ * The entries of an attribute list are sorted by type, name and lowest
+ * vcn, but they have variable lengths, so a lookup has to walk the list
+ * from its start.  For the huge lists of heavily fragmented files, the
+ * offsets of the entries are kept in an array, in list order, so that
+ * the entry a lookup stops at is found by a binary search.
+ *
+ * The index records which list it was built for, so that a list replaced
+ * or truncated by other means is indexed again when next searched.  It is
+ * only used when the list was found correctly sorted, otherwise lookups
+ * walk the list as before, so that they behave the same on damaged
+ * lists.
+ */
+
+struct ntfs_attrlist_index {
+	const u8 *attr_list;	/* The list indexed. */
+	u32 attr_list_size;
+	BOOL sorted;		/* Usable for lookups. */
+	u32 count;		/* Entries in the list. */
+	u32 allocated;		/* Room in @offsets. */
+	u32 *offsets;		/* Offsets of the entries, in list order. */
+};
+
+#define AL_ENTRY(al, idx, i) \
+	((const ATTR_LIST_ENTRY*)((al) + (idx)->offsets[i]))
+#define AL_NAME(ale) \
+	((const ntfschar*)((const u8*)(ale) + (ale)->name_offset))
+
+/*
+ *		Check the collation order of two consecutive entries
+ */
+
+static BOOL ntfs_attrlist_in_order(ntfs_volume *vol,
+		const ATTR_LIST_ENTRY *prev, const ATTR_LIST_ENTRY *next)
+{
+	int rc;
+
+	if (le32_to_cpu(prev->type) != le32_to_cpu(next->type))
+		return (le32_to_cpu(prev->type) < le32_to_cpu(next->type));
+	rc = ntfs_names_full_collate(AL_NAME(prev), prev->name_length,
+			AL_NAME(next), next->name_length, CASE_SENSITIVE,
+			vol->upcase, vol->upcase_len);
+	if (rc)
+		return (rc < 0);
+	return (sle64_to_cpu(prev->lowest_vcn)
+			<= sle64_to_cpu(next->lowest_vcn));
+}
+
+/**
+ * ntfs_attrlist_index_free - forget the index of an attribute list
+ * @ni:		inode owning the attribute list
+ *
+ * To be called when the attribute list is freed, the memory could be
+ * reused for another list of the same size.
+ */
+void ntfs_attrlist_index_free(ntfs_inode *ni)
+{
+	if (ni->attr_index) {
+		free(ni->attr_index->offsets);
+		free(ni->attr_index);
+		ni->attr_index = NULL;
+	}
+}
+
+/*
+ *		Build the index of an attribute list
+ *
+ * Returns the index, possibly not sorted, or NULL if there was no
+ * memory, with errno unchanged.
+ */
+
+static struct ntfs_attrlist_index *ntfs_attrlist_index_build(ntfs_inode *ni)
+{
+	struct ntfs_attrlist_index *idx;
+	const ATTR_LIST_ENTRY *ale;
+	const u8 *al_start, *al_end;
+	u32 *offsets;
+	u32 len;
+	int eo;
+
+	eo = errno;
+	idx = (struct ntfs_attrlist_index*)ntfs_calloc(
+			sizeof(struct ntfs_attrlist_index));
+	if (!idx)
+		goto out;
+	idx->attr_list = al_start = ni->attr_list;
+	idx->attr_list_size = ni->attr_list_size;
+	al_end = al_start + ni->attr_list_size;
+	idx->sorted = TRUE;
+	for (ale = (const ATTR_LIST_ENTRY*)al_start; (const u8*)ale < al_end;
+			ale = (const ATTR_LIST_ENTRY*)((const u8*)ale + len)) {
+		/* Same checks as when walking the list */
+		len = ((const u8*)ale + offsetof(ATTR_LIST_ENTRY, name)
+				<= al_end ? le16_to_cpu(ale->length) : 0);
+		if ((len < offsetof(ATTR_LIST_ENTRY, name)) || (len & 7)
+		    || ((const u8*)ale + len > al_end)
+		    || (ale->name_length
+			&& ((const u8*)ale + ale->name_offset
+			    + ale->name_length * sizeof(ntfschar) > al_end))) {
+			idx->sorted = FALSE;
+			break;
+		}
+		if (idx->count == idx->allocated) {
+			idx->allocated = (idx->allocated ?
+					2*idx->allocated : 64);
+			offsets = (u32*)realloc(idx->offsets,
+					idx->allocated*sizeof(u32));
+			if (!offsets) {
+				free(idx->offsets);
+				free(idx);
+				idx = (struct ntfs_attrlist_index*)NULL;
+				goto out;
+			}
+			idx->offsets = offsets;
+		}
+		if (idx->count
+		    && !ntfs_attrlist_in_order(ni->vol,
+				AL_ENTRY(al_start, idx, idx->count - 1), ale)) {
+			idx->sorted = FALSE;
+			break;
+		}
+		idx->offsets[idx->count++] = (const u8*)ale - al_start;
+	}
+	ntfs_log_debug("Attribute list of inode %lld indexed, %u entries%s\n",
+			(long long)ni->mft_no, (unsigned)idx->count,
+			(idx->sorted ? "" : ", not sorted"));
+out:
+	errno = eo;
+	return (idx);
+}
+
+/*
+ *		Get the index of the attribute list of a base inode
+ *
+ * Returns the index if it can be used for lookups,
+ *	NULL if the list is small, not sorted, or there was no memory
+ */
+
+static struct ntfs_attrlist_index *ntfs_attrlist_index_get(ntfs_inode *ni)
+{
+	struct ntfs_attrlist_index *idx;
+
+	idx = ni->attr_index;
+	if (idx && ((idx->attr_list != ni->attr_list)
+			|| (idx->attr_list_size != ni->attr_list_size))) {
+		ntfs_attrlist_index_free(ni);
+		idx = (struct ntfs_attrlist_index*)NULL;
+	}
+	if (!idx) {
+		if (!ATTRLIST_INDEX_SIZE
+		    || (ni->attr_list_size < ATTRLIST_INDEX_SIZE)
+		    || !ni->attr_list || !ni->vol->upcase)
+			return ((struct ntfs_attrlist_index*)NULL);
+		idx = ni->attr_index = ntfs_attrlist_index_build(ni);
+	}
+	return (idx && idx->sorted ? idx : (struct ntfs_attrlist_index*)NULL);
+}
+
+/**
+ * ntfs_attrlist_index_find - find where a lookup in an attribute list stops
+ * @ni:		base inode owning the attribute list
+ * @type:	attribute type searched, neither AT_UNUSED nor AT_END
+ * @name:	attribute name, AT_UNNAMED or NULL as for ntfs_attr_lookup()
+ * @name_len:	attribute name length
+ * @ic:		IGNORE_CASE or CASE_SENSITIVE
+ * @lowest_vcn:	lowest vcn searched, or 0
+ *
+ * Walking the attribute list from its start, the entries before the one
+ * returned would all be skipped as collating before the attribute searched,
+ * or as ending before @lowest_vcn, so the walk can start from the entry
+ * returned.  This is the first entry of the attribute, or the one holding
+ * @lowest_vcn, if present, otherwise the entry before which the attribute
+ * would be inserted.
+ *
+ * Returns the entry, possibly the end of the list, or NULL if the list is
+ * not indexed, so it has to be walked from its start.
+ */
+ATTR_LIST_ENTRY *ntfs_attrlist_index_find(ntfs_inode *ni, ATTR_TYPES type,
+		const ntfschar *name, u32 name_len, IGNORE_CASE_BOOL ic,
+		VCN lowest_vcn)
+{
+	struct ntfs_attrlist_index *idx;
+	const ATTR_LIST_ENTRY *ale;
+	const ATTR_LIST_ENTRY *first;
+	const u8 *al;
+	ntfs_volume *vol;
+	u32 lo, hi, mid;
+	BOOL before;
+
+	idx = ntfs_attrlist_index_get(ni);
+	if (!idx)
+		return ((ATTR_LIST_ENTRY*)NULL);
+	vol = ni->vol;
+	al = ni->attr_list;
+		/* first entry not collating before the attribute */
+	lo = 0;
+	hi = idx->count;
+	while (lo < hi) {
+		mid = (lo + hi)/2;
+		ale = AL_ENTRY(al, idx, mid);
+		if (ale->type != type)
+			before = le32_to_cpu(ale->type) < le32_to_cpu(type);
+		else
+			before = name && (name != AT_UNNAMED)
+				&& (ntfs_names_full_collate(name, name_len,
+					AL_NAME(ale), ale->name_length, ic,
+					vol->upcase, vol->upcase_len) > 0);
+		if (before)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == idx->count)
+		return ((ATTR_LIST_ENTRY*)(al + ni->attr_list_size));
+	first = AL_ENTRY(al, idx, lo);
+	if (lowest_vcn && (first->type == type)
+	    && (name != AT_UNNAMED || !first->name_length)
+	    && (!name || (name == AT_UNNAMED)
+		|| !ntfs_names_full_collate(name, name_len, AL_NAME(first),
+				first->name_length, ic,
+				vol->upcase, vol->upcase_len))) {
+			/* last extent of the same name starting at most there */
+		hi = idx->count;
+		lo++;
+		while (lo < hi) {
+			mid = (lo + hi)/2;
+			ale = AL_ENTRY(al, idx, mid);
+			if ((ale->type == type)
+			    && (sle64_to_cpu(ale->lowest_vcn) <= lowest_vcn)
+			    && ntfs_names_are_equal(AL_NAME(ale),
+					ale->name_length, AL_NAME(first),
+					first->name_length, CASE_SENSITIVE,
+					vol->upcase, vol->upcase_len))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		lo--;
+	}
+	return ((ATTR_LIST_ENTRY*)(al + idx->offsets[lo]));
+}
+
+/*
+ *		Update the index for an entry inserted into the list
+ *
+ * The new list @new_al is fully built, the inode still has the old one.
+ */
+
+static void ntfs_attrlist_index_insert(ntfs_inode *ni, const u8 *new_al,
+		u32 offset, u32 len)
+{
+	struct ntfs_attrlist_index *idx;
+	u32 *offsets;
+	u32 i, pos;
+
+	idx = ni->attr_index;
+	if (!idx)
+		return;
+	if (!idx->sorted || (idx->attr_list != ni->attr_list)
+	    || (idx->attr_list_size != ni->attr_list_size)) {
+		ntfs_attrlist_index_free(ni);
+		return;
+	}
+	if (idx->count == idx->allocated) {
+		offsets = (u32*)realloc(idx->offsets,
+				2*idx->allocated*sizeof(u32));
+		if (!offsets) {
+			ntfs_attrlist_index_free(ni);
+			return;
+		}
+		idx->offsets = offsets;
+		idx->allocated *= 2;
+	}
+	for (pos = idx->count; pos && (idx->offsets[pos - 1] >= offset); pos--)
+		idx->offsets[pos] = idx->offsets[pos - 1] + len;
+	idx->offsets[pos] = offset;
+	idx->count++;
+	idx->attr_list = new_al;
+	idx->attr_list_size = ni->attr_list_size + len;
+	for (i = (pos ? pos - 1 : pos); (i <= pos + 1) && (i + 1 < idx->count);
+			i++)
+		if (!ntfs_attrlist_in_order(ni->vol, AL_ENTRY(new_al, idx, i),
+				AL_ENTRY(new_al, idx, i + 1)))
+			idx->sorted = FALSE;
+}
+
+/*
+ *		Update the index for an entry removed from the list
+ *
+ * The new list @new_al is fully built, the inode still has the old one.
+ */
+
+static void ntfs_attrlist_index_remove(ntfs_inode *ni, const u8 *new_al,
+		u32 offset, u32 len)
+{
+	struct ntfs_attrlist_index *idx;
+	u32 pos;
+
+	idx = ni->attr_index;
+	if (!idx)
+		return;
+	if (!idx->sorted || (idx->attr_list != ni->attr_list)
+	    || (idx->attr_list_size != ni->attr_list_size)) {
+		ntfs_attrlist_index_free(ni);
+		return;
+	}
+	for (pos = idx->count; pos && (idx->offsets[pos - 1] > offset); pos--)
+		idx->offsets[pos - 1] -= len;
+	if (!pos || (idx->offsets[pos - 1] != offset)) {
+		ntfs_attrlist_index_free(ni);
+		return;
+	}
+	memmove(&idx->offsets[pos - 1], &idx->offsets[pos],
+			(idx->count - pos)*sizeof(u32));
+	idx->count--;
+	idx->attr_list = new_al;
+	idx->attr_list_size = ni->attr_list_size - len;
+}
+
 /**
  * ntfs_attrlist_entry_add - add an attribute list attribute entry
  * @ni:		opened ntfs inode, which contains that attribute
@@ -218,6 +540,7 @@ int ntfs_attrlist_entry_add(ntfs_inode *ni, ATTR_RECORD *attr)
 			entry_offset, ni->attr_list_size - entry_offset);
 
 	/* Set new runlist. */
+	ntfs_attrlist_index_insert(ni, new_al, entry_offset, entry_len);
 	free(ni->attr_list);
 	ni->attr_list = new_al;
 	ni->attr_list_size = ni->attr_list_size + entry_len;
@@ -298,6 +621,8 @@ int ntfs_attrlist_entry_rm(ntfs_attr_search_ctx *ctx)
 		ale->length), new_al_len - ((u8*)ale - base_ni->attr_list));
 
 	/* Set new runlist. */
+	ntfs_attrlist_index_remove(base_ni, new_al,
+			(u8*)ale - base_ni->attr_list, le16_to_cpu(ale->length));
 	free(base_ni->attr_list);
 	base_ni->attr_list = new_al;
 	base_ni->attr_list_size = new_al_len;
@@ -37,11 +37,20 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__) && defined(HAVE_IMMINTRIN_H)
+#define NTFS_BITMAP_X86
+#include <immintrin.h>
+#endif
 
 #include "types.h"
 #include "attrib.h"
 #include "bitmap.h"
 #include "debug.h"
+#include "volume.h"
+#include "lcnindex.h"
 #include "logging.h"
 #include "misc.h"
 
@@ -100,6 +109,1032 @@ char ntfs_bit_get_and_set(u8 *bitmap, const u64 bit, const u8 new_value)
 	return old_bit;
 }
 
+/*
+ *		Range kernels
+ *
+ * The functions below work on bitmaps held in memory, a 64-bit word at a
+ * time where ntfs_bit_get() and ntfs_bit_set() would work a bit at a time.
+ * The bitmap is little endian, bit n being bit n & 7 of byte n >> 3, so a
+ * word loaded from any byte offset with le64_to_cpu() holds the following
+ * 64 bits in order, whatever the byte order of the cpu.  Words are loaded
+ * through memcpy() and need no alignment.
+ *
+ * The caller has to make sure that the bitmap extends to the byte holding
+ * the last bit of the range, no byte beyond it is accessed.
+ */
+
+/*
+ * Count the bits set in a word.  Without a popcount instruction the builtin
+ * is a library call, the bit-parallel count is faster.
+ */
+static __inline__ int ntfs_bitmap_weight(u64 w)
+{
+#if defined(__GNUC__) && defined(__POPCNT__)
+	return __builtin_popcountll(w);
+#else
+	w -= (w >> 1) & 0x5555555555555555ULL;
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((w * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/*
+ * Count the bits set in @words consecutive words, the bulk of a popcount.
+ */
+static s64 ntfs_bitmap_weight_words_generic(const u8 *p, s64 words)
+{
+	s64 n = 0;
+	u64 w;
+
+	for (; words > 0; words--, p += 8) {
+		memcpy(&w, p, 8);
+		n += ntfs_bitmap_weight(w);
+	}
+	return n;
+}
+
+#ifdef NTFS_BITMAP_X86
+
+/*
+ * The popcnt instruction and AVX2 are not in the base x86-64 instruction
+ * set, the variants using them are compiled for them and selected according
+ * to the features of the processor when the library is loaded.
+ */
+
+__attribute__((target("popcnt")))
+static s64 ntfs_bitmap_weight_words_popcnt(const u8 *p, s64 words)
+{
+	s64 n = 0;
+	u64 w;
+
+	for (; words > 0; words--, p += 8) {
+		memcpy(&w, p, 8);
+		n += __builtin_popcountll(w);
+	}
+	return n;
+}
+
+/*
+ * Count 32 bytes at a time, looking the count of each nibble up in a table
+ * with a byte shuffle.  The byte counts are summed into 64-bit lanes before
+ * they can overflow, after at most 255 / 8 rounds.
+ */
+__attribute__((target("avx2,popcnt")))
+static s64 ntfs_bitmap_weight_words_avx2(const u8 *p, s64 words)
+{
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+			1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3,
+			1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i sum = _mm256_setzero_si256();
+	__m256i bytes, v;
+	s64 n;
+	int i;
+
+	while (words >= 4) {
+		bytes = _mm256_setzero_si256();
+		for (i = 0; i < 31 && words >= 4; i++, words -= 4, p += 32) {
+			v = _mm256_loadu_si256((const __m256i*)p);
+			bytes = _mm256_add_epi8(bytes,
+				_mm256_shuffle_epi8(table,
+					_mm256_and_si256(v, nibble)));
+			bytes = _mm256_add_epi8(bytes,
+				_mm256_shuffle_epi8(table,
+					_mm256_and_si256(
+					_mm256_srli_epi16(v, 4), nibble)));
+		}
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(bytes,
+				_mm256_setzero_si256()));
+	}
+	n = _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1)
+		+ _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+	return n + ntfs_bitmap_weight_words_popcnt(p, words);
+}
+
+static s64 (*ntfs_bitmap_weight_words)(const u8 *p, s64 words) =
+		ntfs_bitmap_weight_words_generic;
+
+__attribute__((constructor))
+static void ntfs_bitmap_select_kernels(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+		ntfs_bitmap_weight_words = ntfs_bitmap_weight_words_avx2;
+	else if (__builtin_cpu_supports("popcnt"))
+		ntfs_bitmap_weight_words = ntfs_bitmap_weight_words_popcnt;
+}
+
+#else /* NTFS_BITMAP_X86 */
+
+#define ntfs_bitmap_weight_words ntfs_bitmap_weight_words_generic
+
+#endif /* NTFS_BITMAP_X86 */
+
+/*
+ * Get the index of the lowest bit set in a non-zero word.
+ */
+static __inline__ int ntfs_bitmap_lowest(u64 w)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(w);
+#else
+	int n = 0;
+
+	while (!(w & 0xff)) {
+		w >>= 8;
+		n += 8;
+	}
+	while (!(w & 1)) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+/*
+ * Load the bits from byte @pos of the bitmap, which has @size bytes.  The
+ * bytes beyond the bitmap read as zero.
+ */
+static __inline__ u64 ntfs_bitmap_load(const u8 *bm, s64 pos, s64 size)
+{
+	u64 w = 0;
+
+	if (size - pos >= 8)
+		memcpy(&w, bm + pos, 8);
+	else
+		memcpy(&w, bm + pos, size - pos);
+	return le64_to_cpu(w);
+}
+
+/**
+ * ntfs_bitmap_set_bits - set or clear a range of bits in memory
+ */
+static void ntfs_bitmap_set_bits(u8 *bm, s64 start, s64 count, int value)
+{
+	s64 first, last;
+	u8 mask;
+
+	if (count <= 0)
+		return;
+	first = start >> 3;
+	last = (start + count - 1) >> 3;
+	mask = 0xff << (start & 7);
+	if (first == last) {
+		mask &= 0xff >> (7 - ((start + count - 1) & 7));
+		if (value)
+			bm[first] |= mask;
+		else
+			bm[first] &= ~mask;
+		return;
+	}
+	if (value)
+		bm[first] |= mask;
+	else
+		bm[first] &= ~mask;
+	memset(bm + first + 1, value ? 0xff : 0, last - first - 1);
+	mask = 0xff >> (7 - ((start + count - 1) & 7));
+	if (value)
+		bm[last] |= mask;
+	else
+		bm[last] &= ~mask;
+}
+
+/**
+ * ntfs_bitmap_set_range - set a range of bits in memory
+ * @bm:		bitmap
+ * @start:	first bit to set
+ * @count:	number of bits to set
+ */
+void ntfs_bitmap_set_range(u8 *bm, s64 start, s64 count)
+{
+	ntfs_bitmap_set_bits(bm, start, count, 1);
+}
+
+/**
+ * ntfs_bitmap_clear_range - clear a range of bits in memory
+ * @bm:		bitmap
+ * @start:	first bit to clear
+ * @count:	number of bits to clear
+ */
+void ntfs_bitmap_clear_range(u8 *bm, s64 start, s64 count)
+{
+	ntfs_bitmap_set_bits(bm, start, count, 0);
+}
+
+/**
+ * ntfs_bitmap_popcount - count the bits set in a range of a bitmap in memory
+ * @bm:		bitmap
+ * @start:	first bit to count
+ * @count:	number of bits to count
+ *
+ * Return the number of bits set among the @count bits from @start.
+ */
+s64 ntfs_bitmap_popcount(const u8 *bm, s64 start, s64 count)
+{
+	s64 pos, size, end, n, words;
+	u64 w;
+
+	if (count <= 0)
+		return 0;
+	end = start + count;
+	size = (end + 7) >> 3;
+	pos = start >> 3;
+	/* The first word, from the byte holding @start. */
+	w = ntfs_bitmap_load(bm, pos, size) & (~0ULL << (start & 7));
+	if (end - (pos << 3) < 64)
+		w &= (1ULL << (end - (pos << 3))) - 1;
+	n = ntfs_bitmap_weight(w);
+	pos += 8;
+	if (pos + 8 <= end >> 3) {
+		words = ((end >> 3) - pos) >> 3;
+		n += ntfs_bitmap_weight_words(bm + pos, words);
+		pos += words << 3;
+	}
+	/* The last bits, less than a word. */
+	if (pos < size) {
+		w = ntfs_bitmap_load(bm, pos, size);
+		w &= (1ULL << (end - (pos << 3))) - 1;
+		n += ntfs_bitmap_weight(w);
+	}
+	return n;
+}
+
+#ifdef ENABLE_THREADS
+
+/* Bits counted by each thread at least, and most threads counting. */
+#define NTFS_BITMAP_THREAD_BITS	(1LL << 25)
+#define NTFS_BITMAP_MAX_THREADS	8
+
+/**
+ * struct ntfs_bitmap_count - part of a bitmap counted by a thread
+ */
+struct ntfs_bitmap_count {
+	const u8 *bm;
+	s64 start;
+	s64 count;
+	s64 set;		/* Result. */
+	pthread_t thread;
+};
+
+static void *ntfs_bitmap_count_thread(void *arg)
+{
+	struct ntfs_bitmap_count *bc = arg;
+
+	bc->set = ntfs_bitmap_popcount(bc->bm, bc->start, bc->count);
+	return NULL;
+}
+
+#endif /* ENABLE_THREADS */
+
+/**
+ * ntfs_bitmap_popcount_parallel - count the bits set in a large bitmap
+ * @bm:		bitmap
+ * @start:	first bit to count
+ * @count:	number of bits to count
+ *
+ * Same as ntfs_bitmap_popcount(), the range being shared among threads, one
+ * per processor, when it is large enough for the threads to be worth
+ * starting.  The part of a thread which cannot be started is counted by the
+ * calling thread.
+ *
+ * Return the number of bits set among the @count bits from @start.
+ */
+s64 ntfs_bitmap_popcount_parallel(const u8 *bm, s64 start, s64 count)
+{
+#ifdef ENABLE_THREADS
+	struct ntfs_bitmap_count bc[NTFS_BITMAP_MAX_THREADS];
+	BOOL started[NTFS_BITMAP_MAX_THREADS];
+	s64 part, n;
+	int nr, i;
+
+	nr = ntfs_nr_cpus();
+	if (nr > NTFS_BITMAP_MAX_THREADS)
+		nr = NTFS_BITMAP_MAX_THREADS;
+	if (nr > count / NTFS_BITMAP_THREAD_BITS)
+		nr = count / NTFS_BITMAP_THREAD_BITS;
+	if (nr <= 1)
+		return ntfs_bitmap_popcount(bm, start, count);
+	/* Parts of whole words, the last one taking the remainder. */
+	part = (count / nr) & ~63LL;
+	for (i = 0; i < nr; i++) {
+		bc[i].bm = bm;
+		bc[i].start = start + i * part;
+		bc[i].count = i < nr - 1 ? part : count - i * part;
+		started[i] = i && !pthread_create(&bc[i].thread, NULL,
+				ntfs_bitmap_count_thread, &bc[i]);
+	}
+	n = 0;
+	for (i = 0; i < nr; i++) {
+		if (started[i])
+			pthread_join(bc[i].thread, NULL);
+		else
+			ntfs_bitmap_count_thread(&bc[i]);
+		n += bc[i].set;
+	}
+	return n;
+#else
+	return ntfs_bitmap_popcount(bm, start, count);
+#endif
+}
+
+/**
+ * ntfs_bitmap_find - find the first bit of a value in a bitmap in memory
+ */
+static s64 ntfs_bitmap_find(const u8 *bm, s64 start, s64 end, int value)
+{
+	u64 w, invert;
+	s64 pos, size;
+
+	if (start >= end)
+		return -1;
+	invert = value ? 0 : ~0ULL;
+	size = (end + 7) >> 3;
+	pos = start >> 3;
+	w = (ntfs_bitmap_load(bm, pos, size) ^ invert)
+			& (~0ULL << (start & 7));
+	while (!w) {
+		pos += 8;
+		if (pos >= size)
+			return -1;
+		w = ntfs_bitmap_load(bm, pos, size) ^ invert;
+	}
+	pos = (pos << 3) + ntfs_bitmap_lowest(w);
+	return pos < end ? pos : -1;
+}
+
+/**
+ * ntfs_bitmap_find_first_zero - find the first clear bit in a bitmap in memory
+ * @bm:		bitmap
+ * @start:	first bit to examine
+ * @end:	bit following the last one to examine
+ *
+ * Return the index of the first clear bit at or after @start and before
+ * @end, or -1 if all of them are set.
+ */
+s64 ntfs_bitmap_find_first_zero(const u8 *bm, s64 start, s64 end)
+{
+	return ntfs_bitmap_find(bm, start, end, 0);
+}
+
+/**
+ * ntfs_bitmap_find_first_set - find the first set bit in a bitmap in memory
+ * @bm:		bitmap
+ * @start:	first bit to examine
+ * @end:	bit following the last one to examine
+ *
+ * Return the index of the first set bit at or after @start and before @end,
+ * or -1 if all of them are clear.
+ */
+s64 ntfs_bitmap_find_first_set(const u8 *bm, s64 start, s64 end)
+{
+	return ntfs_bitmap_find(bm, start, end, 1);
+}
+
+/**
+ * ntfs_bitmap_find_zero_run - find a run of clear bits in a bitmap in memory
+ * @bm:		bitmap
+ * @start:	first bit to examine
+ * @end:	bit following the last one to examine
+ * @len:	number of consecutive clear bits wanted
+ *
+ * Return the index of the first bit of the first run of at least @len clear
+ * bits at or after @start and ending before @end, or -1 if there is none.
+ */
+s64 ntfs_bitmap_find_zero_run(const u8 *bm, s64 start, s64 end, s64 len)
+{
+	s64 zero, set;
+
+	if (len <= 0)
+		return start < end ? start : -1;
+	while (1) {
+		zero = ntfs_bitmap_find_first_zero(bm, start, end);
+		if (zero < 0 || end - zero < len)
+			return -1;
+		set = ntfs_bitmap_find_first_set(bm, zero, zero + len);
+		if (set < 0)
+			return zero;
+		start = set + 1;
+	}
+}
+
+/**
+ * ntfs_bitmap_longest_zero_run - find the longest run of clear bits in memory
+ * @bm:		bitmap
+ * @start:	first bit to examine
+ * @end:	bit following the last one to examine
+ * @len:	where to return the length of the run, or NULL
+ *
+ * Return the index of the first bit of the first longest run of clear bits
+ * at or after @start and before @end, or -1 if all the bits are set.
+ */
+s64 ntfs_bitmap_longest_zero_run(const u8 *bm, s64 start, s64 end, s64 *len)
+{
+	s64 zero, set, best = -1, best_len = 0;
+
+	while ((zero = ntfs_bitmap_find_first_zero(bm, start, end)) >= 0) {
+		set = ntfs_bitmap_find_first_set(bm, zero, end);
+		if (set < 0)
+			set = end;
+		if (set - zero > best_len) {
+			best = zero;
+			best_len = set - zero;
+		}
+		start = set;
+	}
+	if (len)
+		*len = best_len;
+	return best;
+}
+
+/*
+ *		Resident cluster bitmap
+ *
+ * When a volume is mounted for writing, the whole of $Bitmap is read into
+ * memory and kept there until unmounting.  ntfs_attr_pread() and
+ * ntfs_attr_pwrite() on vol->lcnbmp_na are served from memory, as are the
+ * runs set and cleared by the allocator, so that $Bitmap is never read
+ * again.  The changed parts are tracked in chunks of NTFS_LCNBMP_CHUNK
+ * bytes and the consecutive changed chunks are written in a single go by
+ * ntfs_lcn_bitmap_flush().
+ *
+ * Large copies are allocated by mmap() by the C library, their pages are
+ * only backed by memory once touched.
+ */
+
+#define NTFS_LCNBMP_CHUNK	4096
+
+/**
+ * struct ntfs_lcn_bitmap -
+ */
+struct ntfs_lcn_bitmap {
+	u8 *bm;			/* The data of $Bitmap. */
+	s64 size;		/* Bytes in bm, the data size of $Bitmap. */
+	u8 *dirty;		/* One bit per changed chunk. */
+	s64 chunks;		/* Number of chunks. */
+	BOOL flushing;		/* Writing to $Bitmap itself. */
+} ;
+
+/*
+ * Note the bytes from @pos to @pos + @count, excluded, have changed.
+ */
+static void ntfs_lcn_bitmap_dirty(struct ntfs_lcn_bitmap *lb, s64 pos,
+		s64 count)
+{
+	s64 first, last;
+
+	first = pos / NTFS_LCNBMP_CHUNK;
+	last = (pos + count - 1) / NTFS_LCNBMP_CHUNK;
+	ntfs_bitmap_set_range(lb->dirty, first, last - first + 1);
+}
+
+/**
+ * ntfs_lcn_bitmap_load - read the whole of $Bitmap into memory
+ * @vol:	volume mounted for writing
+ *
+ * Return 0 on success or -1 with errno set on error, $Bitmap is then
+ * accessed on the device.
+ */
+int ntfs_lcn_bitmap_load(ntfs_volume *vol)
+{
+	struct ntfs_lcn_bitmap *lb;
+	s64 br;
+	int eo;
+
+	if (!vol->lcnbmp_na || vol->lcnbmp_cache) {
+		errno = EINVAL;
+		return -1;
+	}
+	lb = ntfs_calloc(sizeof(struct ntfs_lcn_bitmap));
+	if (!lb)
+		return -1;
+	lb->size = vol->lcnbmp_na->data_size;
+	lb->chunks = (lb->size + NTFS_LCNBMP_CHUNK - 1) / NTFS_LCNBMP_CHUNK;
+	lb->bm = ntfs_malloc(lb->size ? lb->size : 1);
+	lb->dirty = ntfs_calloc((lb->chunks + 7) >> 3 ? (lb->chunks + 7) >> 3
+			: 1);
+	if (!lb->bm || !lb->dirty)
+		goto err_out;
+	br = ntfs_attr_pread(vol->lcnbmp_na, 0, lb->size, lb->bm);
+	if (br != lb->size) {
+		if (br >= 0)
+			errno = EIO;
+		goto err_out;
+	}
+	vol->lcnbmp_cache = lb;
+	ntfs_log_debug("Loaded %lld bytes of $Bitmap\n", (long long)lb->size);
+	return 0;
+err_out:
+	eo = errno;
+	free(lb->bm);
+	free(lb->dirty);
+	free(lb);
+	errno = eo;
+	return -1;
+}
+
+/**
+ * ntfs_lcn_bitmap_flush - write the changes of the resident $Bitmap
+ * @vol:	volume
+ *
+ * Write the changed parts of $Bitmap, consecutive changed chunks being
+ * written together.  Nothing is done if $Bitmap is not resident.
+ *
+ * Return 0 on success or -1 with errno set on error, the parts not written
+ * being still considered as changed.
+ */
+int ntfs_lcn_bitmap_flush(ntfs_volume *vol)
+{
+	struct ntfs_lcn_bitmap *lb = vol->lcnbmp_cache;
+	s64 first, last, pos, count, written;
+	int ret = 0;
+
+	if (!lb)
+		return 0;
+	lb->flushing = TRUE;
+	for (first = ntfs_bitmap_find_first_set(lb->dirty, 0, lb->chunks);
+			first >= 0;
+			first = ntfs_bitmap_find_first_set(lb->dirty, last,
+				lb->chunks)) {
+		last = ntfs_bitmap_find_first_zero(lb->dirty, first,
+				lb->chunks);
+		if (last < 0)
+			last = lb->chunks;
+		pos = first * NTFS_LCNBMP_CHUNK;
+		count = last * NTFS_LCNBMP_CHUNK;
+		if (count > lb->size)
+			count = lb->size;
+		count -= pos;
+		written = ntfs_attr_pwrite(vol->lcnbmp_na, pos, count,
+				lb->bm + pos);
+		if (written != count) {
+			if (written >= 0)
+				errno = EIO;
+			ntfs_log_perror("Failed to write $Bitmap (%lld, %lld)",
+					(long long)pos, (long long)count);
+			ret = -1;
+			continue;
+		}
+		ntfs_bitmap_clear_range(lb->dirty, first, last - first);
+	}
+	lb->flushing = FALSE;
+	return ret;
+}
+
+/**
+ * ntfs_lcn_bitmap_release - flush and free the resident $Bitmap
+ * @vol:	volume
+ *
+ * $Bitmap is accessed on the device afterwards, even if the changes could
+ * not be written.
+ *
+ * Return 0 on success or -1 with errno set if the changes could not all be
+ * written.
+ */
+int ntfs_lcn_bitmap_release(ntfs_volume *vol)
+{
+	struct ntfs_lcn_bitmap *lb = vol->lcnbmp_cache;
+	int ret;
+
+	if (!lb)
+		return 0;
+	ret = ntfs_lcn_bitmap_flush(vol);
+	vol->lcnbmp_cache = NULL;
+	free(lb->bm);
+	free(lb->dirty);
+	free(lb);
+	return ret;
+}
+
+/**
+ * ntfs_lcn_bitmap_pread - read from the resident $Bitmap
+ * @vol:	volume
+ * @pos:	byte position in $Bitmap
+ * @count:	number of bytes to read
+ * @b:		output buffer
+ *
+ * Return the number of bytes read, or 0 if the read has to be made on the
+ * device, which is the case beyond the end of $Bitmap.
+ */
+s64 ntfs_lcn_bitmap_pread(ntfs_volume *vol, s64 pos, s64 count, void *b)
+{
+	struct ntfs_lcn_bitmap *lb = vol->lcnbmp_cache;
+
+	if (!lb || lb->flushing || pos >= lb->size)
+		return 0;
+	if (count > lb->size - pos)
+		count = lb->size - pos;
+	memcpy(b, lb->bm + pos, count);
+	return count;
+}
+
+/**
+ * ntfs_lcn_bitmap_free_bits - count the zero bits of the resident $Bitmap
+ * @vol:	volume
+ *
+ * Return the number of zero bits, or -1 if $Bitmap is not resident.
+ */
+s64 ntfs_lcn_bitmap_free_bits(ntfs_volume *vol)
+{
+	struct ntfs_lcn_bitmap *lb = vol->lcnbmp_cache;
+
+	if (!lb)
+		return -1;
+	return (lb->size << 3) - ntfs_bitmap_popcount_parallel(lb->bm, 0,
+			lb->size << 3);
+}
+
+/**
+ * ntfs_lcn_bitmap_pwrite - write to the resident $Bitmap
+ * @vol:	volume
+ * @pos:	byte position in $Bitmap
+ * @count:	number of bytes to write
+ * @b:		data to write
+ *
+ * A write extending $Bitmap releases the resident copy, the write then has
+ * to be made on the device.
+ *
+ * Return the number of bytes written, or 0 if the write has to be made on
+ * the device.
+ */
+s64 ntfs_lcn_bitmap_pwrite(ntfs_volume *vol, s64 pos, s64 count,
+		const void *b)
+{
+	struct ntfs_lcn_bitmap *lb = vol->lcnbmp_cache;
+
+	if (!lb || lb->flushing || count <= 0)
+		return 0;
+	if (pos + count > lb->size) {
+		ntfs_lcn_bitmap_release(vol);
+		return 0;
+	}
+	memcpy(lb->bm + pos, b, count);
+	ntfs_lcn_bitmap_dirty(lb, pos, count);
+	ntfs_lcn_index_update(vol, pos, count, lb->bm + pos);
+	return count;
+}
+
+/*
+ * Set or clear a run of clusters in the resident $Bitmap.
+ *
+ * Return 0 if done, or -1 if the run is not within the resident copy.
+ */
+static int ntfs_lcn_bitmap_set_run(ntfs_volume *vol, s64 start_bit,
+		s64 count, int value)
+{
+	struct ntfs_lcn_bitmap *lb = vol->lcnbmp_cache;
+	s64 first, last;
+
+	if (!lb || lb->flushing || start_bit + count > lb->size << 3)
+		return -1;
+	if (!count)
+		return 0;
+	if (value)
+		ntfs_bitmap_set_range(lb->bm, start_bit, count);
+	else
+		ntfs_bitmap_clear_range(lb->bm, start_bit, count);
+	first = start_bit >> 3;
+	last = (start_bit + count - 1) >> 3;
+	ntfs_lcn_bitmap_dirty(lb, first, last - first + 1);
+	ntfs_lcn_index_update(vol, first, last - first + 1, lb->bm + first);
+	return 0;
+}
+
+/*
+ *		Resident mft bitmap
+ *
+ * $MFT/$BITMAP is kept in memory as $Bitmap is, so that allocating an mft
+ * record does not read it again.  A summary has one bit per 64-bit word
+ * of the copy, set when the word has a clear bit, so that finding a free
+ * record skips 4096 records in use at a time.  Unlike $Bitmap, the copy
+ * follows $MFT/$BITMAP growing as the mft is extended.  The changes are
+ * written back in chunks by ntfs_mft_bitmap_flush(), within the
+ * initialized size which the mft allocator maintains itself.
+ */
+
+#define NTFS_MFTBMP_CHUNK	4096
+
+/**
+ * struct ntfs_mft_bitmap -
+ */
+struct ntfs_mft_bitmap {
+	u8 *bm;			/* The data of $MFT/$BITMAP. */
+	s64 size;		/* Bytes in bm, the data size of $MFT/$BITMAP. */
+	s64 alloc;		/* Bytes allocated for bm, a multiple of 8. */
+	u8 *summary;		/* One bit per word of bm having a clear bit. */
+	u8 *dirty;		/* One bit per changed chunk. */
+	BOOL flushing;		/* Writing to $MFT/$BITMAP itself. */
+} ;
+
+/* Bytes of the summary and of the dirty chunk map of @alloc bytes of bm. */
+#define NTFS_MFTBMP_SUMMARY_SIZE(alloc)	((((alloc) / 8 + 63) >> 6) << 3)
+#define NTFS_MFTBMP_DIRTY_SIZE(alloc) \
+	(((((alloc) + NTFS_MFTBMP_CHUNK - 1) / NTFS_MFTBMP_CHUNK + 63) >> 6) << 3)
+
+/*
+ * Make room for @size bytes in the copy, zeroing what is added.
+ */
+static int ntfs_mft_bitmap_grow(struct ntfs_mft_bitmap *mb, s64 size)
+{
+	s64 alloc, old;
+	u8 *p;
+
+	if (size <= mb->alloc)
+		return 0;
+	alloc = mb->alloc * 2;
+	if (alloc < ((size + 7) & ~7LL))
+		alloc = (size + 7) & ~7LL;
+	p = realloc(mb->bm, alloc);
+	if (!p)
+		goto err;
+	mb->bm = p;
+	memset(mb->bm + mb->alloc, 0, alloc - mb->alloc);
+	old = mb->alloc ? NTFS_MFTBMP_SUMMARY_SIZE(mb->alloc) : 0;
+	p = realloc(mb->summary, NTFS_MFTBMP_SUMMARY_SIZE(alloc));
+	if (!p)
+		goto err;
+	mb->summary = p;
+	memset(mb->summary + old, 0, NTFS_MFTBMP_SUMMARY_SIZE(alloc) - old);
+	old = mb->alloc ? NTFS_MFTBMP_DIRTY_SIZE(mb->alloc) : 0;
+	p = realloc(mb->dirty, NTFS_MFTBMP_DIRTY_SIZE(alloc));
+	if (!p)
+		goto err;
+	mb->dirty = p;
+	memset(mb->dirty + old, 0, NTFS_MFTBMP_DIRTY_SIZE(alloc) - old);
+	mb->alloc = alloc;
+	return 0;
+err:
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * Note the bytes from @pos to @pos + @count, excluded, have changed and
+ * update their words in the summary.
+ */
+static void ntfs_mft_bitmap_changed(struct ntfs_mft_bitmap *mb, s64 pos,
+		s64 count, BOOL dirty)
+{
+	s64 first, last;
+	u64 w;
+
+	if (count <= 0)
+		return;
+	if (dirty) {
+		first = pos / NTFS_MFTBMP_CHUNK;
+		last = (pos + count - 1) / NTFS_MFTBMP_CHUNK;
+		ntfs_bitmap_set_range(mb->dirty, first, last - first + 1);
+	}
+	last = (pos + count - 1) >> 3;
+	for (first = pos >> 3; first <= last; first++) {
+		memcpy(&w, mb->bm + (first << 3), 8);
+		ntfs_bit_set(mb->summary, first, w != ~(u64)0);
+	}
+}
+
+/**
+ * ntfs_mft_bitmap_load - read the whole of $MFT/$BITMAP into memory
+ * @vol:	volume mounted for writing
+ *
+ * Return 0 on success or -1 with errno set on error, $MFT/$BITMAP is then
+ * accessed on the device.
+ */
+int ntfs_mft_bitmap_load(ntfs_volume *vol)
+{
+	struct ntfs_mft_bitmap *mb;
+	s64 br;
+	int eo;
+
+	if (!vol->mftbmp_na || vol->mftbmp_cache) {
+		errno = EINVAL;
+		return -1;
+	}
+	mb = ntfs_calloc(sizeof(struct ntfs_mft_bitmap));
+	if (!mb)
+		return -1;
+	mb->size = vol->mftbmp_na->data_size;
+	if (ntfs_mft_bitmap_grow(mb, mb->size ? mb->size : 8))
+		goto err_out;
+	br = ntfs_attr_pread(vol->mftbmp_na, 0, mb->size, mb->bm);
+	if (br != mb->size) {
+		if (br >= 0)
+			errno = EIO;
+		goto err_out;
+	}
+	ntfs_mft_bitmap_changed(mb, 0, mb->size, FALSE);
+	vol->mftbmp_cache = mb;
+	ntfs_log_debug("Loaded %lld bytes of $MFT/$BITMAP\n",
+			(long long)mb->size);
+	return 0;
+err_out:
+	eo = errno;
+	free(mb->bm);
+	free(mb->summary);
+	free(mb->dirty);
+	free(mb);
+	errno = eo;
+	return -1;
+}
+
+/**
+ * ntfs_mft_bitmap_flush - write the changes of the resident $MFT/$BITMAP
+ * @vol:	volume
+ *
+ * Write the changed parts of $MFT/$BITMAP, consecutive changed chunks
+ * being written together.  Nothing is done if $MFT/$BITMAP is not resident.
+ *
+ * Return 0 on success or -1 with errno set on error, the parts not written
+ * being still considered as changed.
+ */
+int ntfs_mft_bitmap_flush(ntfs_volume *vol)
+{
+	struct ntfs_mft_bitmap *mb = vol->mftbmp_cache;
+	s64 first, last, chunks, pos, count, end, written;
+	int ret = 0;
+
+	if (!mb)
+		return 0;
+	/* Beyond the initialized size, the bytes are zero on the device. */
+	end = vol->mftbmp_na->initialized_size;
+	if (end > mb->size)
+		end = mb->size;
+	chunks = (mb->size + NTFS_MFTBMP_CHUNK - 1) / NTFS_MFTBMP_CHUNK;
+	mb->flushing = TRUE;
+	for (first = ntfs_bitmap_find_first_set(mb->dirty, 0, chunks);
+			first >= 0;
+			first = ntfs_bitmap_find_first_set(mb->dirty, last,
+				chunks)) {
+		last = ntfs_bitmap_find_first_zero(mb->dirty, first, chunks);
+		if (last < 0)
+			last = chunks;
+		pos = first * NTFS_MFTBMP_CHUNK;
+		count = last * NTFS_MFTBMP_CHUNK;
+		if (count > end)
+			count = end;
+		count -= pos;
+		if (count > 0) {
+			written = ntfs_attr_pwrite(vol->mftbmp_na, pos, count,
+					mb->bm + pos);
+			if (written != count) {
+				if (written >= 0)
+					errno = EIO;
+				ntfs_log_perror("Failed to write $MFT/$BITMAP "
+						"(%lld, %lld)", (long long)pos,
+						(long long)count);
+				ret = -1;
+				continue;
+			}
+		}
+		ntfs_bitmap_clear_range(mb->dirty, first, last - first);
+	}
+	mb->flushing = FALSE;
+	return ret;
+}
+
+/**
+ * ntfs_mft_bitmap_release - flush and free the resident $MFT/$BITMAP
+ * @vol:	volume
+ *
+ * $MFT/$BITMAP is accessed on the device afterwards, even if the changes
+ * could not be written.
+ *
+ * Return 0 on success or -1 with errno set if the changes could not all be
+ * written.
+ */
+int ntfs_mft_bitmap_release(ntfs_volume *vol)
+{
+	struct ntfs_mft_bitmap *mb = vol->mftbmp_cache;
+	int ret;
+
+	if (!mb)
+		return 0;
+	ret = ntfs_mft_bitmap_flush(vol);
+	vol->mftbmp_cache = NULL;
+	free(mb->bm);
+	free(mb->summary);
+	free(mb->dirty);
+	free(mb);
+	return ret;
+}
+
+/**
+ * ntfs_mft_bitmap_pread - read from the resident $MFT/$BITMAP
+ * @vol:	volume
+ * @pos:	byte position in $MFT/$BITMAP
+ * @count:	number of bytes to read
+ * @b:		output buffer
+ *
+ * Return the number of bytes read, or 0 if the read has to be made on the
+ * device, which is the case beyond the end of $MFT/$BITMAP.
+ */
+s64 ntfs_mft_bitmap_pread(ntfs_volume *vol, s64 pos, s64 count, void *b)
+{
+	struct ntfs_mft_bitmap *mb = vol->mftbmp_cache;
+
+	if (!mb || mb->flushing || pos >= mb->size)
+		return 0;
+	if (count > mb->size - pos)
+		count = mb->size - pos;
+	memcpy(b, mb->bm + pos, count);
+	return count;
+}
+
+/**
+ * ntfs_mft_bitmap_pwrite - write to the resident $MFT/$BITMAP
+ * @vol:	volume
+ * @pos:	byte position in $MFT/$BITMAP
+ * @count:	number of bytes to write
+ * @b:		data to write
+ *
+ * The writes extending $MFT/$BITMAP are only kept in memory if the mft
+ * allocator has already raised its initialized size.  Otherwise, or if the
+ * copy cannot grow, the resident copy is released and the write has to be
+ * made on the device.
+ *
+ * Return the number of bytes written, or 0 if the write has to be made on
+ * the device.
+ */
+s64 ntfs_mft_bitmap_pwrite(ntfs_volume *vol, s64 pos, s64 count,
+		const void *b)
+{
+	struct ntfs_mft_bitmap *mb = vol->mftbmp_cache;
+
+	if (!mb || mb->flushing || count <= 0)
+		return 0;
+	if (pos + count > vol->mftbmp_na->initialized_size
+	    || ntfs_mft_bitmap_grow(mb, pos + count)) {
+		ntfs_mft_bitmap_release(vol);
+		return 0;
+	}
+	if (pos + count > mb->size)
+		mb->size = pos + count;
+	memcpy(mb->bm + pos, b, count);
+	ntfs_mft_bitmap_changed(mb, pos, count, TRUE);
+	return count;
+}
+
+/**
+ * ntfs_mft_bitmap_find_free - find a free record in the resident $MFT/$BITMAP
+ * @vol:	volume with a resident $MFT/$BITMAP
+ * @start:	first record to consider
+ * @end:	record following the last one to consider
+ *
+ * Return the number of the first record from @start to @end marked free,
+ * or -1 if there is none.
+ */
+s64 ntfs_mft_bitmap_find_free(ntfs_volume *vol, s64 start, s64 end)
+{
+	struct ntfs_mft_bitmap *mb = vol->mftbmp_cache;
+	s64 word, stop, bit;
+
+	if (end > mb->size << 3)
+		end = mb->size << 3;
+	while (start < end) {
+		word = ntfs_bitmap_find_first_set(mb->summary, start >> 6,
+				(end + 63) >> 6);
+		if (word < 0)
+			break;
+		if (start < word << 6)
+			start = word << 6;
+		stop = (word + 1) << 6;
+		if (stop > end)
+			stop = end;
+		bit = ntfs_bitmap_find_first_zero(mb->bm, start, stop);
+		if (bit >= 0)
+			return bit;
+		start = stop;
+	}
+	return -1;
+}
+
+/*
+ * Set or clear a run of records in the resident $MFT/$BITMAP.
+ *
+ * Return 0 if done, or -1 if the run is not within the initialized part of
+ * the resident copy.
+ */
+static int ntfs_mft_bitmap_set_run(ntfs_volume *vol, s64 start_bit,
+		s64 count, int value)
+{
+	struct ntfs_mft_bitmap *mb = vol->mftbmp_cache;
+	s64 first, last;
+
+	if (!mb || mb->flushing || start_bit + count > mb->size << 3
+	    || start_bit + count > vol->mftbmp_na->initialized_size << 3)
+		return -1;
+	if (!count)
+		return 0;
+	if (value)
+		ntfs_bitmap_set_range(mb->bm, start_bit, count);
+	else
+		ntfs_bitmap_clear_range(mb->bm, start_bit, count);
+	first = start_bit >> 3;
+	last = (start_bit + count - 1) >> 3;
+	ntfs_mft_bitmap_changed(mb, first, last - first + 1, TRUE);
+	return 0;
+}
+
 /**
  * ntfs_bitmap_set_bits_in_run - set a run of bits in a bitmap to a value
  * @na:		attribute containing the bitmap
@@ -126,6 +1161,15 @@ static int ntfs_bitmap_set_bits_in_run(ntfs_attr *na, s64 start_bit,
 		return -1;
 	}
 
+	/* Clusters are set and cleared in the resident copy of $Bitmap. */
+	if (na == na->ni->vol->lcnbmp_na
+	    && !ntfs_lcn_bitmap_set_run(na->ni->vol, start_bit, count, value))
+		return 0;
+	/* And mft records in the resident copy of $MFT/$BITMAP. */
+	if (na == na->ni->vol->mftbmp_na
+	    && !ntfs_mft_bitmap_set_run(na->ni->vol, start_bit, count, value))
+		return 0;
+
 	bit = start_bit & 7;
 	if (bit)
 		firstbyte = 1;
@@ -154,12 +1198,9 @@ static int ntfs_bitmap_set_bits_in_run(ntfs_attr *na, s64 start_bit,
 			goto free_err_out;
 		}
 		/* and set or clear the appropriate bits in it. */
-		while ((bit & 7) && count--) {
-			if (value)
-				*buf |= 1 << bit++;
-			else
-				*buf &= ~(1 << bit++);
-		}
+		tmp = count < 8 - bit ? count : 8 - bit;
+		ntfs_bitmap_set_bits(buf, bit, tmp, value);
+		count -= tmp;
 		/* Update @start_bit to the new position. */
 		start_bit = (start_bit + 7) & ~7;
 	}
@@ -196,12 +1237,8 @@ static int ntfs_bitmap_set_bits_in_run(ntfs_attr *na, s64 start_bit,
 					goto free_err_out;
 				}
 				/* and set/clear the appropriate bits in it. */
-				while (bit && count--) {
-					if (value)
-						*lastbyte_buf |= 1 << --bit;
-					else
-						*lastbyte_buf &= ~(1 << --bit);
-				}
+				ntfs_bitmap_set_bits(lastbyte_buf, 0, bit, value);
+				count -= bit;
 				/* We don't want to come back here... */
 				bit = 0;
 				/* We have a last byte that we have handled. */
@@ -297,4 +1334,3 @@ int ntfs_bitmap_clear_run(ntfs_attr *na, s64 start_bit, s64 count)
 	ntfs_log_leave("\n");
 	return ret;
 }
-
@@ -32,6 +32,7 @@
 
 #include "types.h"
 #include "security.h"
+#include "inode.h"
 #include "cache.h"
 #include "misc.h"
 #include "logging.h"
@@ -551,6 +552,315 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 	return (cache);
 }
 
+#if CACHE_NIDATA_SIZE
+
+/*
+ *		Cache of closed inodes
+ *
+ *	Closing an inode keeps it in this cache, and opening it again
+ *	takes it back without reading its mft record.  As directory
+ *	walks open thousands of inodes, the cache is sized from a memory
+ *	budget, and the inodes are located through an open addressed
+ *	hash table of entry indexes instead of chains.
+ *
+ *	Eviction uses the CLOCK algorithm : a hand sweeps the entries,
+ *	giving a second chance to the referenced ones, so that a hit
+ *	costs no list relinking.  An entry stays in place while its
+ *	inode is open, with no inode attached, so that an inode opened
+ *	again and again is referenced when it comes back.
+ *
+ *	Inodes are synced when they are closed, a dirty one found in the
+ *	cache is left in place until it is closed at unmount.
+ */
+
+static s64 nidata_budget;
+
+/*
+ *		Set the memory used by the inode caches of volumes
+ *	mounted afterwards, 0 meaning the default CACHE_NIDATA_BUDGET
+ *
+ *	The cache holds CACHE_NIDATA_SIZE inodes at least.
+ */
+
+void ntfs_set_nidata_budget(s64 bytes)
+{
+	nidata_budget = (bytes > 0 ? bytes : 0);
+}
+
+static int nidata_home(const struct NIDATA_CACHE *cache, u64 inum)
+{
+	return ((inum * 0x9e3779b97f4a7c15ULL) >> 32) & cache->hash_mask;
+}
+
+/*
+ *		Get the hash slot of an inode, or the empty slot where
+ *	it would be inserted
+ */
+
+static int nidata_slot(const struct NIDATA_CACHE *cache, u64 inum)
+{
+	int h;
+
+	h = nidata_home(cache, inum);
+	while ((cache->hash[h] >= 0)
+	    && (cache->entry[cache->hash[h]].inum != inum))
+		h = (h + 1) & cache->hash_mask;
+	return (h);
+}
+
+/*
+ *		Remove an entry from the hash table and mark it unused
+ *
+ *	The entries following in the probe sequence are shifted back,
+ *	so that no deleted marker is needed.
+ */
+
+static void nidata_unhash(struct NIDATA_CACHE *cache, int h)
+{
+	int i;
+	int j;
+	int k;
+
+	cache->entry[cache->hash[h]].used = FALSE;
+	cache->entry[cache->hash[h]].ni = (ntfs_inode*)NULL;
+	i = h;
+	j = h;
+	while (1) {
+		j = (j + 1) & cache->hash_mask;
+		if (cache->hash[j] < 0)
+			break;
+		k = nidata_home(cache, cache->entry[cache->hash[j]].inum);
+			/* move back unless the home slot is in (i, j] */
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		cache->hash[i] = cache->hash[j];
+		i = j;
+	}
+	cache->hash[i] = -1;
+}
+
+static void nidata_release(struct NIDATA_CACHE *cache, int e)
+{
+	cache->entry[e].next_free = cache->free_entry;
+	cache->free_entry = e;
+}
+
+/*
+ *		Get an unused entry, evicting one if there is none
+ *
+ *	The returned entry is neither hashed nor in the free list.
+ *	Returns -1 if all the entries are dirty or in use.
+ */
+
+static int nidata_evict(struct NIDATA_CACHE *cache)
+{
+	struct NIDATA_ENTRY *current;
+	ntfs_inode *ni;
+	int tries;
+	int e;
+
+	if (cache->free_entry >= 0) {
+		e = cache->free_entry;
+		cache->free_entry = cache->entry[e].next_free;
+		return (e);
+	}
+		/* two rounds, the first one clearing the references */
+	for (tries = 0; tries < 2*cache->max_entries; tries++) {
+		e = cache->hand;
+		cache->hand = (e + 1) % cache->max_entries;
+		current = &cache->entry[e];
+		if (!current->used)
+			continue;
+		if (current->referenced) {
+			current->referenced = FALSE;
+			continue;
+		}
+		ni = current->ni;
+		if (ni && (NInoDirty(ni) || NInoAttrListDirty(ni)))
+			continue;
+			/*
+			 * Unhash before closing, closing may open and
+			 * close other inodes through the cache.
+			 */
+		nidata_unhash(cache, nidata_slot(cache, current->inum));
+		if (ni) {
+			cache->evictions++;
+			if (ntfs_inode_real_close(ni))
+				ntfs_log_perror("Failed to close inode %lld"
+					" evicted from cache",
+					(long long)ni->mft_no);
+		}
+		return (e);
+	}
+	return (-1);
+}
+
+/*
+ *		Fetch a closed inode from cache
+ *
+ *	Returns the inode, which is not cached any more, or NULL if
+ *	not available
+ */
+
+ntfs_inode *ntfs_fetch_nidata(struct NIDATA_CACHE *cache, u64 inum)
+{
+	struct NIDATA_ENTRY *current;
+	ntfs_inode *ni;
+	int h;
+
+	ni = (ntfs_inode*)NULL;
+	if (cache) {
+		cache->reads++;
+		h = nidata_slot(cache, inum);
+		if (cache->hash[h] >= 0) {
+			current = &cache->entry[cache->hash[h]];
+			ni = current->ni;
+			if (ni) {
+				cache->hits++;
+				current->ni = (ntfs_inode*)NULL;
+				current->referenced = TRUE;
+			}
+		}
+	}
+	return (ni);
+}
+
+/*
+ *		Enter a closed inode into cache
+ *
+ *	The inode is really closed if it cannot be cached, or if it
+ *	is cached already.
+ */
+
+void ntfs_enter_nidata(struct NIDATA_CACHE *cache, ntfs_inode *ni)
+{
+	struct NIDATA_ENTRY *current;
+	int h;
+	int e;
+
+	h = nidata_slot(cache, ni->mft_no);
+	if (cache->hash[h] >= 0) {
+		current = &cache->entry[cache->hash[h]];
+		if (!current->ni) {
+				/* back from being open */
+			current->ni = ni;
+			return;
+		}
+		if (current->ni == ni)
+			return;
+	} else {
+		e = nidata_evict(cache);
+		if (e >= 0) {
+				/* evicting may have moved the slot */
+			h = nidata_slot(cache, ni->mft_no);
+			if (cache->hash[h] < 0) {
+				current = &cache->entry[e];
+				current->inum = ni->mft_no;
+				current->ni = ni;
+				current->used = TRUE;
+				current->referenced = FALSE;
+				cache->hash[h] = e;
+				return;
+			}
+			nidata_release(cache, e);
+		}
+	}
+	ntfs_inode_real_close(ni);
+}
+
+/*
+ *		Drop an inode from cache, closing it if it was cached
+ *
+ *	Returns 1 if the inode was known to the cache, 0 otherwise
+ */
+
+int ntfs_invalidate_nidata(struct NIDATA_CACHE *cache, u64 inum)
+{
+	ntfs_inode *ni;
+	int h;
+	int e;
+
+	if (!cache)
+		return (0);
+	h = nidata_slot(cache, inum);
+	e = cache->hash[h];
+	if (e < 0)
+		return (0);
+	ni = cache->entry[e].ni;
+	nidata_unhash(cache, h);
+	nidata_release(cache, e);
+	if (ni)
+		ntfs_inode_real_close(ni);
+	return (1);
+}
+
+/*
+ *		Create the inode cache, sized from the memory budget
+ *
+ *	Returns the cache, or NULL if it could not be created
+ */
+
+static struct NIDATA_CACHE *ntfs_create_nidata(ntfs_volume *vol)
+{
+	struct NIDATA_CACHE *cache;
+	s64 budget;
+	s64 count;
+	int hash_size;
+	int i;
+
+	budget = (nidata_budget ? nidata_budget : CACHE_NIDATA_BUDGET);
+	count = budget / (sizeof(struct NIDATA_ENTRY) + 2*sizeof(int)
+			+ sizeof(ntfs_inode) + vol->mft_record_size);
+	if (count < CACHE_NIDATA_SIZE)
+		count = CACHE_NIDATA_SIZE;
+	if (count > (1 << 24))
+		count = 1 << 24;
+	for (hash_size=16; hash_size<2*count; hash_size<<=1) { }
+	cache = (struct NIDATA_CACHE*)ntfs_malloc(sizeof(struct NIDATA_CACHE)
+			+ count*sizeof(struct NIDATA_ENTRY)
+			+ hash_size*sizeof(int));
+	if (cache) {
+		cache->max_entries = count;
+		cache->hand = 0;
+		cache->free_entry = -1;
+		for (i=count-1; i>=0; i--) {
+			cache->entry[i].used = FALSE;
+			cache->entry[i].ni = (ntfs_inode*)NULL;
+			nidata_release(cache, i);
+		}
+		cache->hash = (int*)&cache->entry[count];
+		cache->hash_mask = hash_size - 1;
+		for (i=0; i<hash_size; i++)
+			cache->hash[i] = -1;
+		cache->reads = 0;
+		cache->hits = 0;
+		cache->evictions = 0;
+		ntfs_log_debug("Caching %d inodes\n", (int)count);
+	}
+	return (cache);
+}
+
+/*
+ *		Close the cached inodes and free the inode cache
+ */
+
+static void ntfs_free_nidata(struct NIDATA_CACHE *cache)
+{
+	int i;
+
+	if (cache) {
+		for (i=0; i<cache->max_entries; i++)
+			if (cache->entry[i].used && cache->entry[i].ni)
+				ntfs_inode_real_close(cache->entry[i].ni);
+		ntfs_log_debug("Inode cache : %lu reads, %lu hits, %lu"
+				" evictions\n", cache->reads, cache->hits,
+				cache->evictions);
+		free(cache);
+	}
+}
+
+#endif /* CACHE_NIDATA_SIZE */
+
 /*
  *		Create all LRU caches
  *
@@ -568,10 +878,7 @@ void ntfs_create_lru_caches(ntfs_volume *vol)
 #endif
 #if CACHE_NIDATA_SIZE
 		 /* idata cache */
-	vol->nidata_cache = ntfs_create_cache("nidata",
-		ntfs_inode_nidata_free, ntfs_inode_nidata_hash,
-		sizeof(struct CACHED_NIDATA),
-		CACHE_NIDATA_SIZE, 2*CACHE_NIDATA_SIZE);
+	vol->nidata_cache = ntfs_create_nidata(vol);
 #endif
 #if CACHE_LOOKUP_SIZE
 		 /* lookup cache */
@@ -598,7 +905,12 @@ void ntfs_free_lru_caches(ntfs_volume *vol)
 	ntfs_free_cache(vol->xinode_cache);
 #endif
 #if CACHE_NIDATA_SIZE
-	ntfs_free_cache(vol->nidata_cache);
+	struct NIDATA_CACHE *nidata_cache;
+
+		/* inodes closed from now on are not cached */
+	nidata_cache = vol->nidata_cache;
+	vol->nidata_cache = (struct NIDATA_CACHE*)NULL;
+	ntfs_free_nidata(nidata_cache);
 #endif
 #if CACHE_LOOKUP_SIZE
 	ntfs_free_cache(vol->lookup_cache);
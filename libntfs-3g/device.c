@@ -59,6 +59,12 @@
 #ifdef HAVE_SYS_MOUNT_H
 #include <sys/mount.h>
 #endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_GETTIMEOFDAY
+#include <sys/time.h>
+#endif
 #ifdef HAVE_SYS_DISK_H
 #include <sys/disk.h>
 #endif
@@ -78,6 +84,7 @@
 #include "device.h"
 #include "logging.h"
 #include "misc.h"
+#include "ntfstime.h"
 
 #if defined(linux) && defined(_IO) && !defined(BLKGETSIZE)
 #define BLKGETSIZE	_IO(0x12,96)  /* Get device size in 512-byte blocks. */
@@ -95,6 +102,815 @@
 #	define BLKBSZSET _IOW(0x12,113,size_t) /* Set device block size in bytes. */
 #endif
 
+/*
+ *		Block cache
+ *
+ *	A device may be given a cache of fixed size blocks (usually the
+ *	cluster size) by ntfs_device_cache_enable().  ntfs_pread() and
+ *	ntfs_pwrite(), and hence everything built upon them, then go through
+ *	the cache.  Blocks are kept in a hash table and on a list ordered by
+ *	last use, the least recently used block is recycled when the memory
+ *	allowed for the cache is exhausted.  Consecutive missing blocks are
+ *	read with a single vectored read, and dirty blocks are written back
+ *	in device order, coalesced into vectored writes.
+ *
+ *	The unpositioned read and write device operations bypass the cache,
+ *	a caller writing through them must call ntfs_device_cache_invalidate()
+ *	for the range written.
+ */
+
+struct ntfs_cache_block {
+	struct ntfs_cache_block *hnext;	/* Next block in hash chain. */
+	struct ntfs_cache_block *newer;	/* Neighbours on the LRU list. */
+	struct ntfs_cache_block *older;
+	s64 blk;			/* Block number on the device. */
+	u32 valid;			/* Bytes present, lower at end of device. */
+	BOOL dirty;			/* Not yet written to the device. */
+	char *data;
+};
+
+struct ntfs_dev_cache {
+	u32 bsize;			/* Block size, a power of two. */
+	int bits;			/* log2(bsize) */
+	ntfs_cache_policy policy;
+	s64 bypass;			/* Larger transfers bypass the cache. */
+	s64 max_blocks;			/* Memory cap in blocks. */
+	s64 nr_blocks;			/* Blocks allocated. */
+	s64 nr_dirty;			/* Blocks waiting for write back. */
+	u32 hash_mask;
+	struct ntfs_cache_block **hash;
+	struct ntfs_cache_block *newest;	/* Head of LRU list. */
+	struct ntfs_cache_block *oldest;	/* Next eviction candidate. */
+	struct ntfs_device_cache_stats stats;
+};
+
+/**
+ * ntfs_dev_rw - positioned transfer straight to or from the device
+ */
+static s64 ntfs_dev_rw(struct ntfs_device *dev, s64 pos, s64 count, void *b,
+		BOOL wr)
+{
+	struct ntfs_device_operations *dops;
+	s64 br, total;
+
+	dops = dev->d_ops;
+	for (total = 0; count; count -= br, total += br) {
+		if (wr)
+			br = dops->pwrite(dev, (char*)b + total, count,
+					pos + total);
+		else
+			br = dops->pread(dev, (char*)b + total, count,
+					pos + total);
+		/* If everything ok, continue. */
+		if (br > 0)
+			continue;
+		/* If EOF or error return number of bytes transferred. */
+		if (!br || total)
+			break;
+		/* Nothing transferred and error, return error status. */
+		return br;
+	}
+	return total;
+}
+
+/**
+ * ntfs_rwv_fallback - transfer an iovec list one buffer at a time
+ */
+static s64 ntfs_rwv_fallback(struct ntfs_device *dev, s64 pos,
+		const struct iovec *iov, int iovcnt, s64 skip, BOOL wr,
+		s64 (*rw)(struct ntfs_device*, s64, s64, void*, BOOL))
+{
+	s64 br, total, len;
+	char *buf;
+	int i;
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (skip >= (s64)iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		buf = (char*)iov[i].iov_base + skip;
+		len = iov[i].iov_len - skip;
+		br = rw(dev, pos + total, len, buf, wr);
+		skip = 0;
+		if (br < 0)
+			return total ? total : br;
+		total += br;
+		if (br != len)
+			break;
+	}
+	return total;
+}
+
+/**
+ * ntfs_dev_rwv - positioned vectored transfer straight to or from the device
+ */
+static s64 ntfs_dev_rwv(struct ntfs_device *dev, s64 pos,
+		const struct iovec *iov, int iovcnt, s64 count, BOOL wr)
+{
+	s64 (*op)(struct ntfs_device *, const struct iovec *, int, s64);
+	s64 br;
+
+	op = wr ? dev->d_ops->pwritev : dev->d_ops->preadv;
+	if (!op)
+		return ntfs_rwv_fallback(dev, pos, iov, iovcnt, 0, wr,
+				ntfs_dev_rw);
+	br = op(dev, iov, iovcnt, pos);
+	if (br > 0 && br < count) {
+		/* Partial transfer, complete it one buffer at a time. */
+		s64 more;
+
+		more = ntfs_rwv_fallback(dev, pos + br, iov, iovcnt, br, wr,
+				ntfs_dev_rw);
+		if (more > 0)
+			br += more;
+	}
+	return br;
+}
+
+static struct ntfs_cache_block *ntfs_cache_lookup(struct ntfs_dev_cache *cache,
+		s64 blk)
+{
+	struct ntfs_cache_block *cb;
+
+	for (cb = cache->hash[blk & cache->hash_mask]; cb; cb = cb->hnext)
+		if (cb->blk == blk)
+			break;
+	return cb;
+}
+
+static void ntfs_cache_lru_unlink(struct ntfs_dev_cache *cache,
+		struct ntfs_cache_block *cb)
+{
+	if (cb->newer)
+		cb->newer->older = cb->older;
+	else
+		cache->newest = cb->older;
+	if (cb->older)
+		cb->older->newer = cb->newer;
+	else
+		cache->oldest = cb->newer;
+}
+
+static void ntfs_cache_lru_add(struct ntfs_dev_cache *cache,
+		struct ntfs_cache_block *cb)
+{
+	cb->newer = NULL;
+	cb->older = cache->newest;
+	if (cache->newest)
+		cache->newest->newer = cb;
+	else
+		cache->oldest = cb;
+	cache->newest = cb;
+}
+
+static void ntfs_cache_touch(struct ntfs_dev_cache *cache,
+		struct ntfs_cache_block *cb)
+{
+	if (cache->newest != cb) {
+		ntfs_cache_lru_unlink(cache, cb);
+		ntfs_cache_lru_add(cache, cb);
+	}
+}
+
+static void ntfs_cache_insert(struct ntfs_dev_cache *cache,
+		struct ntfs_cache_block *cb)
+{
+	struct ntfs_cache_block **slot;
+
+	slot = &cache->hash[cb->blk & cache->hash_mask];
+	cb->hnext = *slot;
+	*slot = cb;
+	ntfs_cache_lru_add(cache, cb);
+	if (cb->dirty)
+		cache->nr_dirty++;
+}
+
+static void ntfs_cache_remove(struct ntfs_dev_cache *cache,
+		struct ntfs_cache_block *cb)
+{
+	struct ntfs_cache_block **pp;
+
+	for (pp = &cache->hash[cb->blk & cache->hash_mask]; *pp != cb;
+			pp = &(*pp)->hnext)
+		;
+	*pp = cb->hnext;
+	ntfs_cache_lru_unlink(cache, cb);
+	if (cb->dirty) {
+		cb->dirty = FALSE;
+		cache->nr_dirty--;
+	}
+}
+
+static void ntfs_cache_release(struct ntfs_dev_cache *cache,
+		struct ntfs_cache_block *cb)
+{
+	free(cb);
+	cache->nr_blocks--;
+}
+
+static int ntfs_cache_blk_cmp(const void *p1, const void *p2)
+{
+	const struct ntfs_cache_block *cb1, *cb2;
+
+	cb1 = *(const struct ntfs_cache_block* const*)p1;
+	cb2 = *(const struct ntfs_cache_block* const*)p2;
+	return cb1->blk < cb2->blk ? -1 : cb1->blk > cb2->blk;
+}
+
+/**
+ * ntfs_cache_flush - write all dirty blocks back to the device
+ *
+ * Blocks which could not be written remain dirty.
+ *
+ * Return 0 on success or -1 with errno set if some block could not be
+ * written.
+ */
+static int ntfs_cache_flush(struct ntfs_device *dev,
+		struct ntfs_dev_cache *cache)
+{
+	struct ntfs_cache_block **list, *cb;
+	struct ntfs_vio vio;
+	s64 n, i, first, br;
+	int err, ret;
+
+	if (!cache->nr_dirty)
+		return 0;
+	list = ntfs_malloc(cache->nr_dirty * sizeof(*list));
+	if (!list)
+		return -1;
+	n = 0;
+	for (cb = cache->newest; cb; cb = cb->older)
+		if (cb->dirty)
+			list[n++] = cb;
+	qsort(list, n, sizeof(*list), ntfs_cache_blk_cmp);
+
+	NDevSetDirty(dev);
+	ntfs_vio_init(&vio);
+	err = 0;
+	for (first = 0, i = 0; i <= n; i++) {
+		if (i < n && ntfs_vio_add(&vio, list[i]->blk << cache->bits,
+				list[i]->data, list[i]->valid))
+			continue;
+		do {
+			br = ntfs_dev_rwv(dev, vio.pos, vio.iov, vio.nr,
+					vio.count, TRUE);
+		} while (br == -1 && errno == EINTR);
+		if (br == vio.count) {
+			for (; first < i; first++) {
+				list[first]->dirty = FALSE;
+				cache->nr_dirty--;
+				cache->stats.writebacks++;
+			}
+		} else if (!err)
+			err = br < 0 ? errno : EIO;
+		first = i;
+		ntfs_vio_init(&vio);
+		if (i < n)
+			ntfs_vio_add(&vio, list[i]->blk << cache->bits,
+					list[i]->data, list[i]->valid);
+	}
+	free(list);
+	ret = 0;
+	if (err) {
+		ntfs_log_perror("Failed to write back cached blocks");
+		errno = err;
+		ret = -1;
+	}
+	return ret;
+}
+
+/**
+ * ntfs_cache_get_block - get a block buffer not yet in the cache
+ *
+ * Allocate a new block while the cache is below its memory cap, otherwise
+ * recycle the least recently used one, writing back the dirty blocks first
+ * if it is dirty.  The block must be either inserted into the cache or given
+ * back with ntfs_cache_release().
+ */
+static struct ntfs_cache_block *ntfs_cache_get_block(struct ntfs_device *dev,
+		struct ntfs_dev_cache *cache)
+{
+	struct ntfs_cache_block *cb;
+
+	cb = cache->oldest;
+	if (cache->nr_blocks < cache->max_blocks || !cb) {
+		cb = ntfs_malloc(sizeof(*cb) + cache->bsize);
+		if (cb) {
+			cb->data = (char*)(cb + 1);
+			cache->nr_blocks++;
+		}
+		return cb;
+	}
+	if (cb->dirty && ntfs_cache_flush(dev, cache))
+		return NULL;
+	ntfs_cache_remove(cache, cb);
+	cache->stats.evictions++;
+	return cb;
+}
+
+/**
+ * ntfs_cache_fill - read a run of missing blocks into the cache
+ *
+ * Read block @blk, and the following ones up to @last as long as they are
+ * not in the cache either, with a single vectored read.
+ *
+ * Return the number of blocks inserted into the cache, 0 if @blk is beyond
+ * the end of the device, or -1 with errno set on error.
+ */
+static int ntfs_cache_fill(struct ntfs_device *dev,
+		struct ntfs_dev_cache *cache, s64 blk, s64 last)
+{
+	struct ntfs_cache_block *run[NTFS_VIO_MAX];
+	struct iovec iov[NTFS_VIO_MAX];
+	s64 br;
+	int i, n, nr;
+
+	for (n = 0; n < NTFS_VIO_MAX && blk + n <= last; n++) {
+		if (n && ntfs_cache_lookup(cache, blk + n))
+			break;
+		run[n] = ntfs_cache_get_block(dev, cache);
+		if (!run[n])
+			break;
+		run[n]->blk = blk + n;
+		run[n]->dirty = FALSE;
+		iov[n].iov_base = run[n]->data;
+		iov[n].iov_len = cache->bsize;
+	}
+	br = -1;
+	if (n) {
+		do {
+			br = ntfs_dev_rwv(dev, blk << cache->bits, iov, n,
+					(s64)n << cache->bits, FALSE);
+		} while (br == -1 && errno == EINTR);
+	}
+	nr = 0;
+	for (i = 0; i < n; i++) {
+		s64 valid = br - ((s64)i << cache->bits);
+
+		if (valid <= 0) {
+			ntfs_cache_release(cache, run[i]);
+			continue;
+		}
+		run[i]->valid = valid < cache->bsize ? valid : cache->bsize;
+		ntfs_cache_insert(cache, run[i]);
+		nr++;
+	}
+	if (br < 0)
+		return -1;
+	cache->stats.misses += nr;
+	return nr;
+}
+
+static void ntfs_cache_update_block(struct ntfs_dev_cache *cache,
+		struct ntfs_cache_block *cb, s64 pos, s64 count, const void *b)
+{
+	s64 start, end;
+	u32 ofs, len;
+
+	if (!b) {
+		ntfs_cache_remove(cache, cb);
+		ntfs_cache_release(cache, cb);
+		return;
+	}
+	start = cb->blk << cache->bits;
+	end = start + cache->bsize;
+	if (end > pos + count)
+		end = pos + count;
+	ofs = pos > start ? pos - start : 0;
+	len = end - start - ofs;
+	/* A write beyond the end of a file leaves a hole. */
+	if (ofs > cb->valid)
+		memset(cb->data + cb->valid, 0, ofs - cb->valid);
+	memcpy(cb->data + ofs, (const char*)b + (start + ofs - pos), len);
+	if (ofs + len > cb->valid)
+		cb->valid = ofs + len;
+}
+
+/**
+ * ntfs_cache_update - bring the cached copy of a range up to date
+ *
+ * Copy the data @b written at @pos into the cached blocks it overlaps, or
+ * drop these blocks if @b is NULL.
+ */
+static void ntfs_cache_update(struct ntfs_dev_cache *cache, s64 pos,
+		s64 count, const void *b)
+{
+	struct ntfs_cache_block *cb, *older;
+	s64 first, last, blk;
+
+	if (count <= 0)
+		return;
+	first = pos >> cache->bits;
+	last = (pos + count - 1) >> cache->bits;
+	if (last - first >= cache->nr_blocks) {
+		/* Fewer blocks in the cache than in the range. */
+		for (cb = cache->newest; cb; cb = older) {
+			older = cb->older;
+			if (cb->blk >= first && cb->blk <= last)
+				ntfs_cache_update_block(cache, cb, pos, count,
+						b);
+		}
+		return;
+	}
+	for (blk = first; blk <= last; blk++) {
+		cb = ntfs_cache_lookup(cache, blk);
+		if (cb)
+			ntfs_cache_update_block(cache, cb, pos, count, b);
+	}
+}
+
+/**
+ * ntfs_cache_pread - positioned read through the block cache
+ */
+static s64 ntfs_cache_pread(struct ntfs_device *dev, s64 pos, s64 count,
+		void *b)
+{
+	struct ntfs_dev_cache *cache = dev->d_cache;
+	struct ntfs_cache_block *cb;
+	s64 blk, last, filled, total, len;
+	u32 ofs;
+	int n;
+
+	if (count > cache->bypass) {
+		cache->stats.bypassed++;
+		if (ntfs_cache_flush(dev, cache))
+			return -1;
+		return ntfs_dev_rw(dev, pos, count, b, FALSE);
+	}
+	blk = pos >> cache->bits;
+	ofs = pos & (cache->bsize - 1);
+	last = (pos + count - 1) >> cache->bits;
+	filled = blk;
+	for (total = 0; count; count -= len, total += len) {
+		cb = ntfs_cache_lookup(cache, blk);
+		if (!cb) {
+			n = ntfs_cache_fill(dev, cache, blk, last);
+			if (n <= 0) {
+				if (n < 0 && !total)
+					return -1;
+				break;
+			}
+			filled = blk + n;
+			cb = ntfs_cache_lookup(cache, blk);
+		} else {
+			if (blk >= filled)
+				cache->stats.hits++;
+			ntfs_cache_touch(cache, cb);
+		}
+		if (ofs >= cb->valid)
+			break;
+		len = cb->valid - ofs;
+		if (len > count)
+			len = count;
+		memcpy((char*)b + total, cb->data + ofs, len);
+		blk++;
+		ofs = 0;
+	}
+	return total;
+}
+
+/**
+ * ntfs_cache_pwrite - positioned write through the block cache
+ */
+static s64 ntfs_cache_pwrite(struct ntfs_device *dev, s64 pos, s64 count,
+		const void *b)
+{
+	struct ntfs_dev_cache *cache = dev->d_cache;
+	struct ntfs_cache_block *cb;
+	s64 blk, total, len, written;
+	u32 ofs;
+
+	if (cache->policy == NTFS_CACHE_WRITE_THROUGH
+	    || count > cache->bypass) {
+		if (count > cache->bypass)
+			cache->stats.bypassed++;
+		written = ntfs_dev_rw(dev, pos, count, (void*)b, TRUE);
+		if (written > 0)
+			ntfs_cache_update(cache, pos, written, b);
+		/* What a failed write left on the device is unknown. */
+		if (written < count)
+			ntfs_cache_update(cache, pos + (written > 0 ? written
+					: 0), count - (written > 0 ? written
+					: 0), NULL);
+		return written;
+	}
+
+	for (total = 0; count; count -= len, total += len) {
+		blk = (pos + total) >> cache->bits;
+		ofs = (pos + total) & (cache->bsize - 1);
+		len = cache->bsize - ofs;
+		if (len > count)
+			len = count;
+		cb = ntfs_cache_lookup(cache, blk);
+		if (!cb && len != cache->bsize) {
+			/* Partial block, read the rest of it first. */
+			if (ntfs_cache_fill(dev, cache, blk, blk) < 0)
+				break;
+			cb = ntfs_cache_lookup(cache, blk);
+		}
+		if (!cb) {
+			cb = ntfs_cache_get_block(dev, cache);
+			if (!cb)
+				break;
+			cb->blk = blk;
+			cb->valid = 0;
+			cb->dirty = FALSE;
+			ntfs_cache_insert(cache, cb);
+		} else
+			ntfs_cache_touch(cache, cb);
+		/* A write beyond the end of a file leaves a hole. */
+		if (ofs > cb->valid)
+			memset(cb->data + cb->valid, 0, ofs - cb->valid);
+		memcpy(cb->data + ofs, (const char*)b + total, len);
+		if (ofs + len > cb->valid)
+			cb->valid = ofs + len;
+		if (!cb->dirty) {
+			cb->dirty = TRUE;
+			cache->nr_dirty++;
+		}
+	}
+	return total ? total : -1;
+}
+
+/**
+ * ntfs_cache_rw - positioned transfer through the block cache
+ */
+static s64 ntfs_cache_rw(struct ntfs_device *dev, s64 pos, s64 count,
+		void *b, BOOL wr)
+{
+	if (wr)
+		return ntfs_cache_pwrite(dev, pos, count, b);
+	return ntfs_cache_pread(dev, pos, count, b);
+}
+
+static void ntfs_cache_free(struct ntfs_dev_cache *cache)
+{
+	struct ntfs_cache_block *cb, *older;
+
+	for (cb = cache->newest; cb; cb = older) {
+		older = cb->older;
+		free(cb);
+	}
+	free(cache->hash);
+	free(cache);
+}
+
+/**
+ * ntfs_device_cache_enable - give a device a block cache
+ * @dev:	device to cache
+ * @block_size:	size of the cached blocks, a power of two (usually the
+ *		cluster size)
+ * @max_bytes:	memory the cached blocks may use, zero for the default
+ * @policy:	write-through or write-back, see ntfs_cache_policy
+ *
+ * Make ntfs_pread() and ntfs_pwrite() on @dev go through an LRU cache of
+ * @block_size blocks, so that data read again and again (such as the $MFT,
+ * $Bitmap and index blocks read by checking tools) is only read once from
+ * the device.  Transfers larger than a quarter of the cache, and at most 64
+ * blocks, bypass it.
+ *
+ * Return 0 on success or -1 with errno set:
+ *	EINVAL		@block_size is not a power of two of at least 512.
+ *	EBUSY		@dev already has a cache.
+ *	ENOMEM		Not enough memory.
+ */
+int ntfs_device_cache_enable(struct ntfs_device *dev, u32 block_size,
+		s64 max_bytes, ntfs_cache_policy policy)
+{
+	struct ntfs_dev_cache *cache;
+	u32 hash_size;
+
+	if (!dev || block_size < NTFS_BLOCK_SIZE
+	    || (block_size & (block_size - 1)) || max_bytes < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (dev->d_cache) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (!max_bytes)
+		max_bytes = NTFS_DEVICE_CACHE_DEFAULT_SIZE;
+	cache = ntfs_calloc(sizeof(*cache));
+	if (!cache)
+		return -1;
+	cache->bsize = block_size;
+	cache->bits = ffs(block_size) - 1;
+	cache->policy = policy;
+	cache->max_blocks = max_bytes >> cache->bits;
+	if (!cache->max_blocks)
+		cache->max_blocks = 1;
+	cache->bypass = (s64)NTFS_VIO_MAX << cache->bits;
+	if (cache->bypass > max_bytes / 4)
+		cache->bypass = max_bytes / 4;
+	if (cache->bypass < block_size)
+		cache->bypass = block_size;
+	for (hash_size = 16; hash_size < cache->max_blocks
+			&& hash_size < (1U << 24); hash_size <<= 1)
+		;
+	cache->hash_mask = hash_size - 1;
+	cache->hash = ntfs_calloc(hash_size * sizeof(*cache->hash));
+	if (!cache->hash) {
+		free(cache);
+		return -1;
+	}
+	dev->d_cache = cache;
+	ntfs_log_debug("Caching %s in %u byte blocks, up to %lld of them\n",
+			dev->d_name, (unsigned)block_size,
+			(long long)cache->max_blocks);
+	return 0;
+}
+
+/**
+ * ntfs_device_cache_flush - write the dirty cached blocks to the device
+ * @dev:	device whose cache is to be flushed
+ *
+ * Return 0 on success (or if @dev has no cache) or -1 with errno set if
+ * some blocks could not be written.
+ */
+int ntfs_device_cache_flush(struct ntfs_device *dev)
+{
+	if (!dev->d_cache)
+		return 0;
+	return ntfs_cache_flush(dev, dev->d_cache);
+}
+
+/**
+ * ntfs_device_cache_disable - flush and remove the block cache of a device
+ * @dev:	device whose cache is to be removed
+ *
+ * The cache is removed even if writing back its dirty blocks fails.
+ *
+ * Return 0 on success (or if @dev has no cache) or -1 with errno set if
+ * some dirty blocks could not be written.
+ */
+int ntfs_device_cache_disable(struct ntfs_device *dev)
+{
+	int ret;
+
+	if (!dev->d_cache)
+		return 0;
+	ret = ntfs_cache_flush(dev, dev->d_cache);
+	ntfs_log_debug("Block cache of %s: %lld hits, %lld misses\n",
+			dev->d_name, (long long)dev->d_cache->stats.hits,
+			(long long)dev->d_cache->stats.misses);
+	ntfs_cache_free(dev->d_cache);
+	dev->d_cache = NULL;
+	return ret;
+}
+
+/**
+ * ntfs_device_cache_invalidate - drop the cached blocks of a range
+ * @dev:	device whose cache is to be updated
+ * @pos:	position of the range on the device
+ * @count:	length of the range in bytes
+ *
+ * Drop the cached blocks overlapping the range, dirty or not.  This must be
+ * called after writing to the device without ntfs_pwrite().
+ */
+void ntfs_device_cache_invalidate(struct ntfs_device *dev, s64 pos, s64 count)
+{
+	if (dev->d_cache && pos >= 0)
+		ntfs_cache_update(dev->d_cache, pos, count, NULL);
+}
+
+/**
+ * ntfs_device_cache_stats_get - get the counters of a device block cache
+ * @dev:	device whose cache counters are wanted
+ * @stats:	where to return the counters
+ *
+ * Return 0 on success or -1 with errno set to ENODATA if @dev has no cache.
+ */
+int ntfs_device_cache_stats_get(struct ntfs_device *dev,
+		struct ntfs_device_cache_stats *stats)
+{
+	if (!dev->d_cache) {
+		errno = ENODATA;
+		return -1;
+	}
+	*stats = dev->d_cache->stats;
+	return 0;
+}
+
+/*
+ *		I/O statistics
+ *
+ *	Counters may be attached to a device to find out how much I/O it
+ *	does, and how long it takes.  They are updated by ntfs_pread(),
+ *	ntfs_pwrite(), their vectored variants and ntfs_device_submit(),
+ *	hence by everything built upon them, including ntfs_mst_pread() and
+ *	ntfs_mst_pwrite() which also count the records they transfer.  The
+ *	counters reflect the requests made to the device layer, transfers
+ *	served by the block cache are counted too.
+ */
+
+/* Counters attached to new devices, see ntfs_device_io_stats_default(). */
+static struct ntfs_device_io_stats *ntfs_io_stats_default;
+
+/**
+ * ntfs_io_stats_bucket - histogram bucket of a value, its rounded down log2
+ */
+static int ntfs_io_stats_bucket(s64 value)
+{
+	int n;
+
+	for (n = 0; value > 1 && n < NTFS_IO_HIST_BUCKETS - 1; n++)
+		value >>= 1;
+	return n;
+}
+
+/**
+ * ntfs_io_stats_account - record a transfer into the counters of a device
+ * @dev:	device the transfer was made on
+ * @wr:		TRUE for a write, FALSE for a read
+ * @pos:	device position of the transfer
+ * @count:	number of bytes requested
+ * @br:		number of bytes transferred, or -1 on error
+ * @start:	time the transfer started, from ntfs_monotonic_time()
+ */
+static void ntfs_io_stats_account(struct ntfs_device *dev, BOOL wr, s64 pos,
+		s64 count, s64 br, s64 start)
+{
+	struct ntfs_device_io_stats *stats = dev->d_stats;
+	struct ntfs_io_dir_stats *ds;
+	s64 usecs;
+
+	ds = wr ? &stats->writes : &stats->reads;
+	usecs = ntfs_monotonic_time() - start;
+	ds->ops++;
+	ds->usecs += usecs;
+	ds->size_hist[ntfs_io_stats_bucket(count)]++;
+	ds->lat_hist[ntfs_io_stats_bucket(usecs)]++;
+	if (pos == stats->next_pos)
+		ds->sequential++;
+	if (br < 0) {
+		ds->errors++;
+		br = 0;
+	}
+	ds->bytes += br;
+	stats->next_pos = pos + br;
+}
+
+/**
+ * ntfs_device_io_stats_attach - count the I/O made on a device
+ * @dev:	device to watch
+ * @stats:	counters to update, or NULL to stop counting
+ *
+ * From now on, add the transfers made on @dev to @stats.  The counters are
+ * not reset, so that several devices can share them.  The caller must keep
+ * @stats valid until it is detached or @dev is freed.
+ */
+void ntfs_device_io_stats_attach(struct ntfs_device *dev,
+		struct ntfs_device_io_stats *stats)
+{
+	dev->d_stats = stats;
+}
+
+/**
+ * ntfs_device_io_stats_default - count the I/O made on all new devices
+ * @stats:	counters to update, or NULL to stop counting
+ *
+ * Attach @stats to every device allocated from now on by ntfs_device_alloc(),
+ * including those ntfs_mount() allocates.  This lets a program account for
+ * all the I/O it makes, mounting included, without knowing its devices.
+ */
+void ntfs_device_io_stats_default(struct ntfs_device_io_stats *stats)
+{
+	ntfs_io_stats_default = stats;
+}
+
+/* Operations ntfs_mount() uses, see ntfs_device_default_ops_set(). */
+static struct ntfs_device_operations *ntfs_default_dops;
+
+/**
+ * ntfs_device_default_ops_set - select the device operations to mount with
+ * @dops:	device operations, or NULL for the default io operations
+ *
+ * Make ntfs_mount(), and the programs asking ntfs_device_default_ops_get()
+ * for the operations of the devices they allocate, use @dops instead of
+ * ntfs_device_default_io_ops.  This lets a program run on top of another
+ * backend, such as the simulated slow device of sim_io.c, without changing
+ * how it opens its devices.
+ */
+void ntfs_device_default_ops_set(struct ntfs_device_operations *dops)
+{
+	ntfs_default_dops = dops;
+}
+
+/**
+ * ntfs_device_default_ops_get - get the device operations to mount with
+ *
+ * Return the operations selected by ntfs_device_default_ops_set(), or
+ * ntfs_device_default_io_ops if none were.
+ */
+struct ntfs_device_operations *ntfs_device_default_ops_get(void)
+{
+	return ntfs_default_dops ? ntfs_default_dops
+			: &ntfs_device_default_io_ops;
+}
+
 /**
  * ntfs_device_alloc - allocate an ntfs device structure and pre-initialize it
  * @name:	name of the device (must be present)
@@ -134,6 +950,8 @@ struct ntfs_device *ntfs_device_alloc(const char *name, const long state,
 		dev->d_private = priv_data;
 		dev->d_heads = -1;
 		dev->d_sectors_per_track = -1;
+		dev->d_cache = NULL;
+		dev->d_stats = ntfs_io_stats_default;
 	}
 	return dev;
 }
@@ -159,6 +977,8 @@ int ntfs_device_free(struct ntfs_device *dev)
 		errno = EBUSY;
 		return -1;
 	}
+	if (dev->d_cache)
+		ntfs_cache_free(dev->d_cache);
 	free(dev->d_name);
 	free(dev);
 	return 0;
@@ -175,6 +995,8 @@ int ntfs_device_sync(struct ntfs_device *dev)
 	int ret;
 	struct ntfs_device_operations *dops;
 
+	if (dev->d_cache && ntfs_cache_flush(dev, dev->d_cache))
+		return -1;
 	if (NDevDirty(dev)) {
 		dops = dev->d_ops;
 		ret = dops->sync(dev);
@@ -204,8 +1026,7 @@ int ntfs_device_sync(struct ntfs_device *dev)
  */
 s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 {
-	s64 br, total;
-	struct ntfs_device_operations *dops;
+	s64 br, start = 0;
 
 	ntfs_log_trace("pos %lld, count %lld\n",(long long)pos,(long long)count);
 	
@@ -216,21 +1037,15 @@ s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 	if (!count)
 		return 0;
 	
-	dops = dev->d_ops;
-
-	for (total = 0; count; count -= br, total += br) {
-		br = dops->pread(dev, (char*)b + total, count, pos + total);
-		/* If everything ok, continue. */
-		if (br > 0)
-			continue;
-		/* If EOF or error return number of bytes read. */
-		if (!br || total)
-			return total;
-		/* Nothing read and error, return error status. */
-		return br;
-	}
-	/* Finally, return the number of bytes read. */
-	return total;
+	if (dev->d_stats)
+		start = ntfs_monotonic_time();
+	if (dev->d_cache)
+		br = ntfs_cache_pread(dev, pos, count, b);
+	else
+		br = ntfs_dev_rw(dev, pos, count, b, FALSE);
+	if (dev->d_stats)
+		ntfs_io_stats_account(dev, FALSE, pos, count, br, start);
+	return br;
 }
 
 /**
@@ -255,8 +1070,7 @@ s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		const void *b)
 {
-	s64 written, total, ret = -1;
-	struct ntfs_device_operations *dops;
+	s64 total, ret = -1, start = 0;
 
 	ntfs_log_trace("pos %lld, count %lld\n",(long long)pos,(long long)count);
 
@@ -271,32 +1085,347 @@ s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		goto out;
 	}
 	
-	dops = dev->d_ops;
-
 	NDevSetDirty(dev);
-	for (total = 0; count; count -= written, total += written) {
-		written = dops->pwrite(dev, (const char*)b + total, count,
-				       pos + total);
-		/* If everything ok, continue. */
-		if (written > 0)
-			continue;
-		/*
-		 * If nothing written or error return number of bytes written.
-		 */
-		if (!written || total)
-			break;
-		/* Nothing written and error, return error status. */
-		total = written;
-		break;
-	}
-	if (NDevSync(dev) && total && dops->sync(dev)) {
+	if (dev->d_stats)
+		start = ntfs_monotonic_time();
+	if (dev->d_cache)
+		total = ntfs_cache_pwrite(dev, pos, count, b);
+	else
+		total = ntfs_dev_rw(dev, pos, count, (void*)b, TRUE);
+	if (NDevSync(dev) && total > 0 && ntfs_device_sync(dev)) {
 		total--; /* on sync error, return partially written */
 	}
+	if (dev->d_stats)
+		ntfs_io_stats_account(dev, TRUE, pos, count, total, start);
 	ret = total;
 out:	
 	return ret;
 }
 
+/**
+ * ntfs_rwv - positioned vectored transfer
+ */
+static s64 ntfs_rwv(struct ntfs_device *dev, const s64 pos,
+		const struct iovec *iov, int iovcnt, BOOL wr)
+{
+	s64 br, count, start = 0;
+	int i;
+
+	if (!iov || iovcnt < 0 || pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (count = 0, i = 0; i < iovcnt; i++) {
+		if (!iov[i].iov_base && iov[i].iov_len) {
+			errno = EINVAL;
+			return -1;
+		}
+		count += iov[i].iov_len;
+	}
+	if (!count)
+		return 0;
+	if (wr) {
+		if (NDevReadOnly(dev)) {
+			errno = EROFS;
+			return -1;
+		}
+		NDevSetDirty(dev);
+	}
+	if (dev->d_stats)
+		start = ntfs_monotonic_time();
+	if (dev->d_cache)
+		br = ntfs_rwv_fallback(dev, pos, iov, iovcnt, 0, wr,
+				ntfs_cache_rw);
+	else
+		br = ntfs_dev_rwv(dev, pos, iov, iovcnt, count, wr);
+	if (wr && NDevSync(dev) && br > 0 && ntfs_device_sync(dev))
+		br--; /* on sync error, return partially written */
+	if (dev->d_stats)
+		ntfs_io_stats_account(dev, wr, pos, count, br, start);
+	return br;
+}
+
+/**
+ * ntfs_preadv - positioned gather read from disk
+ * @dev:	device to read from
+ * @pos:	position in device to read from
+ * @iov:	buffers to read into
+ * @iovcnt:	number of buffers in @iov
+ *
+ * Read the contiguous device extent starting at @pos into the buffers
+ * described by @iov, filling each buffer before moving on to the next one.
+ * Devices without a preadv operation are read one buffer at a time.
+ *
+ * Return values are the same as for ntfs_pread(), @count being the total
+ * length of the buffers.
+ */
+s64 ntfs_preadv(struct ntfs_device *dev, const s64 pos,
+		const struct iovec *iov, int iovcnt)
+{
+	ntfs_log_trace("pos %lld, iovcnt %d\n", (long long)pos, iovcnt);
+	return ntfs_rwv(dev, pos, iov, iovcnt, FALSE);
+}
+
+/**
+ * ntfs_pwritev - positioned scatter write to disk
+ * @dev:	device to write to
+ * @pos:	position in device to write to
+ * @iov:	buffers to write
+ * @iovcnt:	number of buffers in @iov
+ *
+ * Write the buffers described by @iov to the contiguous device extent
+ * starting at @pos.  Devices without a pwritev operation are written one
+ * buffer at a time.
+ *
+ * Return values are the same as for ntfs_pwrite(), @count being the total
+ * length of the buffers.
+ */
+s64 ntfs_pwritev(struct ntfs_device *dev, const s64 pos,
+		const struct iovec *iov, int iovcnt)
+{
+	ntfs_log_trace("pos %lld, iovcnt %d\n", (long long)pos, iovcnt);
+	return ntfs_rwv(dev, pos, iov, iovcnt, TRUE);
+}
+
+/**
+ * ntfs_vio_add - gather a buffer into a vectored transfer
+ * @vio:	vectored transfer being built
+ * @pos:	device position of the data
+ * @buf:	buffer to read into or write from
+ * @count:	number of bytes
+ *
+ * Append @buf to @vio if @pos is where the extent gathered so far ends on the
+ * device.  A buffer following the previous one in memory extends it instead
+ * of using a new iovec.
+ *
+ * Return TRUE if @buf was added and FALSE if @vio must be flushed first.
+ * Adding to an empty @vio always succeeds.
+ */
+BOOL ntfs_vio_add(struct ntfs_vio *vio, s64 pos, void *buf, s64 count)
+{
+	struct iovec *last;
+
+	if (!vio->nr) {
+		vio->pos = pos;
+		vio->count = count;
+		vio->iov[0].iov_base = buf;
+		vio->iov[0].iov_len = count;
+		vio->nr = 1;
+		return TRUE;
+	}
+	if (pos != vio->pos + vio->count)
+		return FALSE;
+	last = &vio->iov[vio->nr - 1];
+	if ((char*)last->iov_base + last->iov_len == (char*)buf)
+		last->iov_len += count;
+	else {
+		if (vio->nr == NTFS_VIO_MAX)
+			return FALSE;
+		last++;
+		last->iov_base = buf;
+		last->iov_len = count;
+		vio->nr++;
+	}
+	vio->count += count;
+	return TRUE;
+}
+
+/**
+ * ntfs_vio_flush - perform a gathered vectored transfer
+ * @dev:	device to transfer to or from
+ * @vio:	vectored transfer to perform
+ * @wr:		TRUE to write the buffers, FALSE to read into them
+ * @stop:	where to return the first byte not transferred
+ *
+ * Transfer everything gathered in @vio with a single ntfs_preadv() or
+ * ntfs_pwritev(), retrying if interrupted, and empty @vio.
+ *
+ * Return the number of bytes transferred, or -1 with errno set if nothing
+ * was.  If the transfer is incomplete, *@stop is set to the address within
+ * the buffers at which it stopped, so that a caller gathering consecutive
+ * parts of one linear buffer knows how much of it is valid.
+ */
+s64 ntfs_vio_flush(struct ntfs_device *dev, struct ntfs_vio *vio, BOOL wr,
+		void **stop)
+{
+	s64 br, done;
+	int i;
+
+	if (!vio->nr)
+		return 0;
+	do {
+		if (wr)
+			br = ntfs_pwritev(dev, vio->pos, vio->iov, vio->nr);
+		else
+			br = ntfs_preadv(dev, vio->pos, vio->iov, vio->nr);
+	} while (br == -1 && errno == EINTR);
+	if (br != vio->count) {
+		done = br > 0 ? br : 0;
+		for (i = 0; done >= (s64)vio->iov[i].iov_len; i++)
+			done -= vio->iov[i].iov_len;
+		*stop = (char*)vio->iov[i].iov_base + done;
+	}
+	ntfs_vio_init(vio);
+	return br;
+}
+
+/**
+ * ntfs_device_submit - perform a batch of positioned transfers
+ * @dev:	device to transfer to and from
+ * @reqs:	array of transfer requests
+ * @nr:		number of requests in @reqs
+ *
+ * Perform all the reads and writes described by @reqs.  Devices which can
+ * have several transfers in flight (see uring_io.c) receive the whole batch
+ * at once, for other devices the requests are performed one after the other
+ * through ntfs_pread() and ntfs_pwrite().  The order in which the transfers
+ * reach the device is not defined, so the caller must not put overlapping
+ * writes, or a read overlapping a write, into the same batch.
+ *
+ * The outcome of each transfer is returned in its @done and @error fields.
+ *
+ * Return 0 if no transfer failed, otherwise return -1 with errno set to the
+ * error of the first failed request.
+ */
+int ntfs_device_submit(struct ntfs_device *dev, struct ntfs_io_req *reqs,
+		int nr)
+{
+	struct ntfs_io_req *req;
+	s64 start = 0;
+	int i, ret;
+
+	if (!dev || nr < 0 || (nr && !reqs)) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < nr; i++) {
+		req = &reqs[i];
+		if (!req->buf || req->count < 0 || req->offset < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (req->write && NDevReadOnly(dev)) {
+			errno = EROFS;
+			return -1;
+		}
+		req->done = 0;
+		req->error = 0;
+	}
+	if (!nr)
+		return 0;
+
+	/* The block cache is only kept up to date by ntfs_pread/pwrite(). */
+	if (dev->d_ops->submit && !dev->d_cache) {
+		for (i = 0; i < nr; i++)
+			if (reqs[i].write) {
+				NDevSetDirty(dev);
+				break;
+			}
+		if (dev->d_stats)
+			start = ntfs_monotonic_time();
+		ret = dev->d_ops->submit(dev, reqs, nr);
+		if (!ret && i < nr && NDevSync(dev) && ntfs_device_sync(dev))
+			ret = -1;
+		/* Each transfer is accounted as taking the whole batch. */
+		if (dev->d_stats)
+			for (i = 0; i < nr; i++)
+				ntfs_io_stats_account(dev, reqs[i].write,
+					reqs[i].offset, reqs[i].count,
+					reqs[i].error ? -1 : reqs[i].done,
+					start);
+		return ret;
+	}
+
+	ret = 0;
+	for (i = 0; i < nr; i++) {
+		s64 br;
+
+		req = &reqs[i];
+		if (req->write)
+			br = ntfs_pwrite(dev, req->offset, req->count,
+					req->buf);
+		else
+			br = ntfs_pread(dev, req->offset, req->count,
+					req->buf);
+		if (br < 0) {
+			req->error = errno;
+			ret = -1;
+		} else
+			req->done = br;
+	}
+	/* Report the first failure, later transfers may have changed errno. */
+	if (ret) {
+		for (i = 0; !reqs[i].error; i++)
+			;
+		errno = reqs[i].error;
+	}
+	return ret;
+}
+
+/**
+ * ntfs_device_borrow - get a pointer to device data without copying it
+ * @dev:	device to read from
+ * @pos:	position in the device of the data
+ * @count:	number of bytes wanted
+ *
+ * Devices which hold their whole contents in memory (see mmap_io.c) can hand
+ * out a pointer to the @count bytes at @pos, saving the copy ntfs_pread()
+ * would make.  The data must not be modified, and the pointer is valid until
+ * the device is closed.
+ *
+ * Borrowing is refused while the block cache holds data not yet written to
+ * the device, as the device contents would then be stale.
+ *
+ * Return a pointer to the data on success.  Return NULL with errno set to
+ * EOPNOTSUPP if the data cannot be borrowed, in which case the caller should
+ * fall back to ntfs_pread(), or with errno set to EINVAL on invalid arguments.
+ */
+const void *ntfs_device_borrow(struct ntfs_device *dev, s64 pos, s64 count)
+{
+	if (!dev || pos < 0 || count < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!dev->d_ops->borrow || (dev->d_cache && dev->d_cache->nr_dirty)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	return dev->d_ops->borrow(dev, pos, count);
+}
+
+/**
+ * ntfs_device_shared_fd - get a file descriptor threads may read directly
+ * @dev:	open device
+ *
+ * Threads cannot go through the device operations, which are not reentrant,
+ * but when the device is a file or a block device opened by operations
+ * which read it at any alignment, they can pread(2) its file descriptor.
+ * The caller has to flush the block cache beforehand.
+ *
+ * Return the file descriptor, or -1 with errno set to EOPNOTSUPP if the
+ * device cannot be read this way.
+ */
+int ntfs_device_shared_fd(struct ntfs_device *dev)
+{
+	if (!dev || !dev->d_private || NDevDirect(dev))
+		goto unsupported;
+#ifndef NO_NTFS_DEVICE_DEFAULT_IO_OPS
+	if (dev->d_ops == &ntfs_device_default_io_ops
+#ifdef ENABLE_IO_URING
+	    || dev->d_ops == &ntfs_device_uring_io_ops
+#endif
+#ifdef ENABLE_MMAP_IO
+	    || dev->d_ops == &ntfs_device_mmap_io_ops
+#endif
+	    )
+		/* Their private data starts with the file descriptor. */
+		return *(int *)dev->d_private;
+#endif /* NO_NTFS_DEVICE_DEFAULT_IO_OPS */
+unsupported:
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
 /**
  * ntfs_mst_pread - multi sector transfer (mst) positioned read
  * @dev:	device to read from
@@ -329,7 +1458,7 @@ out:
 s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b)
 {
-	s64 br, i;
+	s64 br;
 
 	if (bksize & (bksize - 1) || bksize % NTFS_BLOCK_SIZE) {
 		errno = EINVAL;
@@ -346,9 +1475,9 @@ s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 	 * magic will be detected later on.
 	 */
 	count = br / bksize;
-	for (i = 0; i < count; ++i)
-		ntfs_mst_post_read_fixup((NTFS_RECORD*)
-				((u8*)b + i * bksize), bksize);
+	ntfs_mst_post_read_fixup_batch(b, bksize, count, TRUE);
+	if (dev->d_stats)
+		dev->d_stats->reads.mst_records += count;
 	/* Finally, return the number of complete blocks read. */
 	return count;
 }
@@ -394,27 +1523,19 @@ s64 ntfs_mst_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 	}
 	if (!count)
 		return 0;
-	/* Prepare data for writing. */
-	for (i = 0; i < count; ++i) {
-		int err;
-
-		err = ntfs_mst_pre_write_fixup((NTFS_RECORD*)
-				((u8*)b + i * bksize), bksize);
-		if (err < 0) {
-			/* Abort write at this position. */
-			if (!i)
-				return err;
-			count = i;
-			break;
-		}
-	}
+	/* Prepare data for writing, aborting at the first bad record. */
+	i = ntfs_mst_pre_write_fixup_batch(b, bksize, count);
+	if (!i)
+		return -1;
+	count = i;
 	/* Write the prepared data. */
 	written = ntfs_pwrite(dev, pos, count * bksize, b);
 	/* Quickly deprotect the data again. */
-	for (i = 0; i < count; ++i)
-		ntfs_mst_post_write_fixup((NTFS_RECORD*)((u8*)b + i * bksize));
+	ntfs_mst_post_write_fixup_batch(b, bksize, count);
 	if (written <= 0)
 		return written;
+	if (dev->d_stats)
+		dev->d_stats->writes.mst_records += written / bksize;
 	/* Finally, return the number of complete blocks written. */
 	return written / bksize;
 }
@@ -129,7 +129,8 @@ ntfs_index_context *ntfs_index_ctx_get(ntfs_inode *ni,
 	}
 	if (ni->nr_extents == -1)
 		ni = ni->base_ni;
-	icx = ntfs_calloc(sizeof(ntfs_index_context));
+	icx = ntfs_pool_calloc(ni->vol->index_ctx_pool,
+			sizeof(ntfs_index_context));
 	if (icx)
 		*icx = (ntfs_index_context) {
 			.ni = ni,
@@ -180,7 +181,7 @@ static void ntfs_index_ctx_free(ntfs_index_context *icx)
 void ntfs_index_ctx_put(ntfs_index_context *icx)
 {
 	ntfs_index_ctx_free(icx);
-	free(icx);
+	ntfs_pool_free(icx);
 }
 
 /**
@@ -2342,7 +2343,7 @@ INDEX_ENTRY *ntfs_index_walk_up(INDEX_ENTRY *ie,
 				ictx->is_in_root = TRUE;
 				/* a new search context is to be allocated */
 				if (ictx->actx)
-					free(ictx->actx);
+					ntfs_attr_put_search_ctx(ictx->actx);
 				ictx->ir = ntfs_ir_lookup(ictx->ni,
 					ictx->name, ictx->name_len,
 					&ictx->actx);
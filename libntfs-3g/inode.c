@@ -93,7 +93,8 @@ static ntfs_inode *__ntfs_inode_allocate(ntfs_volume *vol)
 {
 	ntfs_inode *ni;
 
-	ni = (ntfs_inode*)ntfs_calloc(sizeof(ntfs_inode));
+	ni = (ntfs_inode*)ntfs_pool_calloc(vol->inode_pool,
+			sizeof(ntfs_inode));
 	if (ni)
 		ni->vol = vol;
 	return ni;
@@ -130,10 +131,12 @@ static void __ntfs_inode_release(ntfs_inode *ni)
 	if (NInoDirty(ni))
 		ntfs_log_error("Releasing dirty inode %lld!\n", 
 			       (long long)ni->mft_no);
+	ntfs_attr_drop_delayed(ni);
 	if (NInoAttrList(ni) && ni->attr_list)
 		free(ni->attr_list);
-	free(ni->mrec);
-	free(ni);
+	ntfs_attrlist_index_free(ni);
+	ntfs_pool_free(ni->mrec);
+	ntfs_pool_free(ni);
 	return;
 }
 
@@ -177,6 +180,9 @@ static ntfs_inode *ntfs_inode_real_open(ntfs_volume *vol, const MFT_REF mref)
 	ni = __ntfs_inode_allocate(vol);
 	if (!ni)
 		goto out;
+	ni->mrec = ntfs_pool_alloc(vol->mrec_pool, vol->mft_record_size);
+	if (!ni->mrec)
+		goto err_out;
 	if (ntfs_file_record_read(vol, mref, &ni->mrec, NULL))
 		goto err_out;
 
@@ -423,37 +429,6 @@ err:
 
 #if CACHE_NIDATA_SIZE
 
-/*
- *		Free an inode structure when there is not more space
- *	in the cache
- */
-
-void ntfs_inode_nidata_free(const struct CACHED_GENERIC *cached)
-{
-        ntfs_inode_real_close(((const struct CACHED_NIDATA*)cached)->ni);
-}
-
-/*
- *		Compute a hash value for an inode entry
- */
-
-int ntfs_inode_nidata_hash(const struct CACHED_GENERIC *item)
-{
-	return (((const struct CACHED_NIDATA*)item)->inum
-			% (2*CACHE_NIDATA_SIZE));
-}
-
-/*
- *		inum comparing for entering/fetching from cache
- */
-
-static int idata_cache_compare(const struct CACHED_GENERIC *cached,
-			const struct CACHED_GENERIC *wanted)
-{
-	return (((const struct CACHED_NIDATA*)cached)->inum
-			!= ((const struct CACHED_NIDATA*)wanted)->inum);
-}
-
 /*
  *		Invalidate an inode entry when not needed anymore.
  *	The entry should have been synced, it may be reused later,
@@ -462,14 +437,7 @@ static int idata_cache_compare(const struct CACHED_GENERIC *cached,
 
 void ntfs_inode_invalidate(ntfs_volume *vol, const MFT_REF mref)
 {
-	struct CACHED_NIDATA item;
-
-	item.inum = MREF(mref);
-	item.ni = (ntfs_inode*)NULL;
-	item.pathname = (const char*)NULL;
-	item.varsize = 0;
-	ntfs_invalidate_cache(vol->nidata_cache,
-				GENERIC(&item),idata_cache_compare,CACHE_FREE);
+	ntfs_invalidate_nidata(vol->nidata_cache, MREF(mref));
 }
 
 #endif
@@ -488,26 +456,13 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
 {
 	ntfs_inode *ni;
 #if CACHE_NIDATA_SIZE
-	struct CACHED_NIDATA item;
-	struct CACHED_NIDATA *cached;
-
-		/* fetch idata from cache */
-	item.inum = MREF(mref);
-	debug_double_inode(item.inum,1);
-	item.pathname = (const char*)NULL;
-	item.varsize = 0;
-	cached = (struct CACHED_NIDATA*)ntfs_fetch_cache(vol->nidata_cache,
-				GENERIC(&item),idata_cache_compare);
-	if (cached) {
-		ni = cached->ni;
-		/* do not keep open entries in cache */
-		ntfs_remove_cache(vol->nidata_cache,
-				(struct CACHED_GENERIC*)cached,0);
-	} else {
+		/* fetch idata from cache, it is not kept there while open */
+	debug_double_inode(MREF(mref),1);
+	ni = ntfs_fetch_nidata(vol->nidata_cache, MREF(mref));
+	if (!ni)
 		ni = ntfs_inode_real_open(vol, mref);
-	}
 	if (!ni) {
-		debug_double_inode(item.inum, 0);
+		debug_double_inode(MREF(mref), 0);
 	}
 #else
 	ni = ntfs_inode_real_open(vol, mref);
@@ -530,7 +485,6 @@ int ntfs_inode_close(ntfs_inode *ni)
 	int res;
 #if CACHE_NIDATA_SIZE
 	BOOL dirty;
-	struct CACHED_NIDATA item;
 
 	if (ni) {
 		debug_double_inode(ni->mft_no,0);
@@ -550,13 +504,8 @@ int ntfs_inode_close(ntfs_inode *ni)
 
 			if (!res) {
 					/* feed idata into cache */
-				item.inum = ni->mft_no;
-				item.ni = ni;
-				item.pathname = (const char*)NULL;
-				item.varsize = 0;
 				debug_cached_inode(ni);
-				ntfs_enter_cache(ni->vol->nidata_cache,
-					GENERIC(&item), idata_cache_compare);
+				ntfs_enter_nidata(ni->vol->nidata_cache, ni);
 			}
 		} else {
 			/* cache not ready or system file, really close */
@@ -672,6 +621,10 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 	ni = __ntfs_inode_allocate(base_ni->vol);
 	if (!ni)
 		goto out;
+	ni->mrec = ntfs_pool_alloc(base_ni->vol->mrec_pool,
+			base_ni->vol->mft_record_size);
+	if (!ni->mrec)
+		goto err_out;
 	if (ntfs_file_record_read(base_ni->vol, le64_to_cpu(mref), &ni->mrec, NULL))
 		goto err_out;
 
@@ -1009,6 +962,10 @@ int ntfs_inode_sync_in_dir(ntfs_inode *ni, ntfs_inode *dir_ni)
 
 	ntfs_log_enter("Entering for inode %lld\n", (long long)ni->mft_no);
 
+	/* Retry the mapping pairs which could not be written on close. */
+	if (ni->delayed_na && ntfs_attr_flush_delayed(ni, AT_UNUSED, NULL, 0))
+		err = (errno == EIO ? EIO : EBUSY);
+
 	/* Update STANDARD_INFORMATION. */
 	if ((ni->mrec->flags & MFT_RECORD_IN_USE) && ni->nr_extents != -1 &&
 			NInoDirty(ni) &&
@@ -1117,6 +1074,10 @@ sync_inode:
 		}
 	}
 
+	/* Keep the inode dirty while attributes wait for their runs. */
+	if (ni->delayed_na)
+		NInoSetDirty(ni);
+
 	if (err) {
 		errno = err;
 		ret = -1;
@@ -1326,6 +1287,7 @@ rollback:
 		ale = (ATTR_LIST_ENTRY*)((u8*)ale + le16_to_cpu(ale->length));
 	}
 	/* Remove in-memory attribute list. */
+	ntfs_attrlist_index_free(ni);
 	ni->attr_list = NULL;
 	ni->attr_list_size = 0;
 	NInoClearAttrList(ni);
@@ -32,6 +32,9 @@
 #ifdef HAVE_STDIO_H
 #include <stdio.h>
 #endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -43,6 +46,7 @@
 #include "runlist.h"
 #include "volume.h"
 #include "lcnalloc.h"
+#include "lcnindex.h"
 #include "logging.h"
 #include "misc.h"
 
@@ -115,57 +119,9 @@ static void update_full_status(ntfs_volume *vol, LCN lcn)
  
 static s64 max_empty_bit_range(unsigned char *buf, int size)
 {
-	int i, j, run = 0;
-	int max_range = 0;
-	s64 start_pos = -1;
-	
 	ntfs_log_trace("Entering\n");
-	
-	i = 0;
-	while (i < size) {
-		switch (*buf) {
-		case 0 :
-			do {
-				buf++;
-				run += 8;
-				i++;
-			} while ((i < size) && !*buf);
-			break;
-		case 255 :
-			if (run > max_range) {
-				max_range = run;
-				start_pos = (s64)i * 8 - run;
-			}
-			run = 0;
-			do {
-				buf++;
-				i++;
-			} while ((i < size) && (*buf == 255));
-			break;
-		default :
-			for (j = 0; j < 8; j++) {
-			
-				int bit = *buf & (1 << j);
-		
-				if (bit) {
-					if (run > max_range) {
-						max_range = run;
-						start_pos = (s64)i * 8 + (j - run);
-					}
-					run = 0;
-				} else 
-					run++;
-			}
-			i++;
-			buf++;
-		
-		}
-	}
-	
-	if (run > max_range)
-		start_pos = (s64)i * 8 - run;
-	
-	return start_pos;
+
+	return ntfs_bitmap_longest_zero_run(buf, 0, (s64)size * 8, NULL);
 }
 
 static int bitmap_writeback(ntfs_volume *vol, s64 pos, s64 size, void *b, 
@@ -192,6 +148,251 @@ static int bitmap_writeback(ntfs_volume *vol, s64 pos, s64 size, void *b,
 	return 0;
 }
 
+/*
+ *		Shrink the mft zone when the data zones are full
+ *
+ *	The mft zone is halved, its upper half going to the first data zone,
+ * and the free cluster index follows the new zones.
+ *
+ *	Returns TRUE if the data zones were given clusters, FALSE if the mft
+ * zone was already empty.
+ */
+
+static BOOL ntfs_cluster_shrink_mft_zone(ntfs_volume *vol)
+{
+	LCN size;
+
+	size = vol->mft_zone_end - vol->mft_zone_start;
+	if (size <= 0)
+		return FALSE;
+	vol->mft_zone_end = vol->mft_zone_start + (size >> 1);
+	if (vol->mft_zone_pos >= vol->mft_zone_end) {
+		vol->mft_zone_pos = vol->mft_lcn;
+		if (vol->mft_zone_pos >= vol->mft_zone_end)
+			vol->mft_zone_pos = vol->mft_zone_start;
+	}
+	vol->data1_zone_pos = vol->mft_zone_end;
+	vol->full_zones &= ~ZONE_DATA1;
+	ntfs_log_debug("Data zones full, mft zone shrunk to %lld-%lld\n",
+			(long long)vol->mft_zone_start,
+			(long long)vol->mft_zone_end);
+	ntfs_lcn_index_rezone(vol);
+	return TRUE;
+}
+
+/*
+ *		Append the clusters allocated by scanning $Bitmap
+ *
+ *	Used when the free cluster index was dropped while allocating, the
+ * runs of @srl are copied after the @rlpos runs of @*rl, and @srl is freed.
+ */
+
+static int ntfs_cluster_append_runs(runlist **rl, int *rlpos, runlist *srl)
+{
+	runlist *trl;
+	int n;
+
+	for (n = 0; srl[n].length; n++)
+		;
+	trl = realloc(*rl, (*rlpos + n + 1) * sizeof(runlist));
+	if (!trl) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(trl + *rlpos, srl, n * sizeof(runlist));
+	*rl = trl;
+	*rlpos += n;
+	free(srl);
+	return 0;
+}
+
+/*
+ *		Allocate clusters from the free cluster index
+ *
+ *	The zones are searched in the same order as when scanning $Bitmap.
+ * The smallest free extent which can hold all the clusters still wanted is
+ * chosen, from the first zone which has one.  If no extent is big enough,
+ * the largest one of the first zone with free clusters is taken, so that
+ * the allocation is as contiguous as the free space allows.  Data is never
+ * put in the mft zone, the mft zone is shrunk instead when the data zones
+ * are full.  A requested @start_lcn is used first if it is free.
+ *
+ *	The bits are set by ntfs_bitmap_set_run(), which updates the index.
+ * The zone positions and full zones are kept as when scanning, in case the
+ * index is dropped, and if it is dropped while allocating, the rest of the
+ * clusters is allocated by scanning.
+ */
+
+static runlist *ntfs_cluster_alloc_indexed(ntfs_volume *vol, VCN start_vcn,
+		s64 count, LCN start_lcn,
+		const NTFS_CLUSTER_ALLOCATION_ZONES zone)
+{
+	static const int zone_order[NTFS_LCN_ZONES][NTFS_LCN_ZONES] = {
+		[NTFS_LCN_ZONE_DATA2] = { NTFS_LCN_ZONE_DATA2,
+				NTFS_LCN_ZONE_DATA1, NTFS_LCN_ZONE_MFT },
+		[NTFS_LCN_ZONE_MFT] = { NTFS_LCN_ZONE_MFT,
+				NTFS_LCN_ZONE_DATA1, NTFS_LCN_ZONE_DATA2 },
+		[NTFS_LCN_ZONE_DATA1] = { NTFS_LCN_ZONE_DATA1,
+				NTFS_LCN_ZONE_DATA2, NTFS_LCN_ZONE_MFT },
+	} ;
+	static const u8 zone_bit[NTFS_LCN_ZONES] = {
+		[NTFS_LCN_ZONE_DATA2] = ZONE_DATA2,
+		[NTFS_LCN_ZONE_MFT] = ZONE_MFT,
+		[NTFS_LCN_ZONE_DATA1] = ZONE_DATA1,
+	} ;
+	runlist *rl = NULL, *trl;
+	LCN lcn, tc;
+	s64 clusters, len;
+	int err, first, i, z, rlpos, rlsize;
+
+	if (start_lcn >= 0) {
+		lcn = start_lcn;
+		len = ntfs_lcn_index_free_at(vol, lcn);
+		first = ntfs_lcn_index_zone(vol, lcn);
+	} else {
+		len = 0;
+		first = (zone == DATA_ZONE ? NTFS_LCN_ZONE_DATA1
+				: NTFS_LCN_ZONE_MFT);
+	}
+	clusters = count;
+	rlpos = rlsize = 0;
+	while (clusters) {
+		if (!vol->lcn_index) {
+			ntfs_log_debug("Free cluster index dropped, scanning "
+					"$Bitmap.\n");
+			trl = ntfs_cluster_alloc(vol, rlpos ? rl[rlpos - 1].vcn
+					+ rl[rlpos - 1].length : start_vcn,
+					clusters, -1, zone);
+			if (!trl) {
+				err = errno;
+				goto err_ret;
+			}
+			if (!rlpos) {
+				free(rl);
+				return trl;
+			}
+			if (ntfs_cluster_append_runs(&rl, &rlpos, trl)) {
+				err = errno;
+				ntfs_cluster_free_from_rl(vol, trl);
+				free(trl);
+				goto err_ret;
+			}
+			break;
+		}
+		/*
+		 * Look for an extent holding all the clusters wanted, not
+		 * in the mft zone unless allocating for the mft.
+		 */
+		for (i = 0; i < NTFS_LCN_ZONES && !len; i++) {
+			z = zone_order[first][i];
+			if (zone == DATA_ZONE && z == NTFS_LCN_ZONE_MFT)
+				continue;
+			len = ntfs_lcn_index_best_fit(vol, z, clusters, &lcn);
+			if (!len)
+				vol->full_zones |= zone_bit[z];
+			else if (len < clusters)
+				len = 0;
+		}
+		/* Otherwise take the largest extent of the first zone. */
+		for (i = 0; i < NTFS_LCN_ZONES && !len; i++) {
+			z = zone_order[first][i];
+			if (zone == DATA_ZONE && z == NTFS_LCN_ZONE_MFT)
+				continue;
+			len = ntfs_lcn_index_best_fit(vol, z, clusters, &lcn);
+		}
+		if (!len) {
+			/*
+			 * Give the data some of the mft zone and retry,
+			 * unless the request cannot fit anyway.
+			 */
+			if (zone == DATA_ZONE
+			    && (!NVolFreeSpaceKnown(vol)
+				|| vol->free_clusters >= clusters)
+			    && ntfs_cluster_shrink_mft_zone(vol)) {
+				first = NTFS_LCN_ZONE_DATA1;
+				continue;
+			}
+			ntfs_log_trace("All zones are finished, no space on "
+					"device.\n");
+			err = ENOSPC;
+			goto err_ret;
+		}
+		if (len > clusters)
+			len = clusters;
+		z = ntfs_lcn_index_zone(vol, lcn);
+
+		/* Reallocate memory if necessary. */
+		if ((rlpos + 2) * (int)sizeof(runlist) >= rlsize) {
+			rlsize += 4096;
+			trl = realloc(rl, rlsize);
+			if (!trl) {
+				err = ENOMEM;
+				ntfs_log_perror("realloc() failed");
+				goto err_ret;
+			}
+			rl = trl;
+		}
+
+		if (ntfs_bitmap_set_run(vol->lcnbmp_na, lcn, len)) {
+			err = errno;
+			goto err_ret;
+		}
+		if (NVolFreeSpaceKnown(vol)) {
+			if (vol->free_clusters < len) {
+				ntfs_log_error("Non-positive free clusters "
+						"(%lld)!\n", (long long)
+						(vol->free_clusters - len));
+				vol->free_clusters = 0;
+			} else
+				vol->free_clusters -= len;
+		}
+
+		/* Coalesce with previous run if adjacent LCNs. */
+		if (rlpos && rl[rlpos - 1].lcn + rl[rlpos - 1].length == lcn)
+			rl[rlpos - 1].length += len;
+		else {
+			rl[rlpos].vcn = rlpos ? rl[rlpos - 1].vcn +
+					rl[rlpos - 1].length : start_vcn;
+			rl[rlpos].lcn = lcn;
+			rl[rlpos].length = len;
+			rlpos++;
+		}
+		ntfs_log_debug("RUN:   %-16lld %-16lld %-16lld\n",
+			       (long long)rl[rlpos - 1].vcn,
+			       (long long)rl[rlpos - 1].lcn,
+			       (long long)rl[rlpos - 1].length);
+		clusters -= len;
+		/* Leave room to grow after the last extent, as when scanning. */
+		tc = lcn + len + (clusters ? 0 : NTFS_LCNALLOC_SKIP);
+		ntfs_cluster_update_zone_pos(vol, zone_bit[z], tc);
+		if (vol->lcn_index
+		    && !ntfs_lcn_index_best_fit(vol, z, 1, &tc))
+			vol->full_zones |= zone_bit[z];
+		len = 0;
+	}
+	/* Add runlist terminator element. */
+	rl[rlpos].vcn = rl[rlpos - 1].vcn + rl[rlpos - 1].length;
+	rl[rlpos].lcn = LCN_RL_NOT_MAPPED;
+	rl[rlpos].length = 0;
+	return rl;
+
+err_ret:
+	if (rl) {
+		if (rlpos) {
+			rl[rlpos].vcn = rl[rlpos - 1].vcn +
+					rl[rlpos - 1].length;
+			rl[rlpos].lcn = LCN_RL_NOT_MAPPED;
+			rl[rlpos].length = 0;
+			ntfs_debug_runlist_dump(rl);
+			ntfs_cluster_free_from_rl(vol, rl);
+		}
+		free(rl);
+	}
+	errno = err;
+	ntfs_log_perror("Failed to allocate clusters");
+	return NULL;
+}
+
 /**
  * ntfs_cluster_alloc - allocate clusters on an ntfs volume
  * @vol:	mounted ntfs volume on which to allocate the clusters
@@ -231,6 +432,10 @@ static int bitmap_writeback(ntfs_volume *vol, s64 pos, s64 size, void *b,
  *   1) implements MFT zone reservation
  *   2) causes reduction in fragmentation. 
  * The code is not optimized for speed.
+ *
+ * When the volume has a free cluster index, which is built when mounting
+ * for writing, the clusters are allocated from it instead, see
+ * ntfs_cluster_alloc_indexed().
  */
 runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		LCN start_lcn, const NTFS_CLUSTER_ALLOCATION_ZONES zone)
@@ -239,9 +444,9 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 	LCN last_read_pos, lcn;
 	LCN bmp_pos;		/* current bit position inside the bitmap */
 	LCN prev_lcn = 0, prev_run_len = 0;
-	s64 clusters, br;
+	s64 clusters, br, run;
 	runlist *rl = NULL, *trl;
-	u8 *buf, *byte, bit, writeback;
+	u8 *buf, writeback;
 	u8 pass = 1; 	/* 1: inside zone;  2: start of zone */
 	u8 search_zone; /* 4: data2 (start) 1: mft (middle) 2: data1 (end) */
 	u8 done_zones = 0;
@@ -272,6 +477,12 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		goto out;
 	}
 
+	if (ntfs_lcn_index_usable(vol)) {
+		rl = ntfs_cluster_alloc_indexed(vol, start_vcn, count,
+				start_lcn, zone);
+		goto out;
+	}
+
 	buf = ntfs_malloc(NTFS_LCNALLOC_BSIZE);
 	if (!buf)
 		goto out;
@@ -336,13 +547,19 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		writeback = 0;
 		
 		while (lcn < buf_size) {
-			byte = buf + (lcn >> 3);
-			bit = 1 << (lcn & 7);
 			if (has_guess) {
-				if (*byte & bit) {
+				/* Allocate the free bits from lcn on. */
+				run = ntfs_bitmap_find_first_set(buf, lcn,
+						buf_size);
+				if (run == lcn) {
 					has_guess = 0;
 					break;
 				}
+				if (run < 0)
+					run = buf_size;
+				run -= lcn;
+				if (run > clusters)
+					run = clusters;
 			} else {
 				lcn = max_empty_bit_range(buf, br);
 				if (lcn < 0)
@@ -365,16 +582,18 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 				rl = trl;
 			}
 			
-			/* Allocate the bitmap bit. */
-			*byte |= bit;
+			/* Allocate the bitmap bits. */
+			ntfs_bitmap_set_range(buf, lcn, run);
 			writeback = 1;
 			if (NVolFreeSpaceKnown(vol)) {
-				if (vol->free_clusters <= 0)
+				if (vol->free_clusters < run) {
 					ntfs_log_error("Non-positive free"
 					       " clusters (%lld)!\n",
-						(long long)vol->free_clusters);
-				else	
-					vol->free_clusters--;
+						(long long)(vol->free_clusters
+							- run));
+					vol->free_clusters = 0;
+				} else	
+					vol->free_clusters -= run;
 			}
 			
 			/*
@@ -388,7 +607,8 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 					       (long long)prev_lcn, 
 					       (long long)lcn, (long long)bmp_pos, 
 					       (long long)prev_run_len);
-				rl[rlpos - 1].length = ++prev_run_len;
+				prev_run_len += run;
+				rl[rlpos - 1].length = prev_run_len;
 			} else {
 				if (rlpos)
 					rl[rlpos].vcn = rl[rlpos - 1].vcn +
@@ -400,7 +620,7 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 				}
 				
 				rl[rlpos].lcn = prev_lcn = lcn + bmp_pos;
-				rl[rlpos].length = prev_run_len = 1;
+				rl[rlpos].length = prev_run_len = run;
 				rlpos++;
 			}
 			
@@ -408,16 +628,16 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 				       (long long)rl[rlpos - 1].vcn, 
 				       (long long)rl[rlpos - 1].lcn, 
 				       (long long)rl[rlpos - 1].length);
+			lcn += run;
+			clusters -= run;
 			/* Done? */
-			if (!--clusters) {
+			if (!clusters) {
 				if (used_zone_pos)
 					ntfs_cluster_update_zone_pos(vol, 
-						search_zone, lcn + bmp_pos + 1 +
+						search_zone, lcn + bmp_pos +
 							NTFS_LCNALLOC_SKIP);
 				goto done_ret;
 			}
-			
-			lcn++;
 		}
 		
 		if (bitmap_writeback(vol, last_read_pos, br, buf, &writeback)) {
@@ -568,6 +788,140 @@ err_ret:
 	goto done_err_ret;
 }
 
+/*
+ *		Preallocation windows
+ *
+ * On a volume mounted with NTFS_MNT_PREALLOC, the holes filled at the end
+ * of a data stream being appended to are allocated by
+ * ntfs_cluster_prealloc(), which reserves clusters beyond those needed.
+ * The following appends are allocated from the reservation, so that a
+ * stream of small appends gets a few large extents, which the runlist
+ * merges into a single run, whatever is allocated meanwhile for other
+ * files.  The reservation grows with each streak of appends it serves, up
+ * to NTFS_PREALLOC_MAX bytes, and is released by
+ * ntfs_cluster_prealloc_release() when the attribute is closed.
+ *
+ * The reserved clusters are marked in use in $Bitmap, only the attribute
+ * knows about them.  If the volume is not unmounted cleanly while an
+ * attribute holds a reservation, the clusters are lost until chkdsk runs.
+ */
+
+#define NTFS_PREALLOC_MIN	(64 << 10)
+#define NTFS_PREALLOC_MAX	(16 << 20)
+
+/**
+ * ntfs_cluster_prealloc - allocate clusters for appending to an attribute
+ * @na:		attribute being appended to
+ * @start_vcn:	vcn of the first cluster to allocate
+ * @count:	number of clusters to allocate
+ * @start_lcn:	preferred first lcn, or -1
+ *
+ * Allocate @count clusters for @na from @start_vcn on, from the clusters
+ * reserved by the previous append when it ended at @start_vcn, otherwise
+ * reserving a window of clusters beyond them.
+ *
+ * Return the runlist of the allocated clusters, as ntfs_cluster_alloc()
+ * does, or NULL with errno set on error.
+ */
+runlist *ntfs_cluster_prealloc(ntfs_attr *na, VCN start_vcn, s64 count,
+		LCN start_lcn)
+{
+	ntfs_volume *vol = na->ni->vol;
+	runlist *rl;
+	s64 window, ofs;
+	LCN lcn;
+	int i;
+
+	if (na->prealloc_len && na->prealloc_vcn == start_vcn
+	    && na->prealloc_len >= count) {
+		rl = ntfs_malloc(2 * sizeof(runlist_element));
+		if (!rl)
+			return NULL;
+		rl[0].vcn = start_vcn;
+		rl[0].lcn = na->prealloc_lcn;
+		rl[0].length = count;
+		rl[1].vcn = start_vcn + count;
+		rl[1].lcn = LCN_RL_NOT_MAPPED;
+		rl[1].length = 0;
+		na->prealloc_vcn += count;
+		na->prealloc_lcn += count;
+		na->prealloc_len -= count;
+		return rl;
+	}
+	/* A continued streak gets a larger window, next to the old one. */
+	if (na->prealloc_window && na->prealloc_vcn == start_vcn) {
+		window = na->prealloc_window << 1;
+		start_lcn = na->prealloc_lcn;
+	} else
+		window = NTFS_PREALLOC_MIN >> vol->cluster_size_bits;
+	if (window > NTFS_PREALLOC_MAX >> vol->cluster_size_bits)
+		window = NTFS_PREALLOC_MAX >> vol->cluster_size_bits;
+	if (window < 1)
+		window = 1;
+	if (ntfs_cluster_prealloc_release(na))
+		return NULL;
+	/* Do not take the last free clusters of the volume. */
+	if (NVolFreeSpaceKnown(vol) && window > vol->free_clusters >> 6)
+		window = vol->free_clusters >> 6;
+	na->prealloc_window = window;
+	rl = ntfs_cluster_alloc(vol, start_vcn, count + window, start_lcn,
+			DATA_ZONE);
+	if (!rl)
+		return ntfs_cluster_alloc(vol, start_vcn, count, start_lcn,
+				DATA_ZONE);
+	/*
+	 * Keep the clusters following the last needed one as the
+	 * reservation, or the next extent if there are none, and free
+	 * the other extents.
+	 */
+	for (i = 0; rl[i].vcn + rl[i].length < start_vcn + count; i++)
+		;
+	ofs = start_vcn + count - rl[i].vcn;
+	lcn = rl[i].lcn + ofs;
+	na->prealloc_len = rl[i].length - ofs;
+	rl[i].length = ofs;
+	if (!na->prealloc_len && rl[i + 1].length) {
+		lcn = rl[++i].lcn;
+		na->prealloc_len = rl[i].length;
+	}
+	na->prealloc_lcn = lcn;
+	na->prealloc_vcn = start_vcn + count;
+	for (i++; rl[i].length; i++)
+		if (ntfs_cluster_free_basic(vol, rl[i].lcn, rl[i].length))
+			ntfs_log_perror("Failed to free %lld clusters at %lld",
+					(long long)rl[i].length,
+					(long long)rl[i].lcn);
+	/* Terminate after the needed clusters. */
+	for (i = 0; rl[i].vcn + rl[i].length < start_vcn + count; i++)
+		;
+	rl[i + 1].vcn = start_vcn + count;
+	rl[i + 1].lcn = LCN_RL_NOT_MAPPED;
+	rl[i + 1].length = 0;
+	ntfs_log_debug("Reserved %lld clusters at %lld for inode %lld\n",
+			(long long)na->prealloc_len,
+			(long long)na->prealloc_lcn,
+			(long long)na->ni->mft_no);
+	return rl;
+}
+
+/**
+ * ntfs_cluster_prealloc_release - release the clusters reserved for appending
+ * @na:		attribute
+ *
+ * Return 0 on success or -1 with errno set on error.
+ */
+int ntfs_cluster_prealloc_release(ntfs_attr *na)
+{
+	int ret = 0;
+
+	if (na->prealloc_len) {
+		ret = ntfs_cluster_free_basic(na->ni->vol, na->prealloc_lcn,
+				na->prealloc_len);
+		na->prealloc_len = 0;
+	}
+	return ret;
+}
+
 /**
  * ntfs_cluster_free_from_rl - free clusters from runlist
  * @vol:	mounted ntfs volume on which to free the clusters
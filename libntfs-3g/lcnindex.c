@@ -0,0 +1,635 @@
+/**
+ * lcnindex.c - Index of the free cluster extents of a volume.
+ *
+ * Copyright (c) 2026 ntfsprogs contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * The free clusters of a volume opened for writing are read once from
+ * $Bitmap at mount time and kept as extents of consecutive free clusters,
+ * split at the boundaries of the cluster zones.  Each extent is in two
+ * trees, one ordered by position to look up and merge neighbours, the other
+ * ordered by zone then size to find the best fitting extent of a zone in
+ * logarithmic time.  The trees are treaps, the priorities being hashed from
+ * the positions so that allocations are reproducible.
+ *
+ * The index is not updated by the allocator, it follows every write to
+ * $Bitmap through ntfs_attr_pwrite(), from which the state of the written
+ * clusters is known whoever makes the change.  If memory runs out while
+ * updating, the index is dropped and the allocator falls back to scanning
+ * $Bitmap.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "types.h"
+#include "attrib.h"
+#include "bitmap.h"
+#include "debug.h"
+#include "volume.h"
+#include "lcnindex.h"
+#include "logging.h"
+#include "misc.h"
+
+/* Bytes of $Bitmap read at a time when building the index. */
+#define NTFS_LCN_INDEX_BSIZE	65536
+
+/* The trees an extent is in. */
+enum {
+	BY_LCN = 0,
+	BY_SIZE = 1,
+};
+
+/**
+ * struct lcn_extent -
+ *
+ * A run of free clusters, within a single zone.
+ */
+struct lcn_extent {
+	struct lcn_extent *child[2][2];	/* Left and right, in each tree. */
+	LCN lcn;			/* First free cluster. */
+	s64 length;			/* Number of free clusters. */
+	u32 prio;			/* Treap priority. */
+	int zone;			/* Zone holding the extent. */
+};
+
+/**
+ * struct ntfs_lcn_index -
+ */
+struct ntfs_lcn_index {
+	struct lcn_extent *root[2];	/* Roots of the two trees. */
+	LCN zone_start[NTFS_LCN_ZONES + 1]; /* Zone boundaries, the last one
+					   being the number of clusters. */
+	s64 extents;			/* Number of extents. */
+	s64 free_clusters;		/* Clusters in the extents. */
+};
+
+/*
+ *		Tree primitives
+ */
+
+static int lcnx_cmp(int t, const struct lcn_extent *a,
+			const struct lcn_extent *b)
+{
+	if (t == BY_SIZE) {
+		if (a->zone != b->zone)
+			return a->zone < b->zone ? -1 : 1;
+		if (a->length != b->length)
+			return a->length < b->length ? -1 : 1;
+	}
+	if (a->lcn != b->lcn)
+		return a->lcn < b->lcn ? -1 : 1;
+	return 0;
+}
+
+static void lcnx_insert(int t, struct lcn_extent **root, struct lcn_extent *x)
+{
+	struct lcn_extent *r, *c;
+	int dir;
+
+	r = *root;
+	if (!r) {
+		x->child[t][0] = x->child[t][1] = NULL;
+		*root = x;
+		return;
+	}
+	dir = lcnx_cmp(t, x, r) > 0;
+	lcnx_insert(t, &r->child[t][dir], x);
+	c = r->child[t][dir];
+	if (c->prio > r->prio) {
+		/* Rotate the child up. */
+		r->child[t][dir] = c->child[t][!dir];
+		c->child[t][!dir] = r;
+		*root = c;
+	}
+}
+
+static void lcnx_delete(int t, struct lcn_extent **root, struct lcn_extent *x)
+{
+	struct lcn_extent *r, *c;
+	int dir;
+
+	while ((r = *root) != x) {
+		if (!r)
+			return;
+		root = &r->child[t][lcnx_cmp(t, x, r) > 0];
+	}
+	/* Rotate the extent down until it has at most one child. */
+	while (x->child[t][0] && x->child[t][1]) {
+		dir = x->child[t][0]->prio < x->child[t][1]->prio;
+		c = x->child[t][dir];
+		x->child[t][dir] = c->child[t][!dir];
+		c->child[t][!dir] = x;
+		*root = c;
+		root = &c->child[t][!dir];
+	}
+	*root = x->child[t][0] ? x->child[t][0] : x->child[t][1];
+}
+
+static int lcnx_zone(const struct ntfs_lcn_index *idx, LCN lcn)
+{
+	int zone;
+
+	for (zone = 0; zone < NTFS_LCN_ZONES - 1; zone++)
+		if (lcn < idx->zone_start[zone + 1])
+			break;
+	return zone;
+}
+
+static void lcnx_link(struct ntfs_lcn_index *idx, struct lcn_extent *x)
+{
+	x->prio = (u32)(((u64)x->lcn * 0x9e3779b97f4a7c15ULL) >> 32);
+	x->zone = lcnx_zone(idx, x->lcn);
+	lcnx_insert(BY_LCN, &idx->root[BY_LCN], x);
+	lcnx_insert(BY_SIZE, &idx->root[BY_SIZE], x);
+}
+
+static void lcnx_unlink(struct ntfs_lcn_index *idx, struct lcn_extent *x)
+{
+	lcnx_delete(BY_LCN, &idx->root[BY_LCN], x);
+	lcnx_delete(BY_SIZE, &idx->root[BY_SIZE], x);
+}
+
+/*
+ * Get the extent starting at or before @lcn, nearest to it.
+ */
+static struct lcn_extent *lcnx_floor(const struct ntfs_lcn_index *idx,
+			LCN lcn)
+{
+	struct lcn_extent *r, *best = NULL;
+
+	for (r = idx->root[BY_LCN]; r; ) {
+		if (r->lcn <= lcn) {
+			best = r;
+			r = r->child[BY_LCN][1];
+		} else
+			r = r->child[BY_LCN][0];
+	}
+	return best;
+}
+
+/*
+ * Get the extent starting at or after @lcn, nearest to it.
+ */
+static struct lcn_extent *lcnx_ceil(const struct ntfs_lcn_index *idx,
+			LCN lcn)
+{
+	struct lcn_extent *r, *best = NULL;
+
+	for (r = idx->root[BY_LCN]; r; ) {
+		if (r->lcn >= lcn) {
+			best = r;
+			r = r->child[BY_LCN][0];
+		} else
+			r = r->child[BY_LCN][1];
+	}
+	return best;
+}
+
+/*
+ *		Updating the extents
+ */
+
+/*
+ * Add free clusters, all in one zone and not already in an extent,
+ * merging with the neighbouring extents.
+ */
+static int lcnx_add_piece(struct ntfs_lcn_index *idx, LCN lcn, s64 length)
+{
+	struct lcn_extent *left, *right, *x;
+	int zone;
+
+	zone = lcnx_zone(idx, lcn);
+	left = (lcn ? lcnx_floor(idx, lcn - 1) : NULL);
+	if (left && (left->zone != zone
+			|| left->lcn + left->length != lcn))
+		left = NULL;
+	right = lcnx_ceil(idx, lcn + length);
+	if (right && (right->zone != zone || right->lcn != lcn + length))
+		right = NULL;
+	if (left) {
+		lcnx_unlink(idx, left);
+		left->length += length;
+		if (right) {
+			lcnx_unlink(idx, right);
+			left->length += right->length;
+			free(right);
+			idx->extents--;
+		}
+		lcnx_link(idx, left);
+	} else if (right) {
+		lcnx_unlink(idx, right);
+		right->lcn = lcn;
+		right->length += length;
+		lcnx_link(idx, right);
+	} else {
+		x = ntfs_malloc(sizeof(struct lcn_extent));
+		if (!x)
+			return -1;
+		x->lcn = lcn;
+		x->length = length;
+		lcnx_link(idx, x);
+		idx->extents++;
+	}
+	idx->free_clusters += length;
+	return 0;
+}
+
+/*
+ * Add free clusters, splitting them at the zone boundaries.
+ */
+static int lcnx_add(struct ntfs_lcn_index *idx, LCN lcn, s64 length)
+{
+	s64 piece;
+	int zone;
+
+	while (length > 0) {
+		zone = lcnx_zone(idx, lcn);
+		piece = length;
+		if (zone < NTFS_LCN_ZONES - 1
+		    && lcn + piece > idx->zone_start[zone + 1])
+			piece = idx->zone_start[zone + 1] - lcn;
+		if (lcnx_add_piece(idx, lcn, piece))
+			return -1;
+		lcn += piece;
+		length -= piece;
+	}
+	return 0;
+}
+
+/*
+ * Forget the free clusters from @start to @end, excluded.
+ */
+static int lcnx_remove(struct ntfs_lcn_index *idx, LCN start, LCN end)
+{
+	struct lcn_extent *x, *tail;
+	LCN x_end;
+
+	x = lcnx_floor(idx, start);
+	if (x && x->lcn < start && x->lcn + x->length > start) {
+		x_end = x->lcn + x->length;
+		if (x_end > end) {
+			/* The range is inside the extent, split it. */
+			tail = ntfs_malloc(sizeof(struct lcn_extent));
+			if (!tail)
+				return -1;
+			tail->lcn = end;
+			tail->length = x_end - end;
+			lcnx_link(idx, tail);
+			idx->extents++;
+		}
+		lcnx_unlink(idx, x);
+		x->length = start - x->lcn;
+		lcnx_link(idx, x);
+		idx->free_clusters -= (x_end > end ? end : x_end) - start;
+	}
+	while ((x = lcnx_ceil(idx, start)) && x->lcn < end) {
+		x_end = x->lcn + x->length;
+		lcnx_unlink(idx, x);
+		if (x_end > end) {
+			idx->free_clusters -= end - x->lcn;
+			x->lcn = end;
+			x->length = x_end - end;
+			lcnx_link(idx, x);
+			break;
+		}
+		idx->free_clusters -= x->length;
+		free(x);
+		idx->extents--;
+	}
+	return 0;
+}
+
+/*
+ * Add the free clusters shown by @count bytes of $Bitmap from byte @pos.
+ */
+static int lcnx_add_bitmap(struct ntfs_lcn_index *idx, s64 pos, s64 count,
+			const u8 *b)
+{
+	LCN base;
+	s64 zero, set, end;
+
+	base = pos << 3;
+	end = count << 3;
+	if (end > idx->zone_start[NTFS_LCN_ZONES] - base)
+		end = idx->zone_start[NTFS_LCN_ZONES] - base;
+	for (zero = ntfs_bitmap_find_first_zero(b, 0, end); zero >= 0;
+			zero = ntfs_bitmap_find_first_zero(b, set, end)) {
+		set = ntfs_bitmap_find_first_set(b, zero, end);
+		if (set < 0)
+			set = end;
+		if (lcnx_add(idx, base + zero, set - zero))
+			return -1;
+	}
+	return 0;
+}
+
+static void lcnx_free_tree(struct lcn_extent *x)
+{
+	if (x) {
+		lcnx_free_tree(x->child[BY_LCN][0]);
+		lcnx_free_tree(x->child[BY_LCN][1]);
+		free(x);
+	}
+}
+
+/*
+ *		Exported functions
+ */
+
+/**
+ * ntfs_lcn_index_free - release the free cluster index of a volume
+ * @vol:	volume
+ */
+void ntfs_lcn_index_free(ntfs_volume *vol)
+{
+	if (vol->lcn_index) {
+		lcnx_free_tree(vol->lcn_index->root[BY_LCN]);
+		free(vol->lcn_index);
+		vol->lcn_index = NULL;
+	}
+}
+
+/**
+ * ntfs_lcn_index_build - index the free clusters of a volume
+ * @vol:	volume whose $Bitmap and cluster zones are set up
+ *
+ * Read the whole of $Bitmap and record the runs of free clusters, replacing
+ * the current index if any.
+ *
+ * Return 0 on success or -1 with errno set on error, the volume then has no
+ * index and the clusters are allocated by scanning $Bitmap.
+ */
+int ntfs_lcn_index_build(ntfs_volume *vol)
+{
+	struct ntfs_lcn_index *idx;
+	u8 *buf;
+	s64 pos, br;
+	int eo;
+
+	ntfs_lcn_index_free(vol);
+	if (!vol->lcnbmp_na) {
+		errno = EINVAL;
+		return -1;
+	}
+	idx = ntfs_calloc(sizeof(struct ntfs_lcn_index));
+	buf = ntfs_malloc(NTFS_LCN_INDEX_BSIZE);
+	if (!idx || !buf)
+		goto err_out;
+	idx->zone_start[NTFS_LCN_ZONE_DATA2] = 0;
+	idx->zone_start[NTFS_LCN_ZONE_MFT] = vol->mft_zone_start;
+	idx->zone_start[NTFS_LCN_ZONE_DATA1] = vol->mft_zone_end;
+	idx->zone_start[NTFS_LCN_ZONES] = vol->nr_clusters;
+	for (pos = 0; (pos << 3) < vol->nr_clusters; pos += br) {
+		br = ntfs_attr_pread(vol->lcnbmp_na, pos, NTFS_LCN_INDEX_BSIZE,
+				buf);
+		if (br <= 0) {
+			if (!br)
+				break;
+			goto err_out;
+		}
+		if (lcnx_add_bitmap(idx, pos, br, buf))
+			goto err_out;
+	}
+	free(buf);
+	vol->lcn_index = idx;
+	ntfs_log_debug("Indexed %lld free clusters in %lld extents\n",
+			(long long)idx->free_clusters, (long long)idx->extents);
+	return 0;
+err_out:
+	eo = errno;
+	if (idx) {
+		lcnx_free_tree(idx->root[BY_LCN]);
+		free(idx);
+	}
+	free(buf);
+	errno = eo;
+	return -1;
+}
+
+/**
+ * ntfs_lcn_index_usable - check whether the free cluster index can be used
+ * @vol:	volume
+ *
+ * The index is dropped if the volume was resized or its zones were moved
+ * since it was built.
+ *
+ * Return TRUE if the volume has a valid index.
+ */
+BOOL ntfs_lcn_index_usable(ntfs_volume *vol)
+{
+	struct ntfs_lcn_index *idx = vol->lcn_index;
+
+	if (!idx)
+		return FALSE;
+	if (idx->zone_start[NTFS_LCN_ZONE_MFT] != vol->mft_zone_start
+	    || idx->zone_start[NTFS_LCN_ZONE_DATA1] != vol->mft_zone_end
+	    || idx->zone_start[NTFS_LCN_ZONES] != vol->nr_clusters) {
+		ntfs_log_debug("Volume geometry changed, dropping the free "
+				"cluster index\n");
+		ntfs_lcn_index_free(vol);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * ntfs_lcn_index_rezone - follow a move of the mft zone
+ * @vol:	volume with an index
+ *
+ * Called after the allocator has changed the boundaries of the mft zone.
+ * The free extents between the old and the new boundaries are taken out and
+ * indexed again, so that they are split and merged as for the new zones.
+ *
+ * Return 0 on success or -1 with errno set if memory runs out, the index is
+ * then dropped.
+ */
+int ntfs_lcn_index_rezone(ntfs_volume *vol)
+{
+	struct ntfs_lcn_index *idx = vol->lcn_index;
+	struct lcn_extent *x, *next, *moved;
+	LCN lo, hi, end;
+	int zone;
+
+	if (!idx)
+		return 0;
+	if (idx->zone_start[NTFS_LCN_ZONES] != vol->nr_clusters) {
+		ntfs_lcn_index_free(vol);
+		return 0;
+	}
+	lo = vol->nr_clusters;
+	hi = 0;
+	for (zone = NTFS_LCN_ZONE_MFT; zone < NTFS_LCN_ZONES; zone++) {
+		end = (zone == NTFS_LCN_ZONE_MFT ? vol->mft_zone_start
+				: vol->mft_zone_end);
+		if (idx->zone_start[zone] == end)
+			continue;
+		lo = min(lo, min(idx->zone_start[zone], end));
+		hi = max(hi, max(idx->zone_start[zone], end));
+		idx->zone_start[zone] = end;
+	}
+	if (lo > hi)
+		return 0;
+	/*
+	 * Unlink the extents touching the range, chaining them through
+	 * their now unused children, then index them again.
+	 */
+	moved = NULL;
+	x = lcnx_floor(idx, lo);
+	if (!x || x->lcn + x->length < lo)
+		x = lcnx_ceil(idx, lo);
+	while (x && x->lcn <= hi) {
+		next = lcnx_ceil(idx, x->lcn + x->length);
+		lcnx_unlink(idx, x);
+		idx->free_clusters -= x->length;
+		idx->extents--;
+		x->child[BY_LCN][0] = moved;
+		moved = x;
+		x = next;
+	}
+	for (x = moved; x; x = next) {
+		next = x->child[BY_LCN][0];
+		if (lcnx_add(idx, x->lcn, x->length))
+			break;
+		free(x);
+	}
+	if (x) {
+		for (; x; x = next) {
+			next = x->child[BY_LCN][0];
+			free(x);
+		}
+		ntfs_log_debug("No memory to move the cluster zones, "
+				"dropping the free cluster index\n");
+		ntfs_lcn_index_free(vol);
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * ntfs_lcn_index_update - record a change of $Bitmap
+ * @vol:	volume
+ * @pos:	byte position of the change in $Bitmap
+ * @count:	number of bytes written
+ * @b:		bytes written
+ *
+ * Called after each successful write to $Bitmap.  If memory runs out, the
+ * index is dropped.
+ */
+void ntfs_lcn_index_update(ntfs_volume *vol, s64 pos, s64 count,
+		const void *b)
+{
+	struct ntfs_lcn_index *idx = vol->lcn_index;
+	LCN start, end;
+
+	if (!idx || count <= 0)
+		return;
+	start = pos << 3;
+	end = (pos + count) << 3;
+	if (end > idx->zone_start[NTFS_LCN_ZONES])
+		end = idx->zone_start[NTFS_LCN_ZONES];
+	if (start >= end)
+		return;
+	if (lcnx_remove(idx, start, end)
+	    || lcnx_add_bitmap(idx, pos, count, (const u8*)b)) {
+		ntfs_log_debug("No memory to update the free cluster index, "
+				"dropping it\n");
+		ntfs_lcn_index_free(vol);
+	}
+}
+
+/**
+ * ntfs_lcn_index_zone - get the zone of a cluster
+ * @vol:	volume with an index
+ * @lcn:	cluster
+ *
+ * Return the zone holding @lcn, as an NTFS_LCN_ZONE_* value.
+ */
+int ntfs_lcn_index_zone(ntfs_volume *vol, LCN lcn)
+{
+	return lcnx_zone(vol->lcn_index, lcn);
+}
+
+/**
+ * ntfs_lcn_index_free_at - get the free clusters from a position
+ * @vol:	volume with an index
+ * @lcn:	first cluster
+ *
+ * Return the number of consecutive free clusters from @lcn to the end of its
+ * zone at most, zero if @lcn is in use.
+ */
+s64 ntfs_lcn_index_free_at(ntfs_volume *vol, LCN lcn)
+{
+	struct lcn_extent *x;
+
+	x = lcnx_floor(vol->lcn_index, lcn);
+	if (!x || x->lcn + x->length <= lcn)
+		return 0;
+	return x->lcn + x->length - lcn;
+}
+
+/**
+ * ntfs_lcn_index_best_fit - find the best place to allocate clusters
+ * @vol:	volume with an index
+ * @zone:	zone to allocate from, as an NTFS_LCN_ZONE_* value
+ * @count:	number of clusters wanted
+ * @lcn:	where to return the first free cluster
+ *
+ * Find the smallest free extent of @zone holding at least @count clusters,
+ * or if there is none, the largest free extent of @zone.
+ *
+ * Return the length of the extent found, or zero if @zone has no free
+ * cluster.
+ */
+s64 ntfs_lcn_index_best_fit(ntfs_volume *vol, int zone, s64 count, LCN *lcn)
+{
+	struct lcn_extent *r, *best;
+
+	/* The first extent ordered after (zone, count). */
+	best = NULL;
+	for (r = vol->lcn_index->root[BY_SIZE]; r; ) {
+		if (r->zone > zone || (r->zone == zone && r->length >= count)) {
+			best = r;
+			r = r->child[BY_SIZE][0];
+		} else
+			r = r->child[BY_SIZE][1];
+	}
+	if (!best || best->zone != zone) {
+		/* None is big enough, get the last extent of the zone. */
+		best = NULL;
+		for (r = vol->lcn_index->root[BY_SIZE]; r; ) {
+			if (r->zone <= zone) {
+				best = r;
+				r = r->child[BY_SIZE][1];
+			} else
+				r = r->child[BY_SIZE][0];
+		}
+		if (!best || best->zone != zone)
+			return 0;
+	}
+	*lcn = best->lcn;
+	return best->length;
+}
@@ -42,7 +42,13 @@
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <time.h>
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include "compat.h"
 #include "types.h"
@@ -55,10 +61,358 @@
 #include "layout.h"
 #include "lcnalloc.h"
 #include "mft.h"
+#include "mst.h"
 #include "logging.h"
 #include "misc.h"
 #include "lib_utils.h"
 
+/*
+ *		Deferred mft record writes
+ *
+ *	Once ntfs_mft_queue_start() has been called, ntfs_mft_records_write()
+ *	copies the records into a queue instead of writing them, so that a
+ *	record written over and over, such as the one of a directory being
+ *	filled, reaches the device once.  ntfs_mft_records_read() returns the
+ *	queued copies.
+ *
+ *	The queue is flushed when it is full, when $MFT/$DATA or $MFTMirr is
+ *	accessed other than through these functions, and when it is stopped
+ *	as the volume is released.  The records are then sorted and each run
+ *	of consecutive records is written with a single protected write,
+ *	$MFTMirr being written once at the end.
+ */
+
+/* Bytes of consecutive records written at once. */
+#define NTFS_MFT_QUEUE_RUN	(1 << 20)
+
+struct ntfs_mft_queue_entry {
+	s64 mft_no;		/* Number of the queued record. */
+	s64 slot;		/* Position of the record in the queue. */
+};
+
+/**
+ * struct ntfs_mft_queue -
+ *
+ * Mft records waiting to be written, see ntfs_mft_queue_start().
+ */
+struct ntfs_mft_queue {
+	s64 threshold;		/* Records queued before flushing. */
+	s64 count;		/* Records queued. */
+	u8 *records;		/* Room for @threshold deprotected records. */
+	struct ntfs_mft_queue_entry *entries;
+	s64 *hash;		/* Index + 1 of an entry, 0 if unused. */
+	s64 hash_mask;
+	BOOL busy;		/* Accessing the mft for the queue itself. */
+	s64 queued;		/* Statistics, logged when stopping. */
+	s64 writes;
+	s64 flushes;
+};
+
+/*
+ * Return the hash slot of record @mft_no, holding 0 if it is not queued.
+ */
+static s64 *ntfs_mft_queue_slot(struct ntfs_mft_queue *q, s64 mft_no)
+{
+	s64 h;
+
+	h = ((u64)mft_no * 0x9e3779b97f4a7c15ULL >> 32) & q->hash_mask;
+	while (q->hash[h] && q->entries[q->hash[h] - 1].mft_no != mft_no)
+		h = (h + 1) & q->hash_mask;
+	return &q->hash[h];
+}
+
+/*
+ * Return how many of the @count records from @mft_no are queued, copying
+ * them into @b if @copy is TRUE.
+ */
+static s64 ntfs_mft_queue_lookup(const ntfs_volume *vol, s64 mft_no,
+		s64 count, MFT_RECORD *b, BOOL copy)
+{
+	struct ntfs_mft_queue *q = vol->mft_queue;
+	s64 i, found = 0, *slot;
+
+	for (i = 0; i < count; i++) {
+		slot = ntfs_mft_queue_slot(q, mft_no + i);
+		if (!*slot)
+			continue;
+		found++;
+		if (copy)
+			memcpy((u8*)b + (i << vol->mft_record_size_bits),
+				q->records + (q->entries[*slot - 1].slot
+					<< vol->mft_record_size_bits),
+				vol->mft_record_size);
+	}
+	return found;
+}
+
+static int ntfs_mft_queue_cmp(const void *a, const void *b)
+{
+	s64 x = ((const struct ntfs_mft_queue_entry*)a)->mft_no;
+	s64 y = ((const struct ntfs_mft_queue_entry*)b)->mft_no;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Write the queued records, then empty the queue even if some of them
+ * could not be written.
+ */
+static int ntfs_mft_queue_write(const ntfs_volume *vol)
+{
+	struct ntfs_mft_queue *q = vol->mft_queue;
+	const u32 size = vol->mft_record_size;
+	const u8 rsb = vol->mft_record_size_bits;
+	s64 i, k, n, first, nr_records, run, written;
+	u8 *buf, *mirr = NULL, *mirr_done = NULL;
+	int err = 0;
+
+	if (!q || !q->count || q->busy)
+		return 0;
+	run = NTFS_MFT_QUEUE_RUN >> rsb;
+	if (!run)
+		run = 1;
+	if (run > q->count)
+		run = q->count;
+	buf = ntfs_malloc(run << rsb);
+	if (vol->mftmirr_size > 0) {
+		mirr = ntfs_malloc((s64)vol->mftmirr_size << rsb);
+		mirr_done = ntfs_calloc(vol->mftmirr_size);
+	}
+	if (!buf || (vol->mftmirr_size > 0 && (!mirr || !mirr_done))) {
+		free(buf);
+		free(mirr);
+		free(mirr_done);
+		return -1;
+	}
+	qsort(q->entries, q->count, sizeof(struct ntfs_mft_queue_entry),
+			ntfs_mft_queue_cmp);
+	nr_records = vol->mft_na->initialized_size >> rsb;
+	q->busy = TRUE;
+	for (i = 0; i < q->count; i += n) {
+		first = q->entries[i].mft_no;
+		n = 1;
+		/* Dropped by a failed extension of the mft. */
+		if (first >= nr_records)
+			continue;
+		while (i + n < q->count && n < run
+				&& q->entries[i + n].mft_no == first + n
+				&& first + n < nr_records)
+			n++;
+		for (k = 0; k < n; k++) {
+			memcpy(buf + (k << rsb), q->records
+					+ (q->entries[i + k].slot << rsb),
+					size);
+			/* The mirror gets the same update sequence number. */
+			if (first + k < vol->mftmirr_size)
+				memcpy(mirr + ((first + k) << rsb),
+						buf + (k << rsb), size);
+		}
+		written = ntfs_attr_mst_pwrite(vol->mft_na, first << rsb, n,
+				size, buf);
+		q->writes++;
+		if (written != n) {
+			err = written < 0 ? errno : EIO;
+			ntfs_log_perror("Failed to write mft records %lld to "
+					"%lld", (long long)first,
+					(long long)(first + n - 1));
+			if (written < 0)
+				written = 0;
+		}
+		for (k = 0; k < written && first + k < vol->mftmirr_size; k++)
+			mirr_done[first + k] = 1;
+	}
+	/* Update $MFTMirr once, a run of mirrored records at a time. */
+	for (i = 0; i < vol->mftmirr_size; i += n) {
+		n = 1;
+		if (!mirr_done[i])
+			continue;
+		while (i + n < vol->mftmirr_size && mirr_done[i + n])
+			n++;
+		written = ntfs_attr_mst_pwrite(vol->mftmirr_na, i << rsb, n,
+				size, mirr + (i << rsb));
+		q->writes++;
+		if (written != n) {
+			err = written < 0 ? errno : EIO;
+			ntfs_log_debug("Error: failed to sync $MFTMirr! Run "
+					"chkdsk.\n");
+		}
+	}
+	q->busy = FALSE;
+	q->count = 0;
+	memset(q->hash, 0, (q->hash_mask + 1) * sizeof(s64));
+	q->flushes++;
+	free(buf);
+	free(mirr);
+	free(mirr_done);
+	if (!err)
+		return 0;
+	errno = err;
+	return -1;
+}
+
+/*
+ * Queue @count records from @mft_no, instead of writing them, after
+ * increasing their update sequence number in @b as writing them would.
+ */
+static int ntfs_mft_queue_add(const ntfs_volume *vol, s64 mft_no,
+		s64 count, MFT_RECORD *b)
+{
+	struct ntfs_mft_queue *q = vol->mft_queue;
+	struct ntfs_mft_queue_entry *e;
+	s64 i, n, *slot;
+
+	n = ntfs_mst_pre_write_fixup_batch(b, vol->mft_record_size, count);
+	ntfs_mst_post_write_fixup_batch(b, vol->mft_record_size, n);
+	for (i = 0; i < n; i++) {
+		slot = ntfs_mft_queue_slot(q, mft_no + i);
+		if (!*slot) {
+			if (q->count == q->threshold) {
+				if (ntfs_mft_queue_write(vol))
+					return -1;
+				slot = ntfs_mft_queue_slot(q, mft_no + i);
+			}
+			e = &q->entries[q->count];
+			e->mft_no = mft_no + i;
+			e->slot = q->count;
+			*slot = ++q->count;
+		}
+		memcpy(q->records + (q->entries[*slot - 1].slot
+				<< vol->mft_record_size_bits),
+			(u8*)b + (i << vol->mft_record_size_bits),
+			vol->mft_record_size);
+		q->queued++;
+	}
+	if (n < count) {
+		ntfs_log_perror("Failed to queue mft record %lld",
+				(long long)(mft_no + n));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * ntfs_mft_queue_start - defer the writes of mft records
+ * @vol:	volume mounted for writing
+ * @threshold:	records queued before writing them, 0 for the default
+ *
+ * From now on, queue the mft records written by ntfs_mft_records_write()
+ * until @threshold different records are queued, until the queue is
+ * flushed by ntfs_mft_queue_flush(), or until the volume is released.
+ * The queue uses @threshold times the mft record size of memory.
+ *
+ * The NTFS_MNT_MFT_QUEUE mount flag starts the queue with the default
+ * threshold when mounting.
+ *
+ * Return 0 on success or -1 with errno set on error, to EEXIST if the
+ * writes are already deferred.
+ */
+int ntfs_mft_queue_start(ntfs_volume *vol, s64 threshold)
+{
+	struct ntfs_mft_queue *q;
+	s64 hash_size;
+
+	if (!vol || !vol->mft_na || NVolReadOnly(vol) || threshold < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (vol->mft_queue) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (!threshold)
+		threshold = NTFS_MFT_QUEUE_DEFAULT;
+	for (hash_size = 16; hash_size < 2 * threshold; hash_size <<= 1)
+		;
+	q = ntfs_calloc(sizeof(struct ntfs_mft_queue));
+	if (!q)
+		return -1;
+	q->threshold = threshold;
+	q->hash_mask = hash_size - 1;
+	q->records = ntfs_malloc(threshold << vol->mft_record_size_bits);
+	q->entries = ntfs_malloc(threshold
+			* sizeof(struct ntfs_mft_queue_entry));
+	q->hash = ntfs_calloc(hash_size * sizeof(s64));
+	if (!q->records || !q->entries || !q->hash) {
+		free(q->records);
+		free(q->entries);
+		free(q->hash);
+		free(q);
+		return -1;
+	}
+	vol->mft_queue = q;
+	return 0;
+}
+
+/**
+ * ntfs_mft_queue_flush - write the queued mft records
+ * @vol:	volume
+ *
+ * Nothing is done if the writes of mft records are not deferred.
+ *
+ * Return 0 on success or -1 with errno set if some records could not be
+ * written.  They are not queued any more either way.
+ */
+int ntfs_mft_queue_flush(ntfs_volume *vol)
+{
+	if (!vol) {
+		errno = EINVAL;
+		return -1;
+	}
+	return ntfs_mft_queue_write(vol);
+}
+
+/**
+ * ntfs_mft_queue_stop - write the queued mft records and stop deferring
+ * @vol:	volume
+ *
+ * Return 0 on success or -1 with errno set if some records could not be
+ * written, the writes not being deferred any more either way.
+ */
+int ntfs_mft_queue_stop(ntfs_volume *vol)
+{
+	struct ntfs_mft_queue *q;
+	int ret;
+
+	if (!vol) {
+		errno = EINVAL;
+		return -1;
+	}
+	q = vol->mft_queue;
+	if (!q)
+		return 0;
+	ret = ntfs_mft_queue_write(vol);
+	ntfs_log_debug("Queued %lld mft record writes, written in %lld "
+			"writes by %lld flushes\n", (long long)q->queued,
+			(long long)q->writes, (long long)q->flushes);
+	vol->mft_queue = NULL;
+	free(q->records);
+	free(q->entries);
+	free(q->hash);
+	free(q);
+	return ret;
+}
+
+/**
+ * ntfs_mft_queue_barrier - write the queued records before accessing the mft
+ * @na:		attribute about to be accessed
+ *
+ * The queue is flushed if @na is $MFT/$DATA or $MFTMirr/$DATA, whichever
+ * handle it was opened through, unless the access is made for the queue
+ * itself.
+ *
+ * Return 0 on success or -1 with errno set if some records could not be
+ * written.
+ */
+int ntfs_mft_queue_barrier(ntfs_attr *na)
+{
+	ntfs_volume *vol = na->ni->vol;
+
+	if (!vol->mft_queue || na->type != AT_DATA
+	    || (na->ni->mft_no != FILE_MFT && na->ni->mft_no != FILE_MFTMirr))
+		return 0;
+	return ntfs_mft_queue_write(vol);
+}
+
 /**
  * ntfs_mft_records_read - read records from the mft from disk
  * @vol:	volume to read from
@@ -78,11 +432,14 @@
  * caller should check each record with is_baad_record() in case mst
  * deprotection failed.
  *
+ * Records queued by ntfs_mft_records_write() are returned as queued.
+ *
  * NOTE: @b has to be at least of size @count * vol->mft_record_size.
  */
 int ntfs_mft_records_read(const ntfs_volume *vol, const MFT_REF mref,
 		const s64 count, MFT_RECORD *b)
 {
+	struct ntfs_mft_queue *q;
 	s64 br;
 	VCN m;
 
@@ -105,8 +462,18 @@ int ntfs_mft_records_read(const ntfs_volume *vol, const MFT_REF mref,
 				vol->mft_record_size_bits);
 		return -1;
 	}
+	q = vol->mft_queue;
+	if (q && q->count && !q->busy
+	    && ntfs_mft_queue_lookup(vol, m, count, b, FALSE) == count) {
+		ntfs_mft_queue_lookup(vol, m, count, b, TRUE);
+		return 0;
+	}
+	if (q)
+		q->busy = TRUE;
 	br = ntfs_attr_mst_pread(vol->mft_na, m << vol->mft_record_size_bits,
 			count, vol->mft_record_size, b);
+	if (q)
+		q->busy = FALSE;
 	if (br != count) {
 		if (br != -1)
 			errno = EIO;
@@ -115,6 +482,9 @@ int ntfs_mft_records_read(const ntfs_volume *vol, const MFT_REF mref,
 				(long long)br);
 		return -1;
 	}
+	/* The queued records are newer than the ones on the device. */
+	if (q && q->count)
+		ntfs_mft_queue_lookup(vol, m, count, b, TRUE);
 	return 0;
 }
 
@@ -141,6 +511,10 @@ int ntfs_mft_records_read(const ntfs_volume *vol, const MFT_REF mref,
  * temporary buffer before we do the actual write. Then if at least one mft
  * record was successfully written, we write the appropriate mft records from
  * the copied buffer to the mft mirror, too.
+ *
+ * If the writes are deferred, see ntfs_mft_queue_start(), the records are
+ * copied into the queue instead, unless there are more of them than the
+ * queue can hold.
  */
 int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 		const s64 count, MFT_RECORD *b)
@@ -165,6 +539,12 @@ int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 				vol->mft_record_size_bits);
 		return -1;
 	}
+	if (vol->mft_queue && !vol->mft_queue->busy) {
+		if (count < vol->mft_queue->threshold)
+			return ntfs_mft_queue_add(vol, m, count, b);
+		if (ntfs_mft_queue_write(vol))
+			return -1;
+	}
 	if (m < vol->mftmirr_size) {
 		if (!vol->mftmirr_na) {
 			errno = EINVAL;
@@ -402,6 +782,95 @@ err_out:
 	return ret;
 }
 
+/*
+ *		Check an MFT record can be walked, without repairing it
+ *
+ *	Make sure its general fields are safe and its attributes, with
+ *	their names and values, lie within the record up to AT_END.  Unlike
+ *	ntfs_mft_record_check(), the record and the volume are never
+ *	changed and the errors are not counted, so that the workers of
+ *	ntfs_mft_scan_parallel() can check their records concurrently.
+ *	The attributes are not checked individually.
+ *
+ *	Returns 0 if the checks are successful
+ *		-1 with errno = EIO otherwise
+ */
+
+int ntfs_mft_record_check_ro(const ntfs_volume *vol, const MFT_REF mref,
+			     const MFT_RECORD *m)
+{
+	const ATTR_RECORD *a;
+	u32 offset;	/* attribute start offset */
+	u32 min_offset;	/* minimum attribute start offset */
+	u32 biu;	/* bytes_in_use */
+	u32 length;	/* attribute length */
+	u32 space;
+
+	if (!ntfs_is_file_record(m->magic)) {
+		if (!NVolNoFixupWarn(vol))
+			ntfs_log_error("Record %llu has no FILE magic (0x%x)\n",
+				(unsigned long long)MREF(mref),
+				(int)le32_to_cpu(*(const le32*)m));
+		goto err_out;
+	}
+	if (le32_to_cpu(m->bytes_allocated) != vol->mft_record_size) {
+		ntfs_log_error("Record %llu has corrupt allocation size "
+			       "(%u <> %u)\n", (unsigned long long)MREF(mref),
+			       vol->mft_record_size,
+			       le32_to_cpu(m->bytes_allocated));
+		goto err_out;
+	}
+	biu = le32_to_cpu(m->bytes_in_use);
+	if ((biu & 7) || (biu > vol->mft_record_size)) {
+		ntfs_log_error("Record %llu has corrupt in-use size "
+			       "(%u > %u)\n", (unsigned long long)MREF(mref),
+			       (int)biu, (int)vol->mft_record_size);
+		goto err_out;
+	}
+	offset = le16_to_cpu(m->attrs_offset);
+	min_offset = ((le16_to_cpu(m->usa_ofs) +
+			le16_to_cpu(m->usa_count) * 2) + 7) & ~7;
+	if ((offset & 7) || (offset < min_offset)
+	    || (offset >= vol->mft_record_size)) {
+		ntfs_log_error("MFT record(%llu)'s attribute start offset "
+				"is corrupted\n",
+				(unsigned long long)MREF(mref));
+		goto err_out;
+	}
+
+	space = vol->mft_record_size - offset;
+	a = (const ATTR_RECORD*)((const char*)m + offset);
+	while ((space >= sizeof(ATTR_TYPES)) && (a->type != AT_END)) {
+		if (space < offsetof(ATTR_RECORD, resident_end))
+			break;
+		length = le32_to_cpu(a->length);
+		if ((length & 7) || (length > space)
+		    || (length < (a->non_resident
+				? offsetof(ATTR_RECORD, non_resident_end)
+				: offsetof(ATTR_RECORD, resident_end)))
+		    || (a->name_length
+			&& ((u32)le16_to_cpu(a->name_offset)
+				+ a->name_length * sizeof(ntfschar) > length))
+		    || (a->non_resident
+			&& (le16_to_cpu(a->mapping_pairs_offset) >= length))
+		    || (!a->non_resident
+			&& ((u32)le16_to_cpu(a->value_offset)
+				+ le32_to_cpu(a->value_length) > length)))
+			break;
+		space -= length;
+		a = (const ATTR_RECORD*)((const char*)a + length);
+	}
+	if ((space < sizeof(ATTR_TYPES)) || (a->type != AT_END)) {
+		ntfs_log_error("Corrupted MFT record %llu\n",
+			       (unsigned long long)MREF(mref));
+		goto err_out;
+	}
+	return 0;
+err_out:
+	errno = EIO;
+	return -1;
+}
+
 /**
  * ntfs_file_record_read - read a FILE record from the mft from disk
  * @vol:	volume to read from
@@ -678,6 +1147,18 @@ static int ntfs_mft_bitmap_find_free_rec(ntfs_volume *vol, ntfs_inode *base_ni)
 		pass = 2;
 	}
 	pass_start = data_pos;
+	if (vol->mftbmp_cache) {
+		/* As below, stop searching for $MFT after the byte of bit 400. */
+		if (ntfs_is_mft(base_ni) && pass_end > 408)
+			pass_end = 408;
+		ret = ntfs_mft_bitmap_find_free(vol, data_pos, pass_end);
+		if (ret < 0 && pass == 1)
+			ret = ntfs_mft_bitmap_find_free(vol,
+					RESERVED_MFT_RECORDS, pass_start);
+		if (ret < 0)
+			errno = ENOSPC;
+		goto leave;
+	}
 	buf = ntfs_malloc(PAGE_SIZE);
 	if (!buf)
 		goto leave;
@@ -853,6 +1334,7 @@ static int ntfs_mft_bitmap_extend_allocation_i(ntfs_volume *vol)
 		return STATUS_ERROR;
 	}
 	mftbmp_na->rl = rl;
+	ntfs_attr_forget_runs(mftbmp_na);
 	ntfs_log_debug("Adding one run to mft bitmap.\n");
 	/* Find the last run in the new runlist. */
 	for (; rl[1].length; rl++)
@@ -969,6 +1451,7 @@ undo_alloc:
 	lcn = rl->lcn;
 	rl->lcn = rl[1].lcn;
 	rl->length = 0;
+	ntfs_attr_forget_runs(mftbmp_na);
 	
 	/* FIXME: use an ntfs_cluster_free_* function */
 	if (ntfs_bitmap_clear_bit(vol->lcnbmp_na, lcn))
@@ -1205,6 +1688,7 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 		goto out;
 	}
 	mft_na->rl = rl;
+	ntfs_attr_forget_runs(mft_na);
 	
 	/* Find the last run in the new runlist. */
 	for (; rl[1].length; rl++)
@@ -1326,6 +1810,7 @@ undo_alloc:
 	if (ntfs_rl_truncate(&mft_na->rl, old_last_vcn))
 		ntfs_log_error("Failed to truncate mft data attribute "
 				"runlist.%s\n", es);
+	ntfs_attr_forget_runs(mft_na);
 	if (mp_rebuilt) {
 		if (ntfs_mapping_pairs_build(vol, (u8*)a +
 				le16_to_cpu(a->mapping_pairs_offset),
@@ -1602,12 +2087,12 @@ found_free_rec:
 	 * is not zero as well as the update sequence number if it is not zero
 	 * or -1 (0xffff).
 	 */
-	m = ntfs_malloc(vol->mft_record_size);
+	m = ntfs_pool_alloc(vol->mrec_pool, vol->mft_record_size);
 	if (!m)
 		goto undo_mftbmp_alloc;
 	
 	if (ntfs_mft_record_read(vol, bit, m)) {
-		free(m);
+		ntfs_pool_free(m);
 		goto undo_mftbmp_alloc;
 	}
 	/* Sanity check that the mft record is really not in use. */
@@ -1616,7 +2101,7 @@ found_free_rec:
 	    && (m->flags & MFT_RECORD_IN_USE))) {
 		ntfs_log_error("Inode %lld is used but it wasn't marked in "
 			       "$MFT bitmap. Fixed.\n", (long long)bit);
-		free(m);
+		ntfs_pool_free(m);
 		goto undo_mftbmp_alloc;
 	}
 
@@ -1633,7 +2118,7 @@ found_free_rec:
 		usn = const_cpu_to_le16(1);
 	if (ntfs_mft_record_layout(vol, bit, m)) {
 		ntfs_log_error("Failed to re-format mft record.\n");
-		free(m);
+		ntfs_pool_free(m);
 		goto undo_mftbmp_alloc;
 	}
 	if (seq_no)
@@ -1647,7 +2132,7 @@ found_free_rec:
 	ni = ntfs_inode_allocate(vol);
 	if (!ni) {
 		ntfs_log_error("Failed to allocate buffer for inode.\n");
-		free(m);
+		ntfs_pool_free(m);
 		goto undo_mftbmp_alloc;
 	}
 	ni->mft_no = bit;
@@ -1672,8 +2157,8 @@ found_free_rec:
 		i = (base_ni->nr_extents + 4) * sizeof(ntfs_inode *);
 		extent_nis = ntfs_malloc(i);
 		if (!extent_nis) {
-			free(m);
-			free(ni);
+			ntfs_pool_free(m);
+			ntfs_pool_free(ni);
 			goto undo_mftbmp_alloc;
 		}
 		if (base_ni->nr_extents) {
@@ -1918,7 +2403,7 @@ found_free_rec:
 	 * is not zero as well as the update sequence number if it is not zero
 	 * or -1 (0xffff).
 	 */
-	m = ntfs_malloc(vol->mft_record_size);
+	m = ntfs_pool_alloc(vol->mrec_pool, vol->mft_record_size);
 	if (!m)
 		goto undo_mftbmp_alloc;
 	
@@ -1932,7 +2417,7 @@ found_free_rec:
 	if (ntfs_mft_record_read(vol, bit, m)) {
 		if (oldwarn)
 			NVolClearNoFixupWarn(vol);
-		free(m);
+		ntfs_pool_free(m);
 		goto undo_mftbmp_alloc;
 	}
 	if (oldwarn)
@@ -1942,7 +2427,7 @@ found_free_rec:
 	if (ntfs_is_file_record(m->magic) && (m->flags & MFT_RECORD_IN_USE)) {
 		ntfs_log_error("Inode %lld is used but it wasn't marked in "
 			       "$MFT bitmap. Fixed.\n", (long long)bit);
-		free(m);
+		ntfs_pool_free(m);
 		goto retry;
 	}
 	seq_no = m->sequence_number;
@@ -1958,7 +2443,7 @@ found_free_rec:
 		usn = const_cpu_to_le16(1);
 	if (ntfs_mft_record_layout(vol, bit, m)) {
 		ntfs_log_error("Failed to re-format mft record.\n");
-		free(m);
+		ntfs_pool_free(m);
 		goto undo_mftbmp_alloc;
 	}
 	if (seq_no)
@@ -1972,7 +2457,7 @@ found_free_rec:
 	ni = ntfs_inode_allocate(vol);
 	if (!ni) {
 		ntfs_log_error("Failed to allocate buffer for inode.\n");
-		free(m);
+		ntfs_pool_free(m);
 		goto undo_mftbmp_alloc;
 	}
 	ni->mft_no = bit;
@@ -1998,8 +2483,8 @@ found_free_rec:
 			i = (base_ni->nr_extents + 4) * sizeof(ntfs_inode *);
 			extent_nis = ntfs_malloc(i);
 			if (!extent_nis) {
-				free(m);
-				free(ni);
+				ntfs_pool_free(m);
+				ntfs_pool_free(ni);
 				goto undo_mftbmp_alloc;
 			}
 			if (base_ni->nr_extents) {
@@ -2150,3 +2635,706 @@ int ntfs_mft_usn_dec(MFT_RECORD *mrec)
 	return 0;
 }
 
+
+/*
+ *		Scanning the mft
+ *
+ *	Tools examining every record of the mft read the records in
+ *	chunks of several megabytes, one device transfer per extent of
+ *	$MFT/$DATA, so that a full scan runs at the sequential bandwidth of
+ *	the device instead of paying a transfer per record.  The records
+ *	not wanted according to $MFT/$BITMAP are skipped without being
+ *	read when they form large enough gaps, and are never deprotected.
+ */
+
+/* Bytes of records read at a time. */
+#define NTFS_MFT_SCAN_CHUNK	(4 << 20)
+/* Extents of $MFT/$DATA transferred for one chunk at most. */
+#define NTFS_MFT_SCAN_EXTENTS	32
+
+/**
+ * struct ntfs_mft_scan -
+ *
+ * State of a scan of the mft, see ntfs_mft_scan_open().
+ */
+struct ntfs_mft_scan {
+	ntfs_volume *vol;
+	int flags;		/* NTFS_MFT_SCAN_* records returned. */
+	BOOL warn;		/* Log the records failing deprotection. */
+	s64 nr_records;		/* Records in the initialized $MFT/$DATA. */
+	s64 end;		/* Record the scan stops before. */
+	s64 gap;		/* Unwanted records worth not reading. */
+	u8 *bitmap;		/* Copy of $MFT/$BITMAP. */
+	runlist_element *rl;	/* Copy of the runlist of $MFT/$DATA. */
+	runlist_element *cur;	/* Extent found by the last lookup. */
+	int fd;			/* Device file read directly, or -1. */
+	BOOL shared;		/* @bitmap and @rl belong to another scan. */
+	u8 *buf;		/* Records read, deprotected when wanted. */
+	s64 buf_records;	/* Size of @buf in records. */
+	u8 *unread;		/* Records of @buf which could not be read. */
+	BOOL partial;		/* Some records of @buf could not be read. */
+	s64 first;		/* First record in @buf. */
+	s64 count;		/* Records in @buf. */
+	s64 next;		/* Next record to consider. */
+	struct ntfs_io_req reqs[NTFS_MFT_SCAN_EXTENTS];
+};
+
+static BOOL ntfs_mft_scan_wanted(ntfs_mft_scan *scan, s64 mft_no)
+{
+	if (ntfs_bit_get(scan->bitmap, mft_no))
+		return (scan->flags & NTFS_MFT_SCAN_IN_USE) != 0;
+	return (scan->flags & NTFS_MFT_SCAN_FREE) != 0;
+}
+
+/*
+ * Return the first record at or after @start and before @end which is
+ * wanted, or unwanted if @wanted is FALSE, or @end if there is none.
+ */
+static s64 ntfs_mft_scan_find(ntfs_mft_scan *scan, s64 start, s64 end,
+		BOOL wanted)
+{
+	s64 pos;
+
+	if (start >= end)
+		return end;
+	if (scan->flags == NTFS_MFT_SCAN_ALL)
+		return wanted ? start : end;
+	if (wanted == !!(scan->flags & NTFS_MFT_SCAN_IN_USE))
+		pos = ntfs_bitmap_find_first_set(scan->bitmap, start, end);
+	else
+		pos = ntfs_bitmap_find_first_zero(scan->bitmap, start, end);
+	return pos < 0 ? end : pos;
+}
+
+/*
+ * Return the extent of the copy of the runlist holding @vcn, searching
+ * forward from the previous one as the records are read in order.
+ */
+static runlist_element *ntfs_mft_scan_extent(ntfs_mft_scan *scan, VCN vcn)
+{
+	runlist_element *rl = scan->cur;
+
+	if (vcn < rl->vcn)
+		rl = scan->rl;
+	while (rl->length && rl->vcn + rl->length <= vcn)
+		rl++;
+	if (!rl->length || rl->lcn < 0) {
+		errno = EIO;
+		return NULL;
+	}
+	scan->cur = rl;
+	return rl;
+}
+
+/*
+ * Perform the @nr reads prepared in scan->reqs, through the device
+ * operations or, when scanning from several threads, with pread(2).
+ */
+static int ntfs_mft_scan_read(ntfs_mft_scan *scan, int nr)
+{
+	struct ntfs_io_req *req;
+	s64 br;
+	int i;
+
+	if (scan->fd < 0)
+		return ntfs_device_submit(scan->vol->dev, scan->reqs, nr);
+	for (i = 0; i < nr; i++) {
+		req = &scan->reqs[i];
+		req->done = 0;
+		req->error = 0;
+		while (req->done < req->count) {
+			br = pread(scan->fd, (u8*)req->buf + req->done,
+					req->count - req->done,
+					req->offset + req->done);
+			if (br < 0 && errno == EINTR)
+				continue;
+			if (br <= 0) {
+				if (!br)
+					errno = EIO;
+				req->error = errno;
+				return -1;
+			}
+			req->done += br;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Prepare the transfers reading the records from @first to *@end into
+ * @buf, one per extent of $MFT/$DATA.  When there are too many extents,
+ * *@end is set to the record the transfers stop before.
+ *
+ * Return the number of transfers, or -1 with errno set.
+ */
+static int ntfs_mft_scan_prepare(ntfs_mft_scan *scan, s64 first, s64 *end,
+		u8 *buf)
+{
+	ntfs_volume *vol = scan->vol;
+	const u8 rsb = vol->mft_record_size_bits;
+	runlist_element *rl;
+	s64 pos, len, ofs, n;
+	VCN vcn;
+	int nr = 0;
+
+	pos = first << rsb;
+	len = (*end - first) << rsb;
+	for (ofs = 0; ofs < len && nr < NTFS_MFT_SCAN_EXTENTS; nr++) {
+		vcn = (pos + ofs) >> vol->cluster_size_bits;
+		rl = ntfs_mft_scan_extent(scan, vcn);
+		if (!rl)
+			return -1;
+		n = ((rl->vcn + rl->length) << vol->cluster_size_bits)
+				- (pos + ofs);
+		if (n > len - ofs)
+			n = len - ofs;
+		scan->reqs[nr].buf = buf + ofs;
+		scan->reqs[nr].count = n;
+		scan->reqs[nr].offset = ((rl->lcn << vol->cluster_size_bits)
+				+ pos + ofs - (rl->vcn << vol->cluster_size_bits));
+		scan->reqs[nr].write = FALSE;
+		ofs += n;
+	}
+	if (ofs < len) {
+		/* Out of extents, keep the whole records read. */
+		len = ofs & ~((s64)vol->mft_record_size - 1);
+		while (nr && (u8*)scan->reqs[nr - 1].buf >= buf + len)
+			nr--;
+		if (nr)
+			scan->reqs[nr - 1].count = buf + len
+					- (u8*)scan->reqs[nr - 1].buf;
+		*end = first + (len >> rsb);
+	}
+	return nr;
+}
+
+/*
+ * Perform the @nr transfers prepared, all of them to their end.
+ *
+ * Return 0 on success or -1 with errno set.
+ */
+static int ntfs_mft_scan_transfer(ntfs_mft_scan *scan, int nr)
+{
+	int i;
+
+	if (ntfs_mft_scan_read(scan, nr))
+		return -1;
+	for (i = 0; i < nr; i++)
+		if (scan->reqs[i].done != scan->reqs[i].count) {
+			errno = EIO;
+			return -1;
+		}
+	return 0;
+}
+
+/*
+ * Read the wanted records from @first to @end one at a time, after the
+ * chunk holding them could not be read, so that only the unreadable ones
+ * are skipped.  These are zeroed and marked in scan->unread.
+ *
+ * Return 0 on success or -1 with errno set if the records could not be
+ * located.
+ */
+static int ntfs_mft_scan_fill_records(ntfs_mft_scan *scan, s64 first,
+		s64 end)
+{
+	ntfs_volume *vol = scan->vol;
+	s64 n, rec_end;
+	u8 *buf;
+	int nr;
+
+	memset(scan->unread, 0, (scan->buf_records + 7) >> 3);
+	scan->partial = TRUE;
+	for (n = ntfs_mft_scan_find(scan, first, end, TRUE); n < end;
+			n = ntfs_mft_scan_find(scan, n + 1, end, TRUE)) {
+		buf = scan->buf + ((n - first) << vol->mft_record_size_bits);
+		rec_end = n + 1;
+		nr = ntfs_mft_scan_prepare(scan, n, &rec_end, buf);
+		if (nr < 0)
+			return -1;
+		if (rec_end != n + 1 || ntfs_mft_scan_transfer(scan, nr)) {
+			ntfs_log_perror("Failed to read mft record %lld",
+					(long long)n);
+			memset(buf, 0, vol->mft_record_size);
+			ntfs_bit_set(scan->unread, n - first, 1);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fill the chunk buffer with the records from the first wanted one at or
+ * after scan->next, ending before the first gap of unwanted records worth
+ * skipping.  If the chunk cannot be read, its records are read one at a
+ * time and the unreadable ones are skipped.
+ *
+ * Return 0 on success or -1 with errno set, to ENOENT if no record is
+ * wanted any more.
+ */
+static int ntfs_mft_scan_fill(ntfs_mft_scan *scan)
+{
+	ntfs_volume *vol = scan->vol;
+	const u8 rsb = vol->mft_record_size_bits;
+	s64 first, end, pos, gap, n;
+	int nr;
+
+	scan->first = scan->next;
+	scan->count = 0;
+	first = ntfs_mft_scan_find(scan, scan->next, scan->end, TRUE);
+	if (first >= scan->end) {
+		scan->next = scan->end;
+		errno = ENOENT;
+		return -1;
+	}
+	end = first + scan->buf_records;
+	if (end > scan->end)
+		end = scan->end;
+	/* Stop before the first large gap, or the unwanted records at the end. */
+	for (pos = first; pos < end; pos = gap) {
+		pos = ntfs_mft_scan_find(scan, pos, end, FALSE);
+		gap = ntfs_mft_scan_find(scan, pos, end, TRUE);
+		if (gap == end || gap - pos >= scan->gap) {
+			end = pos;
+			break;
+		}
+	}
+
+	/* One transfer per extent, the chunk stopping at the last one. */
+	nr = ntfs_mft_scan_prepare(scan, first, &end, scan->buf);
+	if (nr < 0)
+		goto err;
+	scan->partial = FALSE;
+	if (ntfs_mft_scan_transfer(scan, nr)
+			&& ntfs_mft_scan_fill_records(scan, first, end))
+		goto err;
+
+	/* Deprotect the runs of wanted records. */
+	for (pos = first; pos < end; pos = gap) {
+		pos = ntfs_mft_scan_find(scan, pos, end, TRUE);
+		gap = ntfs_mft_scan_find(scan, pos, end, FALSE);
+		if (gap > pos && !scan->partial)
+			ntfs_mst_post_read_fixup_batch(scan->buf
+					+ ((pos - first) << rsb),
+					vol->mft_record_size, gap - pos,
+					scan->warn);
+		for (n = pos; n < gap && scan->partial; n++)
+			if (!ntfs_bit_get(scan->unread, n - first))
+				ntfs_mst_post_read_fixup_batch(scan->buf
+					+ ((n - first) << rsb),
+					vol->mft_record_size, 1,
+					scan->warn);
+	}
+	scan->first = first;
+	scan->count = end - first;
+	scan->next = first;
+	return 0;
+err:
+	ntfs_log_perror("Failed to read mft records %lld to %lld",
+			(long long)first, (long long)end - 1);
+	return -1;
+}
+
+/*
+ * Allocate a scan of the records of @vol from @start, copying $MFT/$BITMAP
+ * and the runlist of $MFT/$DATA, or sharing the copies of @owner if given.
+ */
+static ntfs_mft_scan *ntfs_mft_scan_alloc(ntfs_volume *vol, s64 start,
+		int flags, ntfs_mft_scan *owner)
+{
+	ntfs_mft_scan *scan;
+	s64 size, br;
+	int n;
+
+	scan = ntfs_calloc(sizeof(*scan));
+	if (!scan)
+		return NULL;
+	scan->vol = vol;
+	scan->flags = flags;
+	scan->warn = !NVolNoFixupWarn(vol);
+	scan->fd = -1;
+	scan->nr_records = vol->mft_na->initialized_size
+			>> vol->mft_record_size_bits;
+	scan->end = scan->nr_records;
+	scan->buf_records = NTFS_MFT_SCAN_CHUNK >> vol->mft_record_size_bits;
+	if (!scan->buf_records)
+		scan->buf_records = 1;
+	/* Skipping fewer records than this costs more than reading them. */
+	scan->gap = scan->buf_records / 16 + 1;
+	scan->next = start;
+	scan->buf = ntfs_malloc(scan->buf_records
+			<< vol->mft_record_size_bits);
+	scan->unread = ntfs_malloc((scan->buf_records + 7) >> 3);
+	if (!scan->buf || !scan->unread)
+		goto err;
+	if (owner) {
+		scan->shared = TRUE;
+		scan->bitmap = owner->bitmap;
+		scan->rl = owner->rl;
+		scan->cur = scan->rl;
+		return scan;
+	}
+	for (n = 0; vol->mft_na->rl[n].length; n++)
+		;
+	scan->rl = ntfs_malloc((n + 1) * sizeof(runlist_element));
+	size = ((scan->nr_records + 63) >> 6) << 3;
+	scan->bitmap = ntfs_calloc(size ? size : 8);
+	if (!scan->rl || !scan->bitmap)
+		goto err;
+	memcpy(scan->rl, vol->mft_na->rl, (n + 1) * sizeof(runlist_element));
+	scan->cur = scan->rl;
+	if (size > vol->mftbmp_na->initialized_size)
+		size = vol->mftbmp_na->initialized_size;
+	br = ntfs_attr_pread(vol->mftbmp_na, 0, size, scan->bitmap);
+	if (br != size) {
+		if (br >= 0)
+			errno = EIO;
+		ntfs_log_perror("Failed to read $MFT/$BITMAP");
+		goto err;
+	}
+	return scan;
+err:
+	ntfs_mft_scan_close(scan);
+	return NULL;
+}
+
+/**
+ * ntfs_mft_scan_open - prepare to scan the records of the mft in order
+ * @vol:	volume to scan
+ * @start:	first mft record to consider
+ * @flags:	which records to return, NTFS_MFT_SCAN_IN_USE, _FREE or _ALL
+ *
+ * Prepare to return the records of the mft of @vol from @start to the end
+ * of the initialized $MFT/$DATA, through ntfs_mft_scan_next().  Only the
+ * records marked in use in $MFT/$BITMAP are returned with
+ * NTFS_MFT_SCAN_IN_USE, and only the ones marked free with
+ * NTFS_MFT_SCAN_FREE.
+ *
+ * The records are read directly from the device, the caller has to sync
+ * the inodes it modified beforehand if it wants the scan to see the
+ * changes.  $MFT/$BITMAP is copied when opening the scan.
+ *
+ * Return the scan, to be freed with ntfs_mft_scan_close(), or NULL with
+ * errno set on error.
+ */
+ntfs_mft_scan *ntfs_mft_scan_open(ntfs_volume *vol, s64 start, int flags)
+{
+	if (!vol || !vol->mft_na || !vol->mftbmp_na || start < 0
+			|| !(flags & NTFS_MFT_SCAN_ALL)
+			|| (flags & ~NTFS_MFT_SCAN_ALL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	/* The records are read from the device, queued ones must be there. */
+	if (ntfs_mft_queue_flush(vol)
+			|| ntfs_attr_map_whole_runlist(vol->mft_na))
+		return NULL;
+	return ntfs_mft_scan_alloc(vol, start, flags, NULL);
+}
+
+/**
+ * ntfs_mft_scan_next - return the next record of a scan of the mft
+ * @scan:	scan opened by ntfs_mft_scan_open()
+ * @mft_no:	where to return the number of the record
+ *
+ * Return the next record wanted by @scan, mst deprotected, with its number
+ * in *@mft_no.  The record is in a buffer belonging to @scan, it is valid
+ * until the next call and may be modified by the caller.  Records failing
+ * deprotection have their magic set to "BAAD", see is_baad_record().
+ * Records which cannot be read are logged and skipped.
+ *
+ * Return NULL with errno set to ENOENT after the last record, or to another
+ * error code if the records could not be read.
+ */
+MFT_RECORD *ntfs_mft_scan_next(ntfs_mft_scan *scan, s64 *mft_no)
+{
+	s64 n;
+
+	if (!scan || !mft_no) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (1) {
+		while (scan->next < scan->first + scan->count) {
+			n = scan->next++;
+			if (ntfs_mft_scan_wanted(scan, n)
+			    && !(scan->partial && ntfs_bit_get(scan->unread,
+						n - scan->first))) {
+				*mft_no = n;
+				return (MFT_RECORD*)(scan->buf + ((n
+					- scan->first)
+					<< scan->vol->mft_record_size_bits));
+			}
+		}
+		if (ntfs_mft_scan_fill(scan))
+			return NULL;
+	}
+}
+
+/**
+ * ntfs_mft_scan_in_use - tell whether a record of a scan is in use
+ * @scan:	scan opened by ntfs_mft_scan_open()
+ * @mft_no:	record returned by ntfs_mft_scan_next()
+ *
+ * A scan returning both the records in use and the free ones does not tell
+ * them apart, their contents being deprotected the same way.  The answer
+ * is taken from the copy of $MFT/$BITMAP the scan selects the records by.
+ *
+ * Return TRUE if @mft_no is marked in use in $MFT/$BITMAP.
+ */
+BOOL ntfs_mft_scan_in_use(ntfs_mft_scan *scan, s64 mft_no)
+{
+	return mft_no >= 0 && mft_no < scan->nr_records
+		&& ntfs_bit_get(scan->bitmap, mft_no);
+}
+
+/**
+ * ntfs_mft_scan_close - free a scan of the mft
+ * @scan:	scan opened by ntfs_mft_scan_open(), may be NULL
+ */
+void ntfs_mft_scan_close(ntfs_mft_scan *scan)
+{
+	if (!scan)
+		return;
+	free(scan->buf);
+	free(scan->unread);
+	if (!scan->shared) {
+		free(scan->bitmap);
+		free(scan->rl);
+	}
+	free(scan);
+}
+
+/*
+ *		Scanning the mft from several threads
+ *
+ *	The workers take ranges of records from a common counter, so that
+ *	one meeting a crowded part of the mft does not hold the others up,
+ *	and read them with a scan of their own sharing the copies of
+ *	$MFT/$BITMAP and of the runlist.  The device operations are not
+ *	reentrant, the workers read the device file directly instead.
+ */
+
+/* Chunks of records a worker takes at a time. */
+#define NTFS_MFT_SCAN_RANGE	4
+
+/**
+ * struct ntfs_mft_pscan - state shared by the workers of a parallel scan
+ */
+struct ntfs_mft_pscan {
+	ntfs_mft_record_fn record;
+	s64 range;		/* Records taken by a worker at a time. */
+	s64 end;		/* Records in the initialized $MFT/$DATA. */
+#ifdef ENABLE_THREADS
+	pthread_mutex_t lock;	/* Protects the fields below. */
+#endif
+	s64 next;		/* First record not taken yet. */
+	int err;		/* First error met, 0 if none. */
+};
+
+/**
+ * struct ntfs_mft_pworker - a worker of a parallel scan
+ */
+struct ntfs_mft_pworker {
+	ntfs_mft_worker w;	/* Handed to the callbacks. */
+	struct ntfs_mft_pscan *ps;
+	ntfs_mft_scan *scan;	/* Scan reading the records of the worker. */
+#ifdef ENABLE_THREADS
+	pthread_t thread;
+	BOOL started;
+#endif
+};
+
+static void ntfs_mft_pscan_lock(struct ntfs_mft_pscan *ps)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_lock(&ps->lock);
+#endif
+}
+
+static void ntfs_mft_pscan_unlock(struct ntfs_mft_pscan *ps)
+{
+#ifdef ENABLE_THREADS
+	pthread_mutex_unlock(&ps->lock);
+#endif
+}
+
+/*
+ * Hand the wanted records to the callback, a range at a time, until all
+ * ranges are taken or a worker met an error.
+ */
+static void *ntfs_mft_pworker_run(void *arg)
+{
+	struct ntfs_mft_pworker *pw = arg;
+	struct ntfs_mft_pscan *ps = pw->ps;
+	ntfs_mft_scan *scan = pw->scan;
+	ntfs_attr_search_ctx *ctx = pw->w.ctx;
+	MFT_RECORD *mrec;
+	s64 start, mft_no;
+	int err = 0;
+
+	while (!err) {
+		ntfs_mft_pscan_lock(ps);
+		start = ps->next;
+		ps->next += ps->range;
+		if (ps->err)
+			start = ps->end;
+		ntfs_mft_pscan_unlock(ps);
+		if (start >= ps->end)
+			break;
+		scan->first = scan->next = start;
+		scan->count = 0;
+		scan->end = start + ps->range;
+		if (scan->end > ps->end)
+			scan->end = ps->end;
+		while (!err && (mrec = ntfs_mft_scan_next(scan, &mft_no))) {
+			ctx->mrec = mrec;
+			ntfs_attr_reinit_search_ctx(ctx);
+			if (ps->record(&pw->w, mft_no, mrec))
+				err = errno ? errno : EIO;
+		}
+		if (!err && errno != ENOENT)
+			err = errno;
+	}
+	ntfs_mft_pscan_lock(ps);
+	if (err && !ps->err)
+		ps->err = err;
+	ntfs_mft_pscan_unlock(ps);
+	return NULL;
+}
+
+/**
+ * ntfs_mft_scan_parallel - hand the records of the mft to worker threads
+ * @vol:	volume to scan
+ * @flags:	which records to hand, NTFS_MFT_SCAN_IN_USE, _FREE or _ALL
+ * @nr_threads:	most workers, 0 for one per processor
+ * @data_size:	bytes of results each worker keeps, may be 0
+ * @record:	called by a worker for each record
+ * @merge:	called for each worker once all are done, may be NULL
+ * @arg:	handed to the callbacks in their worker
+ *
+ * Share the records of the mft of @vol wanted according to @flags (see
+ * ntfs_mft_scan_open()) among up to @nr_threads workers, each calling
+ * @record for its records, mst deprotected, in increasing order within
+ * ranges of records taken in no defined order.  The record is in a buffer
+ * of the worker, valid until @record returns, and w->ctx is a search
+ * context on it.  Check the record with ntfs_mft_record_check_ro() before
+ * looking up its attributes: ntfs_mft_record_check() may repair and write
+ * the record, and counts the errors, which workers must not do.  @record
+ * returns 0 to go on, or -1 with errno set to end the scan.
+ *
+ * Each worker collects its results in w->data, @data_size bytes zeroed at
+ * start, without locking.  Once the workers are started, @merge is called
+ * from the calling thread for each of them in order of w->index, even when
+ * the scan failed so that it can free what the worker allocated.
+ *
+ * The workers only read the records.  While they run, the calling thread
+ * waits, so the volume does not change, and the callbacks may read the
+ * fields set when mounting: the sizes and shifts, the version, the flags,
+ * the upcase table and $AttrDef.  They must not use the device, open
+ * inodes or attributes, allocate or free clusters or records, or otherwise
+ * reach the volume through the library, whose caches are not locked.  A
+ * search context from w->ctx only walks the record itself, an attribute
+ * list has to be followed after the scan.
+ *
+ * Threads are only used when the library was built with them and the
+ * device can be read directly, see ntfs_device_shared_fd(), otherwise the
+ * calling thread is the single worker.
+ *
+ * Return 0 on success or -1 with errno set to the first error of a worker
+ * or a merge.
+ */
+int ntfs_mft_scan_parallel(ntfs_volume *vol, int flags, int nr_threads,
+		size_t data_size, ntfs_mft_record_fn record,
+		ntfs_mft_merge_fn merge, void *arg)
+{
+	struct ntfs_mft_pscan ps;
+	struct ntfs_mft_pworker *pw;
+	ntfs_mft_scan *owner;
+	s64 ranges;
+	int fd = -1, nr, i, err = 0;
+	BOOL ran = FALSE;
+
+	if (!record || nr_threads < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	owner = ntfs_mft_scan_open(vol, 0, flags);
+	if (!owner)
+		return -1;
+	memset(&ps, 0, sizeof(ps));
+	ps.record = record;
+	ps.end = owner->nr_records;
+	ps.range = owner->buf_records * NTFS_MFT_SCAN_RANGE;
+	nr = nr_threads ? nr_threads : ntfs_nr_cpus();
+	if (nr > NTFS_MFT_SCAN_THREADS)
+		nr = NTFS_MFT_SCAN_THREADS;
+	ranges = (ps.end + ps.range - 1) / ps.range;
+	if (nr > ranges)
+		nr = ranges;
+#ifdef ENABLE_THREADS
+	if (nr > 1) {
+		fd = ntfs_device_shared_fd(vol->dev);
+		/* The threads read the device, not the cache. */
+		if (fd >= 0 && vol->dev->d_cache
+				&& ntfs_device_cache_flush(vol->dev))
+			fd = -1;
+	}
+#endif
+	if (fd < 0 || nr < 1)
+		nr = 1;
+	pw = ntfs_calloc(nr * sizeof(struct ntfs_mft_pworker));
+	if (!pw) {
+		ntfs_mft_scan_close(owner);
+		return -1;
+	}
+	for (i = 0; i < nr; i++) {
+		pw[i].ps = &ps;
+		pw[i].w.vol = vol;
+		pw[i].w.index = i;
+		pw[i].w.arg = arg;
+		pw[i].scan = i ? ntfs_mft_scan_alloc(vol, 0, flags, owner)
+				: owner;
+		pw[i].w.ctx = ntfs_calloc(sizeof(ntfs_attr_search_ctx));
+		if (data_size)
+			pw[i].w.data = ntfs_calloc(data_size);
+		if (!pw[i].scan || !pw[i].w.ctx
+				|| (data_size && !pw[i].w.data)) {
+			err = errno;
+			break;
+		}
+		pw[i].scan->fd = nr > 1 ? fd : -1;
+	}
+	if (err)
+		nr = i + 1;
+	else {
+#ifdef ENABLE_THREADS
+		pthread_mutex_init(&ps.lock, NULL);
+		for (i = 1; i < nr; i++)
+			pw[i].started = !pthread_create(&pw[i].thread, NULL,
+					ntfs_mft_pworker_run, &pw[i]);
+#endif
+		ntfs_mft_pworker_run(&pw[0]);
+#ifdef ENABLE_THREADS
+		for (i = 1; i < nr; i++)
+			if (pw[i].started)
+				pthread_join(pw[i].thread, NULL);
+		pthread_mutex_destroy(&ps.lock);
+#endif
+		err = ps.err;
+		ran = TRUE;
+	}
+	for (i = 0; i < nr; i++) {
+		if (ran && merge && merge(&pw[i].w) && !err)
+			err = errno ? errno : EIO;
+		free(pw[i].w.data);
+		free(pw[i].w.ctx);
+		if (i)
+			ntfs_mft_scan_close(pw[i].scan);
+	}
+	ntfs_mft_scan_close(owner);
+	free(pw);
+	if (!err)
+		return 0;
+	errno = err;
+	return -1;
+}
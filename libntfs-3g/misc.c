@@ -30,6 +30,9 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "types.h"
 #include "misc.h"
@@ -75,3 +78,18 @@ void ntfs_free(void *p)
 {
 	free(p);
 }
+
+/**
+ * ntfs_nr_cpus - number of processors to share work among threads
+ *
+ * Return the number of processors online, 1 when it cannot be known.
+ */
+int ntfs_nr_cpus(void)
+{
+	long n = 1;
+
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return (n > 0 ? (int)n : 1);
+}
@@ -0,0 +1,282 @@
+/**
+ * mmap_io.c - Read-only disk io functions serving reads from a mapping.
+ *
+ * Copyright (c) 2026 ntfsprogs contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * The device is opened, locked and closed through the unix_io operations,
+ * then the whole of it is mapped into memory so that positioned reads are
+ * plain copies from the mapping, and ntfs_device_borrow() can hand out
+ * pointers into it.  Only read-only opens are allowed.
+ *
+ * If the device cannot be mapped, for instance because it does not fit into
+ * the address space, it is accessed through the unix_io operations.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#include <sys/mman.h>
+
+#include "types.h"
+#include "debug.h"
+#include "device.h"
+#include "logging.h"
+#include "misc.h"
+
+/**
+ * struct mmap_io_private -
+ *
+ * Private data of an open mapped device.  The file descriptor must come
+ * first, the unix_io operations see the private data as a pointer to it.
+ */
+struct mmap_io_private {
+	int fd;				/* Device file descriptor. */
+	char *map;			/* Mapping of the device or NULL. */
+	s64 size;			/* Size of the device. */
+};
+
+#define MMAP_PRIV(dev)	((struct mmap_io_private *)(dev)->d_private)
+
+/**
+ * ntfs_device_mmap_io_open - Open a device read-only and map it
+ * @dev:	device to open
+ * @flags:	open(2) flags, must be O_RDONLY
+ *
+ * Failing to map the device is not an error, it is then read through the
+ * unix_io operations.
+ *
+ * Return 0 on success and -1 with errno set on error.
+ */
+static int ntfs_device_mmap_io_open(struct ntfs_device *dev, int flags)
+{
+	struct mmap_io_private *p;
+	void *map;
+	int eo;
+
+	if ((flags & O_ACCMODE) != O_RDONLY) {
+		errno = EROFS;
+		return -1;
+	}
+	/* A mapping always goes through the page cache. */
+	NDevClearDirect(dev);
+	if (ntfs_device_default_io_ops.open(dev, flags))
+		return -1;
+	p = ntfs_calloc(sizeof(struct mmap_io_private));
+	if (!p) {
+		eo = errno;
+		ntfs_device_default_io_ops.close(dev);
+		errno = eo;
+		return -1;
+	}
+	p->fd = *(int *)dev->d_private;
+	free(dev->d_private);
+	dev->d_private = p;
+
+	p->size = lseek(p->fd, 0, SEEK_END);
+	if (p->size > 0 && (u64)p->size == (size_t)p->size) {
+		map = mmap(NULL, p->size, PROT_READ, MAP_SHARED, p->fd, 0);
+		if (map != MAP_FAILED)
+			p->map = map;
+	}
+	if (!p->map)
+		ntfs_log_debug("Cannot map %s (%s), using plain reads\n",
+				dev->d_name, strerror(errno));
+	return 0;
+}
+
+/**
+ * ntfs_device_mmap_io_close - Unmap and close the device
+ * @dev:	device to close
+ *
+ * Return 0 on success and -1 with errno set on error.
+ */
+static int ntfs_device_mmap_io_close(struct ntfs_device *dev)
+{
+	struct mmap_io_private *p = MMAP_PRIV(dev);
+
+	if (NDevOpen(dev) && p->map) {
+		munmap(p->map, p->size);
+		p->map = NULL;
+	}
+	return ntfs_device_default_io_ops.close(dev);
+}
+
+/**
+ * ntfs_device_mmap_io_pread - Copy from the mapping
+ * @dev:	device to read from
+ * @buf:	output buffer
+ * @count:	number of bytes to read
+ * @offset:	device position to read from
+ *
+ * Returns the number of bytes read, zero at end of device.
+ */
+static s64 ntfs_device_mmap_io_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	struct mmap_io_private *p = MMAP_PRIV(dev);
+
+	if (!p->map)
+		return ntfs_device_default_io_ops.pread(dev, buf, count,
+				offset);
+	if (offset >= p->size)
+		return 0;
+	if (count > p->size - offset)
+		count = p->size - offset;
+	memcpy(buf, p->map + offset, count);
+	return count;
+}
+
+/**
+ * ntfs_device_mmap_io_preadv - Copy from the mapping into several buffers
+ * @dev:	device to read from
+ * @iov:	buffers to fill
+ * @iovcnt:	number of buffers
+ * @offset:	device position to read from
+ *
+ * Returns the number of bytes read, which is short at end of device.
+ */
+static s64 ntfs_device_mmap_io_preadv(struct ntfs_device *dev,
+		const struct iovec *iov, int iovcnt, s64 offset)
+{
+	s64 br, total;
+	int i;
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++) {
+		br = ntfs_device_mmap_io_pread(dev, iov[i].iov_base,
+				iov[i].iov_len, offset + total);
+		if (br <= 0)
+			return total ? total : br;
+		total += br;
+		if (br != (s64)iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+/**
+ * ntfs_device_mmap_io_borrow - Get a pointer into the mapping
+ * @dev:	device to read from
+ * @offset:	device position of the data
+ * @count:	number of bytes wanted
+ *
+ * Returns a pointer to the data, valid until the device is closed, or NULL
+ * with errno set to EOPNOTSUPP if the device is not mapped or the range is
+ * not entirely within the device.
+ */
+static const void *ntfs_device_mmap_io_borrow(struct ntfs_device *dev,
+		s64 offset, s64 count)
+{
+	struct mmap_io_private *p = MMAP_PRIV(dev);
+
+	if (!p->map || offset > p->size || count > p->size - offset) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	return p->map + offset;
+}
+
+static s64 ntfs_device_mmap_io_write(struct ntfs_device *dev
+			__attribute__((unused)),
+		const void *buf __attribute__((unused)),
+		s64 count __attribute__((unused)))
+{
+	errno = EROFS;
+	return -1;
+}
+
+static s64 ntfs_device_mmap_io_pwrite(struct ntfs_device *dev
+			__attribute__((unused)),
+		const void *buf __attribute__((unused)),
+		s64 count __attribute__((unused)),
+		s64 offset __attribute__((unused)))
+{
+	errno = EROFS;
+	return -1;
+}
+
+/*
+ * Seeking, unpositioned reads and the rest are done by unix_io.
+ */
+
+static s64 ntfs_device_mmap_io_seek(struct ntfs_device *dev, s64 offset,
+		int whence)
+{
+	return ntfs_device_default_io_ops.seek(dev, offset, whence);
+}
+
+static s64 ntfs_device_mmap_io_read(struct ntfs_device *dev, void *buf,
+		s64 count)
+{
+	return ntfs_device_default_io_ops.read(dev, buf, count);
+}
+
+static int ntfs_device_mmap_io_sync(struct ntfs_device *dev)
+{
+	return ntfs_device_default_io_ops.sync(dev);
+}
+
+static int ntfs_device_mmap_io_stat(struct ntfs_device *dev,
+		struct stat *buf)
+{
+	return ntfs_device_default_io_ops.stat(dev, buf);
+}
+
+static int ntfs_device_mmap_io_ioctl(struct ntfs_device *dev,
+		unsigned long request, void *argp)
+{
+	return ntfs_device_default_io_ops.ioctl(dev, request, argp);
+}
+
+/**
+ * Device operations for reading unix style devices and files through a
+ * memory mapping.
+ */
+struct ntfs_device_operations ntfs_device_mmap_io_ops = {
+	.open		= ntfs_device_mmap_io_open,
+	.close		= ntfs_device_mmap_io_close,
+	.seek		= ntfs_device_mmap_io_seek,
+	.read		= ntfs_device_mmap_io_read,
+	.write		= ntfs_device_mmap_io_write,
+	.pread		= ntfs_device_mmap_io_pread,
+	.pwrite		= ntfs_device_mmap_io_pwrite,
+	.preadv		= ntfs_device_mmap_io_preadv,
+	.sync		= ntfs_device_mmap_io_sync,
+	.stat		= ntfs_device_mmap_io_stat,
+	.ioctl		= ntfs_device_mmap_io_ioctl,
+	.borrow		= ntfs_device_mmap_io_borrow,
+};
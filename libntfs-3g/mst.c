@@ -256,3 +256,138 @@ void ntfs_mst_post_write_fixup(NTFS_RECORD *b)
 	}
 }
 
+
+/*
+ *		Batched fixups
+ *
+ *	The functions below apply the fixups to @count consecutive records of
+ *	@size bytes in one buffer, as read from or written to the $MFT or an
+ *	index allocation.  The record size and hence the number of sectors are
+ *	checked once for the whole batch, and the common case of a valid
+ *	record is handled inline without any call.  Records which are not
+ *	valid are handed to the single record functions, so that they are
+ *	reported and marked exactly as before.
+ *
+ *	Vector instructions would not help here: only one le16 per 512 byte
+ *	sector is touched, so the lanes could only be filled by as many
+ *	scalar loads and stores as the plain loop does.
+ */
+
+/**
+ * ntfs_mst_post_read_fixup_batch - deprotect consecutive mst protected records
+ * @b:		pointer to the first record
+ * @size:	size in bytes of each record
+ * @count:	number of records in @b
+ * @warn:	whether to log the invalid records
+ *
+ * Perform ntfs_mst_post_read_fixup_warn() on each of the @count records of
+ * @size bytes in @b.  Invalid records and records with an incomplete multi
+ * sector transfer get their magic set to "BAAD" and processing continues
+ * with the next record.
+ *
+ * Return the number of records which could not be deprotected, 0 if all of
+ * them were.
+ */
+s64 ntfs_mst_post_read_fixup_batch(void *b, const u32 size, const s64 count,
+		BOOL warn)
+{
+	const u32 words = NTFS_BLOCK_SIZE / sizeof(u16);
+	u32 sectors, i;
+	u16 usa_ofs, usn, *rec, *usa;
+	s64 n, bad = 0;
+
+	sectors = size / NTFS_BLOCK_SIZE;
+	for (n = 0; n < count; n++) {
+		rec = (u16*)((u8*)b + n * size);
+		usa_ofs = le16_to_cpu(((NTFS_RECORD*)rec)->usa_ofs);
+		if (!is_valid_record(size, usa_ofs,
+				le16_to_cpu(((NTFS_RECORD*)rec)->usa_count)))
+			goto slow;
+		usa = rec + usa_ofs / sizeof(u16);
+		usn = usa[0];
+		for (i = 1; i <= sectors; i++)
+			if (rec[i * words - 1] != usn)
+				goto slow;
+		for (i = 1; i <= sectors; i++)
+			rec[i * words - 1] = usa[i];
+		continue;
+slow:
+		if (ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)rec, size,
+				warn))
+			bad++;
+	}
+	return bad;
+}
+
+/**
+ * ntfs_mst_pre_write_fixup_batch - protect consecutive records before writing
+ * @b:		pointer to the first record
+ * @size:	size in bytes of each record
+ * @count:	number of records in @b
+ *
+ * Perform ntfs_mst_pre_write_fixup() on each of the @count records of @size
+ * bytes in @b, stopping at the first record which cannot be protected.
+ *
+ * Return the number of records protected, which is lower than @count if one
+ * could not be, with errno set to EINVAL.
+ */
+s64 ntfs_mst_pre_write_fixup_batch(void *b, const u32 size, const s64 count)
+{
+	const u32 words = NTFS_BLOCK_SIZE / sizeof(u16);
+	u32 sectors, i;
+	u16 usa_ofs, usn;
+	le16 le_usn, *rec, *usa;
+	s64 n;
+
+	sectors = size / NTFS_BLOCK_SIZE;
+	for (n = 0; n < count; n++) {
+		rec = (le16*)((u8*)b + n * size);
+		usa_ofs = le16_to_cpu(((NTFS_RECORD*)rec)->usa_ofs);
+		if (ntfs_is_baad_record(((NTFS_RECORD*)rec)->magic)
+		    || ntfs_is_hole_record(((NTFS_RECORD*)rec)->magic)
+		    || !is_valid_record(size, usa_ofs,
+				le16_to_cpu(((NTFS_RECORD*)rec)->usa_count))) {
+			/* Let the single record function report the error. */
+			ntfs_mst_pre_write_fixup((NTFS_RECORD*)rec, size);
+			break;
+		}
+		usa = rec + usa_ofs / sizeof(le16);
+		usn = le16_to_cpup(usa) + 1;
+		if (usn == 0xffff || !usn)
+			usn = 1;
+		le_usn = cpu_to_le16(usn);
+		usa[0] = le_usn;
+		for (i = 1; i <= sectors; i++) {
+			usa[i] = rec[i * words - 1];
+			rec[i * words - 1] = le_usn;
+		}
+	}
+	return n;
+}
+
+/**
+ * ntfs_mst_post_write_fixup_batch - deprotect consecutive records after writing
+ * @b:		pointer to the first record
+ * @size:	size in bytes of each record
+ * @count:	number of records in @b
+ *
+ * Perform ntfs_mst_post_write_fixup() on each of the @count records of @size
+ * bytes in @b, which must have been protected by ntfs_mst_pre_write_fixup()
+ * or ntfs_mst_pre_write_fixup_batch().
+ */
+void ntfs_mst_post_write_fixup_batch(void *b, const u32 size, const s64 count)
+{
+	const u32 words = NTFS_BLOCK_SIZE / sizeof(u16);
+	u32 sectors, i;
+	u16 *rec, *usa;
+	s64 n;
+
+	sectors = size / NTFS_BLOCK_SIZE;
+	for (n = 0; n < count; n++) {
+		rec = (u16*)((u8*)b + n * size);
+		usa = rec + le16_to_cpu(((NTFS_RECORD*)rec)->usa_ofs)
+				/ sizeof(u16);
+		for (i = 1; i <= sectors; i++)
+			rec[i * words - 1] = usa[i];
+	}
+}
@@ -0,0 +1,282 @@
+/**
+ * pool.c - Pools of fixed size objects.
+ *
+ * Copyright (c) 2026 ntfsprogs contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Inodes, their mft records, attributes and search contexts are allocated
+ * and freed for nearly every operation on a file.  A volume keeps a pool of
+ * each, carved out of slabs of several objects, so that most allocations
+ * and frees only pop or push a free list.  The slabs are only freed with
+ * the pool, which keeps the memory of the busiest moment until unmounting.
+ *
+ * Every object starts with a hidden header naming its pool, so that it is
+ * freed without knowing where it came from.  Objects allocated without a
+ * pool, for instance search contexts on a bare mft record, come from
+ * malloc() with the same header.  A pool destroyed while objects are still
+ * allocated is kept until the last of them is freed.
+ *
+ * The pools are not locked, like the rest of the library.  Configuring
+ * with --disable-pools makes every allocation go to malloc(), so that
+ * memory checkers see each object.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "types.h"
+#include "pool.h"
+#include "logging.h"
+#include "misc.h"
+
+#ifdef ENABLE_POOLS
+
+/* Bytes allocated at once for the objects of a pool, at least. */
+#define NTFS_POOL_SLAB		65536
+/* Objects in a slab, at least. */
+#define NTFS_POOL_SLAB_MIN	8
+
+/**
+ * struct ntfs_pool_obj -
+ *
+ * Header of an object, the object itself following.
+ */
+struct ntfs_pool_obj {
+	ntfs_pool *pool;		/* NULL if allocated by malloc(). */
+	struct ntfs_pool_obj *next;	/* Next free object. */
+	union ALIGNMENT payload[0];
+};
+
+/**
+ * struct ntfs_pool_slab -
+ *
+ * A block of objects allocated at once.
+ */
+struct ntfs_pool_slab {
+	struct ntfs_pool_slab *next;
+	union ALIGNMENT payload[0];
+};
+
+/**
+ * struct ntfs_pool -
+ *
+ * Objects of the same size, see ntfs_pool_create().
+ */
+struct ntfs_pool {
+	const char *name;
+	size_t size;			/* Size of the objects. */
+	size_t stride;			/* Size of an object and its header. */
+	int per_slab;			/* Objects in a slab. */
+	struct ntfs_pool_obj *free_list;
+	struct ntfs_pool_slab *slabs;
+	s64 in_use;			/* Objects allocated and not freed. */
+	s64 nr_slabs;
+	s64 allocs;			/* Statistics, logged when destroyed. */
+	BOOL destroyed;			/* Free when @in_use drops to 0. */
+};
+
+static void ntfs_pool_release(ntfs_pool *pool)
+{
+	struct ntfs_pool_slab *slab;
+
+	ntfs_log_debug("Pool %s: %lld allocations, %lld slabs of %d\n",
+			pool->name, (long long)pool->allocs,
+			(long long)pool->nr_slabs, pool->per_slab);
+	while (pool->slabs) {
+		slab = pool->slabs;
+		pool->slabs = slab->next;
+		free(slab);
+	}
+	free(pool);
+}
+
+/*
+ * Carve a new slab into free objects.
+ */
+static int ntfs_pool_grow(ntfs_pool *pool)
+{
+	struct ntfs_pool_slab *slab;
+	struct ntfs_pool_obj *obj;
+	int i;
+
+	slab = ntfs_malloc(sizeof(struct ntfs_pool_slab)
+			+ pool->per_slab * pool->stride);
+	if (!slab)
+		return -1;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->nr_slabs++;
+	for (i = pool->per_slab - 1; i >= 0; i--) {
+		obj = (struct ntfs_pool_obj*)((char*)slab->payload
+				+ i * pool->stride);
+		obj->pool = pool;
+		obj->next = pool->free_list;
+		pool->free_list = obj;
+	}
+	return 0;
+}
+
+#endif /* ENABLE_POOLS */
+
+/**
+ * ntfs_pool_create - create a pool of objects
+ * @name:	name of the pool, for the statistics
+ * @size:	size of the objects
+ *
+ * Return the pool, to be destroyed by ntfs_pool_destroy(), or NULL with
+ * errno set on error.  Without pools, NULL is returned with errno set to
+ * EOPNOTSUPP, allocating from a NULL pool being the same as malloc().
+ */
+ntfs_pool *ntfs_pool_create(const char *name, size_t size)
+{
+#ifdef ENABLE_POOLS
+	ntfs_pool *pool;
+
+	if (!size) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pool = ntfs_calloc(sizeof(ntfs_pool));
+	if (!pool)
+		return NULL;
+	pool->name = name;
+	pool->size = size;
+	pool->stride = (sizeof(struct ntfs_pool_obj) + size
+			+ sizeof(union ALIGNMENT) - 1)
+			& ~(sizeof(union ALIGNMENT) - 1);
+	pool->per_slab = NTFS_POOL_SLAB / pool->stride;
+	if (pool->per_slab < NTFS_POOL_SLAB_MIN)
+		pool->per_slab = NTFS_POOL_SLAB_MIN;
+	return pool;
+#else
+	errno = EOPNOTSUPP;
+	return NULL;
+#endif
+}
+
+/**
+ * ntfs_pool_destroy - destroy a pool of objects
+ * @pool:	pool created by ntfs_pool_create(), may be NULL
+ *
+ * The memory of the pool is freed once all its objects are.
+ */
+void ntfs_pool_destroy(ntfs_pool *pool)
+{
+#ifdef ENABLE_POOLS
+	if (!pool)
+		return;
+	if (pool->in_use) {
+		ntfs_log_debug("Pool %s destroyed with %lld objects "
+				"allocated\n", pool->name,
+				(long long)pool->in_use);
+		pool->destroyed = TRUE;
+	} else
+		ntfs_pool_release(pool);
+#endif
+}
+
+/**
+ * ntfs_pool_alloc - allocate an object
+ * @pool:	pool to allocate from, or NULL
+ * @size:	size of the object, the size of the objects of @pool if any
+ *
+ * Return the object, to be freed by ntfs_pool_free(), or NULL with errno
+ * set on error.
+ */
+void *ntfs_pool_alloc(ntfs_pool *pool, size_t size)
+{
+#ifdef ENABLE_POOLS
+	struct ntfs_pool_obj *obj;
+
+	if (!pool || pool->destroyed || size != pool->size) {
+		obj = ntfs_malloc(sizeof(struct ntfs_pool_obj) + size);
+		if (!obj)
+			return NULL;
+		obj->pool = NULL;
+		return obj->payload;
+	}
+	if (!pool->free_list && ntfs_pool_grow(pool))
+		return NULL;
+	obj = pool->free_list;
+	pool->free_list = obj->next;
+	pool->in_use++;
+	pool->allocs++;
+	return obj->payload;
+#else
+	return ntfs_malloc(size);
+#endif
+}
+
+/**
+ * ntfs_pool_calloc - allocate a zeroed object
+ * @pool:	pool to allocate from, or NULL
+ * @size:	size of the object, the size of the objects of @pool if any
+ *
+ * Return the object, to be freed by ntfs_pool_free(), or NULL with errno
+ * set on error.
+ */
+void *ntfs_pool_calloc(ntfs_pool *pool, size_t size)
+{
+	void *p;
+
+	p = ntfs_pool_alloc(pool, size);
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+/**
+ * ntfs_pool_free - free an object
+ * @p:		object allocated by ntfs_pool_alloc(), may be NULL
+ */
+void ntfs_pool_free(void *p)
+{
+#ifdef ENABLE_POOLS
+	struct ntfs_pool_obj *obj;
+	ntfs_pool *pool;
+
+	if (!p)
+		return;
+	obj = (struct ntfs_pool_obj*)((char*)p
+			- offsetof(struct ntfs_pool_obj, payload));
+	pool = obj->pool;
+	if (!pool) {
+		free(obj);
+		return;
+	}
+	obj->next = pool->free_list;
+	pool->free_list = obj;
+	if (!--pool->in_use && pool->destroyed)
+		ntfs_pool_release(pool);
+#else
+	free(p);
+#endif
+}
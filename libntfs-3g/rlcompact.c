@@ -0,0 +1,371 @@
+/**
+ * rlcompact.c - Compact runlists.
+ *
+ * Copyright (c) 2026 ntfsprogs contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * A runlist element takes 24 bytes, so the runlist of a file fragmented
+ * into millions of runs takes tens or hundreds of MB when fully mapped.
+ * A compact runlist keeps the same runs in a few bytes each.  The length
+ * of a run and the difference between its lcn and the lcn of the previous
+ * allocated run are stored as variable length integers, seven bits in a
+ * byte, and the vcn is implied by the lengths of the runs before.
+ *
+ * The runs are grouped in blocks of a fixed number of runs, each starting
+ * afresh from lcn zero, and an index records the first vcn of each block
+ * and where it starts.  A part of the runlist is decoded on demand into a
+ * usual runlist by finding the block containing a vcn in the index, the
+ * parts before and after it being marked as not mapped.
+ *
+ * A compact runlist is read-only, it has to be expanded into a usual
+ * runlist for changing the allocation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "types.h"
+#include "runlist.h"
+#include "rlcompact.h"
+#include "logging.h"
+#include "misc.h"
+
+/* Runs in a block. */
+#define RLC_BLOCK_RUNS		64
+/* Blocks decoded at once. */
+#define RLC_WINDOW_BLOCKS	4
+/* Bytes taken by a run, at most. */
+#define RLC_RUN_MAX		20
+
+/**
+ * struct ntfs_rlc_block -
+ *
+ * Index entry of a block of runs.
+ */
+struct ntfs_rlc_block {
+	VCN vcn;		/* Vcn of the first run. */
+	u32 offset;		/* Offset of the first run in the data. */
+};
+
+/**
+ * struct ntfs_rlc -
+ *
+ * A runlist starting at vcn zero, with its runs encoded.
+ */
+struct ntfs_rlc {
+	u8 *data;		/* The encoded runs. */
+	u32 size;		/* Bytes used in @data. */
+	u32 allocated;		/* Bytes allocated to @data. */
+	struct ntfs_rlc_block *index;
+	int blocks;		/* Entries used in @index. */
+	int allocated_blocks;	/* Entries allocated to @index. */
+	int runs;		/* Runs encoded. */
+	VCN end_vcn;		/* Vcn following the last run. */
+	LCN prev_lcn;		/* Lcn of the last allocated run encoded. */
+};
+
+static u8 *ntfs_rlc_put(u8 *p, u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = (u8)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (u8)v;
+	return (p);
+}
+
+static const u8 *ntfs_rlc_get(const u8 *p, u64 *pv)
+{
+	u64 v;
+	int shift;
+
+	v = 0;
+	shift = 0;
+	do {
+		v |= (u64)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	*pv = v;
+	return (p);
+}
+
+/**
+ * ntfs_rlc_create - create an empty compact runlist
+ *
+ * Return the compact runlist, or NULL with errno set if there is no memory.
+ */
+ntfs_rlc *ntfs_rlc_create(void)
+{
+	return ((ntfs_rlc*)ntfs_calloc(sizeof(ntfs_rlc)));
+}
+
+/**
+ * ntfs_rlc_free - free a compact runlist
+ * @rlc:	compact runlist, or NULL
+ */
+void ntfs_rlc_free(ntfs_rlc *rlc)
+{
+	if (rlc) {
+		free(rlc->data);
+		free(rlc->index);
+		free(rlc);
+	}
+}
+
+/**
+ * ntfs_rlc_append - append runs to a compact runlist
+ * @rlc:	compact runlist
+ * @rl:		runlist holding the runs following those already in @rlc
+ *
+ * The runs of @rl which are not mapped are ignored, so that the runlist
+ * decoded from the mapping pairs of each extent of an attribute can be
+ * appended in turn.  The other runs must be allocated or holes, and follow
+ * the runs in @rlc without a gap.
+ *
+ * Return 0 on success, or -1 with errno set if there is no memory (ENOMEM)
+ * or the runs do not follow (EIO).  The runs appended before an error are
+ * kept.
+ */
+int ntfs_rlc_append(ntfs_rlc *rlc, const runlist_element *rl)
+{
+	struct ntfs_rlc_block *index;
+	u8 *data;
+	u8 *p;
+	u64 code;
+	s64 delta;
+	u32 allocated;
+	int n;
+
+	for (; rl->length; rl++) {
+		if (rl->lcn == LCN_RL_NOT_MAPPED)
+			continue;
+		if ((rl->vcn != rlc->end_vcn) || (rl->length < 0)
+		    || ((rl->lcn < 0) && (rl->lcn != LCN_HOLE))) {
+			ntfs_log_error("Run at vcn 0x%llx cannot be compacted "
+					"after vcn 0x%llx\n",
+					(long long)rl->vcn,
+					(long long)rlc->end_vcn);
+			errno = EIO;
+			return (-1);
+		}
+		if ((rlc->allocated - rlc->size) < RLC_RUN_MAX) {
+			allocated = (rlc->allocated ? 2*rlc->allocated : 4096);
+			data = (u8*)realloc(rlc->data, allocated);
+			if (!data) {
+				errno = ENOMEM;
+				return (-1);
+			}
+			rlc->data = data;
+			rlc->allocated = allocated;
+		}
+		if (!(rlc->runs % RLC_BLOCK_RUNS)) {
+			if (rlc->blocks == rlc->allocated_blocks) {
+				n = (rlc->allocated_blocks ?
+					2*rlc->allocated_blocks : 64);
+				index = (struct ntfs_rlc_block*)realloc(
+					rlc->index,
+					n*sizeof(struct ntfs_rlc_block));
+				if (!index) {
+					errno = ENOMEM;
+					return (-1);
+				}
+				rlc->index = index;
+				rlc->allocated_blocks = n;
+			}
+			rlc->index[rlc->blocks].vcn = rl->vcn;
+			rlc->index[rlc->blocks].offset = rlc->size;
+			rlc->blocks++;
+			rlc->prev_lcn = 0;
+		}
+			/* zero for a hole, the lcn delta zigzagged plus 1 */
+		code = 0;
+		if (rl->lcn != LCN_HOLE) {
+			delta = rl->lcn - rlc->prev_lcn;
+			code = (((u64)delta << 1) ^ (u64)(delta >> 63)) + 1;
+			rlc->prev_lcn = rl->lcn;
+		}
+		p = ntfs_rlc_put(rlc->data + rlc->size, rl->length);
+		p = ntfs_rlc_put(p, code);
+		rlc->size = p - rlc->data;
+		rlc->runs++;
+		rlc->end_vcn += rl->length;
+	}
+	return (0);
+}
+
+/**
+ * ntfs_rlc_runs - get the number of runs in a compact runlist
+ * @rlc:	compact runlist
+ */
+int ntfs_rlc_runs(const ntfs_rlc *rlc)
+{
+	return (rlc->runs);
+}
+
+/**
+ * ntfs_rlc_size - get the memory used by a compact runlist
+ * @rlc:	compact runlist
+ */
+size_t ntfs_rlc_size(const ntfs_rlc *rlc)
+{
+	return (sizeof(ntfs_rlc) + rlc->allocated
+		+ rlc->allocated_blocks*sizeof(struct ntfs_rlc_block));
+}
+
+/*
+ *		Allocate a runlist
+ *
+ * The size is rounded like in runlist.c, which relies on it to avoid
+ * reallocating when extending.
+ */
+
+static runlist_element *ntfs_rlc_alloc_rl(int count)
+{
+	return ((runlist_element*)ntfs_malloc((count*sizeof(runlist_element)
+			+ 0xfff) & ~0xfff));
+}
+
+/*
+ *		Decode the runs of consecutive blocks
+ *
+ * The runs are followed by a terminator, which tells whether more runs
+ * follow.
+ */
+
+static void ntfs_rlc_decode(const ntfs_rlc *rlc,
+		runlist_element *rl, int first, int count)
+{
+	const u8 *p;
+	VCN vcn;
+	LCN lcn;
+	u64 length, code;
+	int i, end;
+
+	end = first*RLC_BLOCK_RUNS + count;
+	if (end > rlc->runs)
+		end = rlc->runs;
+	p = rlc->data + rlc->index[first].offset;
+	vcn = rlc->index[first].vcn;
+	lcn = 0;
+	for (i = first*RLC_BLOCK_RUNS; i < end; i++) {
+		if (!(i % RLC_BLOCK_RUNS))
+			lcn = 0;
+		p = ntfs_rlc_get(p, &length);
+		p = ntfs_rlc_get(p, &code);
+		rl->vcn = vcn;
+		rl->length = length;
+		if (code) {
+			code--;
+			lcn += (s64)((code >> 1) ^ -(code & 1));
+			rl->lcn = lcn;
+		} else
+			rl->lcn = LCN_HOLE;
+		vcn += length;
+		rl++;
+	}
+	rl->vcn = vcn;
+	rl->length = 0;
+	rl->lcn = (end < rlc->runs ? LCN_RL_NOT_MAPPED : LCN_ENOENT);
+}
+
+/**
+ * ntfs_rlc_window - decode the part of a compact runlist around a vcn
+ * @rlc:	compact runlist
+ * @vcn:	vcn to decode
+ *
+ * Decode a few blocks of runs, starting with the one containing @vcn, or
+ * the last one if @vcn is beyond the runlist.  The runs before and after
+ * them are represented as not mapped, as when an attribute extent is
+ * mapped.
+ *
+ * Return the runlist, to be freed by the caller, or NULL with errno set
+ * if there is no memory.
+ */
+runlist_element *ntfs_rlc_window(const ntfs_rlc *rlc, VCN vcn)
+{
+	runlist_element *rl;
+	runlist_element *p;
+	int lo, hi, mid;
+
+	if (!rlc->runs) {
+		rl = ntfs_rlc_alloc_rl(1);
+		if (rl) {
+			rl->vcn = 0;
+			rl->length = 0;
+			rl->lcn = LCN_ENOENT;
+		}
+		return (rl);
+	}
+		/* last block starting at or before vcn */
+	lo = 0;
+	hi = rlc->blocks;
+	while ((hi - lo) > 1) {
+		mid = lo + (hi - lo)/2;
+		if (vcn < rlc->index[mid].vcn)
+			hi = mid;
+		else
+			lo = mid;
+	}
+	rl = ntfs_rlc_alloc_rl(RLC_WINDOW_BLOCKS*RLC_BLOCK_RUNS + 2);
+	if (rl) {
+		p = rl;
+		if (rlc->index[lo].vcn) {
+			p->vcn = 0;
+			p->length = rlc->index[lo].vcn;
+			p->lcn = LCN_RL_NOT_MAPPED;
+			p++;
+		}
+		ntfs_rlc_decode(rlc, p, lo,
+				RLC_WINDOW_BLOCKS*RLC_BLOCK_RUNS);
+	}
+	return (rl);
+}
+
+/**
+ * ntfs_rlc_expand - decode a whole compact runlist
+ * @rlc:	compact runlist
+ *
+ * Return the runlist, to be freed by the caller, or NULL with errno set
+ * if there is no memory.
+ */
+runlist_element *ntfs_rlc_expand(const ntfs_rlc *rlc)
+{
+	runlist_element *rl;
+
+	rl = ntfs_rlc_alloc_rl(rlc->runs + 1);
+	if (rl) {
+		if (rlc->runs)
+			ntfs_rlc_decode(rlc, rl, 0, rlc->runs);
+		else {
+			rl->vcn = 0;
+			rl->length = 0;
+			rl->lcn = LCN_ENOENT;
+		}
+	}
+	return (rl);
+}
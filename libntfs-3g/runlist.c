@@ -138,6 +138,7 @@ runlist_element *ntfs_rl_extend(ntfs_attr *na, runlist_element *rl,
 			rl = (runlist_element*)NULL;
 		} else {
 			na->rl = newrl;
+			ntfs_attr_forget_runs(na);
 			rl = &newrl[irl];
 		}
 	} else {
@@ -753,6 +754,115 @@ runlist_element *ntfs_runlists_merge(runlist_element *drl,
 	return rl;
 }
 
+/*
+ *		Fast access to the numbers in mapping pairs
+ *
+ * A mapping pair is a header byte, its low nibble being the number of
+ * bytes of the run length and its high nibble the number of bytes of the
+ * lcn change, followed by both numbers, signed and little endian.
+ *
+ * Rather than assembling a number byte by byte, eight bytes are loaded at
+ * once, and the bytes beyond the number are shifted out while extending
+ * the sign.  The shift is taken from a table indexed by the number of
+ * bytes, so that no test is needed.  Numbers of more than eight bytes are
+ * not valid, however they were decoded by keeping their eight lowest
+ * bytes, which the table also does.
+ *
+ * A load or store of eight bytes can only be done when the buffer extends
+ * that far, the numbers near the end of a buffer are processed byte by
+ * byte.
+ */
+
+static const u8 ntfs_mp_shift[16] = {
+	64, 56, 48, 40, 32, 24, 16, 8, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/*
+ *		Get a number of @n bytes (1 to 15) from a mapping pair
+ *
+ * @end is the end of the buffer, at least @n bytes beyond @p
+ */
+
+static __inline__ s64 ntfs_mp_get(const u8 *p, int n, const u8 *end)
+{
+	u64 w;
+	s64 v;
+
+	if ((p + 8) <= end) {
+		memcpy(&w, p, 8);
+		w = le64_to_cpu(w);
+		v = (s64)(w << ntfs_mp_shift[n]) >> ntfs_mp_shift[n];
+	} else {
+		for (v = (s8)p[--n]; n; n--)
+			v = (v << 8) + p[n - 1];
+	}
+	return (v);
+}
+
+/*
+ *		Get the number of bytes needed to store a signed number
+ */
+
+static __inline__ int ntfs_mp_size(s64 n)
+{
+	u64 l;
+
+		/* count the bits, plus one for the sign */
+	l = (u64)(n ^ (n >> 63)) | 1;
+#ifdef __GNUC__
+	return ((72 - __builtin_clzll(l)) >> 3);
+#else
+	{
+		int i;
+
+		i = 1;
+		if (l >= 128) {
+			l >>= 7;
+			do {
+				i++;
+				l >>= 8;
+			} while (l);
+		}
+		return (i);
+	}
+#endif
+}
+
+/*
+ *		Put a number of @n bytes into a mapping pair
+ *
+ * When the buffer extends at least eight bytes beyond @p, all of them are
+ * written to, the bytes beyond the number getting garbage.
+ *
+ * Returns the byte following the number
+ */
+
+static __inline__ u8 *ntfs_mp_put(u8 *p, s64 v, int n, const u8 *end)
+{
+	u64 w;
+	int i;
+
+	if ((p + 8) <= end) {
+		w = cpu_to_le64((u64)v);
+		memcpy(p, &w, 8);
+	} else {
+		for (i = 0; i < n; i++) {
+			p[i] = (u8)v;
+			v >>= 8;
+		}
+	}
+	return (p + n);
+}
+
+/*
+ *		Clear the garbage left by ntfs_mp_put() after the terminator
+ */
+
+static __inline__ void ntfs_mp_clean(u8 *p, const u8 *end)
+{
+	memset(p, 0, (end - p) < 7 ? end - p : 7);
+}
+
 /**
  * ntfs_mapping_pairs_decompress_i - convert mapping pairs array to runlist
  * @vol:	ntfs volume on which the attribute resides
@@ -868,8 +978,7 @@ runlist_element *ntfs_mapping_pairs_decompress_i(const ntfs_volume *vol,
 		if (b) {
 			if (buf + b > attr_end)
 				goto io_error;
-			for (deltaxcn = (s8)buf[b--]; b; b--)
-				deltaxcn = (deltaxcn << 8) + buf[b];
+			deltaxcn = ntfs_mp_get(buf + 1, b, attr_end);
 		} else { /* The length entry is compulsory. */
 			ntfs_log_error("Missing length entry in mapping pairs array.\n");
 			deltaxcn = (s64)-1;
@@ -908,8 +1017,7 @@ runlist_element *ntfs_mapping_pairs_decompress_i(const ntfs_volume *vol,
 			b = b2 + ((*buf >> 4) & 0xf);
 			if (buf + b > attr_end)
 				goto io_error;
-			for (deltaxcn = (s8)buf[b--]; b > b2; b--)
-				deltaxcn = (deltaxcn << 8) + buf[b];
+			deltaxcn = ntfs_mp_get(buf + 1 + b2, b - b2, attr_end);
 			/* Change the current lcn to it's new value. */
 			lcn += deltaxcn;
 #ifdef DEBUG
@@ -1112,6 +1220,188 @@ runlist_element *ntfs_mapping_pairs_decompress_on_fsck(const ntfs_volume *vol,
 	return rle;
 }
 
+/**
+ * ntfs_mapping_pairs_count - count the mapping pairs of an attribute
+ * @attr:	non-resident attribute record
+ *
+ * Count the mapping pairs in the mapping pairs array of @attr, which is
+ * the number of runlist elements they decode into, not counting the
+ * zero-sized holes.  Nothing is checked beyond the pairs fitting into the
+ * attribute record.
+ *
+ * Return the number of mapping pairs, or -1 with errno set to EIO if
+ * the mapping pairs array overflows the attribute record.
+ */
+int ntfs_mapping_pairs_count(const ATTR_RECORD *attr)
+{
+	const u8 *buf;
+	const u8 *attr_end;
+	int count;
+
+	buf = (const u8*)attr + le16_to_cpu(attr->mapping_pairs_offset);
+	attr_end = (const u8*)attr + le32_to_cpu(attr->length);
+	count = 0;
+	while ((buf < attr_end) && *buf) {
+		buf += (*buf & 0xf) + ((*buf >> 4) & 0xf) + 1;
+		count++;
+	}
+	if (buf >= attr_end) {
+		errno = EIO;
+		return (-1);
+	}
+	return (count);
+}
+
+/**
+ * ntfs_mapping_pairs_decode - decode mapping pairs into a runlist array
+ * @vol:	ntfs volume on which the attribute resides
+ * @attr:	non-resident attribute record whose mapping pairs to decode
+ * @rl:		where to store the runlist elements
+ *
+ * Decode the mapping pairs array of the extent @attr into the runlist
+ * elements starting at @rl, which must have room for the number of pairs
+ * returned by ntfs_mapping_pairs_count().  The first element starts at the
+ * lowest vcn of @attr, and unlike ntfs_mapping_pairs_decompress() neither
+ * a not mapped part nor a terminator is added, so that the extents of an
+ * attribute can be decoded one after the other into the same array.
+ *
+ * The checks are the ones of ntfs_mapping_pairs_decompress(), though
+ * nothing is logged, the caller being expected to fall back to it when
+ * the mapping pairs are found to be corrupt.
+ *
+ * Return the number of runlist elements stored, or -1 with errno set to
+ * EIO if the mapping pairs array is corrupt.
+ */
+int ntfs_mapping_pairs_decode(const ntfs_volume *vol,
+		const ATTR_RECORD *attr, runlist_element *rl)
+{
+	const u8 *buf;
+	const u8 *attr_end;
+	VCN vcn;
+	LCN lcn;
+	s64 deltaxcn;
+	s64 highest_vcn;
+	int rlpos;
+	u8 b, b2;
+
+	vcn = sle64_to_cpu(attr->lowest_vcn);
+	lcn = 0;
+	buf = (const u8*)attr + le16_to_cpu(attr->mapping_pairs_offset);
+	attr_end = (const u8*)attr + le32_to_cpu(attr->length);
+	if ((vcn < 0) || (buf < (const u8*)attr) || (buf > attr_end))
+		goto io_error;
+	rlpos = 0;
+	while ((buf < attr_end) && *buf) {
+		b2 = *buf & 0xf;
+		b = b2 + ((*buf >> 4) & 0xf);
+			/* The length entry is compulsory and positive */
+		if (!b2 || (buf + b >= attr_end))
+			goto io_error;
+		deltaxcn = ntfs_mp_get(buf + 1, b2, attr_end);
+		if (deltaxcn < 0)
+			goto io_error;
+		rl[rlpos].vcn = vcn;
+		rl[rlpos].length = deltaxcn;
+		vcn += deltaxcn;
+		if (!(*buf & 0xf0))
+			rl[rlpos].lcn = (LCN)LCN_HOLE;
+		else {
+			lcn += ntfs_mp_get(buf + 1 + b2, b - b2, attr_end);
+				/* chkdsk accepts zero-sized runs only for holes */
+			if ((lcn < (LCN)-1)
+			    || ((lcn != (LCN)-1) && !rl[rlpos].length))
+				goto io_error;
+			rl[rlpos].lcn = lcn;
+		}
+			/* skip zero-sized holes */
+		if (rl[rlpos].length)
+			rlpos++;
+		buf += b + 1;
+	}
+	highest_vcn = sle64_to_cpu(attr->highest_vcn);
+	if ((buf >= attr_end) || (highest_vcn && (vcn - 1 != highest_vcn)))
+		goto io_error;
+	return (rlpos);
+io_error:
+	errno = EIO;
+	return (-1);
+}
+
+/**
+ * ntfs_mapping_pairs_seek - locate the mapping pair starting at a vcn
+ * @attr:	non-resident attribute record whose mapping pairs to walk
+ * @vcn:	vcn at which the wanted mapping pair starts
+ * @last:	where to store the run of the mapping pair preceding it
+ * @prev_lcn:	where to store the last lcn before the wanted pair
+ *
+ * Walk the mapping pairs array of the extent @attr up to the pair starting
+ * at @vcn, or to the terminator if @vcn is the end of the extent, so that
+ * the pairs from there can be rebuilt by ntfs_mapping_pairs_build_tail()
+ * while the ones before are kept.  The run described by the preceding
+ * pair is returned in @last, with a zero length if there is none, and the
+ * lcn the next change in lcn is relative to is returned in @prev_lcn.
+ *
+ * Return the offset of the pair from the start of the mapping pairs array,
+ * or -1 with errno set to ENOENT if no pair starts at @vcn, or to EIO if
+ * the mapping pairs array is corrupt.
+ */
+int ntfs_mapping_pairs_seek(const ATTR_RECORD *attr, const VCN vcn,
+		runlist_element *last, LCN *prev_lcn)
+{
+	const u8 *start;
+	const u8 *buf;
+	const u8 *attr_end;
+	VCN next_vcn;
+	LCN lcn;
+	s64 length;
+	u8 b, b2;
+
+	next_vcn = sle64_to_cpu(attr->lowest_vcn);
+	lcn = 0;
+	start = (const u8*)attr + le16_to_cpu(attr->mapping_pairs_offset);
+	attr_end = (const u8*)attr + le32_to_cpu(attr->length);
+	if ((next_vcn < 0) || (start < (const u8*)attr) || (start > attr_end))
+		goto io_error;
+	last->vcn = next_vcn;
+	last->lcn = LCN_HOLE;
+	last->length = 0;
+	buf = start;
+	while ((next_vcn < vcn) && (buf < attr_end) && *buf) {
+		b2 = *buf & 0xf;
+		b = b2 + ((*buf >> 4) & 0xf);
+		if (!b2 || (buf + b >= attr_end))
+			goto io_error;
+		length = ntfs_mp_get(buf + 1, b2, attr_end);
+		if (length < 0)
+			goto io_error;
+		if (length) {
+			last->vcn = next_vcn;
+			last->length = length;
+			last->lcn = LCN_HOLE;
+		}
+		if (*buf & 0xf0) {
+			lcn += ntfs_mp_get(buf + 1 + b2, b - b2, attr_end);
+			if (lcn < (LCN)-1)
+				goto io_error;
+			if (length)
+				last->lcn = lcn;
+		}
+		next_vcn += length;
+		buf += b + 1;
+	}
+	if (buf >= attr_end)
+		goto io_error;
+	if (next_vcn != vcn) {
+		errno = ENOENT;
+		return (-1);
+	}
+	*prev_lcn = lcn;
+	return (buf - start);
+io_error:
+	errno = EIO;
+	return (-1);
+}
+
 /**
  * ntfs_rl_vcn_to_lcn - convert a vcn into a lcn given a runlist
  * @rl:		runlist to use for conversion
@@ -1166,6 +1456,71 @@ LCN ntfs_rl_vcn_to_lcn(const runlist_element *rl, const VCN vcn)
 	return (LCN)LCN_ENOENT;
 }
 
+/**
+ * ntfs_rl_find_run - find the run containing a vcn by a binary search
+ * @rl:		runlist to search
+ * @runs:	number of runs in @rl, not counting the terminator
+ * @vcn:	vcn to find
+ *
+ * The runs of a runlist follow each other with no gap in the vcns, including
+ * the parts which have not been mapped yet (LCN_RL_NOT_MAPPED), so the run
+ * containing @vcn is found by a binary search on the starting vcns, when the
+ * number of runs is known.
+ *
+ * Return the index of the run containing @vcn, @runs if @vcn is beyond the
+ * last run, so that the terminator tells why, or -1 if @vcn is before the
+ * first run.
+ */
+int ntfs_rl_find_run(const runlist_element *rl, int runs, const VCN vcn)
+{
+	int lo, hi, mid;
+
+	if (vcn < rl[0].vcn)
+		return (-1);
+	if (vcn >= rl[runs].vcn)
+		return (runs);
+		/* rl[lo].vcn <= vcn < rl[hi].vcn */
+	lo = 0;
+	hi = runs;
+	while ((hi - lo) > 1) {
+		mid = lo + (hi - lo)/2;
+		if (vcn < rl[mid].vcn)
+			hi = mid;
+		else
+			lo = mid;
+	}
+	return (lo);
+}
+
+/**
+ * ntfs_rl_vio_flush - perform the transfer gathered by a runlist walk
+ * @vol:	ntfs volume to transfer to or from
+ * @vio:	transfer gathered so far
+ * @wr:		TRUE to write, FALSE to read
+ * @b0:		start of the linear buffer being gathered
+ * @total:	bytes of @b0 accounted as transferred
+ * @err:	where to store the error code
+ *
+ * Flush @vio.  If the transfer is incomplete, reduce @total to the part of
+ * @b0 which was really transferred and set @err.
+ *
+ * Return 0 if everything gathered was transferred and -1 otherwise.
+ */
+static int ntfs_rl_vio_flush(const ntfs_volume *vol, struct ntfs_vio *vio,
+		BOOL wr, void *b0, s64 *total, int *err)
+{
+	s64 expected, done;
+	void *stop;
+
+	expected = vio->count;
+	done = ntfs_vio_flush(vol->dev, vio, wr, &stop);
+	if (done == expected)
+		return 0;
+	*err = done < 0 ? errno : EIO;
+	*total = (u8*)stop - (u8*)b0;
+	return -1;
+}
+
 /**
  * ntfs_rl_pread - gather read from disk
  * @vol:	ntfs volume to read from
@@ -1193,7 +1548,9 @@ LCN ntfs_rl_vcn_to_lcn(const runlist_element *rl, const VCN vcn)
 s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		const s64 pos, s64 count, void *b)
 {
-	s64 bytes_read, to_read, ofs, total;
+	struct ntfs_vio vio;
+	s64 to_read, ofs, total;
+	void *b0 = b;
 	int err = EIO;
 
 	if (!vol || !rl || pos < 0 || count < 0) {
@@ -1211,6 +1568,11 @@ s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		ofs += (rl->length << vol->cluster_size_bits);
 	/* Offset in the run at which to begin reading. */
 	ofs = pos - ofs;
+	/*
+	 * Runs which follow each other on disk are gathered into a single
+	 * vectored read, even when separated by holes.
+	 */
+	ntfs_vio_init(&vio);
 	for (total = 0LL; count; rl++, ofs = 0) {
 		if (!rl->length)
 			goto rl_err_out;
@@ -1227,29 +1589,28 @@ s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 			b = (u8*)b + to_read;
 			continue;
 		}
-		/* It is a real lcn, read it from the volume. */
+		/* It is a real lcn, queue it for reading from the volume. */
 		to_read = min(count, (rl->length << vol->cluster_size_bits) -
 				ofs);
-retry:
-		bytes_read = ntfs_pread(vol->dev, (rl->lcn <<
-				vol->cluster_size_bits) + ofs, to_read, b);
-		/* If everything ok, update progress counters and continue. */
-		if (bytes_read > 0) {
-			total += bytes_read;
-			count -= bytes_read;
-			b = (u8*)b + bytes_read;
-			continue;
+		if (!ntfs_vio_add(&vio, (rl->lcn << vol->cluster_size_bits) +
+				ofs, b, to_read)) {
+			if (ntfs_rl_vio_flush(vol, &vio, FALSE, b0, &total,
+					&err))
+				goto rl_err_out;
+			ntfs_vio_add(&vio, (rl->lcn << vol->cluster_size_bits)
+					+ ofs, b, to_read);
 		}
-		/* If the syscall was interrupted, try again. */
-		if (bytes_read == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (bytes_read == (s64)-1)
-			err = errno;
-		goto rl_err_out;
+		total += to_read;
+		count -= to_read;
+		b = (u8*)b + to_read;
 	}
+	if (ntfs_rl_vio_flush(vol, &vio, FALSE, b0, &total, &err))
+		goto rl_err_out;
 	/* Finally, return the number of bytes read. */
 	return total;
 rl_err_out:
+	/* Complete the reads queued before the bad run. */
+	ntfs_rl_vio_flush(vol, &vio, FALSE, b0, &total, &err);
 	if (total)
 		return total;
 	errno = err;
@@ -1282,7 +1643,9 @@ rl_err_out:
 s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 		s64 ofs, const s64 pos, s64 count, void *b)
 {
-	s64 written, to_write, total = 0;
+	struct ntfs_vio vio;
+	s64 to_write, total = 0;
+	void *b0 = b;
 	int err = EIO;
 
 	if (!vol || !rl || pos < 0 || count < 0) {
@@ -1302,6 +1665,8 @@ s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 	}
 	/* Offset in the run at which to begin writing. */
 	ofs = pos - ofs;
+	/* Runs which follow each other on disk are written together. */
+	ntfs_vio_init(&vio);
 	for (total = 0LL; count; rl++, ofs = 0) {
 		if (!rl->length)
 			goto rl_err_out;
@@ -1318,33 +1683,28 @@ s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 			b = (u8*)b + to_write;
 			continue;
 		}
-		/* It is a real lcn, write it to the volume. */
+		/* It is a real lcn, queue it for writing to the volume. */
 		to_write = min(count, (rl->length << vol->cluster_size_bits) -
 				ofs);
-retry:
-		if (!NVolReadOnly(vol))
-			written = ntfs_pwrite(vol->dev, (rl->lcn <<
-					vol->cluster_size_bits) + ofs,
-					to_write, b);
-		else
-			written = to_write;
-		/* If everything ok, update progress counters and continue. */
-		if (written > 0) {
-			total += written;
-			count -= written;
-			b = (u8*)b + written;
-			continue;
+		if (!NVolReadOnly(vol) && !ntfs_vio_add(&vio, (rl->lcn <<
+				vol->cluster_size_bits) + ofs, b, to_write)) {
+			if (ntfs_rl_vio_flush(vol, &vio, TRUE, b0, &total,
+					&err))
+				goto rl_err_out;
+			ntfs_vio_add(&vio, (rl->lcn << vol->cluster_size_bits)
+					+ ofs, b, to_write);
 		}
-		/* If the syscall was interrupted, try again. */
-		if (written == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (written == (s64)-1)
-			err = errno;
-		goto rl_err_out;
+		total += to_write;
+		count -= to_write;
+		b = (u8*)b + to_write;
 	}
+	if (ntfs_rl_vio_flush(vol, &vio, TRUE, b0, &total, &err))
+		goto rl_err_out;
 out:
 	return total;
 rl_err_out:
+	/* Complete the writes queued before the bad run. */
+	ntfs_rl_vio_flush(vol, &vio, TRUE, b0, &total, &err);
 	if (total)
 		goto out;
 	errno = err;
@@ -1368,45 +1728,20 @@ errno_set:
  */
 int ntfs_get_nr_significant_bytes(const s64 n)
 {
-	u64 l;
-	int i;
-
-	l = (n < 0 ? ~n : n);
-	i = 1;
-	if (l >= 128) {
-		l >>= 7;
-		do {
-			i++;
-			l >>= 8;
-		} while (l);
-	}
-	return i;
+	return (ntfs_mp_size(n));
 }
 
-/**
- * ntfs_get_size_for_mapping_pairs - get bytes needed for mapping pairs array
- * @vol:	ntfs volume (needed for the ntfs version)
- * @rl:		runlist for which to determine the size of the mapping pairs
- * @start_vcn:	vcn at which to start the mapping pairs array
- *
- * Walk the runlist @rl and calculate the size in bytes of the mapping pairs
- * array corresponding to the runlist @rl, starting at vcn @start_vcn.  This
- * for example allows us to allocate a buffer of the right size when building
- * the mapping pairs array.
- *
- * If @rl is NULL, just return 1 (for the single terminator byte).
+/*
+ *		Get the size of mapping pairs following an lcn
  *
- * Return the calculated size in bytes on success.  On error, return -1 with
- * errno set to the error code.  The following error codes are defined:
- *	EINVAL	- Run list contains unmapped elements. Make sure to only pass
- *		  fully mapped runlists to this function.
- *		- @start_vcn is invalid.
- *	EIO	- The runlist is corrupt.
+ * This is ntfs_get_size_for_mapping_pairs() for pairs to be appended to
+ * pairs whose last lcn is @prev_lcn, which is 0 for a new array.
  */
-int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
-		const runlist_element *rl, const VCN start_vcn, int max_size)
+
+static int ntfs_get_size_for_mapping_pairs_i(const ntfs_volume *vol,
+		const runlist_element *rl, const VCN start_vcn, LCN prev_lcn,
+		int max_size)
 {
-	LCN prev_lcn;
 	int rls;
 
 	if (start_vcn < 0) {
@@ -1432,19 +1767,19 @@ int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		errno = EINVAL;
 		goto errno_set;
 	}
-	prev_lcn = 0;
 	/* Always need the terminating zero byte. */
 	rls = 1;
 	/* Do the first partial run if present. */
 	if (start_vcn > rl->vcn) {
 		s64 delta;
+		LCN lcn;
 
 		/* We know rl->length != 0 already. */
 		if (rl->length < 0 || rl->lcn < LCN_HOLE)
 			goto err_out;
 		delta = start_vcn - rl->vcn;
 		/* Header byte + length. */
-		rls += 1 + ntfs_get_nr_significant_bytes(rl->length - delta);
+		rls += 1 + ntfs_mp_size(rl->length - delta);
 		/*
 		 * If the logical cluster number (lcn) denotes a hole and we
 		 * are on NTFS 3.0+, we don't store it at all, i.e. we need
@@ -1453,11 +1788,12 @@ int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		 * an lcn of -1 and not a delta_lcn of -1 (unless both are -1).
 		 */
 		if (rl->lcn >= 0 || vol->major_ver < 3) {
-			prev_lcn = rl->lcn;
+			lcn = rl->lcn;
 			if (rl->lcn >= 0)
-				prev_lcn += delta;
+				lcn += delta;
 			/* Change in lcn. */
-			rls += ntfs_get_nr_significant_bytes(prev_lcn);
+			rls += ntfs_mp_size(lcn - prev_lcn);
+			prev_lcn = lcn;
 		}
 		/* Go to next runlist element. */
 		rl++;
@@ -1467,7 +1803,7 @@ int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		if (rl->length < 0 || rl->lcn < LCN_HOLE)
 			goto err_out;
 		/* Header byte + length. */
-		rls += 1 + ntfs_get_nr_significant_bytes(rl->length);
+		rls += 1 + ntfs_mp_size(rl->length);
 		/*
 		 * If the logical cluster number (lcn) denotes a hole and we
 		 * are on NTFS 3.0+, we don't store it at all, i.e. we need
@@ -1477,7 +1813,7 @@ int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		 */
 		if (rl->lcn >= 0 || vol->major_ver < 3) {
 			/* Change in lcn. */
-			rls += ntfs_get_nr_significant_bytes(rl->lcn -
+			rls += ntfs_mp_size(rl->lcn -
 					prev_lcn);
 			prev_lcn = rl->lcn;
 		}
@@ -1494,6 +1830,56 @@ errno_set:
 	goto out;
 }
 
+/**
+ * ntfs_get_size_for_mapping_pairs - get bytes needed for mapping pairs array
+ * @vol:	ntfs volume (needed for the ntfs version)
+ * @rl:		runlist for which to determine the size of the mapping pairs
+ * @start_vcn:	vcn at which to start the mapping pairs array
+ *
+ * Walk the runlist @rl and calculate the size in bytes of the mapping pairs
+ * array corresponding to the runlist @rl, starting at vcn @start_vcn.  This
+ * for example allows us to allocate a buffer of the right size when building
+ * the mapping pairs array.
+ *
+ * If @rl is NULL, just return 1 (for the single terminator byte).
+ *
+ * Return the calculated size in bytes on success.  On error, return -1 with
+ * errno set to the error code.  The following error codes are defined:
+ *	EINVAL	- Run list contains unmapped elements. Make sure to only pass
+ *		  fully mapped runlists to this function.
+ *		- @start_vcn is invalid.
+ *	EIO	- The runlist is corrupt.
+ */
+int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
+		const runlist_element *rl, const VCN start_vcn, int max_size)
+{
+	return (ntfs_get_size_for_mapping_pairs_i(vol, rl, start_vcn,
+			0, max_size));
+}
+
+/**
+ * ntfs_get_size_for_mapping_pairs_tail - get bytes needed for appended pairs
+ * @vol:	ntfs volume (needed for the ntfs version)
+ * @rl:		runlist for which to determine the size of the mapping pairs
+ * @start_vcn:	vcn at which to start the appended mapping pairs
+ * @prev_lcn:	last lcn stored in the mapping pairs appended to
+ *
+ * Same as ntfs_get_size_for_mapping_pairs(), for mapping pairs to be
+ * appended by ntfs_mapping_pairs_build_tail() to existing ones, @prev_lcn
+ * being the lcn the first change in lcn is relative to.
+ */
+int ntfs_get_size_for_mapping_pairs_tail(const ntfs_volume *vol,
+		const runlist_element *rl, const VCN start_vcn,
+		const LCN prev_lcn, int max_size)
+{
+	if (!rl) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (ntfs_get_size_for_mapping_pairs_i(vol, rl, start_vcn,
+			prev_lcn, max_size));
+}
+
 /**
  * ntfs_write_significant_bytes - write the significant bytes of a number
  * @dst:	destination buffer to write to
@@ -1535,43 +1921,20 @@ err_out:
 	return -1;
 }
 
-/**
- * ntfs_mapping_pairs_build - build the mapping pairs array from a runlist
- * @vol:	ntfs volume (needed for the ntfs version)
- * @dst:	destination buffer to which to write the mapping pairs array
- * @dst_len:	size of destination buffer @dst in bytes
- * @rl:		runlist for which to build the mapping pairs array
- * @start_vcn:	vcn at which to start the mapping pairs array
- * @stop_vcn:	first vcn outside destination buffer on success or ENOSPC error
- *
- * Create the mapping pairs array from the runlist @rl, starting at vcn
- * @start_vcn and save the array in @dst.  @dst_len is the size of @dst in
- * bytes and it should be at least equal to the value obtained by calling
- * ntfs_get_size_for_mapping_pairs().
- *
- * If @rl is NULL, just write a single terminator byte to @dst.
- *
- * On success or ENOSPC error, if @stop_vcn is not NULL, *@stop_vcn is set to
- * the first vcn outside the destination buffer. Note that on error @dst has
- * been filled with all the mapping pairs that will fit, thus it can be treated
- * as partial success, in that a new attribute extent needs to be created or the
- * next extent has to be used and the mapping pairs build has to be continued
- * with @start_vcn set to *@stop_vcn.
+/*
+ *		Build mapping pairs following an lcn
  *
- * Return 0 on success.  On error, return -1 with errno set to the error code.
- * The following error codes are defined:
- *	EINVAL	- Run list contains unmapped elements. Make sure to only pass
- *		  fully mapped runlists to this function.
- *		- @start_vcn is invalid.
- *	EIO	- The runlist is corrupt.
- *	ENOSPC	- The destination buffer is too small.
+ * This is ntfs_mapping_pairs_build() for pairs appended to pairs whose
+ * last lcn is @prev_lcn, which is 0 for a new array.
  */
-int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
+
+static int ntfs_mapping_pairs_build_i(const ntfs_volume *vol, u8 *dst,
 		const int dst_len, const runlist_element *rl,
-		const VCN start_vcn, runlist_element const **stop_rl)
+		const VCN start_vcn, LCN prev_lcn,
+		runlist_element const **stop_rl)
 {
-	LCN prev_lcn;
-	u8 *dst_max, *dst_next;
+	s64 delta_lcn;
+	u8 *dst_max, *dst_next, *dst_end;
 	s8 len_len, lcn_len;
 	int ret = 0;
 
@@ -1592,24 +1955,22 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 	if ((!rl->length && start_vcn > rl->vcn) || start_vcn < rl->vcn)
 		goto val_err;
 	/*
-	 * @dst_max is used for bounds checking in
-	 * ntfs_write_significant_bytes().
+	 * @dst_max is used for bounds checking, @dst_end tells how far
+	 * whole words can be stored.
 	 */
 	dst_max = dst + dst_len - 1;
-	prev_lcn = 0;
+	dst_end = dst + dst_len;
 	/* Do the first partial run if present. */
 	if (start_vcn > rl->vcn) {
 		s64 delta;
+		LCN lcn;
 
 		/* We know rl->length != 0 already. */
 		if (rl->length < 0 || rl->lcn < LCN_HOLE)
 			goto err_out;
 		delta = start_vcn - rl->vcn;
-		/* Write length. */
-		len_len = ntfs_write_significant_bytes(dst + 1, dst_max,
-				rl->length - delta);
-		if (len_len < 0)
-			goto size_err;
+		/* Get the size of length. */
+		len_len = ntfs_mp_size(rl->length - delta);
 		/*
 		 * If the logical cluster number (lcn) denotes a hole and we
 		 * are on NTFS 3.0+, we don't store it at all, i.e. we need
@@ -1620,19 +1981,23 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		 * change until someone tells us otherwise... (AIA)
 		 */
 		if (rl->lcn >= 0 || vol->major_ver < 3) {
-			prev_lcn = rl->lcn;
+			lcn = rl->lcn;
 			if (rl->lcn >= 0)
-				prev_lcn += delta;
-			/* Write change in lcn. */
-			lcn_len = ntfs_write_significant_bytes(dst + 1 +
-					len_len, dst_max, prev_lcn);
-			if (lcn_len < 0)
-				goto size_err;
-		} else
+				lcn += delta;
+			delta_lcn = lcn - prev_lcn;
+			lcn_len = ntfs_mp_size(delta_lcn);
+		} else {
+			lcn = prev_lcn;
+			delta_lcn = 0;
 			lcn_len = 0;
+		}
 		dst_next = dst + len_len + lcn_len + 1;
 		if (dst_next > dst_max)
 			goto size_err;
+		/* Write length and change in lcn. */
+		ntfs_mp_put(ntfs_mp_put(dst + 1, rl->length - delta, len_len,
+				dst_end), delta_lcn, lcn_len, dst_end);
+		prev_lcn = lcn;
 		/* Update header byte. */
 		*dst = lcn_len << 4 | len_len;
 		/* Position at next mapping pairs array element. */
@@ -1644,11 +2009,8 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 	for (; rl->length; rl++) {
 		if (rl->length < 0 || rl->lcn < LCN_HOLE)
 			goto err_out;
-		/* Write length. */
-		len_len = ntfs_write_significant_bytes(dst + 1, dst_max,
-				rl->length);
-		if (len_len < 0)
-			goto size_err;
+		/* Get the size of length. */
+		len_len = ntfs_mp_size(rl->length);
 		/*
 		 * If the logical cluster number (lcn) denotes a hole and we
 		 * are on NTFS 3.0+, we don't store it at all, i.e. we need
@@ -1659,25 +2021,32 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		 * change until someone tells us otherwise... (AIA)
 		 */
 		if (rl->lcn >= 0 || vol->major_ver < 3) {
-			/* Write change in lcn. */
-			lcn_len = ntfs_write_significant_bytes(dst + 1 +
-					len_len, dst_max, rl->lcn - prev_lcn);
-			if (lcn_len < 0)
-				goto size_err;
-			prev_lcn = rl->lcn;
-		} else
+			delta_lcn = rl->lcn - prev_lcn;
+			lcn_len = ntfs_mp_size(delta_lcn);
+		} else {
+			delta_lcn = 0;
 			lcn_len = 0;
+		}
 		dst_next = dst + len_len + lcn_len + 1;
 		if (dst_next > dst_max)
 			goto size_err;
+		/* Write length and change in lcn. */
+		ntfs_mp_put(ntfs_mp_put(dst + 1, rl->length, len_len,
+				dst_end), delta_lcn, lcn_len, dst_end);
+		if (lcn_len)
+			prev_lcn = rl->lcn;
 		/* Update header byte. */
 		*dst = lcn_len << 4 | len_len;
 		/* Position at next mapping pairs array element. */
-		dst += 1 + len_len + lcn_len;
+		dst = dst_next;
 	}
 	/* Set stop vcn. */
 	if (stop_rl)
 		*stop_rl = rl;
+	/* Add terminator byte. */
+	*dst = 0;
+	ntfs_mp_clean(dst + 1, dst_end);
+	goto out;
 ok:	
 	/* Add terminator byte. */
 	*dst = 0;
@@ -1689,6 +2058,7 @@ size_err:
 		*stop_rl = rl;
 	/* Add terminator byte. */
 	*dst = 0;
+	ntfs_mp_clean(dst + 1, dst_end);
 nospc_err:
 	errno = ENOSPC;
 	goto errno_set;
@@ -1705,6 +2075,75 @@ errno_set:
 	goto out;
 }
 
+/**
+ * ntfs_mapping_pairs_build - build the mapping pairs array from a runlist
+ * @vol:	ntfs volume (needed for the ntfs version)
+ * @dst:	destination buffer to which to write the mapping pairs array
+ * @dst_len:	size of destination buffer @dst in bytes
+ * @rl:		runlist for which to build the mapping pairs array
+ * @start_vcn:	vcn at which to start the mapping pairs array
+ * @stop_vcn:	first vcn outside destination buffer on success or ENOSPC error
+ *
+ * Create the mapping pairs array from the runlist @rl, starting at vcn
+ * @start_vcn and save the array in @dst.  @dst_len is the size of @dst in
+ * bytes and it should be at least equal to the value obtained by calling
+ * ntfs_get_size_for_mapping_pairs().
+ *
+ * If @rl is NULL, just write a single terminator byte to @dst.  Otherwise
+ * up to seven bytes following the terminator may be zeroed.
+ *
+ * On success or ENOSPC error, if @stop_vcn is not NULL, *@stop_vcn is set to
+ * the first vcn outside the destination buffer. Note that on error @dst has
+ * been filled with all the mapping pairs that will fit, thus it can be treated
+ * as partial success, in that a new attribute extent needs to be created or the
+ * next extent has to be used and the mapping pairs build has to be continued
+ * with @start_vcn set to *@stop_vcn.
+ *
+ * Return 0 on success.  On error, return -1 with errno set to the error code.
+ * The following error codes are defined:
+ *	EINVAL	- Run list contains unmapped elements. Make sure to only pass
+ *		  fully mapped runlists to this function.
+ *		- @start_vcn is invalid.
+ *	EIO	- The runlist is corrupt.
+ *	ENOSPC	- The destination buffer is too small.
+ */
+int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
+		const int dst_len, const runlist_element *rl,
+		const VCN start_vcn, runlist_element const **stop_rl)
+{
+	return (ntfs_mapping_pairs_build_i(vol, dst, dst_len, rl,
+			start_vcn, 0, stop_rl));
+}
+
+/**
+ * ntfs_mapping_pairs_build_tail - append mapping pairs to existing ones
+ * @vol:	ntfs volume (needed for the ntfs version)
+ * @dst:	where to write the appended mapping pairs
+ * @dst_len:	size of destination buffer @dst in bytes
+ * @rl:		runlist for which to build the mapping pairs
+ * @start_vcn:	vcn at which to start the appended mapping pairs
+ * @prev_lcn:	last lcn stored in the mapping pairs appended to
+ * @stop_rl:	first runlist element outside destination buffer
+ *
+ * Same as ntfs_mapping_pairs_build(), except that @dst follows existing
+ * mapping pairs, overwriting their terminator, so that the first change
+ * in lcn is relative to @prev_lcn, as got from ntfs_mapping_pairs_seek().
+ * @dst_len should be at least the value returned by
+ * ntfs_get_size_for_mapping_pairs_tail().
+ */
+int ntfs_mapping_pairs_build_tail(const ntfs_volume *vol, u8 *dst,
+		const int dst_len, const runlist_element *rl,
+		const VCN start_vcn, const LCN prev_lcn,
+		runlist_element const **stop_rl)
+{
+	if (!rl) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (ntfs_mapping_pairs_build_i(vol, dst, dst_len, rl,
+			start_vcn, prev_lcn, stop_rl));
+}
+
 /**
  * ntfs_rl_truncate - truncate a runlist starting at a specified vcn
  * @arl:	address of runlist to truncate
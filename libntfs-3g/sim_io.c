@@ -0,0 +1,372 @@
+/**
+ * sim_io.c - Disk io functions simulating a slow device.
+ *
+ * Copyright (c) 2026 ntfsprogs contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * The transfers are performed by the unix_io operations, then delayed so
+ * that the time they take is that of a device with the configured
+ * characteristics, see ntfs_device_sim_io_configure().  Each transfer costs
+ *
+ *	latency + seek * distance / device size + count / bandwidth
+ *
+ * where distance is how far the transfer starts from where the previous one
+ * ended, so that sequential transfers do not pay for seeking.  This lets the
+ * effect of access patterns on rotating or throttled storage be measured on
+ * fast local storage.
+ *
+ * Short delays are not slept one by one, which would be dominated by the
+ * timer resolution, they are accumulated until they are worth sleeping.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include "types.h"
+#include "debug.h"
+#include "device.h"
+#include "logging.h"
+#include "misc.h"
+
+/* Delays shorter than this many microseconds are accumulated. */
+#define SIM_IO_MIN_SLEEP	1000
+
+/**
+ * struct sim_io_params -
+ *
+ * Characteristics of the simulated device, all zero meaning no delay.
+ */
+struct sim_io_params {
+	s64 latency;		/* Microseconds added to every transfer. */
+	s64 seek;		/* Microseconds to seek across the device. */
+	s64 bandwidth;		/* Bytes per second, 0 for unlimited. */
+};
+
+static struct sim_io_params sim_io_params;
+
+/**
+ * struct sim_io_private -
+ *
+ * Private data of an open simulated device.  The file descriptor must come
+ * first, the unix_io operations see the private data as a pointer to it.
+ */
+struct sim_io_private {
+	int fd;				/* Device file descriptor. */
+	struct sim_io_params params;	/* Copied when opening. */
+	s64 size;			/* Size of the device, 0 if unknown. */
+	s64 pos;			/* Where the last transfer ended. */
+	s64 offset;			/* File offset for read and write. */
+	s64 pending;			/* Microseconds not slept yet. */
+};
+
+#define SIM_PRIV(dev)	((struct sim_io_private *)(dev)->d_private)
+
+/**
+ * sim_io_parse_number - parse a number with an optional binary suffix
+ */
+static int sim_io_parse_number(const char *s, char **end, s64 *value)
+{
+	long long v;
+
+	errno = 0;
+	v = strtoll(s, end, 10);
+	if (errno || *end == s || v < 0)
+		return -1;
+	switch (**end) {
+	case 'G': case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		v <<= 10;
+		(*end)++;
+		break;
+	}
+	*value = v;
+	return 0;
+}
+
+/**
+ * ntfs_device_sim_io_configure - set the characteristics of simulated devices
+ * @params:	comma separated list of name=value settings, or NULL
+ *
+ * The settings are:
+ *	latency=N	microseconds added to every transfer
+ *	seek=N		microseconds to seek from one end of the device to the
+ *			other, shorter seeks taking proportionally less
+ *	bw=N		bandwidth in bytes per second, a K, M or G suffix
+ *			multiplying by 1024, 1024^2 or 1024^3
+ *
+ * Settings not given are reset to zero, meaning no delay.  The settings
+ * apply to the devices opened afterwards through ntfs_device_sim_io_ops.
+ *
+ * Return 0 on success or -1 with errno set to EINVAL if @params is invalid,
+ * in which case the settings are unchanged.
+ */
+int ntfs_device_sim_io_configure(const char *params)
+{
+	struct sim_io_params p;
+	const char *s;
+	char *end;
+	s64 *value;
+
+	memset(&p, 0, sizeof(p));
+	for (s = params; s && *s; s = end) {
+		if (!strncmp(s, "latency=", 8)) {
+			value = &p.latency;
+			s += 8;
+		} else if (!strncmp(s, "seek=", 5)) {
+			value = &p.seek;
+			s += 5;
+		} else if (!strncmp(s, "bw=", 3)) {
+			value = &p.bandwidth;
+			s += 3;
+		} else
+			goto err;
+		if (sim_io_parse_number(s, &end, value))
+			goto err;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			goto err;
+	}
+	sim_io_params = p;
+	return 0;
+err:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * sim_io_delay - account for the time a transfer takes on the simulated device
+ * @dev:	device the transfer was made on
+ * @pos:	device position of the transfer
+ * @count:	number of bytes transferred
+ */
+static void sim_io_delay(struct ntfs_device *dev, s64 pos, s64 count)
+{
+	struct sim_io_private *p = SIM_PRIV(dev);
+	struct sim_io_params *sp = &p->params;
+	s64 distance;
+
+	p->pending += sp->latency;
+	if (sp->seek && pos != p->pos) {
+		distance = pos > p->pos ? pos - p->pos : p->pos - pos;
+		if (!p->size || distance >= p->size)
+			p->pending += sp->seek;
+		else
+			p->pending += (s64)((double)sp->seek * distance
+					/ p->size);
+	}
+	if (sp->bandwidth && count > 0)
+		p->pending += (s64)((double)count * 1000000 / sp->bandwidth);
+	p->pos = pos + (count > 0 ? count : 0);
+	if (p->pending >= SIM_IO_MIN_SLEEP) {
+		struct timespec ts;
+
+		ts.tv_sec = p->pending / 1000000;
+		ts.tv_nsec = (p->pending % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+		p->pending = 0;
+	}
+}
+
+/**
+ * ntfs_device_sim_io_open - Open a device to be accessed with delays
+ * @dev:	device to open
+ * @flags:	open(2) flags
+ *
+ * Return 0 on success and -1 with errno set on error.
+ */
+static int ntfs_device_sim_io_open(struct ntfs_device *dev, int flags)
+{
+	struct sim_io_private *p;
+	int eo;
+
+	/* The delays are simulated, the transfers need no alignment. */
+	NDevClearDirect(dev);
+	if (ntfs_device_default_io_ops.open(dev, flags))
+		return -1;
+	p = ntfs_calloc(sizeof(struct sim_io_private));
+	if (!p) {
+		eo = errno;
+		ntfs_device_default_io_ops.close(dev);
+		errno = eo;
+		return -1;
+	}
+	p->fd = *(int *)dev->d_private;
+	free(dev->d_private);
+	dev->d_private = p;
+	p->params = sim_io_params;
+	p->size = lseek(p->fd, 0, SEEK_END);
+	if (p->size < 0 || lseek(p->fd, 0, SEEK_SET)) {
+		eo = errno;
+		ntfs_device_default_io_ops.close(dev);
+		errno = eo;
+		return -1;
+	}
+	ntfs_log_debug("Simulating latency %lld us, seek %lld us, bandwidth "
+			"%lld B/s on %s\n", (long long)p->params.latency,
+			(long long)p->params.seek,
+			(long long)p->params.bandwidth, dev->d_name);
+	return 0;
+}
+
+static int ntfs_device_sim_io_close(struct ntfs_device *dev)
+{
+	return ntfs_device_default_io_ops.close(dev);
+}
+
+static s64 ntfs_device_sim_io_seek(struct ntfs_device *dev, s64 offset,
+		int whence)
+{
+	s64 ret;
+
+	ret = ntfs_device_default_io_ops.seek(dev, offset, whence);
+	if (ret >= 0)
+		SIM_PRIV(dev)->offset = ret;
+	return ret;
+}
+
+static s64 ntfs_device_sim_io_read(struct ntfs_device *dev, void *buf,
+		s64 count)
+{
+	struct sim_io_private *p = SIM_PRIV(dev);
+	s64 br;
+
+	br = ntfs_device_default_io_ops.read(dev, buf, count);
+	sim_io_delay(dev, p->offset, br);
+	if (br > 0)
+		p->offset += br;
+	return br;
+}
+
+static s64 ntfs_device_sim_io_write(struct ntfs_device *dev, const void *buf,
+		s64 count)
+{
+	struct sim_io_private *p = SIM_PRIV(dev);
+	s64 bw;
+
+	bw = ntfs_device_default_io_ops.write(dev, buf, count);
+	sim_io_delay(dev, p->offset, bw);
+	if (bw > 0)
+		p->offset += bw;
+	return bw;
+}
+
+static s64 ntfs_device_sim_io_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	s64 br;
+
+	br = ntfs_device_default_io_ops.pread(dev, buf, count, offset);
+	sim_io_delay(dev, offset, br);
+	return br;
+}
+
+static s64 ntfs_device_sim_io_pwrite(struct ntfs_device *dev, const void *buf,
+		s64 count, s64 offset)
+{
+	s64 bw;
+
+	bw = ntfs_device_default_io_ops.pwrite(dev, buf, count, offset);
+	sim_io_delay(dev, offset, bw);
+	return bw;
+}
+
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+
+static s64 ntfs_device_sim_io_preadv(struct ntfs_device *dev,
+		const struct iovec *iov, int iovcnt, s64 offset)
+{
+	s64 br;
+
+	br = ntfs_device_default_io_ops.preadv(dev, iov, iovcnt, offset);
+	sim_io_delay(dev, offset, br);
+	return br;
+}
+
+static s64 ntfs_device_sim_io_pwritev(struct ntfs_device *dev,
+		const struct iovec *iov, int iovcnt, s64 offset)
+{
+	s64 bw;
+
+	bw = ntfs_device_default_io_ops.pwritev(dev, iov, iovcnt, offset);
+	sim_io_delay(dev, offset, bw);
+	return bw;
+}
+
+#endif /* defined(HAVE_PREADV) && defined(HAVE_PWRITEV) */
+
+static int ntfs_device_sim_io_sync(struct ntfs_device *dev)
+{
+	return ntfs_device_default_io_ops.sync(dev);
+}
+
+static int ntfs_device_sim_io_stat(struct ntfs_device *dev, struct stat *buf)
+{
+	return ntfs_device_default_io_ops.stat(dev, buf);
+}
+
+static int ntfs_device_sim_io_ioctl(struct ntfs_device *dev,
+		unsigned long request, void *argp)
+{
+	return ntfs_device_default_io_ops.ioctl(dev, request, argp);
+}
+
+/**
+ * Device operations for unix style devices made to behave like slower ones.
+ */
+struct ntfs_device_operations ntfs_device_sim_io_ops = {
+	.open		= ntfs_device_sim_io_open,
+	.close		= ntfs_device_sim_io_close,
+	.seek		= ntfs_device_sim_io_seek,
+	.read		= ntfs_device_sim_io_read,
+	.write		= ntfs_device_sim_io_write,
+	.pread		= ntfs_device_sim_io_pread,
+	.pwrite		= ntfs_device_sim_io_pwrite,
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+	.preadv		= ntfs_device_sim_io_preadv,
+	.pwritev	= ntfs_device_sim_io_pwritev,
+#endif
+	.sync		= ntfs_device_sim_io_sync,
+	.stat		= ntfs_device_sim_io_stat,
+	.ioctl		= ntfs_device_sim_io_ioctl,
+};
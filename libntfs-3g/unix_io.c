@@ -56,6 +56,9 @@
 #ifdef HAVE_LINUX_FS_H
 #include <linux/fs.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 #include "types.h"
 #include "mst.h"
@@ -65,12 +68,37 @@
 #include "misc.h"
 
 #define DEV_FD(dev)	(*(int *)dev->d_private)
+#define UNIX_PRIV(dev)	((struct unix_io_private *)(dev)->d_private)
 
 /* Define to nothing if not present on this system. */
 #ifndef O_EXCL
 #	define O_EXCL 0
 #endif
 
+#if defined(O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+#define UNIX_IO_DIRECT
+#endif
+
+/* Size of the bounce buffers used for unaligned transfers with O_DIRECT. */
+#define UNIX_IO_BOUNCE_SIZE	(64 * 1024)
+/* Number of free bounce buffers kept for reuse. */
+#define UNIX_IO_BOUNCE_POOL	4
+
+/**
+ * struct unix_io_private -
+ *
+ * Private data of an open device.  The file descriptor must come first,
+ * stacked device operations see the private data as a pointer to it.  The
+ * other fields are only used with O_DIRECT, which stacked devices clear.
+ */
+struct unix_io_private {
+	int fd;				/* Device file descriptor. */
+	u32 align;			/* Transfer alignment required by
+					   O_DIRECT, zero if not direct. */
+	int nr_free;			/* Bounce buffers in @pool. */
+	void *pool[UNIX_IO_BOUNCE_POOL];
+};
+
 /**
  * fsync replacement which makes every effort to try to get the data down to
  * disk, using different means for different operating systems. Specifically,
@@ -105,6 +133,150 @@ static int ntfs_fsync(int fildes)
 	return ret;
 }
 
+#ifdef UNIX_IO_DIRECT
+
+/**
+ * unix_io_direct_align - Get the transfer alignment required by O_DIRECT
+ *
+ * Block devices require their logical sector size.  For files the page size
+ * is used, it satisfies every file system.
+ */
+static u32 unix_io_direct_align(struct ntfs_device *dev)
+{
+	u32 align = 4096;
+#ifdef BLKSSZGET
+	int sect;
+
+	if (NDevBlock(dev) && !ioctl(DEV_FD(dev), BLKSSZGET, &sect)
+			&& sect >= NTFS_BLOCK_SIZE && !(sect & (sect - 1)))
+		align = sect;
+#endif
+	return align;
+}
+
+static BOOL unix_io_aligned(struct ntfs_device *dev, const void *buf,
+		s64 count, s64 offset)
+{
+	return !(((unsigned long)buf | (u64)count | (u64)offset)
+			& (UNIX_PRIV(dev)->align - 1));
+}
+
+static void *unix_io_bounce_get(struct unix_io_private *p)
+{
+	void *buf;
+	int err;
+
+	if (p->nr_free)
+		return p->pool[--p->nr_free];
+	err = posix_memalign(&buf, p->align, UNIX_IO_BOUNCE_SIZE);
+	if (err) {
+		errno = err;
+		ntfs_log_perror("Failed to allocate a bounce buffer");
+		return NULL;
+	}
+	return buf;
+}
+
+static void unix_io_bounce_put(struct unix_io_private *p, void *buf)
+{
+	if (p->nr_free < UNIX_IO_BOUNCE_POOL)
+		p->pool[p->nr_free++] = buf;
+	else
+		free(buf);
+}
+
+/**
+ * unix_io_bounce_rw - Unaligned positioned transfer with O_DIRECT
+ * @dev:	device to transfer to or from
+ * @buf:	caller's buffer
+ * @count:	number of bytes to transfer
+ * @offset:	device position
+ * @wr:		TRUE to write @buf, FALSE to read into it
+ *
+ * Transfer through an aligned bounce buffer covering the sectors around the
+ * range, reading them first when only part of a sector is written.  At most
+ * one bounce buffer worth of data is transferred, callers loop on short
+ * transfers.  When an image file is extended, it is truncated back to the
+ * end of the data, as the whole sectors written may reach beyond it.
+ *
+ * Returns the number of bytes transferred, or -1 if no bounce buffer could
+ * be allocated.  Exits on I/O errors like the other unix_io operations.
+ */
+static s64 unix_io_bounce_rw(struct ntfs_device *dev, void *buf, s64 count,
+		s64 offset, BOOL wr)
+{
+	struct unix_io_private *p = UNIX_PRIV(dev);
+	s64 start, end, head, len, cnt, size;
+	struct stat st;
+	char *bounce;
+
+	start = offset & ~(s64)(p->align - 1);
+	head = offset - start;
+	if (count > UNIX_IO_BOUNCE_SIZE - head)
+		count = UNIX_IO_BOUNCE_SIZE - head;
+	end = (offset + count + p->align - 1) & ~(s64)(p->align - 1);
+	len = end - start;
+	bounce = unix_io_bounce_get(p);
+	if (!bounce)
+		return -1;
+	if (!wr || head || end != offset + count) {
+		if ((cnt = pread(p->fd, bounce, len, start)) < 0) {
+			ntfs_log_perror("Failed to pread device %s",
+					dev->d_name);
+			exit(8);
+		}
+		if (!wr)
+			goto copy;
+		if (cnt < len)
+			memset(bounce + cnt, 0, len - cnt);
+	}
+	memcpy(bounce + head, buf, count);
+	size = -1;
+	if (!NDevBlock(dev) && !fstat(p->fd, &st) && end > st.st_size)
+		size = st.st_size > offset + count
+				? st.st_size : offset + count;
+	if ((cnt = pwrite(p->fd, bounce, len, start)) < 0) {
+		ntfs_log_perror("Failed to pwrite device %s", dev->d_name);
+		exit(8);
+	}
+	if (size >= 0 && start + cnt > size && ftruncate(p->fd, size)) {
+		ntfs_log_perror("Failed to truncate %s", dev->d_name);
+		exit(8);
+	}
+copy:
+	cnt = cnt > head ? cnt - head : 0;
+	if (cnt > count)
+		cnt = count;
+	if (!wr)
+		memcpy(buf, bounce + head, cnt);
+	unix_io_bounce_put(p, bounce);
+	return cnt;
+}
+
+/**
+ * unix_io_direct_seq - Transfer at the current location with O_DIRECT
+ */
+static s64 unix_io_direct_seq(struct ntfs_device *dev, void *buf, s64 count,
+		BOOL wr)
+{
+	s64 pos, cnt;
+
+	pos = lseek(DEV_FD(dev), 0, SEEK_CUR);
+	if (pos < 0)
+		return -1;
+	if (unix_io_aligned(dev, buf, count, pos)) {
+		if (wr)
+			return write(DEV_FD(dev), buf, count);
+		return read(DEV_FD(dev), buf, count);
+	}
+	cnt = unix_io_bounce_rw(dev, buf, count, pos, wr);
+	if (cnt > 0 && lseek(DEV_FD(dev), pos + cnt, SEEK_SET) < 0)
+		return -1;
+	return cnt;
+}
+
+#endif /* UNIX_IO_DIRECT */
+
 /**
  * ntfs_device_unix_io_open - Open a device and lock it exclusively
  * @dev:
@@ -131,7 +303,7 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
 	if (S_ISBLK(sbuf.st_mode))
 		NDevSetBlock(dev);
 	
-	dev->d_private = ntfs_malloc(sizeof(int));
+	dev->d_private = ntfs_calloc(sizeof(struct unix_io_private));
 	if (!dev->d_private)
 		return -1;
 	/*
@@ -140,6 +312,20 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
 	 */ 
 	if (!NDevBlock(dev) && (flags & O_RDWR) == O_RDWR)
 		flags |= O_EXCL;
+#ifdef UNIX_IO_DIRECT
+	if (NDevDirect(dev)) {
+		*(int*)dev->d_private = open(dev->d_name, flags | O_DIRECT);
+		if (*(int*)dev->d_private == -1 && errno == EINVAL) {
+			/* The file system does not support O_DIRECT. */
+			ntfs_log_debug("Cannot open %s with O_DIRECT\n",
+					dev->d_name);
+			NDevClearDirect(dev);
+		}
+	}
+	if (!NDevDirect(dev))
+#else
+	NDevClearDirect(dev);
+#endif
 	*(int*)dev->d_private = open(dev->d_name, flags);
 	if (*(int*)dev->d_private == -1) {
 		err = errno;
@@ -171,6 +357,10 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
 	
 	if ((flags & O_RDWR) != O_RDWR)
 		NDevSetReadOnly(dev);
+#ifdef UNIX_IO_DIRECT
+	if (NDevDirect(dev))
+		UNIX_PRIV(dev)->align = unix_io_direct_align(dev);
+#endif
 	
 	memset(&flk, 0, sizeof(flk));
 	if (NDevReadOnly(dev))
@@ -231,6 +421,9 @@ static int ntfs_device_unix_io_close(struct ntfs_device *dev)
 		exit(8);
 	}
 	NDevClearOpen(dev);
+	if (NDevDirect(dev))
+		while (UNIX_PRIV(dev)->nr_free)
+			free(UNIX_PRIV(dev)->pool[--UNIX_PRIV(dev)->nr_free]);
 	free(dev->d_private);
 	dev->d_private = NULL;
 	return 0;
@@ -267,7 +460,15 @@ static s64 ntfs_device_unix_io_read(struct ntfs_device *dev, void *buf,
 {
 	s64 cnt;
 
-	if ((cnt = read(DEV_FD(dev), buf, count)) < 0) {
+#ifdef UNIX_IO_DIRECT
+	if (NDevDirect(dev)) {
+		if ((cnt = unix_io_direct_seq(dev, buf, count, FALSE)) < 0
+				&& errno == ENOMEM)
+			return -1;
+	} else
+#endif
+	cnt = read(DEV_FD(dev), buf, count);
+	if (cnt < 0) {
 		ntfs_log_perror("Failed to read device %s", dev->d_name);
 		exit(8);
 	}
@@ -296,7 +497,15 @@ static s64 ntfs_device_unix_io_write(struct ntfs_device *dev, const void *buf,
 	}
 	NDevSetDirty(dev);
 
-	if ((cnt = write(DEV_FD(dev), buf, count)) < 0) {
+#ifdef UNIX_IO_DIRECT
+	if (NDevDirect(dev)) {
+		if ((cnt = unix_io_direct_seq(dev, (void*)buf, count, TRUE)) < 0
+				&& errno == ENOMEM)
+			return -1;
+	} else
+#endif
+	cnt = write(DEV_FD(dev), buf, count);
+	if (cnt < 0) {
 		ntfs_log_perror("Failed to write device %s", dev->d_name);
 		exit(8);
 	}
@@ -320,6 +529,10 @@ static s64 ntfs_device_unix_io_pread(struct ntfs_device *dev, void *buf,
 {
 	s64 cnt;
 
+#ifdef UNIX_IO_DIRECT
+	if (NDevDirect(dev) && !unix_io_aligned(dev, buf, count, offset))
+		return unix_io_bounce_rw(dev, buf, count, offset, FALSE);
+#endif
 	if ((cnt = pread(DEV_FD(dev), buf, count, offset)) < 0) {
 		ntfs_log_perror("Failed to pread device %s", dev->d_name);
 		exit(8);
@@ -350,6 +563,10 @@ static s64 ntfs_device_unix_io_pwrite(struct ntfs_device *dev, const void *buf,
 	}
 	NDevSetDirty(dev);
 
+#ifdef UNIX_IO_DIRECT
+	if (NDevDirect(dev) && !unix_io_aligned(dev, buf, count, offset))
+		return unix_io_bounce_rw(dev, (void*)buf, count, offset, TRUE);
+#endif
 	if ((cnt = pwrite(DEV_FD(dev), buf, count, offset)) < 0) {
 		ntfs_log_perror("Failed to pwrite device %s", dev->d_name);
 		exit(8);
@@ -358,6 +575,89 @@ static s64 ntfs_device_unix_io_pwrite(struct ntfs_device *dev, const void *buf,
 	return cnt;
 }
 
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+
+#ifdef UNIX_IO_DIRECT
+/*
+ * With O_DIRECT a vectored transfer is only passed on if all the buffers
+ * are aligned.  Otherwise only the first buffer is transferred, through a
+ * bounce buffer, and the caller completes the short transfer.
+ */
+static BOOL unix_io_iov_aligned(struct ntfs_device *dev,
+		const struct iovec *iov, int iovcnt, s64 offset)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		if (!unix_io_aligned(dev, iov[i].iov_base, iov[i].iov_len,
+				offset))
+			return FALSE;
+	return TRUE;
+}
+#endif
+
+/**
+ * ntfs_device_unix_io_preadv - Perform a positioned gather read
+ * @dev:	device to read from
+ * @iov:	buffers to fill
+ * @iovcnt:	number of buffers
+ * @offset:	device position to read from
+ *
+ * Returns the number of bytes read, which may be short, or -1 on error.
+ */
+static s64 ntfs_device_unix_io_preadv(struct ntfs_device *dev,
+		const struct iovec *iov, int iovcnt, s64 offset)
+{
+	s64 cnt;
+
+#ifdef UNIX_IO_DIRECT
+	if (NDevDirect(dev) && !unix_io_iov_aligned(dev, iov, iovcnt, offset))
+		return ntfs_device_unix_io_pread(dev, iov[0].iov_base,
+				iov[0].iov_len, offset);
+#endif
+	if ((cnt = preadv(DEV_FD(dev), iov, iovcnt, offset)) < 0) {
+		ntfs_log_perror("Failed to preadv device %s", dev->d_name);
+		exit(8);
+	}
+
+	return cnt;
+}
+
+/**
+ * ntfs_device_unix_io_pwritev - Perform a positioned scatter write
+ * @dev:	device to write to
+ * @iov:	buffers to write
+ * @iovcnt:	number of buffers
+ * @offset:	device position to write to
+ *
+ * Returns the number of bytes written, which may be short, or -1 on error.
+ */
+static s64 ntfs_device_unix_io_pwritev(struct ntfs_device *dev,
+		const struct iovec *iov, int iovcnt, s64 offset)
+{
+	s64 cnt;
+
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	NDevSetDirty(dev);
+
+#ifdef UNIX_IO_DIRECT
+	if (NDevDirect(dev) && !unix_io_iov_aligned(dev, iov, iovcnt, offset))
+		return ntfs_device_unix_io_pwrite(dev, iov[0].iov_base,
+				iov[0].iov_len, offset);
+#endif
+	if ((cnt = pwritev(DEV_FD(dev), iov, iovcnt, offset)) < 0) {
+		ntfs_log_perror("Failed to pwritev device %s", dev->d_name);
+		exit(8);
+	}
+
+	return cnt;
+}
+
+#endif /* defined(HAVE_PREADV) && defined(HAVE_PWRITEV) */
+
 /**
  * ntfs_device_unix_io_sync - Flush any buffered changes to the device
  * @dev:
@@ -421,6 +721,10 @@ struct ntfs_device_operations ntfs_device_unix_io_ops = {
 	.write		= ntfs_device_unix_io_write,
 	.pread		= ntfs_device_unix_io_pread,
 	.pwrite		= ntfs_device_unix_io_pwrite,
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+	.preadv		= ntfs_device_unix_io_preadv,
+	.pwritev	= ntfs_device_unix_io_pwritev,
+#endif
 	.sync		= ntfs_device_unix_io_sync,
 	.stat		= ntfs_device_unix_io_stat,
 	.ioctl		= ntfs_device_unix_io_ioctl,
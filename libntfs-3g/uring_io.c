@@ -0,0 +1,541 @@
+/**
+ * uring_io.c - Linux io_uring disk io functions.
+ *
+ * Copyright (c) 2026 ntfsprogs contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * The device is opened, locked, closed and accessed one transfer at a time
+ * through the unix_io operations.  Only batches handed to
+ * ntfs_device_submit() go through the ring, so that many reads or writes are
+ * in flight at once and are all queued with a single system call.
+ *
+ * The ring is driven with the raw system calls so that liburing is not
+ * required.  If the running kernel does not support io_uring the batches are
+ * performed one transfer at a time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "types.h"
+#include "debug.h"
+#include "device.h"
+#include "logging.h"
+#include "misc.h"
+
+/* Number of submission queue entries, ie. transfers in flight at once. */
+#define URING_IO_DEPTH	64
+
+/**
+ * struct uring_io_private -
+ *
+ * Private data of an open io_uring device.  The file descriptor must come
+ * first, the unix_io operations see the private data as a pointer to it.
+ */
+struct uring_io_private {
+	int fd;				/* Device file descriptor. */
+	int ring_fd;			/* io_uring instance or -1. */
+	unsigned int entries;		/* Submission queue entries. */
+	void *sq_ring;			/* Mapped submission queue ring. */
+	size_t sq_ring_size;
+	void *cq_ring;			/* Mapped completion queue ring. */
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;	/* Mapped submission queue entries. */
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct iovec iov[URING_IO_DEPTH]; /* One per transfer in flight. */
+	int slot_req[URING_IO_DEPTH];	/* Request index of each slot. */
+};
+
+#define URING_PRIV(dev)	((struct uring_io_private *)(dev)->d_private)
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+/**
+ * uring_io_ring_exit - unmap and close the ring of a device
+ */
+static void uring_io_ring_exit(struct uring_io_private *p)
+{
+	if (p->sqes)
+		munmap(p->sqes, p->sqes_size);
+	if (p->cq_ring && p->cq_ring != p->sq_ring)
+		munmap(p->cq_ring, p->cq_ring_size);
+	if (p->sq_ring)
+		munmap(p->sq_ring, p->sq_ring_size);
+	if (p->ring_fd >= 0)
+		close(p->ring_fd);
+	p->sqes = NULL;
+	p->cq_ring = p->sq_ring = NULL;
+	p->ring_fd = -1;
+}
+
+/**
+ * uring_io_ring_init - create and map the ring of a device
+ *
+ * Return 0 on success and -1 with errno set if io_uring cannot be used.
+ */
+static int uring_io_ring_init(struct uring_io_private *p)
+{
+	struct io_uring_params params;
+	u8 *sq, *cq;
+	int eo;
+
+	memset(&params, 0, sizeof(params));
+	p->ring_fd = uring_setup(URING_IO_DEPTH, &params);
+	if (p->ring_fd < 0)
+		return -1;
+	p->entries = params.sq_entries;
+	if (p->entries > URING_IO_DEPTH)
+		p->entries = URING_IO_DEPTH;
+
+	p->sq_ring_size = params.sq_off.array
+			+ params.sq_entries * sizeof(unsigned int);
+	p->cq_ring_size = params.cq_off.cqes
+			+ params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (p->cq_ring_size > p->sq_ring_size)
+			p->sq_ring_size = p->cq_ring_size;
+		p->cq_ring_size = p->sq_ring_size;
+	}
+	p->sq_ring = mmap(NULL, p->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, p->ring_fd,
+			IORING_OFF_SQ_RING);
+	if (p->sq_ring == MAP_FAILED) {
+		p->sq_ring = NULL;
+		goto err_out;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		p->cq_ring = p->sq_ring;
+	else {
+		p->cq_ring = mmap(NULL, p->cq_ring_size,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, p->ring_fd,
+				IORING_OFF_CQ_RING);
+		if (p->cq_ring == MAP_FAILED) {
+			p->cq_ring = NULL;
+			goto err_out;
+		}
+	}
+	p->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	p->sqes = mmap(NULL, p->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, p->ring_fd,
+			IORING_OFF_SQES);
+	if (p->sqes == MAP_FAILED) {
+		p->sqes = NULL;
+		goto err_out;
+	}
+	sq = p->sq_ring;
+	cq = p->cq_ring;
+	p->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	p->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	p->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	p->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	p->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	p->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	p->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	p->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+err_out:
+	eo = errno;
+	uring_io_ring_exit(p);
+	errno = eo;
+	return -1;
+}
+
+/**
+ * ntfs_device_uring_io_open - Open a device and set up its ring
+ * @dev:	device to open
+ * @flags:	open(2) flags
+ *
+ * The device is opened and locked by the unix_io operations.  Failing to set
+ * up the ring is not an error, batches are then performed synchronously.
+ *
+ * Return 0 on success and -1 with errno set on error.
+ */
+static int ntfs_device_uring_io_open(struct ntfs_device *dev, int flags)
+{
+	struct uring_io_private *p;
+	int eo;
+
+	/* Batches are queued from the caller's buffers, which need not be
+	   aligned as O_DIRECT requires. */
+	NDevClearDirect(dev);
+	if (ntfs_device_default_io_ops.open(dev, flags))
+		return -1;
+	p = ntfs_calloc(sizeof(struct uring_io_private));
+	if (!p) {
+		eo = errno;
+		ntfs_device_default_io_ops.close(dev);
+		errno = eo;
+		return -1;
+	}
+	p->fd = *(int *)dev->d_private;
+	free(dev->d_private);
+	dev->d_private = p;
+	if (uring_io_ring_init(p))
+		ntfs_log_debug("io_uring unavailable for %s (%s), using "
+				"synchronous transfers\n", dev->d_name,
+				strerror(errno));
+	return 0;
+}
+
+/**
+ * ntfs_device_uring_io_close - Tear down the ring and close the device
+ * @dev:	device to close
+ *
+ * Return 0 on success and -1 with errno set on error.
+ */
+static int ntfs_device_uring_io_close(struct ntfs_device *dev)
+{
+	if (NDevOpen(dev))
+		uring_io_ring_exit(URING_PRIV(dev));
+	return ntfs_device_default_io_ops.close(dev);
+}
+
+/**
+ * uring_io_queue - put a transfer into the next submission queue entry
+ */
+static void uring_io_queue(struct uring_io_private *p, unsigned int slot,
+		struct ntfs_io_req *req, int idx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	tail = *p->sq_tail;
+	sqe = &p->sqes[tail & *p->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	p->iov[slot].iov_base = (char *)req->buf + req->done;
+	p->iov[slot].iov_len = req->count - req->done;
+	p->slot_req[slot] = idx;
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = p->fd;
+	sqe->off = req->offset + req->done;
+	sqe->addr = (unsigned long)&p->iov[slot];
+	sqe->len = 1;
+	sqe->user_data = slot;
+	p->sq_array[tail & *p->sq_mask] = tail & *p->sq_mask;
+	__atomic_store_n(p->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * uring_io_submit_sync - Perform a batch of transfers one after the other
+ *
+ * Used when the kernel does not provide io_uring, and to complete a batch
+ * after the ring failed.  Requests which already failed are not retried.
+ */
+static void uring_io_submit_sync(struct uring_io_private *p,
+		struct ntfs_io_req *reqs, int nr)
+{
+	struct ntfs_io_req *req;
+	ssize_t r;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		req = &reqs[i];
+		while (!req->error && req->done < req->count) {
+			if (req->write)
+				r = pwrite(p->fd, (char *)req->buf + req->done,
+						req->count - req->done,
+						req->offset + req->done);
+			else
+				r = pread(p->fd, (char *)req->buf + req->done,
+						req->count - req->done,
+						req->offset + req->done);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				req->error = errno;
+			if (r <= 0)
+				break;
+			req->done += r;
+		}
+	}
+}
+
+/**
+ * uring_io_drain - Wait for the transfers in flight after a ring failure
+ *
+ * The submission queue entries not yet taken by the kernel are dropped and
+ * the completions of the @inflight transfers are reaped, recording their
+ * outcome without resubmitting short transfers, so that the kernel no longer
+ * uses the buffers of the requests and no stale completion is left for the
+ * next batch.
+ *
+ * Return 0 on success and -1 with errno set if the ring cannot be drained.
+ */
+static int uring_io_drain(struct uring_io_private *p,
+		struct ntfs_io_req *reqs, unsigned int inflight)
+{
+	unsigned int head, tail;
+
+	__atomic_store_n(p->sq_tail,
+			__atomic_load_n(p->sq_head, __ATOMIC_ACQUIRE),
+			__ATOMIC_RELEASE);
+	while (inflight) {
+		head = *p->cq_head;
+		tail = __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail && inflight; head++) {
+			struct io_uring_cqe *cqe;
+			struct ntfs_io_req *req;
+
+			cqe = &p->cqes[head & *p->cq_mask];
+			req = &reqs[p->slot_req[cqe->user_data]];
+			if (cqe->res < 0)
+				req->error = -cqe->res;
+			else
+				req->done += cqe->res;
+			inflight--;
+		}
+		__atomic_store_n(p->cq_head, head, __ATOMIC_RELEASE);
+		if (inflight && uring_enter(p->ring_fd, 0, inflight,
+				IORING_ENTER_GETEVENTS) < 0
+		    && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * ntfs_device_uring_io_submit - Perform a batch of transfers through the ring
+ * @dev:	device to transfer to and from
+ * @reqs:	transfer requests
+ * @nr:		number of requests
+ *
+ * Keep up to URING_IO_DEPTH transfers in flight until every request has been
+ * completed.  Short transfers are resubmitted for their remainder until the
+ * device returns end of file or an error.  If the ring fails, the transfers
+ * in flight are waited for and the batch is completed synchronously, the
+ * ring being torn down if it cannot even be drained.
+ *
+ * Return 0 if all transfers succeeded and -1 with errno set to the error of
+ * the first failed request otherwise.
+ */
+static int ntfs_device_uring_io_submit(struct ntfs_device *dev,
+		struct ntfs_io_req *reqs, int nr)
+{
+	struct uring_io_private *p = URING_PRIV(dev);
+	unsigned int free_slots[URING_IO_DEPTH];
+	unsigned int nr_free, queued, inflight;
+	int next, i;
+
+	if (p->ring_fd < 0) {
+		uring_io_submit_sync(p, reqs, nr);
+		goto out;
+	}
+
+	for (nr_free = 0; nr_free < p->entries; nr_free++)
+		free_slots[nr_free] = nr_free;
+	next = 0;
+	queued = 0;
+	inflight = 0;
+	while (next < nr || queued || inflight) {
+		unsigned int head, tail;
+		int r;
+
+		for (; next < nr && nr_free; next++) {
+			/* Empty transfers are done, with nothing to do. */
+			if (!reqs[next].count)
+				continue;
+			uring_io_queue(p, free_slots[--nr_free], &reqs[next],
+					next);
+			queued++;
+		}
+		/* Only empty transfers were left, nothing to wait for. */
+		if (!queued && !inflight)
+			break;
+		/* Submit what was queued and wait for one completion. */
+		r = uring_enter(p->ring_fd, queued, 1, IORING_ENTER_GETEVENTS);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+					errno == EBUSY)
+				continue;
+			ntfs_log_perror("io_uring_enter failed on %s",
+					dev->d_name);
+			if (uring_io_drain(p, reqs, inflight)) {
+				ntfs_log_perror("Could not drain the io_uring "
+						"of %s, using synchronous "
+						"transfers", dev->d_name);
+				uring_io_ring_exit(p);
+			}
+			uring_io_submit_sync(p, reqs, nr);
+			goto out;
+		}
+		inflight += r;
+		queued -= r;
+
+		head = *p->cq_head;
+		tail = __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe;
+			struct ntfs_io_req *req;
+			unsigned int slot;
+
+			cqe = &p->cqes[head & *p->cq_mask];
+			slot = cqe->user_data;
+			req = &reqs[p->slot_req[slot]];
+			inflight--;
+			if (cqe->res < 0)
+				req->error = -cqe->res;
+			else {
+				req->done += cqe->res;
+				if (cqe->res && req->done < req->count) {
+					/* Short transfer, queue the rest. */
+					uring_io_queue(p, slot, req,
+							p->slot_req[slot]);
+					queued++;
+					continue;
+				}
+			}
+			free_slots[nr_free++] = slot;
+		}
+		__atomic_store_n(p->cq_head, head, __ATOMIC_RELEASE);
+	}
+out:
+	for (i = 0; i < nr; i++)
+		if (reqs[i].error) {
+			errno = reqs[i].error;
+			return -1;
+		}
+	return 0;
+}
+
+/*
+ * Everything but opening, closing and batches is done by unix_io.
+ */
+
+static s64 ntfs_device_uring_io_seek(struct ntfs_device *dev, s64 offset,
+		int whence)
+{
+	return ntfs_device_default_io_ops.seek(dev, offset, whence);
+}
+
+static s64 ntfs_device_uring_io_read(struct ntfs_device *dev, void *buf,
+		s64 count)
+{
+	return ntfs_device_default_io_ops.read(dev, buf, count);
+}
+
+static s64 ntfs_device_uring_io_write(struct ntfs_device *dev,
+		const void *buf, s64 count)
+{
+	return ntfs_device_default_io_ops.write(dev, buf, count);
+}
+
+static s64 ntfs_device_uring_io_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	return ntfs_device_default_io_ops.pread(dev, buf, count, offset);
+}
+
+static s64 ntfs_device_uring_io_pwrite(struct ntfs_device *dev,
+		const void *buf, s64 count, s64 offset)
+{
+	return ntfs_device_default_io_ops.pwrite(dev, buf, count, offset);
+}
+
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+
+static s64 ntfs_device_uring_io_preadv(struct ntfs_device *dev,
+		const struct iovec *iov, int iovcnt, s64 offset)
+{
+	return ntfs_device_default_io_ops.preadv(dev, iov, iovcnt, offset);
+}
+
+static s64 ntfs_device_uring_io_pwritev(struct ntfs_device *dev,
+		const struct iovec *iov, int iovcnt, s64 offset)
+{
+	return ntfs_device_default_io_ops.pwritev(dev, iov, iovcnt, offset);
+}
+
+#endif
+
+static int ntfs_device_uring_io_sync(struct ntfs_device *dev)
+{
+	return ntfs_device_default_io_ops.sync(dev);
+}
+
+static int ntfs_device_uring_io_stat(struct ntfs_device *dev,
+		struct stat *buf)
+{
+	return ntfs_device_default_io_ops.stat(dev, buf);
+}
+
+static int ntfs_device_uring_io_ioctl(struct ntfs_device *dev,
+		unsigned long request, void *argp)
+{
+	return ntfs_device_default_io_ops.ioctl(dev, request, argp);
+}
+
+/**
+ * Device operations for working with unix style devices and files through
+ * io_uring.
+ */
+struct ntfs_device_operations ntfs_device_uring_io_ops = {
+	.open		= ntfs_device_uring_io_open,
+	.close		= ntfs_device_uring_io_close,
+	.seek		= ntfs_device_uring_io_seek,
+	.read		= ntfs_device_uring_io_read,
+	.write		= ntfs_device_uring_io_write,
+	.pread		= ntfs_device_uring_io_pread,
+	.pwrite		= ntfs_device_uring_io_pwrite,
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+	.preadv		= ntfs_device_uring_io_preadv,
+	.pwritev	= ntfs_device_uring_io_pwritev,
+#endif
+	.sync		= ntfs_device_uring_io_sync,
+	.stat		= ntfs_device_uring_io_stat,
+	.ioctl		= ntfs_device_uring_io_ioctl,
+	.submit		= ntfs_device_uring_io_submit,
+};
@@ -53,6 +53,9 @@
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #if defined(__sun) && defined (__SVR4)
 #include <sys/mnttab.h>
@@ -68,6 +71,8 @@
 #include "debug.h"
 #include "inode.h"
 #include "runlist.h"
+#include "bitmap.h"
+#include "lcnindex.h"
 #include "logfile.h"
 #include "dir.h"
 #include "logging.h"
@@ -75,6 +80,7 @@
 #include "realpath.h"
 #include "misc.h"
 #include "security.h"
+#include "ntfstime.h"
 
 const char *ntfs_home = 
 "News, support and information:  https://github.com/tuxera/ntfs-3g/\n";
@@ -139,6 +145,35 @@ ntfs_volume *ntfs_volume_alloc(void)
 	return ntfs_calloc(sizeof(ntfs_volume));
 }
 
+/*
+ *		Create the pools of the objects of a volume
+ *
+ * The pools are created once the mft record size is known.  Without
+ * them, the objects are allocated by malloc(), so failing to create
+ * them is not an error.
+ */
+
+static void ntfs_volume_pools_create(ntfs_volume *vol)
+{
+	vol->inode_pool = ntfs_pool_create("inode", sizeof(ntfs_inode));
+	vol->mrec_pool = ntfs_pool_create("mft record",
+			vol->mft_record_size);
+	vol->attr_pool = ntfs_pool_create("attribute", sizeof(ntfs_attr));
+	vol->ctx_pool = ntfs_pool_create("search context",
+			sizeof(ntfs_attr_search_ctx));
+	vol->index_ctx_pool = ntfs_pool_create("index context",
+			sizeof(ntfs_index_context));
+}
+
+static void ntfs_volume_pools_destroy(ntfs_volume *vol)
+{
+	ntfs_pool_destroy(vol->inode_pool);
+	ntfs_pool_destroy(vol->mrec_pool);
+	ntfs_pool_destroy(vol->attr_pool);
+	ntfs_pool_destroy(vol->ctx_pool);
+	ntfs_pool_destroy(vol->index_ctx_pool);
+}
+
 static void ntfs_attr_free(ntfs_attr **na)
 {
 	if (na && *na) {
@@ -165,6 +200,261 @@ static void ntfs_error_set(int *err)
 		*err = errno;
 }
 
+/*
+ *		Counting the free clusters
+ *
+ * Counting the zero bits of $Bitmap, 512 MiB on a 16 TiB volume with 4 KiB
+ * clusters, dominates the time taken to get the free space.  A resident
+ * $Bitmap is counted in place by several threads.  Otherwise, on a unix
+ * style device, several threads read $Bitmap in large chunks straight from
+ * the device and count them, so that the reads overlap and the count can
+ * run in the background, see ntfs_volume_get_free_space_start().
+ *
+ * The library is not thread safe, so the threads get a copy of the runlist
+ * of $Bitmap and the file descriptor of the device, and share nothing else
+ * with it.  The count is only valid if $Bitmap is not written to the device
+ * meanwhile, which is the case of a read-only volume, or of a volume which
+ * is not used until the count completes.
+ */
+
+#ifdef ENABLE_THREADS
+
+/* Bytes of $Bitmap read at once, and most threads reading. */
+#define NTFS_FREE_COUNT_CHUNK	(4 << 20)
+#define NTFS_FREE_COUNT_THREADS	8
+
+/**
+ * struct ntfs_free_count - count of the free clusters in progress
+ */
+struct ntfs_free_count {
+	pthread_t threads[NTFS_FREE_COUNT_THREADS];
+	int fd;			/* Device file descriptor. */
+	u8 cluster_size_bits;
+	s64 size;		/* Data size of $Bitmap. */
+	s64 initialized_size;	/* Initialized size of $Bitmap. */
+	runlist_element *rl;	/* Copy of the runlist of $Bitmap. */
+	s64 start_time;		/* When the count started, in microseconds. */
+	pthread_mutex_t lock;	/* Protects the fields below. */
+	int nr_threads;		/* Threads started. */
+	int finished;		/* Threads done. */
+	s64 next;		/* Next byte of $Bitmap to count. */
+	s64 free;		/* Zero bits counted so far. */
+	int err;		/* First error met, 0 if none. */
+	BOOL stop;		/* Abandon the count. */
+	s64 end_time;		/* When the last thread finished. */
+};
+
+/*
+ * Count the zero bits in @count bytes of $Bitmap from byte @pos, reading
+ * them into @buf.  Bytes beyond the initialized size and in holes are zero.
+ *
+ * Return the number of zero bits or -1 with errno set.
+ */
+static s64 ntfs_free_count_chunk(struct ntfs_free_count *fc, u8 *buf,
+		s64 pos, s64 count)
+{
+	runlist_element *rl;
+	s64 zeros, end, n, done, br;
+	VCN vcn;
+
+	zeros = 0;
+	end = pos + count;
+	if (end > fc->initialized_size) {
+		n = end - (pos > fc->initialized_size ? pos
+				: fc->initialized_size);
+		zeros += n << 3;
+		end -= n;
+	}
+	while (pos < end) {
+		vcn = pos >> fc->cluster_size_bits;
+		for (rl = fc->rl; rl->length && rl->vcn + rl->length <= vcn;
+				rl++)
+			;
+		if (!rl->length || rl->vcn > vcn
+				|| (rl->lcn < 0 && rl->lcn != LCN_HOLE)) {
+			errno = EIO;
+			return -1;
+		}
+		n = ((rl->vcn + rl->length) << fc->cluster_size_bits) - pos;
+		if (n > end - pos)
+			n = end - pos;
+		if (rl->lcn == LCN_HOLE) {
+			zeros += n << 3;
+			pos += n;
+			continue;
+		}
+		for (done = 0; done < n; done += br) {
+			br = pread(fc->fd, buf + done, n - done,
+					((rl->lcn - rl->vcn)
+					<< fc->cluster_size_bits) + pos + done);
+			if (br < 0 && errno == EINTR)
+				br = 0;
+			else if (br <= 0) {
+				if (!br)
+					errno = EIO;
+				return -1;
+			}
+		}
+		zeros += (n << 3) - ntfs_bitmap_popcount(buf, 0, n << 3);
+		pos += n;
+	}
+	return zeros;
+}
+
+/*
+ * Thread counting chunks of $Bitmap until all are taken.
+ */
+static void *ntfs_free_count_thread(void *arg)
+{
+	struct ntfs_free_count *fc = arg;
+	s64 pos, count, zeros;
+	u8 *buf;
+	int err = 0;
+
+	buf = ntfs_malloc(NTFS_FREE_COUNT_CHUNK);
+	if (!buf)
+		err = errno;
+	while (!err) {
+		pthread_mutex_lock(&fc->lock);
+		pos = fc->next;
+		fc->next += NTFS_FREE_COUNT_CHUNK;
+		if (fc->stop || fc->err)
+			pos = fc->size;
+		pthread_mutex_unlock(&fc->lock);
+		if (pos >= fc->size)
+			break;
+		count = fc->size - pos;
+		if (count > NTFS_FREE_COUNT_CHUNK)
+			count = NTFS_FREE_COUNT_CHUNK;
+		zeros = ntfs_free_count_chunk(fc, buf, pos, count);
+		if (zeros < 0) {
+			err = errno;
+			break;
+		}
+		pthread_mutex_lock(&fc->lock);
+		fc->free += zeros;
+		pthread_mutex_unlock(&fc->lock);
+	}
+	free(buf);
+	pthread_mutex_lock(&fc->lock);
+	if (err && !fc->err)
+		fc->err = err;
+	fc->finished++;
+	fc->end_time = ntfs_monotonic_time();
+	pthread_mutex_unlock(&fc->lock);
+	return NULL;
+}
+
+/**
+ * ntfs_free_count_start - start the threads counting the free clusters
+ * @vol:	volume
+ *
+ * Return 0 if the count is in progress or -1 with errno set if it cannot be
+ * made by threads.
+ */
+static int ntfs_free_count_start(ntfs_volume *vol)
+{
+	struct ntfs_free_count *fc;
+	struct ntfs_device *dev = vol->dev;
+	ntfs_attr *na = vol->lcnbmp_na;
+	s64 chunks;
+	int nr, n, fd;
+
+	if (vol->free_count)
+		return 0;
+	fd = ntfs_device_shared_fd(dev);
+	if (fd < 0)
+		return -1;
+	/* The threads read the device, not the cache. */
+	if (dev->d_cache && ntfs_device_cache_flush(dev))
+		return -1;
+	if (ntfs_attr_map_whole_runlist(na))
+		return -1;
+	fc = ntfs_calloc(sizeof(struct ntfs_free_count));
+	if (!fc)
+		return -1;
+	for (n = 0; na->rl[n].length; n++)
+		;
+	fc->rl = ntfs_malloc((n + 1) * sizeof(runlist_element));
+	if (!fc->rl) {
+		free(fc);
+		return -1;
+	}
+	memcpy(fc->rl, na->rl, (n + 1) * sizeof(runlist_element));
+	fc->fd = fd;
+	fc->cluster_size_bits = vol->cluster_size_bits;
+	fc->size = na->data_size;
+	fc->initialized_size = na->initialized_size;
+	pthread_mutex_init(&fc->lock, NULL);
+
+	chunks = (fc->size + NTFS_FREE_COUNT_CHUNK - 1) / NTFS_FREE_COUNT_CHUNK;
+	nr = ntfs_nr_cpus();
+	if (nr > NTFS_FREE_COUNT_THREADS)
+		nr = NTFS_FREE_COUNT_THREADS;
+	if (nr > chunks)
+		nr = chunks;
+	fc->start_time = ntfs_monotonic_time();
+	for (n = 0; n < nr; n++) {
+		if (pthread_create(&fc->threads[n], NULL,
+				ntfs_free_count_thread, fc))
+			break;
+		pthread_mutex_lock(&fc->lock);
+		fc->nr_threads++;
+		pthread_mutex_unlock(&fc->lock);
+	}
+	if (!n) {
+		pthread_mutex_destroy(&fc->lock);
+		free(fc->rl);
+		free(fc);
+		errno = EAGAIN;
+		return -1;
+	}
+	ntfs_log_debug("Counting the free clusters with %d threads\n", n);
+	vol->free_count = fc;
+	return 0;
+}
+
+/**
+ * ntfs_free_count_finish - wait for the threads counting the free clusters
+ * @vol:	volume with a count in progress
+ * @stop:	abandon the count
+ *
+ * Return the number of free clusters or -1 with errno set.
+ */
+static s64 ntfs_free_count_finish(ntfs_volume *vol, BOOL stop)
+{
+	struct ntfs_free_count *fc = vol->free_count;
+	s64 free_clusters;
+	int i;
+
+	if (stop) {
+		pthread_mutex_lock(&fc->lock);
+		fc->stop = TRUE;
+		pthread_mutex_unlock(&fc->lock);
+	}
+	for (i = 0; i < fc->nr_threads; i++)
+		pthread_join(fc->threads[i], NULL);
+	vol->free_count = NULL;
+	free_clusters = fc->free;
+	if (fc->err) {
+		errno = fc->err;
+		free_clusters = -1;
+	} else if (stop) {
+		errno = EINTR;
+		free_clusters = -1;
+	} else
+		ntfs_log_verbose("Counted %lld free clusters with %d threads "
+				"in %lld us\n", (long long)free_clusters,
+				fc->nr_threads,
+				(long long)(fc->end_time - fc->start_time));
+	pthread_mutex_destroy(&fc->lock);
+	free(fc->rl);
+	free(fc);
+	return free_clusters;
+}
+
+#endif /* ENABLE_THREADS */
+
 /**
  * __ntfs_volume_release - Destroy an NTFS volume object
  * @v:
@@ -177,6 +467,12 @@ static int __ntfs_volume_release(ntfs_volume *v)
 {
 	int err = 0;
 
+#ifdef ENABLE_THREADS
+	if (v->free_count)
+		ntfs_free_count_finish(v, TRUE);
+#endif
+	if (v->mft_queue && ntfs_mft_queue_stop(v))
+		ntfs_error_set(&err);
 	if (ntfs_close_secure(v))
 		ntfs_error_set(&err);
 
@@ -186,12 +482,17 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	 * FIXME: Inodes must be synced before closing
 	 * attributes, otherwise unmount could fail.
 	 */
+	if (v->lcnbmp_na && ntfs_lcn_bitmap_release(v))
+		ntfs_error_set(&err);
 	if (v->lcnbmp_ni && NInoDirty(v->lcnbmp_ni))
 		ntfs_inode_sync(v->lcnbmp_ni);
 	ntfs_attr_free(&v->lcnbmp_na);
+	ntfs_lcn_index_free(v);
 	if (ntfs_inode_free(&v->lcnbmp_ni))
 		ntfs_error_set(&err);
 	
+	if (v->mftbmp_na && ntfs_mft_bitmap_release(v))
+		ntfs_error_set(&err);
 	if (v->mft_ni && NInoDirty(v->mft_ni))
 		ntfs_inode_sync(v->mft_ni);
 	ntfs_attr_free(&v->mftbmp_na);
@@ -208,6 +509,8 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	if (v->dev) {
 		struct ntfs_device *dev = v->dev;
 
+		if (ntfs_device_cache_disable(dev))
+			ntfs_error_set(&err);
 		if (dev->d_ops->sync(dev))
 			ntfs_error_set(&err);
 		if (dev->d_ops->close(dev))
@@ -219,6 +522,7 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	free(v->upcase);
 	if (v->locase) free(v->locase);
 	free(v->attrdef);
+	ntfs_volume_pools_destroy(v);
 	free(v);
 
 	errno = err;
@@ -268,7 +572,7 @@ static int ntfs_mft_load(ntfs_volume *vol)
 
 	/* Manually setup an ntfs_inode. */
 	vol->mft_ni = ntfs_inode_allocate(vol);
-	mb = ntfs_malloc(vol->mft_record_size);
+	mb = ntfs_pool_alloc(vol->mrec_pool, vol->mft_record_size);
 	if (!vol->mft_ni || !mb) {
 		ntfs_log_perror("Error allocating memory for $MFT");
 		goto error_exit;
@@ -416,6 +720,7 @@ mft_has_no_attr_list:
 			goto error_exit;
 		}
 		vol->mft_na->rl = nrl;
+		ntfs_attr_forget_runs(vol->mft_na);
 
 		/* Get the lowest vcn for the next extent. */
 		highest_vcn = sle64_to_cpu(a->highest_vcn);
@@ -804,6 +1109,9 @@ ntfs_volume *ntfs_volume_startup(struct ntfs_device *dev,
 	if (flags & NTFS_MNT_FSCK)
 		NVolSetFsck(vol);
 
+	if (flags & NTFS_MNT_PREALLOC)
+		NVolSetPrealloc(vol);
+
 	if (flags & NTFS_MNT_FS_YES_REPAIR)
 		NVolSetFsYesRepair(vol);
 	else if (flags & NTFS_MNT_FS_ASK_REPAIR)
@@ -902,6 +1210,8 @@ ntfs_volume *ntfs_volume_startup(struct ntfs_device *dev,
 	 * The cluster allocator is now fully operational.
 	 */
 
+	ntfs_volume_pools_create(vol);
+
 reload_mft:
 	/* Need to setup $MFT so we can use the library read functions. */
 	if (ntfs_mft_load(vol) < 0) {
@@ -1630,6 +1940,30 @@ skip_compare_mft:
 		NVolSetReadOnly(vol);
 		ntfs_log_error("%s", fallback_readonly_msg);
 	}
+	/*
+	 * Keep $Bitmap and $MFT/$BITMAP in memory and index the free
+	 * clusters, unless the caller updates them behind the library.  All
+	 * of them are optional.
+	 */
+	if (!NVolReadOnly(vol) && !(flags & NTFS_MNT_FORENSIC)) {
+		if (ntfs_lcn_bitmap_load(vol))
+			ntfs_log_debug("Could not load $Bitmap: %s\n",
+					strerror(errno));
+		if (ntfs_mft_bitmap_load(vol))
+			ntfs_log_debug("Could not load $MFT/$BITMAP: %s\n",
+					strerror(errno));
+		if (ntfs_lcn_index_build(vol))
+			ntfs_log_debug("Could not index the free clusters: "
+					"%s\n", strerror(errno));
+	}
+	if ((flags & NTFS_MNT_COUNT_FREE)
+			&& ntfs_volume_get_free_space_start(vol))
+		ntfs_log_debug("Could not count the free space: %s\n",
+				strerror(errno));
+	if ((flags & NTFS_MNT_MFT_QUEUE) && !NVolReadOnly(vol)
+			&& ntfs_mft_queue_start(vol, 0))
+		ntfs_log_debug("Could not defer the mft record writes: %s\n",
+				strerror(errno));
 
 	return vol;
 bad_upcase :
@@ -1713,6 +2047,12 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
  * the mount system call (man 2 mount). Currently only the following flags
  * is implemented:
  *	NTFS_MNT_RDONLY	- mount volume read-only
+ *	NTFS_MNT_DIRECT_IO - open the device with O_DIRECT where supported
+ *	NTFS_MNT_MMAP_IO - with NTFS_MNT_RDONLY, read the device through a
+ *			   memory mapping where supported
+ *
+ * The device is accessed through the operations selected by
+ * ntfs_device_default_ops_set(), ntfs_device_default_io_ops by default.
  *
  * The function opens the device or file @name and verifies that it contains a
  * valid bootsector. Then, it allocates an ntfs_volume structure and initializes
@@ -1730,11 +2070,20 @@ ntfs_volume *ntfs_mount(const char *name __attribute__((unused)),
 		ntfs_mount_flags flags __attribute__((unused)))
 {
 #ifndef NO_NTFS_DEVICE_DEFAULT_IO_OPS
+	struct ntfs_device_operations *dops;
 	struct ntfs_device *dev;
 	ntfs_volume *vol;
 
+	dops = ntfs_device_default_ops_get();
+#ifdef ENABLE_MMAP_IO
+	/* Operations explicitly selected by the program take precedence. */
+	if ((flags & NTFS_MNT_MMAP_IO) && (flags & NTFS_MNT_RDONLY)
+	    && dops == &ntfs_device_default_io_ops)
+		dops = &ntfs_device_mmap_io_ops;
+#endif
 	/* Allocate an ntfs_device structure. */
-	dev = ntfs_device_alloc(name, 0, &ntfs_device_default_io_ops, NULL);
+	dev = ntfs_device_alloc(name, (flags & NTFS_MNT_DIRECT_IO)
+			? 1L << ND_Direct : 0, dops, NULL);
 	if (!dev)
 		return NULL;
 	/* Call ntfs_device_mount() to do the actual mount. */
@@ -2188,16 +2537,16 @@ int ntfs_set_locale(void)
 }
 
 /*
- *		Feed the counts of free clusters and free mft records
+ *		Feed the count of free mft records, the count of free clusters
+ *	being known
  */
 
-int ntfs_volume_get_free_space(ntfs_volume *vol)
+static int ntfs_volume_free_space_done(ntfs_volume *vol)
 {
 	ntfs_attr *na;
 	int ret;
 
 	ret = -1; /* default return */
-	vol->free_clusters = ntfs_attr_get_free_bits(vol->lcnbmp_na);
 	if (vol->free_clusters < 0) {
 		ntfs_log_perror("Failed to read NTFS $Bitmap");
 	} else {
@@ -2217,6 +2566,89 @@ int ntfs_volume_get_free_space(ntfs_volume *vol)
 	return (ret);
 }
 
+/*
+ *		Feed the counts of free clusters and free mft records
+ *
+ *	A count started by ntfs_volume_get_free_space_start() is waited for.
+ */
+
+int ntfs_volume_get_free_space(ntfs_volume *vol)
+{
+	s64 start;
+
+#ifdef ENABLE_THREADS
+	if (!vol->free_count && !vol->lcnbmp_cache)
+		ntfs_free_count_start(vol);
+	if (vol->free_count)
+		return (ntfs_volume_get_free_space_wait(vol, TRUE));
+#endif
+	start = ntfs_monotonic_time();
+	vol->free_clusters = ntfs_attr_get_free_bits(vol->lcnbmp_na);
+	if (vol->free_clusters >= 0)
+		ntfs_log_verbose("Counted %lld free clusters in %lld us\n",
+				(long long)vol->free_clusters,
+				(long long)(ntfs_monotonic_time() - start));
+	return (ntfs_volume_free_space_done(vol));
+}
+
+/**
+ * ntfs_volume_get_free_space_start - count the free space in the background
+ * @vol:	volume
+ *
+ * On a read-only volume on a unix style device, start threads counting the
+ * free clusters and return without waiting for them.  The count is collected
+ * by ntfs_volume_get_free_space_wait(), which sets NVolFreeSpaceKnown(), or
+ * by ntfs_volume_get_free_space().  Otherwise, or when the threads cannot be
+ * started, the free space is counted before returning.
+ *
+ * Return 0 on success or -1 with errno set on error.
+ */
+int ntfs_volume_get_free_space_start(ntfs_volume *vol)
+{
+#ifdef ENABLE_THREADS
+	if (NVolReadOnly(vol) && !ntfs_free_count_start(vol))
+		return 0;
+#endif
+	return ntfs_volume_get_free_space(vol);
+}
+
+/**
+ * ntfs_volume_get_free_space_wait - collect the count of the free space
+ * @vol:	volume
+ * @block:	wait for a count in progress to complete
+ *
+ * Complete the count started by ntfs_volume_get_free_space_start() and set
+ * NVolFreeSpaceKnown().  If no count is in progress, the free space is
+ * counted unless already known.
+ *
+ * Return 0 on success or -1 with errno set on error, errno being EAGAIN
+ * if @block is FALSE and the count is still in progress.
+ */
+int ntfs_volume_get_free_space_wait(ntfs_volume *vol, BOOL block)
+{
+#ifdef ENABLE_THREADS
+	struct ntfs_free_count *fc = vol->free_count;
+	BOOL done;
+
+	if (fc) {
+		if (!block) {
+			pthread_mutex_lock(&fc->lock);
+			done = fc->finished == fc->nr_threads;
+			pthread_mutex_unlock(&fc->lock);
+			if (!done) {
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+		vol->free_clusters = ntfs_free_count_finish(vol, FALSE);
+		return ntfs_volume_free_space_done(vol);
+	}
+#endif
+	if (NVolFreeSpaceKnown(vol))
+		return 0;
+	return ntfs_volume_get_free_space(vol);
+}
+
 /**
  * ntfs_volume_rename - change the current label on a volume
  * @vol:	volume to change the label on
@@ -35,19 +35,120 @@
 #endif
 
 #include "cluster.h"
+#include "mft.h"
 #include "utils.h"
 #include "logging.h"
 
+/* The inodes which may own clusters of the range, as found by the scan. */
+struct cluster_owners {
+	u64 *inodes;
+	s64 count;
+	s64 size;
+};
+
+struct cluster_range {
+	LCN begin;
+	LCN end;
+	struct cluster_owners all;
+};
+
+/**
+ * add_owner
+ */
+static int add_owner(struct cluster_owners *o, u64 inode)
+{
+	u64 *p;
+
+	if (o->count == o->size) {
+		p = realloc(o->inodes, (o->size + 1024) * sizeof(u64));
+		if (!p) {
+			ntfs_log_error("Out of memory.\n");
+			return -1;
+		}
+		o->inodes = p;
+		o->size += 1024;
+	}
+	o->inodes[o->count++] = inode;
+	return 0;
+}
+
+/**
+ * scan_record - Called by the scan workers for each record in use
+ *
+ * Only reads the record, the inodes found are opened after the scan.  The
+ * records which cannot be parsed are kept, for the errors to be reported
+ * as when walking the mft in order.
+ */
+static int scan_record(ntfs_mft_worker *w, s64 mft_no, MFT_RECORD *mrec)
+{
+	struct cluster_range *r = w->arg;
+	ATTR_RECORD *a;
+	runlist *runs;
+	BOOL found;
+	int j;
+
+	found = ntfs_mft_record_check_ro(w->vol, mft_no, mrec) != 0;
+	while (!found && !ntfs_attrs_walk(w->ctx)) {
+		a = w->ctx->attr;
+		if (!a->non_resident)
+			continue;
+		runs = ntfs_mapping_pairs_decompress(w->vol, a, NULL);
+		if (!runs) {
+			found = TRUE;
+			break;
+		}
+		for (j = 0; runs[j].length > 0 && !found; j++)
+			found = (runs[j].lcn >= 0) && (runs[j].lcn <= r->end)
+				&& (runs[j].lcn + runs[j].length > r->begin);
+		free(runs);
+	}
+	if (!found)
+		return 0;
+	/* Report the base inode, which the attribute lookups go through. */
+	if (mrec->base_mft_record)
+		mft_no = MREF_LE(mrec->base_mft_record);
+	return add_owner(w->data, mft_no);
+}
+
+/**
+ * merge_owners
+ */
+static int merge_owners(ntfs_mft_worker *w)
+{
+	struct cluster_owners *o = w->data;
+	struct cluster_range *r = w->arg;
+	int err = 0;
+	s64 i;
+
+	for (i = 0; i < o->count && !err; i++)
+		err = add_owner(&r->all, o->inodes[i]);
+	free(o->inodes);
+	return err;
+}
+
+static int cmp_inodes(const void *a, const void *b)
+{
+	u64 x = *(const u64*)a;
+	u64 y = *(const u64*)b;
+
+	return (x > y) - (x < y);
+}
+
 /**
  * cluster_find
+ *
+ * The mft is read by ntfs_mft_scan_parallel(), whose workers pick the
+ * inodes with runs in the range.  Only those are opened, in order, to call
+ * @cb for each of their runs in the range.
  */
 int cluster_find(ntfs_volume *vol, LCN c_begin, LCN c_end, cluster_cb *cb, void *data)
 {
 	int j;
 	int result = -1;
-	struct mft_search_ctx *m_ctx = NULL;
+	ntfs_inode *inode = NULL;
 	ntfs_attr_search_ctx  *a_ctx = NULL;
-	s64 count;
+	struct cluster_range range;
+	s64 count, i;
 	BOOL found;
 	ATTR_RECORD *rec;
 	runlist *runs;
@@ -55,19 +156,34 @@ int cluster_find(ntfs_volume *vol, LCN c_begin, LCN c_end, cluster_cb *cb, void
 	if (!vol || !cb)
 		return -1;
 
-	m_ctx = mft_get_search_ctx(vol);
-	m_ctx->flags_search = FEMR_IN_USE | FEMR_BASE_RECORD;
+	memset(&range, 0, sizeof(range));
+	range.begin = c_begin;
+	range.end = c_end;
+	if (ntfs_mft_scan_parallel(vol, NTFS_MFT_SCAN_IN_USE, 0,
+			sizeof(struct cluster_owners), scan_record,
+			merge_owners, &range)) {
+		ntfs_log_perror("Couldn't scan the mft");
+		goto done;
+	}
+	qsort(range.all.inodes, range.all.count, sizeof(u64), cmp_inodes);
 	count = 0;
 
-	while (mft_next_record(m_ctx) == 0) {
+	for (i = 0; i < range.all.count; i++) {
 
-		if (!(m_ctx->flags_match & FEMR_BASE_RECORD))
+		if (i && (range.all.inodes[i] == range.all.inodes[i - 1]))
 			continue;
 
+		inode = ntfs_inode_open(vol, range.all.inodes[i]);
+		if (!inode) {
+			ntfs_log_perror("Couldn't open inode %llu",
+				(unsigned long long)range.all.inodes[i]);
+			continue;
+		}
+
 		ntfs_log_verbose("Inode: %llu\n", (unsigned long long)
-				m_ctx->inode->mft_no);
+				inode->mft_no);
 
-		a_ctx = ntfs_attr_get_search_ctx(m_ctx->inode, NULL);
+		a_ctx = ntfs_attr_get_search_ctx(inode, NULL);
 
 		found = FALSE;
 		while ((rec = find_attribute(AT_UNUSED, a_ctx))) {
@@ -106,14 +222,20 @@ int cluster_find(ntfs_volume *vol, LCN c_begin, LCN c_end, cluster_cb *cb, void
 				if ((a_begin > c_end) || (a_end < c_begin))
 					continue;	// before or after search range
 
-				if ((*cb) (m_ctx->inode, a_ctx->attr, runs+j, data))
-					return 1;
+				if ((*cb) (inode, a_ctx->attr, runs+j, data)) {
+					free(runs);
+					result = 1;
+					goto done;
+				}
 				found = TRUE;
 			}
+			free(runs);
 		}
 
 		ntfs_attr_put_search_ctx(a_ctx);
 		a_ctx = NULL;
+		ntfs_inode_close(inode);
+		inode = NULL;
 		if (found)
 			count++;
 	}
@@ -125,8 +247,9 @@ int cluster_find(ntfs_volume *vol, LCN c_begin, LCN c_end, cluster_cb *cb, void
 	result = 0;
 done:
 	ntfs_attr_put_search_ctx(a_ctx);
-	mft_put_search_ctx(m_ctx);
+	if (inode)
+		ntfs_inode_close(inode);
+	free(range.all.inodes);
 
 	return result;
 }
-
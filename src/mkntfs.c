@@ -3471,7 +3471,7 @@ static BOOL mkntfs_open_partition(ntfs_volume *vol)
 	 * Allocate and initialize an ntfs device structure and attach it to
 	 * the volume.
 	 */
-	vol->dev = ntfs_device_alloc(opts.dev_name, 0, &ntfs_device_default_io_ops, NULL);
+	vol->dev = ntfs_device_alloc(opts.dev_name, 0, ntfs_device_default_ops_get(), NULL);
 	if (!vol->dev) {
 		ntfs_log_perror("Could not create device");
 		goto done;
@@ -5223,6 +5223,7 @@ int main(int argc, char *argv[])
 	int result = 1;
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 	utils_set_locale();
 
 	mkntfs_init_options(&opts);			/* Set up the options */
@@ -336,6 +336,7 @@ static int cat(ntfs_volume *vol, ntfs_inode *inode, ATTR_TYPES type,
 {
 	const int bufsize = 4096;
 	char *buffer;
+	const void *data;
 	ntfs_attr *attr;
 	s64 bytes_read, written;
 	s64 offset;
@@ -362,13 +363,24 @@ static int cat(ntfs_volume *vol, ntfs_inode *inode, ATTR_TYPES type,
 
 	offset = 0;
 	for (;;) {
+		data = buffer;
 		if (!opts.raw && block_size > 0) {
 			// These types have fixup
 			bytes_read = ntfs_attr_mst_pread(attr, offset, 1, block_size, buffer);
 			if (bytes_read > 0)
 				bytes_read *= block_size;
 		} else {
-			bytes_read = ntfs_attr_pread(attr, offset, bufsize, buffer);
+			// Write straight from the device mapping if possible
+			bytes_read = attr->data_size - offset;
+			if (bytes_read > bufsize)
+				bytes_read = bufsize;
+			if (bytes_read <= 0
+			    || !(data = ntfs_attr_borrow(attr, offset,
+						bytes_read))) {
+				data = buffer;
+				bytes_read = ntfs_attr_pread(attr, offset,
+						bufsize, buffer);
+			}
 		}
 		//ntfs_log_info("read %lld bytes\n", bytes_read);
 		if (bytes_read == -1) {
@@ -378,7 +390,7 @@ static int cat(ntfs_volume *vol, ntfs_inode *inode, ATTR_TYPES type,
 		if (!bytes_read)
 			break;
 
-		written = fwrite(buffer, 1, bytes_read, stdout);
+		written = fwrite(data, 1, bytes_read, stdout);
 		if (written != bytes_read) {
 			ntfs_log_perror("ERROR: Couldn't output all data!");
 			break;
@@ -408,6 +420,7 @@ int main(int argc, char *argv[])
 	int result = 1;
 
 	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	utils_io_options(&argc, argv);
 
 	res = parse_options(argc, argv);
 	if (res >= 0)
@@ -416,7 +429,7 @@ int main(int argc, char *argv[])
 	utils_set_locale();
 
 	vol = utils_mount_volume(opts.device, NTFS_MNT_RDONLY |
-			(opts.force ? NTFS_MNT_RECOVER : 0));
+			NTFS_MNT_MMAP_IO | (opts.force ? NTFS_MNT_RECOVER : 0));
 	if (!vol) {
 		ntfs_log_perror("ERROR: couldn't mount volume");
 		return 1;
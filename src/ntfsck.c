@@ -383,8 +383,10 @@ static void ntfsck_check_orphaned_clusters(ntfs_volume *vol)
 
 static void ntfsck_set_bitmap_range(u8 *bm, s64 pos, s64 length, u8 bit)
 {
-	while (length--)
-		ntfs_bit_set(bm, pos++, bit);
+	if (bit)
+		ntfs_bitmap_set_range(bm, pos, length);
+	else
+		ntfs_bitmap_clear_range(bm, pos, length);
 }
 
 static u8 *ntfsck_get_lcnbmp(s64 pos)
@@ -1296,7 +1298,8 @@ static void ntfsck_check_mft_record_unused(ntfs_volume *vol, s64 mft_num)
 }
 
 s64 clear_mft_cnt;
-static void ntfsck_verify_mft_record(ntfs_volume *vol, s64 mft_num)
+static void ntfsck_verify_mft_record(ntfs_volume *vol, s64 mft_num,
+		MFT_RECORD *mrec)
 {
 	int is_used;
 	int always_exist_sys_meta_num = vol->major_ver >= 3 ? 11 : 10;
@@ -1314,7 +1317,17 @@ static void ntfsck_verify_mft_record(ntfs_volume *vol, s64 mft_num)
 			return;
 		}
 
-		ntfsck_check_mft_record_unused(vol, mft_num);
+		/*
+		 * The copy from the scan, if any, tells most unused records
+		 * without reading them again.
+		 */
+		if (mrec && ((!ntfs_is_file_record(mrec->magic)
+				&& !ntfs_is_baad_record(mrec->magic))
+			    || !(mrec->flags & MFT_RECORD_IN_USE)))
+			ntfs_log_verbose("Record(%"PRId64") unused. Skipping.\n",
+					mft_num);
+		else
+			ntfsck_check_mft_record_unused(vol, mft_num);
 		ntfsck_mft_bmp_bit_clear(mft_num);
 		return;
 	}
@@ -1995,6 +2008,7 @@ static runlist_element *ntfsck_decompose_runlist(ntfs_attr *na, BOOL *need_fix)
 					rl = NULL;
 				}
 				na->rl = NULL;
+				ntfs_attr_forget_runs(na);
 				*need_fix = TRUE;
 				goto out;
 			}
@@ -2017,6 +2031,7 @@ static runlist_element *ntfsck_decompose_runlist(ntfs_attr *na, BOOL *need_fix)
 		if (not_mapped) {
 			rl = _ntfsck_decompose_runlist(actx, temp_rl, need_fix);
 			na->rl = rl;
+			ntfs_attr_forget_runs(na);
 		}
 
 		if (!next_vcn) {
@@ -2068,6 +2083,7 @@ static runlist_element *ntfsck_decompose_runlist(ntfs_attr *na, BOOL *need_fix)
 	}
 
 	na->rl = rl;
+	ntfs_attr_forget_runs(na);
 
 out:
 	ntfs_attr_put_search_ctx(actx);
@@ -3585,7 +3601,9 @@ static int ntfsck_scan_index_entries(ntfs_volume *vol)
 
 static void ntfsck_check_mft_records(ntfs_volume *vol)
 {
-	s64 mft_num, nr_mft_records;
+	s64 mft_num, nr_mft_records, scan_no = -1;
+	ntfs_mft_scan *scan;
+	MFT_RECORD *mrec = NULL;
 
 	mrec_unused_chk = ntfs_malloc(512);
 	if (!mrec_unused_chk) {
@@ -3600,8 +3618,21 @@ static void ntfsck_check_mft_records(ntfs_volume *vol)
 			vol->mft_record_size_bits;
 	ntfs_log_verbose("Checking %"PRId64" MFT records.\n", nr_mft_records);
 
-	for (mft_num = FILE_first_user; mft_num < nr_mft_records; mft_num++)
-		ntfsck_verify_mft_record(vol, mft_num);
+	/* Records the scan could not read are verified the usual way. */
+	scan = ntfs_mft_scan_open(vol, FILE_first_user, NTFS_MFT_SCAN_ALL);
+	for (mft_num = FILE_first_user; mft_num < nr_mft_records; mft_num++) {
+		while (scan && scan_no < mft_num) {
+			mrec = ntfs_mft_scan_next(scan, &scan_no);
+			if (!mrec) {
+				ntfs_mft_scan_close(scan);
+				scan = NULL;
+			}
+		}
+		ntfsck_verify_mft_record(vol, mft_num,
+				scan && scan_no == mft_num ? mrec : NULL);
+	}
+	if (scan)
+		ntfs_mft_scan_close(scan);
 
 	if (clear_mft_cnt)
 		ntfs_log_info("Clear MFT bitmap count:%"PRId64"\n", clear_mft_cnt);
@@ -3661,6 +3692,11 @@ static ntfs_volume *ntfsck_mount(const char *path __attribute__((unused)),
 	if (!vol)
 		return NULL;
 
+	/* Checking reads the same $MFT, $Bitmap and index clusters often. */
+	if (ntfs_device_cache_enable(vol->dev, vol->cluster_size, 0,
+			NTFS_CACHE_WRITE_THROUGH))
+		ntfs_log_perror("Failed to set up the block cache");
+
 	/* Initialize fsck lcn bitmap buffer array */
 	max_flb_cnt = FB_ROUND_DOWN((vol->nr_clusters + 7)) + 1;
 	fsck_lcn_bitmap = (u8 **)ntfs_calloc(sizeof(u8 *) * max_flb_cnt);
@@ -3690,8 +3726,15 @@ static ntfs_volume *ntfsck_mount(const char *path __attribute__((unused)),
 
 static void ntfsck_umount(ntfs_volume *vol)
 {
+	struct ntfs_device_cache_stats stats;
 	int bm_i;
 
+	if (!ntfs_device_cache_stats_get(vol->dev, &stats))
+		ntfs_log_verbose("Block cache: %lld hits, %lld misses, "
+				"%lld evictions\n", (long long)stats.hits,
+				(long long)stats.misses,
+				(long long)stats.evictions);
+
 	for (bm_i = 0; bm_i < max_flb_cnt; bm_i++)
 		if (fsck_lcn_bitmap[bm_i])
 			free(fsck_lcn_bitmap[bm_i]);
@@ -3960,6 +4003,7 @@ int main(int argc, char **argv)
 	BOOL check_dirty_only = FALSE;
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	ntfs_log_set_levels(NTFS_LOG_LEVEL_INFO);
 
@@ -163,6 +163,7 @@ static struct {
 	int preserve_timestamps;
 	int full_logfile;
 	int restore_image;
+	int direct_io;		/* read the source with O_DIRECT */
 	char *output;
 	char *volume;
 #ifndef NO_STATFS
@@ -361,6 +362,7 @@ static void usage(int ret)
 		"    -s, --save-image       Save to the special image format\n"
 		"    -r, --restore-image    Restore from the special image format\n"
 		"        --rescue           Continue after disk read errors\n"
+		"        --direct-io        Read SOURCE bypassing the page cache\n"
 		"    -m, --metadata         Clone *only* metadata (for NTFS experts)\n"
 		"    -n, --no-action        Test restoring, without outputting anything\n"
 		"        --ignore-fs-check  Ignore the filesystem check result\n"
@@ -415,6 +417,7 @@ static void parse_options(int argc, char **argv)
 		{ "restore-image",    no_argument,	 NULL, 'r' },
 		{ "ignore-fs-check",  no_argument,	 NULL, 'C' },
 		{ "rescue",           no_argument,	 NULL, 'R' },
+		{ "direct-io",        no_argument,	 NULL, 'D' },
 		{ "new-serial",       no_argument,	 NULL, 'I' },
 		{ "new-half-serial",  no_argument,	 NULL, 'i' },
 		{ "full-logfile",     no_argument,	 NULL, 'l' },
@@ -477,6 +480,9 @@ static void parse_options(int argc, char **argv)
 		case 'C':
 			opt.ignore_fs_check++;
 			break;
+		case 'D':	/* not proposed as a short option */
+			opt.direct_io++;
+			break;
 		case 'R':
 			opt.rescue++;
 			break;
@@ -1785,6 +1791,7 @@ static void walk_runs(struct ntfs_walk_cluster *walk)
 					AT_DATA, NULL, 0);
 			if (na) {
 				na->rl = rl;
+				ntfs_attr_forget_runs(na);
 				rl = (runlist_element*)NULL;
 				if (!ntfs_attr_map_whole_runlist(na)) {
 					copy_wipe_mft(walk->image,na->rl);
@@ -1801,6 +1808,7 @@ static void walk_runs(struct ntfs_walk_cluster *walk)
 					AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4);
 			if (na) {
 				na->rl = rl;
+				ntfs_attr_forget_runs(na);
 				rl = (runlist_element*)NULL;
 				if (!ntfs_attr_map_whole_runlist(na)) {
 					copy_wipe_i30(walk->image,na->rl);
@@ -2173,6 +2181,8 @@ static void check_if_mounted(const char *device, unsigned long new_mntflag)
  */
 static void mount_volume(unsigned long new_mntflag)
 {
+	if (opt.direct_io)
+		new_mntflag |= NTFS_MNT_DIRECT_IO;
 	check_if_mounted(opt.volume, new_mntflag);
 
 	if (!(vol = ntfs_mount(opt.volume, new_mntflag))) {
@@ -2219,6 +2229,11 @@ static void mount_volume(unsigned long new_mntflag)
 		err_exit("Cluster size %u is too large!\n",
 				(unsigned int)vol->cluster_size);
 
+	/* Walking the inodes reads the same metadata clusters many times. */
+	if (ntfs_device_cache_enable(vol->dev, vol->cluster_size, 0,
+			NTFS_CACHE_WRITE_THROUGH))
+		perr_printf("Failed to set up the block cache");
+
 	Printf("NTFS volume version: %d.%d\n", vol->major_ver, vol->minor_ver);
 	if (ntfs_version_is_supported(vol))
 		perr_exit("Unknown NTFS version");
@@ -2592,6 +2607,8 @@ int main(int argc, char **argv)
 	s64 ntfs_size;
 	unsigned int wiped_total = 0;
 
+	utils_io_options(&argc, argv);
+
 	/* make sure the layout of header is not affected by alignments */
 	if (offsetof(struct image_hdr, offset_to_image_data)
 			!= IMAGE_OFFSET_OFFSET) {
@@ -2648,7 +2665,7 @@ int main(int argc, char **argv)
 #ifdef HAVE_WINDOWS_H
 			if (!opt.no_action) {
 				dev_out = ntfs_device_alloc(opt.output, 0,
-					&ntfs_device_default_io_ops, NULL);
+					ntfs_device_default_ops_get(), NULL);
 				if (!dev_out
 				    || (dev_out->d_ops->open)(dev_out, flags))
 					perr_exit("Opening volume '%s' failed",
@@ -491,6 +491,7 @@ int main(int argc, char *argv[])
 #endif
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	res = parse_options(argc, argv);
 	if (res >= 0)
@@ -374,6 +374,45 @@ static int inode_open(ntfs_volume *vol, MFT_REF mref, ntfs_inode **ni)
 	return NTFSCMP_OK;
 }
 
+/*
+ * Same as inode_open() for the record @mrec of @mref read by a scan, which
+ * is NULL if the scan could not read it, but without opening the free and
+ * the extension records.
+ */
+static int record_open(ntfs_volume *vol, MFT_REF mref, MFT_RECORD *mrec,
+		ntfs_inode **ni)
+{
+	*ni = NULL;
+	if (!mrec || ntfs_is_baad_record(mrec->magic))
+		return inode_open(vol, mref, ni);
+
+	if (ntfs_mft_record_check(vol, mref, mrec))
+		return NTFSCMP_INODE_OPEN_IO_ERROR;
+	if (!(mrec->flags & MFT_RECORD_IN_USE))
+		return NTFSCMP_INODE_OPEN_ENOENT_ERROR;
+	if (mrec->base_mft_record)
+		return NTFSCMP_EXTENSION_RECORD;
+
+	return inode_open(vol, mref, ni);
+}
+
+/*
+ * Return the record @inode read by @scan, or NULL if it could not be read.
+ * @scan is closed and set to NULL when it ends.
+ */
+static MFT_RECORD *scan_record(ntfs_mft_scan **scan, s64 *mft_no,
+		MFT_RECORD **mrec, u64 inode)
+{
+	while (*scan && *mft_no < (s64)inode) {
+		*mrec = ntfs_mft_scan_next(*scan, mft_no);
+		if (!*mrec) {
+			ntfs_mft_scan_close(*scan);
+			*scan = NULL;
+		}
+	}
+	return *scan && *mft_no == (s64)inode ? *mrec : NULL;
+}
+
 static ntfs_inode *base_inode(ntfs_attr_search_ctx *ctx)
 {
 	if (ctx->base_ntfs_ino)
@@ -490,7 +529,8 @@ static void print_differ(ntfs_attr *na)
 	printf("content:   DIFFER\n");
 }
 
-static int cmp_buffer(u8 *buf1, u8 *buf2, long long int size, ntfs_attr *na)
+static int cmp_buffer(const u8 *buf1, const u8 *buf2, long long int size,
+		ntfs_attr *na)
 {
 	if (memcmp(buf1, buf2, size)) {
 		print_differ(na);
@@ -597,17 +637,39 @@ out:
 	return;
 }
 
+/*
+ * Get up to NTFS_BUF_SIZE bytes of attribute data at @pos, pointing @data
+ * directly to the data when it can be borrowed and to @buf otherwise.
+ */
+static s64 read_attribute_data(ntfs_attr *na, s64 pos, u8 *buf,
+		const u8 **data)
+{
+	s64 count;
+
+	count = na->data_size - pos;
+	if (count > NTFS_BUF_SIZE)
+		count = NTFS_BUF_SIZE;
+	if (count > 0) {
+		*data = ntfs_attr_borrow(na, pos, count);
+		if (*data)
+			return count;
+	}
+	*data = buf;
+	return ntfs_attr_pread(na, pos, NTFS_BUF_SIZE, buf);
+}
+
 static void cmp_attribute_data(ntfs_attr *na1, ntfs_attr *na2)
 {
 	s64 pos;
 	s64 count1 = 0, count2;
 	u8  buf1[NTFS_BUF_SIZE];
 	u8  buf2[NTFS_BUF_SIZE];
+	const u8 *data1, *data2;
 
 	for (pos = 0; pos <= na1->data_size; pos += count1) {
 
-		count1 = ntfs_attr_pread(na1, pos, NTFS_BUF_SIZE, buf1);
-		count2 = ntfs_attr_pread(na2, pos, NTFS_BUF_SIZE, buf2);
+		count1 = read_attribute_data(na1, pos, buf1, &data1);
+		count2 = read_attribute_data(na2, pos, buf2, &data2);
 
 		if (count1 != count2) {
 			print_na(na1);
@@ -640,7 +702,7 @@ static void cmp_attribute_data(ntfs_attr *na1, ntfs_attr *na2)
 			exit(1);
 		}
 
-		if (cmp_buffer(buf1, buf2, count1, na1))
+		if (cmp_buffer(data1, data2, count1, na1))
 			return;
 	}
 
@@ -902,6 +964,10 @@ static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
 	struct progress_bar progress;
 	int pb_flags = 0;	/* progress bar flags */
 	u64 nr_mft_records, nr_mft_records2;
+	ntfs_mft_scan *scan1, *scan2;
+	MFT_RECORD *mrec1 = NULL, *mrec2 = NULL;
+	s64 mft_no1 = -1, mft_no2 = -1;
+	int ret = 0;
 
 	if (opt.show_progress)
 		pb_flags |= NTFS_PROGBAR;
@@ -921,10 +987,17 @@ static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
 	progress_init(&progress, 0, nr_mft_records - 1, pb_flags);
 	progress_update(&progress, 0);
 
+	scan1 = ntfs_mft_scan_open(vol1, 0, NTFS_MFT_SCAN_ALL);
+	scan2 = ntfs_mft_scan_open(vol2, 0, NTFS_MFT_SCAN_ALL);
+
 	for (inode = 0; inode < nr_mft_records; inode++) {
 
-		ret1 = inode_open(vol1, (MFT_REF)inode, &ni1);
-		ret2 = inode_open(vol2, (MFT_REF)inode, &ni2);
+		ret1 = record_open(vol1, (MFT_REF)inode,
+				scan_record(&scan1, &mft_no1, &mrec1, inode),
+				&ni1);
+		ret2 = record_open(vol2, (MFT_REF)inode,
+				scan_record(&scan2, &mft_no2, &mrec2, inode),
+				&ni2);
 
 		if (ret1 != ret2) {
 			print_inode(inode);
@@ -939,17 +1012,22 @@ static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
 		if (cmp_attributes(ni1, ni2) != 0) {
 			inode_close(ni1);
 			inode_close(ni2);
-			return -1;
+			ret = -1;
+			break;
 		}
 close_inodes:
-		if (inode_close(ni1) != 0)
-			return -1;
-		if (inode_close(ni2) != 0)
-			return -1;
+		if (inode_close(ni1) != 0 || inode_close(ni2) != 0) {
+			ret = -1;
+			break;
+		}
 
 		progress_update(&progress, inode);
 	}
-	return 0;
+	if (scan1)
+		ntfs_mft_scan_close(scan1);
+	if (scan2)
+		ntfs_mft_scan_close(scan2);
+	return ret;
 }
 
 static ntfs_volume *mount_volume(const char *volume)
@@ -969,7 +1047,7 @@ static ntfs_volume *mount_volume(const char *volume)
 				 "You must 'umount' it first.\n", volume);
 	}
 
-	vol = ntfs_mount(volume, NTFS_MNT_RDONLY);
+	vol = ntfs_mount(volume, NTFS_MNT_RDONLY | NTFS_MNT_MMAP_IO);
 	if (vol == NULL) {
 
 		int err = errno;
@@ -992,6 +1070,8 @@ int main(int argc, char **argv)
 	ntfs_volume *vol1;
 	ntfs_volume *vol2;
 
+	utils_io_options(&argc, argv);
+
 	printf("%s v%s (libntfs-3g)\n", EXEC_NAME, VERSION);
 
 	parse_options(argc, argv);
@@ -70,6 +70,7 @@ struct options {
 	int		 quiet;		/* Less output */
 	int		 verbose;	/* Extra output */
 	int		 minfragments;	/* Do minimal fragmentation */
+	int		 prealloc;	/* Reserve clusters ahead of writes */
 	int		 timestamp;	/* Copy the modification time */
 	int		 noaction;	/* Do not write to disk */
 	ATTR_TYPES	 attribute;	/* Write to this attribute. */
@@ -130,6 +131,7 @@ static void usage(void)
 		"    -m, --min_fragments   Do minimal fragmentation\n"
 		"    -N, --attr-name NAME  Write to attribute with this name\n"
 		"    -n, --no-action       Do not write to disk\n"
+		"    -p, --preallocate     Reserve clusters ahead of writes\n"
 		"    -q, --quiet           Less output\n"
 		"    -t, --timestamp       Copy the modification time\n"
 		"    -V, --version         Version information\n"
@@ -149,7 +151,7 @@ static void usage(void)
  */
 static int parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-a:ifh?mN:no:qtVv";
+	static const char *sopt = "-a:ifh?mN:no:pqtVv";
 	static const struct option lopt[] = {
 		{ "attribute",	required_argument,	NULL, 'a' },
 		{ "inode",	no_argument,		NULL, 'i' },
@@ -158,6 +160,7 @@ static int parse_options(int argc, char **argv)
 		{ "min-fragments", no_argument,		NULL, 'm' },
 		{ "attr-name",	required_argument,	NULL, 'N' },
 		{ "no-action",	no_argument,		NULL, 'n' },
+		{ "preallocate", no_argument,		NULL, 'p' },
 		{ "quiet",	no_argument,		NULL, 'q' },
 		{ "timestamp",	no_argument,		NULL, 't' },
 		{ "version",	no_argument,		NULL, 'V' },
@@ -236,6 +239,9 @@ static int parse_options(int argc, char **argv)
 		case 'n':
 			opts.noaction++;
 			break;
+		case 'p':
+			opts.prealloc++;
+			break;
 		case 'q':
 			opts.quiet++;
 			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
@@ -292,6 +298,13 @@ static int parse_options(int argc, char **argv)
 					"at the same time.\n");
 			err++;
 		}
+
+		if (opts.minfragments && opts.prealloc) {
+			ntfs_log_error("You may not use --min-fragments and "
+					"--preallocate at the same time.\n");
+			err++;
+		}
+
 		if (opts.timestamp
 		    && (opts.attr_name || (opts.attribute != AT_DATA))) {
 			ntfs_log_error("Setting --timestamp is only possible"
@@ -660,6 +673,7 @@ static int assign_runlist(struct ALLOC_CONTEXT *alctx)
 	if (na->rl)
 		free(na->rl);
 	na->rl = alctx->rl;
+	ntfs_attr_forget_runs(na);
 			/* Allocate the clusters */
 	for (k=0; ((k + 1) < alctx->rl_count) && !err; k++) {
 		if (ntfs_bitmap_set_run(alctx->vol->lcnbmp_na,
@@ -854,6 +868,7 @@ int main(int argc, char *argv[])
 #endif
 
 	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	utils_io_options(&argc, argv);
 
 	res = parse_options(argc, argv);
 	if (res >= 0)
@@ -874,8 +889,12 @@ int main(int argc, char *argv[])
 
 	if (opts.noaction)
 		flags = NTFS_MNT_RDONLY;
+	else
+		flags |= NTFS_MNT_MFT_QUEUE;
 	if (opts.force)
 		flags |= NTFS_MNT_RECOVER;
+	if (opts.prealloc)
+		flags |= NTFS_MNT_PREALLOC;
 
 	vol = utils_mount_volume(opts.device, flags);
 	if (!vol) {
@@ -1083,14 +1102,15 @@ int main(int argc, char *argv[])
 				" of a compressed attribute\n");
 		opts.minfragments = 0;
 		}
-	if (na->data_size && opts.minfragments) {
+	/* Reserving clusters needs appending writes, from an empty file. */
+	if (na->data_size && (opts.minfragments || opts.prealloc)) {
 		if (ntfs_attr_truncate(na, 0)) {
 			ntfs_log_perror(
 				"ERROR: Couldn't truncate existing attribute");
 			goto close_attr;
 		}
 	}
-	if (na->data_size != new_size) {
+	if (na->data_size != new_size && !opts.prealloc) {
 		if (opts.minfragments) {
 			/*
 			 * Do a standard truncate() to check whether the
@@ -1147,7 +1167,10 @@ int main(int argc, char *argv[])
 	    && ntfs_attr_pclose(na))
 		ntfs_log_perror("ERROR: ntfs_attr_pclose failed");
 	ntfs_log_verbose("Syncing.\n");
-	result = 0;
+	if (ntfs_attr_flush(na))
+		ntfs_log_perror("ERROR: ntfs_attr_flush failed");
+	else
+		result = 0;
 	free(buf);
 close_attr:
 	ntfs_attr_close(na);
@@ -1173,6 +1196,11 @@ close_dst:
 close_src:
 	fclose(in);
 umount:
+	/* The queued mft records are written here at the latest. */
+	if (!opts.noaction && ntfs_mft_queue_flush(vol)) {
+		ntfs_log_perror("ERROR: couldn't write the mft records");
+		result = 1;
+	}
 	ntfs_umount(vol, FALSE);
 	ntfs_log_verbose("Done.\n");
 	return result;
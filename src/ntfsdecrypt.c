@@ -1420,6 +1420,11 @@ static int ntfs_cat_decrypt(ntfs_inode *inode, ntfs_fek *fek)
 	attr->data_size = old_data_size;
 	attr->initialized_size = old_initialized_size;
 	NAttrSetEncrypted(attr);
+	if (ntfs_attr_flush(attr)) {
+		ntfs_log_perror("ERROR: Couldn't update the runlist!");
+		ntfs_attr_close(attr);
+		goto rejected;
+	}
 	ntfs_attr_close(attr);
 	free(buffer);
 	return 0;
@@ -1518,6 +1523,11 @@ static int ntfs_feed_encrypt(ntfs_inode *inode, ntfs_fek *fek)
 	ntfs_attr_truncate(attr, total);
 	inode->last_data_change_time = ntfs_current_time();
 	NAttrSetEncrypted(attr);
+	if (ntfs_attr_flush(attr)) {
+		ntfs_log_perror("ERROR: Couldn't update the runlist!");
+		ntfs_attr_close(attr);
+		goto rejected;
+	}
 	ntfs_attr_close(attr);
 	free(buffer);
 	return 0;
@@ -1548,6 +1558,7 @@ int main(int argc, char *argv[])
 	char thumbprint[NTFS_SHA1_THUMBPRINT_SIZE];
 
 	ntfs_log_set_handler(ntfs_log_handler_stderr);
+	utils_io_options(&argc, argv);
 
 	res = parse_options(argc, argv);
 	if (res >= 0)
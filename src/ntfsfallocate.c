@@ -478,6 +478,7 @@ static void ntfs_restore_rl(ntfs_attr *na, runlist_element *oldrl)
 	}
 	free(na->rl);
 	na->rl = oldrl;
+	ntfs_attr_forget_runs(na);
 	if (ntfs_attr_update_mapping_pairs(na, 0)) {
 		ntfs_log_error("Failed to restore the original runlist\n");
 	}
@@ -575,6 +576,7 @@ static int ntfs_merge_allocation(ntfs_attr *na, runlist_element *rl,
 			err = -1;
 		} else {
 			na->rl = rl;
+			ntfs_attr_forget_runs(na);
 				/* Update the runlist */
 			if (ntfs_attr_update_mapping_pairs(na, 0)) {
 				ntfs_log_error(
@@ -824,6 +826,7 @@ int main(int argc, char **argv)
 
 	vol = (ntfs_volume*)NULL;
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	/* Initialize opts to zero / required values. */
 	memset(&opts, 0, sizeof(opts));
@@ -2472,6 +2472,7 @@ int main(int argc, char **argv)
 	setlinebuf(stdout);
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	res = parse_options(argc, argv);
 	if (res > 0)
@@ -2482,7 +2483,8 @@ int main(int argc, char **argv)
 	utils_set_locale();
 
 	vol = utils_mount_volume(opts.device, NTFS_MNT_RDONLY |
-			(opts.force ? NTFS_MNT_RECOVER : 0));
+			NTFS_MNT_MMAP_IO | (opts.force ? NTFS_MNT_RECOVER : 0) |
+			(opts.mft ? NTFS_MNT_COUNT_FREE : 0));
 	if (!vol) {
 		printf("Failed to open '%s'.\n", opts.device);
 		exit(1);
@@ -415,6 +415,7 @@ int main(int argc, char **argv)
 	ntfs_volume *vol;
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	result = parse_options(argc, argv);
 	if (result >= 0)
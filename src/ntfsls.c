@@ -642,6 +642,7 @@ int main(int argc, char **argv)
 	ntfsls_dirent dirent;
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	if (!parse_options(argc, argv)) {
 		// FIXME: Print error... (AIA)
@@ -651,7 +652,7 @@ int main(int argc, char **argv)
 	utils_set_locale();
 
 	vol = utils_mount_volume(opts.device, NTFS_MNT_RDONLY |
-			(opts.force ? NTFS_MNT_RECOVER : 0));
+			NTFS_MNT_MMAP_IO | (opts.force ? NTFS_MNT_RECOVER : 0));
 	if (!vol) {
 		// FIXME: Print error... (AIA)
 		return 2;
@@ -872,6 +872,7 @@ int main(int argc, char *argv[])
 	s64 count;
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	if (!parse_options(argc, argv))
 		return 1;
@@ -152,6 +152,7 @@ static struct {
 	int show_progress;
 	int badsectors;
 	int check;
+	int direct_io;
 	s64 bytes;
 	char *volume;
 } opt;
@@ -351,6 +352,7 @@ static void usage(int ret)
 		"\n"
 		"    -n, --no-action        Do not write to disk\n"
 		"    -b, --bad-sectors      Support disks having bad sectors\n"
+		"        --direct-io        Bypass the page cache of the device\n"
 		"    -f, --force            Force to progress\n"
 		"    -P, --no-progress-bar  Don't show progress bar\n"
 		"    -v, --verbose          More output\n"
@@ -482,6 +484,7 @@ static int parse_options(int argc, char **argv)
 	static const struct option lopt[] = {
 		{ "bad-sectors",no_argument,		NULL, 'b' },
 		{ "check",	no_argument,		NULL, 'c' },
+		{ "direct-io",	no_argument,		NULL, 'D' },
 #ifdef DEBUG
 		{ "debug",	no_argument,		NULL, 'd' },
 #endif
@@ -523,6 +526,9 @@ static int parse_options(int argc, char **argv)
 		case 'd':
 			opt.debug++;
 			break;
+		case 'D':	/* not proposed as a short option */
+			opt.direct_io++;
+			break;
 		case 'f':
 			opt.force++;
 			break;
@@ -1284,6 +1290,7 @@ static int replace_runlist(ntfs_attr *na, const runlist_element *reprl,
 		/* deallocate the old runlist and replace */
 		free(na->rl);
 		na->rl = newrl;
+		ntfs_attr_forget_runs(na);
 		r = 0;
 	}
 	return (r);
@@ -1695,8 +1702,10 @@ static int replace_attribute_runlist(ntfs_resize_t *resize, runlist *rl)
 
 static void set_bitmap_range(struct bitmap *bm, s64 pos, s64 length, u8 bit)
 {
-	while (length--)
-		ntfs_bit_set(bm->bm, pos++, bit);
+	if (bit)
+		ntfs_bitmap_set_range(bm->bm, pos, length);
+	else
+		ntfs_bitmap_clear_range(bm->bm, pos, length);
 }
 
 static void set_bitmap_clusters(struct bitmap *bm, runlist *rl, u8 bit)
@@ -1918,6 +1927,9 @@ static void copy_clusters(ntfs_resize_t *resize, s64 dest, s64 src, s64 len)
 				printf("%s", bad_sectors_warning_msg);
 			exit(1);
 		}
+		ntfs_device_cache_invalidate(vol->dev,
+				(dest + i) * vol->cluster_size,
+				vol->cluster_size);
 
 		resize->relocations++;
 		progress_update(&resize->progress, resize->relocations);
@@ -2560,6 +2572,7 @@ static void truncate_bitmap_data_attr(ntfs_resize_t *resize)
 			/* switch to the new bitmap runlist */
 		free(lcnbmp_na->rl);
 		lcnbmp_na->rl = rl;
+		ntfs_attr_forget_runs(lcnbmp_na);
 	}
 }
 
@@ -2808,6 +2821,7 @@ static void update_bootsector(ntfs_resize_t *r)
 	if (!opt.ro_flag)
 		if (vol->dev->d_ops->write(vol->dev, bs, bs_size) == -1)
 			perr_exit("write() error");
+	ntfs_device_cache_invalidate(vol->dev, 0, bs_size);
 		/*
 		 * Set the backup boot sector, if the target size is
 		 * either not defined or is defined with no multiplier
@@ -2823,6 +2837,8 @@ static void update_bootsector(ntfs_resize_t *r)
 			perr_exit("lseek");
 		if (vol->dev->d_ops->write(vol->dev, bs, bs_size) == -1)
 			perr_exit("write() error");
+		ntfs_device_cache_invalidate(vol->dev,
+				opt.bytes - vol->sector_size, bs_size);
 	}
 	free(bs);
 }
@@ -2885,7 +2901,8 @@ static ntfs_volume *check_volume(void)
 	 * volume at all.  We will do the logfile emptying and dirty setting
 	 * later if needed.
 	 */
-	if (!(myvol = ntfs_mount(opt.volume, opt.ro_flag | NTFS_MNT_FORENSIC)))
+	if (!(myvol = ntfs_mount(opt.volume, opt.ro_flag | NTFS_MNT_FORENSIC
+			| (opt.direct_io ? NTFS_MNT_DIRECT_IO : 0))))
 	{
 		int err = errno;
 
@@ -2911,6 +2928,10 @@ static ntfs_volume *check_volume(void)
 		}
 		exit(1);
 	}
+	/* Metadata is read several times while checking and relocating. */
+	if (ntfs_device_cache_enable(myvol->dev, myvol->cluster_size, 0,
+			NTFS_CACHE_WRITE_THROUGH))
+		perr_printf("Failed to set up the block cache");
 	return myvol;
 }
 
@@ -4493,8 +4514,8 @@ static int expand_to_beginning(void)
 	s64 new_sectors;
 	        
 	ret = -1;
-	dev = ntfs_device_alloc(opt.volume, 0, &ntfs_device_default_io_ops,
-			NULL);
+	dev = ntfs_device_alloc(opt.volume, opt.direct_io ? 1L << ND_Direct : 0,
+			ntfs_device_default_ops_get(), NULL);
 	if (dev) {
 	        if (!(*dev->d_ops->open)(dev,
 				(opt.ro_flag ? O_RDONLY : O_RDWR))) {
@@ -4542,6 +4563,7 @@ int main(int argc, char **argv)
 	int res;
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	printf("%s v%s (libntfs-3g)\n", EXEC_NAME, VERSION);
 
@@ -6239,6 +6239,8 @@ int main(int argc, char *argv[])
 	BOOL fail;
 	int i;
 
+	utils_io_options(&argc, argv);
+
 	printf("%s\n",BANNER);
 	cmderr = FALSE;
 	fail = FALSE;
@@ -710,6 +710,7 @@ int main(int argc, char **argv)
 	int err;
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	/* Initialize opts to zero / required values. */
 	memset(&opts, 0, sizeof(opts));
@@ -1330,14 +1330,16 @@ static int get_data(struct ufile *file, ntfs_volume *vol)
  * read_record - Read an MFT record into memory
  * @vol:     An ntfs volume obtained from ntfs_mount
  * @record:  The record number to read
+ * @mrec:    The record if it has already been read, or NULL
  *
- * Read the specified MFT record and gather as much information about it as
- * possible.
+ * Read the specified MFT record, unless it is given, and gather as much
+ * information about it as possible.
  *
  * Return:  Pointer  A ufile object containing the results
  *	    NULL     Error
  */
-static struct ufile * read_record(ntfs_volume *vol, long long record)
+static struct ufile * read_record(ntfs_volume *vol, long long record,
+		const MFT_RECORD *mrec)
 {
 	ATTR_RECORD *attr10, *attr20, *attr90;
 	struct ufile *file;
@@ -1364,23 +1366,27 @@ static struct ufile * read_record(ntfs_volume *vol, long long record)
 		return NULL;
 	}
 
-	mft = ntfs_attr_open(vol->mft_ni, AT_DATA, AT_UNNAMED, 0);
-	if (!mft) {
-		ntfs_log_perror("ERROR: Couldn't open $MFT/$DATA");
-		free_file(file);
-		return NULL;
-	}
+	if (mrec)
+		memcpy(file->mft, mrec, vol->mft_record_size);
+	else {
+		mft = ntfs_attr_open(vol->mft_ni, AT_DATA, AT_UNNAMED, 0);
+		if (!mft) {
+			ntfs_log_perror("ERROR: Couldn't open $MFT/$DATA");
+			free_file(file);
+			return NULL;
+		}
+
+		if (ntfs_attr_mst_pread(mft, vol->mft_record_size * record, 1, vol->mft_record_size, file->mft) < 1) {
+			ntfs_log_error("ERROR: Couldn't read MFT Record %lld.\n", record);
+			ntfs_attr_close(mft);
+			free_file(file);
+			return NULL;
+		}
 
-	if (ntfs_attr_mst_pread(mft, vol->mft_record_size * record, 1, vol->mft_record_size, file->mft) < 1) {
-		ntfs_log_error("ERROR: Couldn't read MFT Record %lld.\n", record);
 		ntfs_attr_close(mft);
-		free_file(file);
-		return NULL;
+		mft = NULL;
 	}
 
-	ntfs_attr_close(mft);
-	mft = NULL;
-
 	/* disable errors logging, while examining suspicious records */
 	log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
 	attr10 = find_first_attribute(AT_STANDARD_INFORMATION,	file->mft);
@@ -1983,7 +1989,7 @@ static int undelete_file(ntfs_volume *vol, long long inode)
 		return 0;
 
 	/* try to get record */
-	file = read_record(vol, inode);
+	file = read_record(vol, inode, NULL);
 	if (!file || !file->mft) {
 		ntfs_log_error("Can't read info from mft record %lld.\n", inode);
 		return 0;
@@ -2216,15 +2222,10 @@ free:
  */
 static int scan_disk(ntfs_volume *vol)
 {
-	s64 nr_mft_records;
-	const int BUFSIZE = 8192;
-	char *buffer = NULL;
+	ntfs_mft_scan *scan;
+	MFT_RECORD *mrec;
 	int results = 0;
-	ntfs_attr *attr;
-	long long size;
-	long long bmpsize;
-	long long i;
-	int j, k, b;
+	s64 mft_no;
 	int percent;
 	struct ufile *file;
 	regex_t re;
@@ -2232,19 +2233,12 @@ static int scan_disk(ntfs_volume *vol)
 	if (!vol)
 		return -1;
 
-	attr = ntfs_attr_open(vol->mft_ni, AT_BITMAP, AT_UNNAMED, 0);
-	if (!attr) {
-		ntfs_log_perror("ERROR: Couldn't open $MFT/$BITMAP");
-		return -1;
-	}
 	NVolSetNoFixupWarn(vol);
-	bmpsize = attr->initialized_size;
-
-	buffer = malloc(BUFSIZE);
-	if (!buffer) {
-		ntfs_log_error("ERROR: Couldn't allocate memory in scan_disk()\n");
-		results = -1;
-		goto out;
+	scan = ntfs_mft_scan_open(vol, 0, NTFS_MFT_SCAN_FREE);
+	if (!scan) {
+		ntfs_log_perror("ERROR: Couldn't scan the MFT");
+		NVolClearNoFixupWarn(vol);
+		return -1;
 	}
 
 	if (opts.match) {
@@ -2262,76 +2256,58 @@ static int scan_disk(ntfs_volume *vol)
 #endif
 	}
 
-	nr_mft_records = vol->mft_na->initialized_size >>
-			vol->mft_record_size_bits;
-
 	ntfs_log_quiet("Inode    Flags  %%age     Date    Time       Size  Filename\n");
 	ntfs_log_quiet("-----------------------------------------------------------------------\n");
-	for (i = 0; i < bmpsize; i += BUFSIZE) {
-		long long read_count = min((bmpsize - i), BUFSIZE);
-		size = ntfs_attr_pread(attr, i, read_count, buffer);
-		if (size < 0)
-			break;
-
-		for (j = 0; j < size; j++) {
-			b = buffer[j];
-			for (k = 0; k < 8; k++, b>>=1) {
-				if (((i+j)*8+k) >= nr_mft_records)
-					goto done;
-				if (b & 1)
-					continue;
-				file = read_record(vol, (i+j)*8+k);
-				if (!file) {
-					ntfs_log_error("Couldn't read MFT Record %lld.\n",
-							(long long)(i+j)*8+k);
-					continue;
-				}
+	while ((mrec = ntfs_mft_scan_next(scan, &mft_no))) {
+		file = read_record(vol, mft_no, mrec);
+		if (!file) {
+			ntfs_log_error("Couldn't read MFT Record %lld.\n",
+					(long long)mft_no);
+			continue;
+		}
 
-				if ((opts.since > 0) && (file->date <= opts.since))
-					goto skip;
-				if (opts.match && !name_match(&re, file))
-					goto skip;
-				if (opts.size_begin && (opts.size_begin > file->max_size))
-					goto skip;
-				if (opts.size_end && (opts.size_end < file->max_size))
-					goto skip;
-
-				percent = calc_percentage(file, vol);
-				if ((opts.percent == -1) || (percent >= opts.percent)) {
-					if (opts.verbose)
-						dump_record(file);
-					else
-						list_record(file);
-
-					/* Was -u specified with no inode
-					   so undelete file by regex */
-					if (opts.mode == MODE_UNDELETE) {
-						if  (!undelete_file(vol, file->inode))
-							ntfs_log_verbose("ERROR: Failed to undelete "
-								  "inode %lli\n!",
-								  file->inode);
-						ntfs_log_info("\n");
-					}
-				}
-				if (((opts.percent == -1) && (percent > 0)) ||
-				    ((opts.percent > 0)  && (percent >= opts.percent))) {
-					results++;
-				}
-skip:
-				free_file(file);
+		if ((opts.since > 0) && (file->date <= opts.since))
+			goto skip;
+		if (opts.match && !name_match(&re, file))
+			goto skip;
+		if (opts.size_begin && (opts.size_begin > file->max_size))
+			goto skip;
+		if (opts.size_end && (opts.size_end < file->max_size))
+			goto skip;
+
+		percent = calc_percentage(file, vol);
+		if ((opts.percent == -1) || (percent >= opts.percent)) {
+			if (opts.verbose)
+				dump_record(file);
+			else
+				list_record(file);
+
+			/* Was -u specified with no inode
+			   so undelete file by regex */
+			if (opts.mode == MODE_UNDELETE) {
+				if  (!undelete_file(vol, file->inode))
+					ntfs_log_verbose("ERROR: Failed to undelete "
+						  "inode %lli\n!",
+						  file->inode);
+				ntfs_log_info("\n");
 			}
 		}
+		if (((opts.percent == -1) && (percent > 0)) ||
+		    ((opts.percent > 0)  && (percent >= opts.percent))) {
+			results++;
+		}
+skip:
+		free_file(file);
 	}
-done:
+	if (errno != ENOENT)
+		ntfs_log_perror("ERROR: Couldn't read the MFT");
 	ntfs_log_quiet("\nFiles with potentially recoverable content: %d\n",
 		results);
 out:
 	if (opts.match)
 		regfree(&re);
-	free(buffer);
+	ntfs_mft_scan_close(scan);
 	NVolClearNoFixupWarn(vol);
-	if (attr)
-		ntfs_attr_close(attr);
 	return results;
 }
 
@@ -2482,6 +2458,7 @@ int main(int argc, char *argv[])
 	int result = 1;
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	with_regex = 0;
 	avoid_duplicate_printing = 0;
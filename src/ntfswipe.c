@@ -2155,6 +2155,7 @@ int main(int argc, char *argv[])
 	enum action act = act_info;
 
 	ntfs_log_set_handler(ntfs_log_handler_outerr);
+	utils_io_options(&argc, argv);
 
 	res = parse_options(argc, argv);
 	if (res >= 0)
@@ -69,6 +69,7 @@
 #include "utils.h"
 #include "types.h"
 #include "volume.h"
+#include "device.h"
 #include "debug.h"
 #include "dir.h"
 /* #include "version.h" */
@@ -145,6 +146,182 @@ int utils_set_locale(void)
 	}
 }
 
+static struct ntfs_device_io_stats utils_io_stats;
+
+/**
+ * utils_io_stats_print_hist - Print the non-empty buckets of a histogram
+ */
+static void utils_io_stats_print_hist(const char *title, const s64 *hist,
+		const char *unit)
+{
+	int n;
+
+	fprintf(stderr, "  %s:\n", title);
+	for (n = 0; n < NTFS_IO_HIST_BUCKETS; n++) {
+		if (!hist[n])
+			continue;
+		if (n == NTFS_IO_HIST_BUCKETS - 1)
+			fprintf(stderr, "    %11lld %-13s %-5s %12lld\n",
+					1LL << n, "and more", unit,
+					(long long)hist[n]);
+		else
+			fprintf(stderr, "    %11lld - %-11lld %-5s %12lld\n",
+					n ? 1LL << n : 0LL,
+					(2LL << n) - 1, unit,
+					(long long)hist[n]);
+	}
+}
+
+/**
+ * utils_io_stats_print_dir - Print the I/O counters of one direction
+ */
+static void utils_io_stats_print_dir(const char *name,
+		const struct ntfs_io_dir_stats *ds)
+{
+	if (!ds->ops)
+		return;
+	fprintf(stderr, "%s: %lld operations, %lld bytes, %lld errors\n",
+			name, (long long)ds->ops, (long long)ds->bytes,
+			(long long)ds->errors);
+	fprintf(stderr, "  sequential: %lld (%.1f%%), random: %lld\n",
+			(long long)ds->sequential,
+			100.0 * ds->sequential / ds->ops,
+			(long long)(ds->ops - ds->sequential));
+	fprintf(stderr, "  mst records: %lld\n", (long long)ds->mst_records);
+	fprintf(stderr, "  time: %.3f s, average latency: %.1f us\n",
+			ds->usecs / 1e6, (double)ds->usecs / ds->ops);
+	utils_io_stats_print_hist("sizes", ds->size_hist, "bytes");
+	utils_io_stats_print_hist("latencies", ds->lat_hist, "us");
+}
+
+/**
+ * utils_io_stats_print - Print the I/O counters, registered with atexit()
+ */
+static void utils_io_stats_print(void)
+{
+	fprintf(stderr, "I/O statistics:\n");
+	if (!utils_io_stats.reads.ops && !utils_io_stats.writes.ops)
+		fprintf(stderr, "No I/O\n");
+	utils_io_stats_print_dir("Reads", &utils_io_stats.reads);
+	utils_io_stats_print_dir("Writes", &utils_io_stats.writes);
+}
+
+static const struct {
+	const char *name;
+	struct ntfs_device_operations *ops;
+} utils_io_backends[] = {
+	{ "unix",	&ntfs_device_default_io_ops },
+#ifdef ENABLE_IO_URING
+	{ "uring",	&ntfs_device_uring_io_ops },
+#endif
+#ifdef ENABLE_SIM_IO
+	{ "sim",	&ntfs_device_sim_io_ops },
+#endif
+};
+
+/**
+ * utils_io_backend - Select the device operations named by --io-backend
+ * @spec:  Backend name, optionally followed by a colon and its settings
+ *
+ * Errors are printed to stderr, as the tool may not have set up logging yet.
+ *
+ * Return:  1  Success
+ *	    0  Error, unknown backend or invalid settings
+ */
+static int utils_io_backend(const char *spec)
+{
+	const char *params;
+	size_t len;
+	int i;
+
+	params = strchr(spec, ':');
+	len = params ? (size_t)(params++ - spec) : strlen(spec);
+	for (i = 0; i < (int)(sizeof(utils_io_backends)
+			/ sizeof(utils_io_backends[0])); i++) {
+		if (strlen(utils_io_backends[i].name) != len
+		    || strncmp(utils_io_backends[i].name, spec, len))
+			continue;
+#ifdef ENABLE_SIM_IO
+		if (utils_io_backends[i].ops == &ntfs_device_sim_io_ops) {
+			if (ntfs_device_sim_io_configure(params)) {
+				fprintf(stderr, "Invalid I/O backend settings "
+						"'%s'.\n", params);
+				return 0;
+			}
+		} else
+#endif
+		if (params) {
+			fprintf(stderr, "The %s I/O backend has no "
+					"settings.\n",
+					utils_io_backends[i].name);
+			return 0;
+		}
+		ntfs_device_default_ops_set(utils_io_backends[i].ops);
+		return 1;
+	}
+	fprintf(stderr, "Unknown I/O backend '%.*s'.\n", (int)len, spec);
+	return 0;
+}
+
+/**
+ * utils_io_options - Handle the I/O options common to all tools
+ * @argc:  Pointer to the argument count of main()
+ * @argv:  Argument vector of main()
+ *
+ * The options are:
+ *	--io-stats		Count the I/O made on all the devices the tool
+ *				opens and print the counters to stderr when
+ *				the tool exits.
+ *	--io-backend NAME[:SETTINGS]
+ *				Access the devices through another backend,
+ *				e.g. "sim:latency=100,seek=8000,bw=100M" to
+ *				simulate a hard disk.
+ *
+ * They are removed from the arguments, up to a "--", so that the tool's own
+ * option parsing does not see them.  This must be called before the tool
+ * opens any device, usually first thing in main().  The tool exits if an
+ * option is invalid.
+ */
+void utils_io_options(int *argc, char **argv)
+{
+	BOOL stats = FALSE;
+	const char *arg;
+	int i, j;
+
+	for (i = j = 1; i < *argc; i++) {
+		arg = argv[i];
+		if (!strcmp(arg, "--"))
+			break;
+		if (!strcmp(arg, "--io-stats")) {
+			stats = TRUE;
+			continue;
+		}
+		if (!strncmp(arg, "--io-backend", 12)
+		    && (!arg[12] || arg[12] == '=')) {
+			if (arg[12])
+				arg += 13;
+			else if (i + 1 < *argc)
+				arg = argv[++i];
+			else {
+				fprintf(stderr, "Option --io-backend requires "
+						"an argument.\n");
+				exit(1);
+			}
+			if (!utils_io_backend(arg))
+				exit(1);
+			continue;
+		}
+		argv[j++] = argv[i];
+	}
+	while (i <= *argc)
+		argv[j++] = argv[i++];
+	*argc = j - 1;
+	if (stats) {
+		ntfs_device_io_stats_default(&utils_io_stats);
+		atexit(utils_io_stats_print);
+	}
+}
+
 /**
  * linux-ntfs's ntfs_mbstoucs has different semantics, so we emulate it with
  * ntfs-3g's.
@@ -864,15 +1041,23 @@ void mft_put_search_ctx(struct mft_search_ctx *ctx)
 		return;
 	if (ctx->inode)
 		ntfs_inode_close(ctx->inode);
+	if (ctx->scan)
+		ntfs_mft_scan_close(ctx->scan);
 	free(ctx);
 }
 
 /**
  * mft_next_record
+ *
+ * The records not in use are only returned when FEMR_NOT_IN_USE is searched,
+ * flagged as such, and only if they still hold a file record: those never
+ * used, or failing the mst deprotection, are skipped.
  */
 int mft_next_record(struct mft_search_ctx *ctx)
 {
-	s64 nr_mft_records;
+	MFT_RECORD *mrec;
+	s64 mft_no;
+	int flags;
 	ATTR_RECORD *attr10 = NULL;
 	ATTR_RECORD *attr20 = NULL;
 	ATTR_RECORD *attr80 = NULL;
@@ -888,33 +1073,36 @@ int mft_next_record(struct mft_search_ctx *ctx)
 		ctx->inode = NULL;
 	}
 
-	nr_mft_records = ctx->vol->mft_na->initialized_size >>
-			ctx->vol->mft_record_size_bits;
-
-	for (ctx->mft_num++; (s64)ctx->mft_num < nr_mft_records; ctx->mft_num++) {
-		int in_use;
-
-		ctx->flags_match = 0;
-		in_use = utils_mftrec_in_use(ctx->vol, (MFT_REF) ctx->mft_num);
-		if (in_use == -1) {
-			ntfs_log_error("Error reading inode %llu.  Aborting.\n",
-					(unsigned long long)ctx->mft_num);
+	/* Free records only match FEMR_NOT_IN_USE, in use ones the others. */
+	if (!ctx->scan) {
+		flags = 0;
+		if (ctx->flags_search & FEMR_NOT_IN_USE)
+			flags |= NTFS_MFT_SCAN_FREE;
+		if (ctx->flags_search & ~FEMR_NOT_IN_USE)
+			flags |= NTFS_MFT_SCAN_IN_USE;
+		if (!flags)
+			return 1;
+		ctx->scan = ntfs_mft_scan_open(ctx->vol, ctx->mft_num + 1,
+				flags);
+		if (!ctx->scan) {
+			ntfs_log_perror("Couldn't open the MFT scan");
 			return -1;
 		}
+	}
 
-		if (in_use) {
+	while ((mrec = ntfs_mft_scan_next(ctx->scan, &mft_no))) {
+		ctx->mft_num = mft_no;
+
+		ctx->flags_match = 0;
+		if (ntfs_mft_scan_in_use(ctx->scan, mft_no)) {
 			ctx->flags_match |= FEMR_IN_USE;
 
 			ctx->inode = ntfs_inode_open(ctx->vol, (MFT_REF) ctx->mft_num);
 			if (ctx->inode == NULL) {
-				MFT_RECORD *mrec;
-				int r;
 				MFT_REF base_inode;
 
-				mrec = (MFT_RECORD*)NULL;
-				r = ntfs_file_record_read(ctx->vol,
-					(MFT_REF) ctx->mft_num, &mrec, NULL);
-				if (r || !mrec || !mrec->base_mft_record)
+				if (!ntfs_is_file_record(mrec->magic)
+				    || !mrec->base_mft_record)
 					ntfs_log_error(
 						"Error reading inode %lld.\n",
 						(long long)ctx->mft_num);
@@ -926,7 +1114,6 @@ int mft_next_record(struct mft_search_ctx *ctx)
 						(long long)ctx->mft_num,
 						(long long)MREF(base_inode));
 				}
-				free (mrec);
 				continue;
 			}
 
@@ -968,41 +1155,29 @@ int mft_next_record(struct mft_search_ctx *ctx)
 			}
 
 		} else {		// !in_use
-			ntfs_attr *mft;
+			if (!ntfs_is_file_record(mrec->magic))
+				continue;
 
 			ctx->flags_match |= FEMR_NOT_IN_USE;
 
-			ctx->inode = (ntfs_inode*)calloc(1, sizeof(*ctx->inode));
+			/* Released by ntfs_inode_close(), from the volume pools */
+			ctx->inode = ntfs_inode_allocate(ctx->vol);
 			if (!ctx->inode) {
 				ntfs_log_error("Out of memory.  Aborting.\n");
 				return -1;
 			}
 
 			ctx->inode->mft_no = ctx->mft_num;
-			ctx->inode->vol    = ctx->vol;
-			ctx->inode->mrec   = ntfs_malloc(ctx->vol->mft_record_size);
+			ctx->inode->mrec   = ntfs_pool_alloc(ctx->vol->mrec_pool,
+						ctx->vol->mft_record_size);
 			if (!ctx->inode->mrec) {
-				free(ctx->inode); // == ntfs_inode_close
+				ntfs_pool_free(ctx->inode);
+				ctx->inode = NULL;
 				return -1;
 			}
 
-			mft = ntfs_attr_open(ctx->vol->mft_ni, AT_DATA,
-					AT_UNNAMED, 0);
-			if (!mft) {
-				ntfs_log_perror("Couldn't open $MFT/$DATA");
-				// free / close
-				return -1;
-			}
-
-			if (ntfs_attr_pread(mft, ctx->vol->mft_record_size * ctx->mft_num, ctx->vol->mft_record_size, ctx->inode->mrec) < ctx->vol->mft_record_size) {
-				ntfs_log_perror("Couldn't read MFT Record %llu",
-					(unsigned long long) ctx->mft_num);
-				// free / close
-				ntfs_attr_close(mft);
-				return -1;
-			}
-
-			ntfs_attr_close(mft);
+			memcpy(ctx->inode->mrec, mrec,
+					ctx->vol->mft_record_size);
 		}
 
 		if (ctx->flags_match & ctx->flags_search) {
@@ -1018,6 +1193,10 @@ int mft_next_record(struct mft_search_ctx *ctx)
 		ctx->inode = NULL;
 	}
 
+	if (!ctx->inode && errno != ENOENT) {
+		ntfs_log_perror("Couldn't read the MFT");
+		return -1;
+	}
 	return (ctx->inode == NULL);
 }
 
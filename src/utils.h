@@ -30,6 +30,7 @@
 #include "types.h"
 #include "layout.h"
 #include "volume.h"
+#include "mft.h"
 #include "lib_utils.h"
 
 #ifdef HAVE_ERRNO_H
@@ -43,6 +44,7 @@ extern const char *ntfs_bugs;
 extern const char *ntfs_gpl;
 
 int utils_set_locale(void);
+void utils_io_options(int *argc, char **argv);
 int utils_parse_size(const char *value, s64 *size, BOOL scale);
 int utils_parse_range(const char *string, s64 *start, s64 *finish, BOOL scale);
 int utils_inode_get_name(ntfs_inode *inode, char *buffer, int bufsize);
@@ -78,6 +80,7 @@ struct mft_search_ctx {
 	ntfs_inode *inode;
 	ntfs_volume *vol;
 	u64 mft_num;
+	ntfs_mft_scan *scan;
 };
 
 struct mft_search_ctx * mft_get_search_ctx(ntfs_volume *vol);